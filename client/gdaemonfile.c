@@ -2191,11 +2191,9 @@ set_metadata_attribute (GFile *file,
 			GError **error)
 {
   GDaemonFile *daemon_file;
-  DBusMessage *message;
+  GFileInfo *info;
   char *treename;
-  const char *metatreefile;
   MetaTree *tree;
-  int appended;
   gboolean res;
 
   daemon_file = G_DAEMON_FILE (file);
@@ -2204,41 +2202,13 @@ set_metadata_attribute (GFile *file,
   tree = meta_tree_lookup_by_name (treename, FALSE);
   g_free (treename);
 
-  message =
-    dbus_message_new_method_call (G_VFS_DBUS_METADATA_NAME,
-				  G_VFS_DBUS_METADATA_PATH,
-				  G_VFS_DBUS_METADATA_INTERFACE,
-				  G_VFS_DBUS_METADATA_OP_SET);
-  g_assert (message != NULL);
-  metatreefile = meta_tree_get_filename (tree);
-  _g_dbus_message_append_args (message,
-			       G_DBUS_TYPE_CSTRING, &metatreefile,
-			       G_DBUS_TYPE_CSTRING, &daemon_file->path,
-			       0);
-
-  appended = _g_daemon_vfs_append_metadata_for_set (message,
-						    tree,
-						    daemon_file->path,
-						    attribute,
-						    type,
-						    value);
+  info = g_file_info_new ();
+  g_file_info_set_attribute (info, attribute, type, value);
 
-  res = TRUE;
-  if (appended == -1)
-    {
-      res = FALSE;
-      g_set_error (error, G_IO_ERROR,
-		   G_IO_ERROR_INVALID_ARGUMENT,
-		   _("Error setting file metadata: %s"),
-		   _("values must be string or list of strings"));
-    }
-  else if (appended > 0 &&
-      !_g_daemon_vfs_send_message_sync (message,
-					cancellable, error))
-    res = FALSE;
-
-  dbus_message_unref (message);
+  res = _g_daemon_vfs_set_metadata (tree, daemon_file->path, info,
+				    cancellable, error);
 
+  g_object_unref (info);
   meta_tree_unref (tree);
 
   return res;
@@ -2299,6 +2269,68 @@ g_daemon_file_set_attribute (GFile *file,
   return TRUE;
 }
 
+static gboolean
+g_daemon_file_set_attributes_from_info (GFile                *file,
+					GFileInfo            *info,
+					GFileQueryInfoFlags   flags,
+					GCancellable         *cancellable,
+					GError              **error)
+{
+  GDaemonFile *daemon_file;
+  GFileAttributeType type;
+  GFileAttributeStatus status;
+  char **attributes;
+  char *treename;
+  MetaTree *tree;
+  gpointer value;
+  gboolean res;
+  int i;
+
+  /* All metadata keys go out in a single message */
+  res = TRUE;
+  if (g_file_info_has_namespace (info, "metadata"))
+    {
+      daemon_file = G_DAEMON_FILE (file);
+      treename = g_mount_spec_to_string (daemon_file->mount_spec);
+      tree = meta_tree_lookup_by_name (treename, FALSE);
+      g_free (treename);
+
+      res = _g_daemon_vfs_set_metadata (tree, daemon_file->path, info,
+					cancellable, error);
+      if (!res)
+	error = NULL; /* Don't set further errors */
+
+      meta_tree_unref (tree);
+    }
+
+  attributes = g_file_info_list_attributes (info, NULL);
+  for (i = 0; attributes[i] != NULL; i++)
+    {
+      if (g_str_has_prefix (attributes[i], "metadata::"))
+	continue;
+
+      if (!g_file_info_get_attribute_data (info, attributes[i],
+					   &type, &value, &status) ||
+	  status != G_FILE_ATTRIBUTE_STATUS_UNSET)
+	continue;
+
+      if (!g_daemon_file_set_attribute (file, attributes[i], type, value,
+					flags, cancellable, error))
+	{
+	  res = FALSE;
+	  error = NULL; /* Don't set further errors */
+	  g_file_info_set_attribute_status (info, attributes[i],
+					    G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
+	}
+      else
+	g_file_info_set_attribute_status (info, attributes[i],
+					  G_FILE_ATTRIBUTE_STATUS_SET);
+    }
+  g_strfreev (attributes);
+
+  return res;
+}
+
 struct ProgressCallbackData {
   GFileProgressCallback progress_callback;
   gpointer progress_callback_data;
@@ -3197,6 +3229,7 @@ g_daemon_file_file_iface_init (GFileIface *iface)
   iface->query_settable_attributes = g_daemon_file_query_settable_attributes;
   iface->query_writable_namespaces = g_daemon_file_query_writable_namespaces;
   iface->set_attribute = g_daemon_file_set_attribute;
+  iface->set_attributes_from_info = g_daemon_file_set_attributes_from_info;
   iface->make_symbolic_link = g_daemon_file_make_symbolic_link;
   iface->monitor_dir = g_daemon_file_monitor_dir;
   iface->monitor_file = g_daemon_file_monitor_file;
@@ -59,6 +59,7 @@ struct _GDaemonFileEnumerator
 
   GFileAttributeMatcher *matcher;
   MetaTree *metadata_tree;
+  MetaDirCursor *metadata_cursor; /* protected by infos lock */
 };
 
 G_DEFINE_TYPE (GDaemonFileEnumerator, g_daemon_file_enumerator, G_TYPE_FILE_ENUMERATOR)
@@ -112,6 +113,8 @@ g_daemon_file_enumerator_finalize (GObject *object)
   free_info_list (daemon->infos);
 
   g_file_attribute_matcher_unref (daemon->matcher);
+  if (daemon->metadata_cursor)
+    meta_dir_cursor_free (daemon->metadata_cursor);
   if (daemon->metadata_tree)
     meta_tree_unref (daemon->metadata_tree);
 
@@ -196,27 +199,31 @@ enumerate_keys_callback (const char *key,
   return TRUE;
 }
 
+/* Called with infos lock held */
 static void
 add_metadata (GFileInfo *info,
 	      GDaemonFileEnumerator *daemon)
 {
   GFile *container;
-  const char *name;
-  char *path;
 
   if (!daemon->metadata_tree)
     return;
 
-  name = g_file_info_get_name (info);
-  container = g_file_enumerator_get_container (G_FILE_ENUMERATOR (daemon));
-  path = g_build_filename (G_DAEMON_FILE (container)->path, name, NULL);
+  /* The directory is resolved once per enumeration, after that
+     each child is a single lookup in its children block */
+  if (daemon->metadata_cursor == NULL)
+    {
+      container = g_file_enumerator_get_container (G_FILE_ENUMERATOR (daemon));
+      daemon->metadata_cursor =
+	meta_dir_cursor_new (daemon->metadata_tree,
+			     G_DAEMON_FILE (container)->path);
+    }
 
   g_file_info_set_attribute_mask (info, daemon->matcher);
-  meta_tree_enumerate_keys (daemon->metadata_tree, path,
-			    enumerate_keys_callback, info);
+  meta_dir_cursor_enumerate_keys (daemon->metadata_cursor,
+				  g_file_info_get_name (info),
+				  enumerate_keys_callback, info);
   g_file_info_unset_attribute_mask (info);
-
-  g_free (path);
 }
 
 static GCancellable *
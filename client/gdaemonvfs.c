@@ -1235,20 +1235,16 @@ strv_equal (char **a, char **b)
   return TRUE;
 }
 
-/* -1 => error, otherwise number of added items */
-int
-_g_daemon_vfs_append_metadata_for_set (DBusMessage *message,
-				       MetaTree *tree,
-				       const char *path,
-				       const char *attribute,
-				       GFileAttributeType type,
-				       gpointer   value)
+/* -1 => error, 0 => already set, 1 => needs to be sent */
+static int
+metadata_needs_set (MetaTree *tree,
+		    const char *path,
+		    const char *key,
+		    GFileAttributeType type,
+		    gpointer   value)
 {
-  const char *key;
   int res;
 
-  key = attribute + strlen ("metadata::");
-
   res = 0;
   if (type == G_FILE_ATTRIBUTE_TYPE_STRING)
     {
@@ -1257,13 +1253,7 @@ _g_daemon_vfs_append_metadata_for_set (DBusMessage *message,
 
       current = meta_tree_lookup_string (tree, path, key);
       if (current == NULL || strcmp (current, val) != 0)
-	{
-	  res = 1;
-	  _g_dbus_message_append_args (message,
-				       DBUS_TYPE_STRING, &key,
-				       DBUS_TYPE_STRING, &val,
-				       0);
-	}
+	res = 1;
       g_free (current);
     }
   else if (type == G_FILE_ATTRIBUTE_TYPE_STRINGV)
@@ -1272,27 +1262,13 @@ _g_daemon_vfs_append_metadata_for_set (DBusMessage *message,
       char **val = (char **)value;
       current = meta_tree_lookup_stringv (tree, path, key);
       if (current == NULL || !strv_equal (current, val))
-	{
-	  res = 1;
-	  _g_dbus_message_append_args (message,
-				       DBUS_TYPE_STRING, &key,
-				       DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &val, g_strv_length (val),
-				       0);
-	}
+	res = 1;
       g_strfreev (current);
     }
   else if (type == G_FILE_ATTRIBUTE_TYPE_INVALID)
     {
       if (meta_tree_lookup_key_type (tree, path, key) != META_KEY_TYPE_NONE)
-	{
-	  char c = 0;
-	  res = 1;
-	  /* Byte => unset */
-	  _g_dbus_message_append_args (message,
-				       DBUS_TYPE_STRING, &key,
-				       DBUS_TYPE_BYTE, &c,
-				       0);
-	}
+	res = 1;
     }
   else
     res = -1;
@@ -1300,6 +1276,304 @@ _g_daemon_vfs_append_metadata_for_set (DBusMessage *message,
   return res;
 }
 
+/* Appends a (key, value) struct to the per-path array of a SetBatch
+   message, a byte value means unset.
+   -1 => error, otherwise number of added items */
+static int
+append_metadata_for_set_batch (DBusMessageIter *array_iter,
+			       MetaTree *tree,
+			       const char *path,
+			       const char *attribute,
+			       GFileAttributeType type,
+			       gpointer   value)
+{
+  DBusMessageIter struct_iter, variant_iter;
+  const char *key;
+  int res;
+
+  key = attribute + strlen ("metadata::");
+
+  res = metadata_needs_set (tree, path, key, type, value);
+  if (res != 1)
+    return res;
+
+  if (!dbus_message_iter_open_container (array_iter,
+					 DBUS_TYPE_STRUCT,
+					 NULL,
+					 &struct_iter))
+    _g_dbus_oom ();
+
+  if (!dbus_message_iter_append_basic (&struct_iter,
+				       DBUS_TYPE_STRING,
+				       &key))
+    _g_dbus_oom ();
+
+  if (type == G_FILE_ATTRIBUTE_TYPE_STRING)
+    {
+      const char *val = (char *)value;
+
+      if (!dbus_message_iter_open_container (&struct_iter,
+					     DBUS_TYPE_VARIANT,
+					     DBUS_TYPE_STRING_AS_STRING,
+					     &variant_iter))
+	_g_dbus_oom ();
+      if (!dbus_message_iter_append_basic (&variant_iter,
+					   DBUS_TYPE_STRING, &val))
+	_g_dbus_oom ();
+    }
+  else if (type == G_FILE_ATTRIBUTE_TYPE_STRINGV)
+    {
+      char **val = (char **)value;
+
+      if (!dbus_message_iter_open_container (&struct_iter,
+					     DBUS_TYPE_VARIANT,
+					     DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+					     &variant_iter))
+	_g_dbus_oom ();
+      _g_dbus_message_iter_append_args (&variant_iter,
+					DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &val, g_strv_length (val),
+					0);
+    }
+  else
+    {
+      char c = 0;
+
+      /* Byte => unset */
+      if (!dbus_message_iter_open_container (&struct_iter,
+					     DBUS_TYPE_VARIANT,
+					     DBUS_TYPE_BYTE_AS_STRING,
+					     &variant_iter))
+	_g_dbus_oom ();
+      if (!dbus_message_iter_append_basic (&variant_iter,
+					   DBUS_TYPE_BYTE, &c))
+	_g_dbus_oom ();
+    }
+
+  if (!dbus_message_iter_close_container (&struct_iter, &variant_iter))
+    _g_dbus_oom ();
+
+  if (!dbus_message_iter_close_container (array_iter, &struct_iter))
+    _g_dbus_oom ();
+
+  return res;
+}
+
+/* Metadata changes go out as SetBatch messages. Changes to a tree
+   that other threads make while a SetBatch for it is on its way are
+   collected and sent together in the next one, so changing many
+   files at once doesn't cost a round trip per file. */
+typedef struct {
+  DBusMessage *message;
+  int num_waiting;
+  gboolean sent;
+  gboolean res;
+  GError *error;
+} MetadataBatch;
+
+G_LOCK_DEFINE_STATIC(metadata_batches);
+static GHashTable *open_metadata_batches = NULL; /* treefile -> MetadataBatch */
+static GHashTable *sending_metadata_trees = NULL; /* treefiles with a SetBatch in flight */
+static GCond *metadata_batch_sent = NULL;
+
+static void
+metadata_batch_free (MetadataBatch *batch)
+{
+  dbus_message_unref (batch->message);
+  if (batch->error)
+    g_error_free (batch->error);
+  g_free (batch);
+}
+
+/* Sets the metadata attributes of info on path in tree and updates
+   their status in info. Blocks until the daemon applied them. */
+gboolean
+_g_daemon_vfs_set_metadata (MetaTree *tree,
+			    const char *path,
+			    GFileInfo *info,
+			    GCancellable *cancellable,
+			    GError **error)
+{
+  DBusMessageIter iter, array_iter;
+  GFileAttributeType type;
+  MetadataBatch *batch;
+  const char *treefile;
+  char **attributes;
+  gpointer value;
+  int i, appended, num_set;
+  gboolean res;
+
+  res = TRUE;
+  treefile = meta_tree_get_filename (tree);
+  attributes = g_file_info_list_attributes (info, "metadata");
+
+  num_set = 0;
+  for (i = 0; attributes[i] != NULL; i++)
+    {
+      if (g_file_info_get_attribute_data (info, attributes[i], &type, &value, NULL) &&
+	  metadata_needs_set (tree, path, attributes[i] + strlen ("metadata::"),
+			      type, value) == 1)
+	num_set++;
+    }
+
+  /* Nothing changes, don't add an empty entry to the batch */
+  if (num_set == 0)
+    {
+      for (i = 0; attributes[i] != NULL; i++)
+	{
+	  if (!g_file_info_get_attribute_data (info, attributes[i], &type, &value, NULL))
+	    continue;
+
+	  if (metadata_needs_set (tree, path, attributes[i] + strlen ("metadata::"),
+				  type, value) != -1)
+	    g_file_info_set_attribute_status (info, attributes[i],
+					      G_FILE_ATTRIBUTE_STATUS_SET);
+	  else
+	    {
+	      if (res)
+		g_set_error (error, G_IO_ERROR,
+			     G_IO_ERROR_INVALID_ARGUMENT,
+			     _("Error setting file metadata: %s"),
+			     _("values must be string or list of strings"));
+	      res = FALSE;
+	      g_file_info_set_attribute_status (info, attributes[i],
+						G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
+	    }
+	}
+
+      g_strfreev (attributes);
+      return res;
+    }
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    {
+      g_strfreev (attributes);
+      return FALSE;
+    }
+
+  G_LOCK (metadata_batches);
+
+  if (open_metadata_batches == NULL)
+    {
+      open_metadata_batches = g_hash_table_new_full (g_str_hash, g_str_equal,
+						     g_free, NULL);
+      sending_metadata_trees = g_hash_table_new_full (g_str_hash, g_str_equal,
+						      g_free, NULL);
+    }
+
+  batch = g_hash_table_lookup (open_metadata_batches, treefile);
+  if (batch == NULL)
+    {
+      batch = g_new0 (MetadataBatch, 1);
+      batch->message =
+	dbus_message_new_method_call (G_VFS_DBUS_METADATA_NAME,
+				      G_VFS_DBUS_METADATA_PATH,
+				      G_VFS_DBUS_METADATA_INTERFACE,
+				      G_VFS_DBUS_METADATA_OP_SET_BATCH);
+      g_assert (batch->message != NULL);
+      _g_dbus_message_append_args (batch->message,
+				   G_DBUS_TYPE_CSTRING, &treefile,
+				   0);
+      g_hash_table_insert (open_metadata_batches, g_strdup (treefile), batch);
+    }
+
+  dbus_message_iter_init_append (batch->message, &iter);
+  _g_dbus_message_iter_append_cstring (&iter, path);
+  if (!dbus_message_iter_open_container (&iter,
+					 DBUS_TYPE_ARRAY,
+					 DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+					 DBUS_TYPE_STRING_AS_STRING
+					 DBUS_TYPE_VARIANT_AS_STRING
+					 DBUS_STRUCT_END_CHAR_AS_STRING,
+					 &array_iter))
+    _g_dbus_oom ();
+
+  for (i = 0; attributes[i] != NULL; i++)
+    {
+      if (!g_file_info_get_attribute_data (info, attributes[i], &type, &value, NULL))
+	continue;
+
+      appended = append_metadata_for_set_batch (&array_iter,
+						tree,
+						path,
+						attributes[i],
+						type,
+						value);
+      if (appended != -1)
+	{
+	  g_file_info_set_attribute_status (info, attributes[i],
+					    G_FILE_ATTRIBUTE_STATUS_SET);
+	}
+      else
+	{
+	  res = FALSE;
+	  g_set_error (error, G_IO_ERROR,
+		       G_IO_ERROR_INVALID_ARGUMENT,
+		       _("Error setting file metadata: %s"),
+		       _("values must be string or list of strings"));
+	  error = NULL; /* Don't set further errors */
+	  g_file_info_set_attribute_status (info, attributes[i],
+					    G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
+	}
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array_iter))
+    _g_dbus_oom ();
+
+  /* The entry is in the batch now, so wait for it even if the tree
+     changed under us and it ended up empty */
+  batch->num_waiting++;
+
+  /* Whoever finds no SetBatch in flight sends the batch, the
+     others wait for its reply */
+  while (!batch->sent &&
+	 g_hash_table_lookup (sending_metadata_trees, treefile) != NULL)
+    {
+      if (metadata_batch_sent == NULL)
+	metadata_batch_sent = g_cond_new ();
+      g_cond_wait (metadata_batch_sent,
+		   g_static_mutex_get_mutex (&G_LOCK_NAME (metadata_batches)));
+    }
+
+  if (!batch->sent)
+    {
+      g_hash_table_remove (open_metadata_batches, treefile);
+      g_hash_table_insert (sending_metadata_trees,
+			   g_strdup (treefile), GINT_TO_POINTER (1));
+      G_UNLOCK (metadata_batches);
+
+      /* The batch carries the other waiters' changes too, so it
+	 must not be aborted by this caller's cancellable */
+      batch->res = _g_daemon_vfs_send_message_sync (batch->message,
+						    NULL,
+						    &batch->error);
+
+      G_LOCK (metadata_batches);
+      batch->sent = TRUE;
+      g_hash_table_remove (sending_metadata_trees, treefile);
+      if (metadata_batch_sent)
+	g_cond_broadcast (metadata_batch_sent);
+    }
+
+  if (!batch->res)
+    {
+      if (res && batch->error)
+	g_propagate_error (error, g_error_copy (batch->error));
+      res = FALSE;
+      for (i = 0; attributes[i] != NULL; i++)
+	g_file_info_set_attribute_status (info, attributes[i],
+					  G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
+    }
+
+  if (--batch->num_waiting == 0)
+    metadata_batch_free (batch);
+
+  G_UNLOCK (metadata_batches);
+
+  g_strfreev (attributes);
+
+  return res;
+}
+
 static gboolean
 g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
 					const char *filename,
@@ -1308,19 +1582,14 @@ g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
 					GCancellable *cancellable,
 					GError    **error)
 {
-  GFileAttributeType type;
   MetaLookupCache *cache;
-  const char *metatreefile;
   struct stat statbuf;
   char **attributes;
   char *tree_path;
   MetaTree *tree;
   int errsv;
-  int i, num_set;
-  DBusMessage *message;
+  int i;
   gboolean res;
-  int appended;
-  gpointer value;
 
   res = TRUE;
   if (g_file_info_has_namespace (info, "metadata"))
@@ -1350,65 +1619,13 @@ g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
 						statbuf.st_dev,
 						FALSE,
 						&tree_path);
-	  message =
-	    dbus_message_new_method_call (G_VFS_DBUS_METADATA_NAME,
-					  G_VFS_DBUS_METADATA_PATH,
-					  G_VFS_DBUS_METADATA_INTERFACE,
-					  G_VFS_DBUS_METADATA_OP_SET);
-	  g_assert (message != NULL);
-	  metatreefile = meta_tree_get_filename (tree);
-	  _g_dbus_message_append_args (message,
-				       G_DBUS_TYPE_CSTRING, &metatreefile,
-				       G_DBUS_TYPE_CSTRING, &tree_path,
-				       0);
 	  meta_lookup_cache_free (cache);
 
-	  num_set = 0;
-	  for (i = 0; attributes[i] != NULL; i++)
-	    {
-	      if (g_file_info_get_attribute_data (info, attributes[i], &type, &value, NULL))
-		{
-		  appended = _g_daemon_vfs_append_metadata_for_set (message,
-								    tree,
-								    tree_path,
-								    attributes[i],
-								    type,
-								    value);
-		  if (appended != -1)
-		    {
-		      num_set += appended;
-		      g_file_info_set_attribute_status (info, attributes[i],
-							G_FILE_ATTRIBUTE_STATUS_SET);
-		    }
-		  else
-		    {
-		      res = FALSE;
-		      g_set_error (error, G_IO_ERROR,
-				   G_IO_ERROR_INVALID_ARGUMENT,
-				   _("Error setting file metadata: %s"),
-				   _("values must be string or list of strings"));
-		      error = NULL; /* Don't set further errors */
-		      g_file_info_set_attribute_status (info, attributes[i],
-							G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
-		    }
-		}
-	    }
+	  res = _g_daemon_vfs_set_metadata (tree, tree_path, info,
+					    cancellable, error);
 
 	  meta_tree_unref (tree);
 	  g_free (tree_path);
-
-	  if (num_set > 0 &&
-	      !_g_daemon_vfs_send_message_sync (message,
-						cancellable, error))
-	    {
-	      res = FALSE;
-	      error = NULL; /* Don't set further errors */
-	      for (i = 0; attributes[i] != NULL; i++)
-		g_file_info_set_attribute_status (info, attributes[i],
-						  G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
-	    }
-
-	  dbus_message_unref (message);
 	}
 
       g_strfreev (attributes);
@@ -71,12 +71,11 @@ DBusConnection *_g_daemon_vfs_get_async_bus            (void);
 gboolean        _g_daemon_vfs_send_message_sync        (DBusMessage              *message,
 							GCancellable             *cancellable,
 							GError                  **error);
-int             _g_daemon_vfs_append_metadata_for_set  (DBusMessage *message,
-							MetaTree *tree,
-							const char *path,
-							const char *attribute,
-							GFileAttributeType type,
-							gpointer   value);
+gboolean        _g_daemon_vfs_set_metadata             (MetaTree                 *tree,
+							const char               *path,
+							GFileInfo                *info,
+							GCancellable             *cancellable,
+							GError                  **error);
 
 
 
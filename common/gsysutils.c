@@ -31,6 +31,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
@@ -179,3 +180,17 @@ _g_socket_connect (const char *address,
 
   return fd;
 }
+
+/* Reads a tuning knob from the environment, negative values count as 0 */
+guint
+_g_getenv_uint (const char *name,
+		guint default_value)
+{
+  const char *value;
+
+  value = g_getenv (name);
+  if (value == NULL)
+    return default_value;
+
+  return MAX (atoi (value), 0);
+}
@@ -33,6 +33,9 @@ int _g_socket_receive_fd (int          socket_fd);
 int _g_socket_connect    (const char  *address,
 			  GError     **error);
 
+guint _g_getenv_uint     (const char  *name,
+			  guint        default_value);
+
 G_END_DECLS
 
 
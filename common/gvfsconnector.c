@@ -0,0 +1,425 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+#include <glib/gi18n-lib.h>
+
+#include "gvfsconnector.h"
+
+/* A connector opens connections to one host for a mount. The name is
+ * resolved on first use and the addresses are kept until the connector
+ * is freed, so later connections don't wait for the resolver. When the
+ * host has more than one address, connects are started one after the
+ * other, G_VFS_CONNECTOR_ATTEMPT_DELAY apart, and the first one that
+ * succeeds is used. Addresses of both families take turns, so a host
+ * with a broken IPv6 route costs one short delay instead of a TCP
+ * timeout (RFC 6555).
+ */
+
+struct _GVfsConnector
+{
+  GSocketConnectable *  connectable;            /* what we connect to */
+
+  GMutex *              mutex;                  /* protects the following fields */
+  GList *               addresses;              /* GSocketAddresses to try, in order */
+  GVfsConnectorStats    stats;                  /* statistics */
+};
+
+typedef struct {
+  GSocket *             socket;
+  GSocketAddress *      address;
+} Attempt;
+
+static char *
+address_to_string (GSocketAddress *address)
+{
+  GInetSocketAddress *inet_address;
+  char *ip, *result;
+
+  if (!G_IS_INET_SOCKET_ADDRESS (address))
+    return g_strdup ("(unknown)");
+
+  inet_address = G_INET_SOCKET_ADDRESS (address);
+  ip = g_inet_address_to_string (g_inet_socket_address_get_address (inet_address));
+  if (g_socket_address_get_family (address) == G_SOCKET_FAMILY_IPV6)
+    result = g_strdup_printf ("[%s]:%u", ip, g_inet_socket_address_get_port (inet_address));
+  else
+    result = g_strdup_printf ("%s:%u", ip, g_inet_socket_address_get_port (inet_address));
+  g_free (ip);
+
+  return result;
+}
+
+/* Keeps the resolver's order within each family, but alternates between
+ * the family of the first address and the other one */
+static GList *
+interleave_families (GList *addresses)
+{
+  GQueue first = G_QUEUE_INIT, other = G_QUEUE_INIT;
+  GSocketFamily family;
+  GList *walk, *result;
+
+  if (addresses == NULL)
+    return NULL;
+
+  family = g_socket_address_get_family (addresses->data);
+  for (walk = addresses; walk; walk = walk->next)
+    {
+      if (g_socket_address_get_family (walk->data) == family)
+        g_queue_push_tail (&first, walk->data);
+      else
+        g_queue_push_tail (&other, walk->data);
+    }
+  g_list_free (addresses);
+
+  result = NULL;
+  while (!g_queue_is_empty (&first) || !g_queue_is_empty (&other))
+    {
+      if (!g_queue_is_empty (&first))
+        result = g_list_prepend (result, g_queue_pop_head (&first));
+      if (!g_queue_is_empty (&other))
+        result = g_list_prepend (result, g_queue_pop_head (&other));
+    }
+
+  return g_list_reverse (result);
+}
+
+/**
+ * g_vfs_connector_new:
+ * @connectable: the host to connect to
+ *
+ * Creates a connector for @connectable. Nothing is resolved until the
+ * connector is first used. A connector may be used from any thread.
+ *
+ * Returns: a new connector
+ **/
+GVfsConnector *
+g_vfs_connector_new (GSocketConnectable *connectable)
+{
+  GVfsConnector *connector;
+
+  g_return_val_if_fail (G_IS_SOCKET_CONNECTABLE (connectable), NULL);
+
+  connector = g_slice_new0 (GVfsConnector);
+  connector->connectable = g_object_ref (connectable);
+  connector->mutex = g_mutex_new ();
+
+  return connector;
+}
+
+void
+g_vfs_connector_free (GVfsConnector *connector)
+{
+  g_return_if_fail (connector != NULL);
+
+  if (connector->stats.connects > 0 || connector->stats.failed_connects > 0)
+    g_debug ("connector: %u connects (%.1f ms on average), %u failed\n",
+             connector->stats.connects,
+             connector->stats.connects > 0 ?
+               connector->stats.connect_time * 1000 / connector->stats.connects : 0.0,
+             connector->stats.failed_connects);
+
+  g_list_foreach (connector->addresses, (GFunc) g_object_unref, NULL);
+  g_list_free (connector->addresses);
+  g_mutex_free (connector->mutex);
+  g_object_unref (connector->connectable);
+
+  g_slice_free (GVfsConnector, connector);
+}
+
+/**
+ * g_vfs_connector_resolve:
+ * @connector: a connector
+ * @cancellable: cancellable to use
+ * @error: return location for errors
+ *
+ * Resolves the host of @connector, unless that was done before. If
+ * another thread is resolving it already, waits for that thread. A
+ * failed lookup is not remembered, the next call tries again.
+ *
+ * Returns: %TRUE if the host has addresses to connect to
+ **/
+gboolean
+g_vfs_connector_resolve (GVfsConnector *connector,
+                         GCancellable * cancellable,
+                         GError **      error)
+{
+  GSocketAddressEnumerator *enumerator;
+  GSocketAddress *address;
+  GError *my_error = NULL;
+  GList *found = NULL;
+  GTimer *timer;
+
+  g_return_val_if_fail (connector != NULL, FALSE);
+
+  g_mutex_lock (connector->mutex);
+  if (connector->addresses != NULL)
+    {
+      g_mutex_unlock (connector->mutex);
+      return TRUE;
+    }
+
+  timer = g_timer_new ();
+  enumerator = g_socket_connectable_enumerate (connector->connectable);
+  while ((address = g_socket_address_enumerator_next (enumerator, cancellable, &my_error)))
+    found = g_list_prepend (found, address);
+  g_object_unref (enumerator);
+
+  if (found == NULL)
+    {
+      g_mutex_unlock (connector->mutex);
+      g_timer_destroy (timer);
+      if (my_error)
+        g_propagate_error (error, my_error);
+      else
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_HOST_NOT_FOUND,
+                             _("Could not resolve hostname"));
+      return FALSE;
+    }
+  /* we got addresses before it failed, so use them */
+  g_clear_error (&my_error);
+
+  connector->addresses = interleave_families (g_list_reverse (found));
+  connector->stats.n_addresses = g_list_length (connector->addresses);
+  connector->stats.resolve_time = g_timer_elapsed (timer, NULL);
+  g_debug ("connector: resolved to %u addresses in %.1f ms\n",
+           connector->stats.n_addresses,
+           connector->stats.resolve_time * 1000);
+  g_mutex_unlock (connector->mutex);
+  g_timer_destroy (timer);
+
+  return TRUE;
+}
+
+static GSocket *
+attempt_start (GSocketAddress *address,
+               GError **       error)
+{
+  GSocket *socket;
+  GError *my_error = NULL;
+
+  socket = g_socket_new (g_socket_address_get_family (address),
+                         G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_DEFAULT,
+                         error);
+  if (socket == NULL)
+    return NULL;
+
+  /* connecting right away is checked the same way as a pending connect */
+  g_socket_set_blocking (socket, FALSE);
+  if (g_socket_connect (socket, address, NULL, &my_error) ||
+      g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_PENDING))
+    {
+      g_clear_error (&my_error);
+      return socket;
+    }
+
+  g_propagate_error (error, my_error);
+  g_object_unref (socket);
+  return NULL;
+}
+
+/**
+ * g_vfs_connector_connect:
+ * @connector: a connector
+ * @cancellable: cancellable to use
+ * @error: return location for errors
+ *
+ * Opens a new connection to the host of @connector, resolving it first
+ * if necessary. This function blocks until a connection is established,
+ * every address failed or @cancellable was cancelled.
+ *
+ * Returns: a new blocking connection or %NULL on error
+ **/
+GSocketConnection *
+g_vfs_connector_connect (GVfsConnector *connector,
+                         GCancellable * cancellable,
+                         GError **      error)
+{
+  GPtrArray *addresses;
+  GArray *attempts;
+  GPollFD *fds;
+  GSocket *winner;
+  GSocketConnection *connection;
+  GError *last_error = NULL;
+  GTimer *timer;
+  GList *walk;
+  gboolean start_next, poll_cancellable;
+  char *winner_name;
+  guint next, i, n_fds;
+  double elapsed;
+
+  g_return_val_if_fail (connector != NULL, NULL);
+
+  if (!g_vfs_connector_resolve (connector, cancellable, error))
+    return NULL;
+
+  addresses = g_ptr_array_new_with_free_func (g_object_unref);
+  g_mutex_lock (connector->mutex);
+  for (walk = connector->addresses; walk; walk = walk->next)
+    g_ptr_array_add (addresses, g_object_ref (walk->data));
+  g_mutex_unlock (connector->mutex);
+
+  attempts = g_array_new (FALSE, FALSE, sizeof (Attempt));
+  fds = g_new (GPollFD, addresses->len + 1);
+  timer = g_timer_new ();
+  winner = NULL;
+  winner_name = NULL;
+  start_next = TRUE;
+  next = 0;
+
+  while (winner == NULL && !g_cancellable_is_cancelled (cancellable))
+    {
+      if (start_next && next < addresses->len)
+        {
+          Attempt attempt;
+
+          attempt.address = g_ptr_array_index (addresses, next++);
+          g_clear_error (&last_error);
+          attempt.socket = attempt_start (attempt.address, &last_error);
+          if (attempt.socket == NULL)
+            continue;
+
+          g_array_append_val (attempts, attempt);
+          start_next = FALSE;
+        }
+
+      if (attempts->len == 0)
+        {
+          if (next < addresses->len)
+            continue;
+          break;
+        }
+
+      for (i = 0; i < attempts->len; i++)
+        {
+          fds[i].fd = g_socket_get_fd (g_array_index (attempts, Attempt, i).socket);
+          fds[i].events = G_IO_OUT | G_IO_ERR | G_IO_HUP;
+          fds[i].revents = 0;
+        }
+      n_fds = attempts->len;
+      poll_cancellable = cancellable && g_cancellable_make_pollfd (cancellable, &fds[n_fds]);
+      if (poll_cancellable)
+        n_fds++;
+
+      /* wait for the connects in flight, but not longer than it takes
+       * until the next address is due */
+      if (g_poll (fds, n_fds, next < addresses->len ? G_VFS_CONNECTOR_ATTEMPT_DELAY : -1) == 0)
+        start_next = TRUE;
+
+      if (poll_cancellable)
+        g_cancellable_release_fd (cancellable);
+
+      /* backwards, so removing doesn't move the attempts still to check */
+      for (i = attempts->len; i-- > 0; )
+        {
+          Attempt *attempt = &g_array_index (attempts, Attempt, i);
+
+          if (fds[i].revents == 0)
+            continue;
+
+          if (winner == NULL)
+            {
+              g_clear_error (&last_error);
+              if (g_socket_check_connect_result (attempt->socket, &last_error))
+                {
+                  winner = g_object_ref (attempt->socket);
+                  winner_name = address_to_string (attempt->address);
+                }
+              else
+                start_next = TRUE;
+            }
+
+          g_object_unref (attempt->socket);
+          g_array_remove_index (attempts, i);
+        }
+    }
+
+  /* close the connects that lost the race */
+  for (i = 0; i < attempts->len; i++)
+    g_object_unref (g_array_index (attempts, Attempt, i).socket);
+  g_array_free (attempts, TRUE);
+  g_free (fds);
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  if (winner == NULL)
+    {
+      if (!g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          if (last_error)
+            {
+              g_propagate_error (error, last_error);
+              last_error = NULL;
+            }
+          else
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                 _("Could not connect to host"));
+        }
+      g_clear_error (&last_error);
+
+      g_mutex_lock (connector->mutex);
+      connector->stats.failed_connects++;
+      g_mutex_unlock (connector->mutex);
+
+      g_debug ("connector: connect failed after %.1f ms, %u of %u addresses tried\n",
+               elapsed * 1000, next, addresses->len);
+      g_ptr_array_free (addresses, TRUE);
+      return NULL;
+    }
+  g_clear_error (&last_error);
+
+  g_socket_set_blocking (winner, TRUE);
+  connection = g_socket_connection_factory_create_connection (winner);
+  g_object_unref (winner);
+
+  g_mutex_lock (connector->mutex);
+  connector->stats.connects++;
+  connector->stats.connect_time += elapsed;
+  connector->stats.last_connect_time = elapsed;
+  g_mutex_unlock (connector->mutex);
+
+  g_debug ("connector: connected to %s in %.1f ms, %u of %u addresses tried\n",
+           winner_name, elapsed * 1000, next, addresses->len);
+  g_free (winner_name);
+  g_ptr_array_free (addresses, TRUE);
+
+  return connection;
+}
+
+/**
+ * g_vfs_connector_get_stats:
+ * @connector: a connector
+ * @stats: location to store the statistics in
+ *
+ * Copies the name resolution and connect statistics of @connector to
+ * @stats.
+ **/
+void
+g_vfs_connector_get_stats (GVfsConnector *      connector,
+                           GVfsConnectorStats * stats)
+{
+  g_return_if_fail (connector != NULL);
+  g_return_if_fail (stats != NULL);
+
+  g_mutex_lock (connector->mutex);
+  *stats = connector->stats;
+  g_mutex_unlock (connector->mutex);
+}
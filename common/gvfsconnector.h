@@ -0,0 +1,60 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __G_VFS_CONNECTOR_H__
+#define __G_VFS_CONNECTOR_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+
+/* time to give an address before also trying the next one, in ms */
+#define G_VFS_CONNECTOR_ATTEMPT_DELAY 250
+
+typedef struct _GVfsConnector GVfsConnector;
+typedef struct _GVfsConnectorStats GVfsConnectorStats;
+
+struct _GVfsConnectorStats
+{
+  guint                 n_addresses;            /* addresses the name resolved to */
+  double                resolve_time;           /* seconds it took to resolve the name */
+  guint                 connects;               /* successful connects */
+  guint                 failed_connects;        /* connects where no address worked */
+  double                connect_time;           /* seconds spent in successful connects */
+  double                last_connect_time;      /* seconds the last successful connect took */
+};
+
+GVfsConnector *         g_vfs_connector_new             (GSocketConnectable *   connectable);
+void                    g_vfs_connector_free            (GVfsConnector *        connector);
+
+gboolean                g_vfs_connector_resolve         (GVfsConnector *        connector,
+                                                         GCancellable *         cancellable,
+                                                         GError **              error);
+GSocketConnection *     g_vfs_connector_connect         (GVfsConnector *        connector,
+                                                         GCancellable *         cancellable,
+                                                         GError **              error);
+
+void                    g_vfs_connector_get_stats       (GVfsConnector *        connector,
+                                                         GVfsConnectorStats *   stats);
+
+
+G_END_DECLS
+
+#endif /* __G_VFS_CONNECTOR_H__ */
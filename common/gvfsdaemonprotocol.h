@@ -105,6 +105,22 @@ G_BEGIN_DECLS
 #define G_VFS_DBUS_METADATA_OP_UNSET "Unset"
 #define G_VFS_DBUS_METADATA_OP_REMOVE "Remove"
 #define G_VFS_DBUS_METADATA_OP_MOVE "Move"
+#define G_VFS_DBUS_METADATA_OP_SET_BATCH "SetBatch"
+#define G_VFS_DBUS_METADATA_OP_GET_BATCH "GetBatch"
+#define G_VFS_DBUS_METADATA_OP_GET_STATISTICS "GetStatistics"
+
+/* Statistics that backends with caches report in the filesystem info */
+#define G_VFS_FILE_ATTRIBUTE_STATS_CACHE_HITS "gvfs-stats::cache-hits"
+#define G_VFS_FILE_ATTRIBUTE_STATS_CACHE_MISSES "gvfs-stats::cache-misses"
+#define G_VFS_FILE_ATTRIBUTE_STATS_CACHE_INVALIDATIONS "gvfs-stats::cache-invalidations"
+#define G_VFS_FILE_ATTRIBUTE_STATS_CACHE_EVICTIONS "gvfs-stats::cache-evictions"
+#define G_VFS_FILE_ATTRIBUTE_STATS_CACHE_EXPIRATIONS "gvfs-stats::cache-expirations"
+/* Connection setup of backends that use a GVfsConnector, times in ms */
+#define G_VFS_FILE_ATTRIBUTE_STATS_CONNECTS "gvfs-stats::connects"
+#define G_VFS_FILE_ATTRIBUTE_STATS_FAILED_CONNECTS "gvfs-stats::failed-connects"
+#define G_VFS_FILE_ATTRIBUTE_STATS_CONNECT_TIME "gvfs-stats::connect-time"
+#define G_VFS_FILE_ATTRIBUTE_STATS_LAST_CONNECT_TIME "gvfs-stats::last-connect-time"
+#define G_VFS_FILE_ATTRIBUTE_STATS_RESOLVE_TIME "gvfs-stats::resolve-time"
 
 /* Mounts time out in 10 minutes, since they can be slow, with auth, etc */
 #define G_VFS_DBUS_MOUNT_TIMEOUT_MSECS (1000*60*10)
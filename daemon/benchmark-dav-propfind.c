@@ -0,0 +1,274 @@
+#include <config.h>
+
+#include <string.h>
+#include <glib.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include "gvfsdavmultistatus.h"
+
+/* Measures how fast the dav backend can parse the reply to a Depth: 1
+   PROPFIND of a large directory, once by building a tree of the whole
+   reply with xmlReadMemory() and walking it, like the backend used
+   to, and once with the streaming parser fed in chunks as they would
+   arrive from the network. Also shows how long it takes until the
+   first file is known. */
+
+static int n_files = 50000;
+static int rounds = 5;
+static int chunk_size = 8192;
+static GOptionEntry entries[] =
+{
+  { "files", 'f', 0, G_OPTION_ARG_INT, &n_files, "Files in the directory", NULL},
+  { "rounds", 'r', 0, G_OPTION_ARG_INT, &rounds, "Number of times to parse the reply", NULL},
+  { "chunk-size", 'c', 0, G_OPTION_ARG_INT, &chunk_size, "Size of the chunks fed to the streaming parser", NULL},
+  { NULL }
+};
+
+static GString *
+build_reply (void)
+{
+  GString *reply;
+  GRand *rand;
+  gboolean is_dir;
+  int i;
+
+  rand = g_rand_new_with_seed (42);
+  reply = g_string_new ("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+                        "<D:multistatus xmlns:D=\"DAV:\">\n"
+                        "<D:response><D:href>/dav/dir/</D:href><D:propstat><D:prop>"
+                        "<D:resourcetype><D:collection/></D:resourcetype>"
+                        "</D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response>\n");
+
+  for (i = 0; i < n_files; i++)
+    {
+      is_dir = g_rand_int_range (rand, 0, 10) == 0;
+      g_string_append_printf (reply,
+                              "<D:response>"
+                              "<D:href>/dav/dir/%s-%06d%s</D:href>"
+                              "<D:propstat><D:prop>"
+                              "<D:resourcetype>%s</D:resourcetype>"
+                              "<D:getcontentlength>%d</D:getcontentlength>"
+                              "<D:getetag>\"%08x-%06d\"</D:getetag>"
+                              "<D:getlastmodified>Mon, 01 Feb 2010 12:%02d:%02d GMT</D:getlastmodified>"
+                              "<D:creationdate>2010-02-01T12:00:00Z</D:creationdate>"
+                              "%s"
+                              "</D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat>"
+                              "<D:propstat><D:prop><D:displayname/></D:prop>"
+                              "<D:status>HTTP/1.1 404 Not Found</D:status></D:propstat>"
+                              "</D:response>\n",
+                              is_dir ? "folder" : "document", i,
+                              is_dir ? "/" : ".odt",
+                              is_dir ? "<D:collection/>" : "",
+                              is_dir ? 0 : g_rand_int_range (rand, 0, 1 << 30),
+                              g_rand_int (rand), i,
+                              g_rand_int_range (rand, 0, 60),
+                              g_rand_int_range (rand, 0, 60),
+                              is_dir ? "" : "<D:getcontenttype>application/vnd.oasis.opendocument.text</D:getcontenttype>");
+    }
+
+  g_string_append (reply, "</D:multistatus>\n");
+  g_rand_free (rand);
+
+  return reply;
+}
+
+static gboolean
+node_is_dav (xmlNodePtr node, const char *name)
+{
+  return node->type == XML_ELEMENT_NODE &&
+         strcmp ((char *) node->name, name) == 0 &&
+         node->ns && node->ns->href &&
+         g_ascii_strcasecmp ((char *) node->ns->href, "DAV:") == 0;
+}
+
+static const char *
+node_get_content (xmlNodePtr node)
+{
+  if (node == NULL || node->children == NULL ||
+      node->children->type != XML_TEXT_NODE)
+    return NULL;
+
+  return (const char *) node->children->content;
+}
+
+/* the same work the old tree walking code did for each response */
+static guint
+walk_response (xmlNodePtr response)
+{
+  xmlNodePtr iter, child, prop, status;
+  const char *href, *status_text;
+  guint found;
+
+  href = NULL;
+  found = 0;
+  for (iter = response->children; iter; iter = iter->next)
+    {
+      if (node_is_dav (iter, "href"))
+        href = node_get_content (iter);
+      else if (node_is_dav (iter, "propstat"))
+        {
+          prop = status = NULL;
+          for (child = iter->children; child; child = child->next)
+            {
+              if (node_is_dav (child, "prop"))
+                prop = child;
+              else if (node_is_dav (child, "status"))
+                status = child;
+            }
+
+          status_text = node_get_content (status);
+          if (prop == NULL || status_text == NULL ||
+              strstr (status_text, " 200 ") == NULL)
+            continue;
+
+          for (child = prop->children; child; child = child->next)
+            if (child->type == XML_ELEMENT_NODE && node_get_content (child))
+              found++;
+        }
+    }
+
+  return href ? found : 0;
+}
+
+static void
+bench_tree (GString *reply, double *first)
+{
+  xmlDocPtr doc;
+  xmlNodePtr root, iter;
+  GTimer *timer;
+  guint found;
+  int r;
+
+  found = 0;
+  *first = 0;
+  timer = g_timer_new ();
+  for (r = 0; r < rounds; r++)
+    {
+      g_timer_start (timer);
+      doc = xmlReadMemory (reply->str, reply->len, "response.xml", NULL,
+                           XML_PARSE_NONET | XML_PARSE_NOWARNING |
+                           XML_PARSE_NOBLANKS | XML_PARSE_NSCLEAN |
+                           XML_PARSE_NOCDATA | XML_PARSE_COMPACT);
+      root = xmlDocGetRootElement (doc);
+
+      for (iter = root->children; iter; iter = iter->next)
+        {
+          if (!node_is_dav (iter, "response"))
+            continue;
+          if (*first == 0)
+            *first = g_timer_elapsed (timer, NULL);
+          found += walk_response (iter);
+        }
+
+      xmlFreeDoc (doc);
+    }
+  g_timer_destroy (timer);
+
+  /* keep the compiler from dropping the work */
+  if (found == 0)
+    g_printerr ("nothing parsed\n");
+}
+
+typedef struct {
+  GTimer *timer;
+  double first;
+  guint found;
+} StreamData;
+
+static void
+got_response (const GVfsDavResponse *response, gpointer user_data)
+{
+  StreamData *data = user_data;
+
+  if (data->first == 0)
+    data->first = g_timer_elapsed (data->timer, NULL);
+
+  data->found += (response->content_length != NULL) +
+                 (response->etag != NULL) +
+                 (response->last_modified != NULL) +
+                 (response->creation_date != NULL) +
+                 (response->content_type != NULL) +
+                 (response->file_type != 0);
+}
+
+static void
+bench_stream (GString *reply, double *first)
+{
+  GVfsDavMultistatus *ms;
+  StreamData data;
+  gsize offset, len;
+  int r;
+
+  data.found = 0;
+  data.first = 0;
+  data.timer = g_timer_new ();
+  for (r = 0; r < rounds; r++)
+    {
+      ms = g_vfs_dav_multistatus_new (got_response, &data);
+      for (offset = 0; offset < reply->len; offset += len)
+        {
+          len = MIN ((gsize) chunk_size, reply->len - offset);
+          g_vfs_dav_multistatus_feed (ms, reply->str + offset, len, NULL);
+        }
+      if (!g_vfs_dav_multistatus_finish (ms, NULL))
+        g_printerr ("parsing failed\n");
+      g_vfs_dav_multistatus_free (ms);
+    }
+  g_timer_destroy (data.timer);
+
+  if (data.found == 0)
+    g_printerr ("nothing parsed\n");
+
+  *first = data.first;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  GString *reply;
+  GTimer *timer;
+  double tree, stream, tree_first, stream_first;
+
+  context = g_option_context_new ("- benchmark WebDAV PROPFIND reply parsers");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if (n_files <= 0 || rounds <= 0 || chunk_size <= 0)
+    {
+      g_printerr ("all options must be positive\n");
+      return 1;
+    }
+
+  reply = build_reply ();
+  timer = g_timer_new ();
+
+  /* streaming first, so that it doesn't pay for freeing the trees */
+  g_timer_start (timer);
+  bench_stream (reply, &stream_first);
+  stream = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+  bench_tree (reply, &tree_first);
+  tree = g_timer_elapsed (timer, NULL);
+
+  g_print ("%d files, %.1f MB reply, %d rounds:\n",
+           n_files, reply->len / (1024.0 * 1024.0), rounds);
+  g_print ("  tree:      %8.1f MB/s, first file after %8.3f ms\n",
+           reply->len * rounds / tree / (1024 * 1024), tree_first * 1000);
+  g_print ("  streaming: %8.1f MB/s, first file after %8.3f ms (%.2fx)\n",
+           reply->len * rounds / stream / (1024 * 1024), stream_first * 1000,
+           tree / stream);
+
+  g_timer_destroy (timer);
+  g_string_free (reply, TRUE);
+
+  return 0;
+}
@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <glib/gstdio.h>
@@ -35,12 +36,6 @@
 
 #include <libsoup/soup.h>
 
-/* LibXML2 includes */
-#include <libxml/parser.h>
-#include <libxml/tree.h>
-#include <libxml/xpath.h>
-#include <libxml/xpathInternals.h>
-
 #include "gvfsbackenddav.h"
 #include "gvfskeyring.h"
 
@@ -51,12 +46,20 @@
 #include "gvfsjobopenforwrite.h"
 #include "gvfsjobwrite.h"
 #include "gvfsjobseekwrite.h"
+#include "gvfsjobclosewrite.h"
+#include "gvfsjobmakedirectory.h"
+#include "gvfsjobdelete.h"
 #include "gvfsjobsetdisplayname.h"
+#include "gvfsjobcopy.h"
+#include "gvfsjobmove.h"
 #include "gvfsjobqueryinfo.h"
 #include "gvfsjobqueryfsinfo.h"
 #include "gvfsjobqueryattributes.h"
 #include "gvfsjobenumerate.h"
 #include "gvfsdaemonprotocol.h"
+#include "gsysutils.h"
+#include "gvfsdavmultistatus.h"
+#include "gvfshttpdecoder.h"
 
 #include "soup-input-stream.h"
 #include "soup-output-stream.h"
@@ -70,6 +73,9 @@ typedef struct _MountAuthData MountAuthData;
 
 static void mount_auth_info_free (MountAuthData *info);
 
+#define DAV_CACHE_DEFAULT_TTL 60                /* seconds */
+#define DAV_CACHE_DEFAULT_MAX_ENTRIES 100000
+
 
 #ifdef HAVE_AVAHI
 static void dns_sd_resolver_changed  (GVfsDnsSdResolver *resolver, GVfsBackendDav *dav_backend);
@@ -102,6 +108,16 @@ struct _GVfsBackendDav
 
   MountAuthData auth_info;
 
+  /* PROPFIND results by decoded path, see dav_cache_lookup () */
+  GMutex     *cache_lock;
+  GHashTable *cache;
+  GQueue      cache_lru;        /* entries, most recently used first */
+  guint       cache_ttl;
+  guint       cache_max_entries;
+
+  /* the server answers 412 to "If-None-Match: *" for missing files */
+  gboolean    if_none_match_broken;
+
 #ifdef HAVE_AVAHI
   /* only set if we're handling a [dav|davs]+sd:// mounts */
   GVfsDnsSdResolver *resolver;
@@ -126,15 +142,48 @@ g_vfs_backend_dav_finalize (GObject *object)
 #endif
 
   mount_auth_info_free (&(dav_backend->auth_info));
+
+  g_hash_table_destroy (dav_backend->cache);
+  g_mutex_free (dav_backend->cache_lock);
   
   if (G_OBJECT_CLASS (g_vfs_backend_dav_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_dav_parent_class)->finalize) (object);
 }
 
+typedef struct _DavCacheEntry {
+
+  const char *key;              /* owned by the hash table */
+  GFileInfo  *info;
+  glong       expires;
+
+  GQueue     *lru;
+  GList       lru_link;
+
+} DavCacheEntry;
+
+static void
+dav_cache_entry_free (gpointer data)
+{
+  DavCacheEntry *entry = data;
+
+  g_queue_unlink (entry->lru, &entry->lru_link);
+  g_object_unref (entry->info);
+  g_slice_free (DavCacheEntry, entry);
+}
+
 static void
 g_vfs_backend_dav_init (GVfsBackendDav *backend)
 {
   g_vfs_backend_set_user_visible (G_VFS_BACKEND (backend), TRUE);
+
+  backend->cache_lock = g_mutex_new ();
+  backend->cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, dav_cache_entry_free);
+  g_queue_init (&backend->cache_lru);
+  backend->cache_ttl = _g_getenv_uint ("GVFS_DAV_CACHE_TTL",
+                                       DAV_CACHE_DEFAULT_TTL);
+  backend->cache_max_entries = _g_getenv_uint ("GVFS_DAV_CACHE_MAX_ENTRIES",
+                                               DAV_CACHE_DEFAULT_MAX_ENTRIES);
 }
 
 /* ************************************************************************* */
@@ -409,114 +458,261 @@ g_vfs_backend_dav_send_message (GVfsBackend *backend, SoupMessage *message)
   return http_backend_send_message (backend, message);
 }
 
-/* ************************************************************************* */
-/* generic xml parsing functions */
-
-static inline gboolean
-node_has_name (xmlNodePtr node, const char *name)
+/* The same for the try_* functions: the message is sent without
+ * blocking, on the async session, and callback runs in the main
+ * thread. Like soup_session_queue_message () it takes over message. */
+static void
+g_vfs_backend_dav_queue_message (GVfsBackend         *backend,
+                                 SoupMessage         *message,
+                                 SoupSessionCallback  callback,
+                                 gpointer             user_data)
 {
-  g_return_val_if_fail (node != NULL, FALSE);
+  GVfsBackendHttp *http_backend;
+
+  http_backend = G_VFS_BACKEND_HTTP (backend);
+
+  soup_message_set_flags (message, SOUP_MESSAGE_NO_REDIRECT);
 
-  return ! strcmp ((char *) node->name, name);
+  soup_message_add_header_handler (message, "got_body", "Location",
+                                   G_CALLBACK (redirect_handler),
+                                   http_backend->session_async);
+
+  http_backend_queue_message (backend, message, callback, user_data);
 }
 
-static inline gboolean
-node_has_name_ns (xmlNodePtr node, const char *name, const char *ns_href)
-{
-  gboolean has_name;
-  gboolean has_ns;
+/* ************************************************************************* */
+/* Property cache */
 
-  g_return_val_if_fail (node != NULL, FALSE);
+/* File managers stat every file they just listed, so the results of
+ * PROPFIND requests are kept for a while. Entries are keyed by the
+ * decoded path of the resource without trailing slashes, so that the
+ * hrefs sent by the server match the URIs we build from filenames. */
 
-  has_name = has_ns = TRUE;
+static char *
+dav_cache_key (SoupURI *uri)
+{
+  char  *key;
+  gsize  len;
 
-  if (name)
-    has_name = node->name && ! strcmp ((char *) node->name, name);
+  key = soup_uri_decode (uri->path);
 
-  if (ns_href)
-    has_ns = node->ns && node->ns->href &&
-      ! g_ascii_strcasecmp ((char *) node->ns->href, ns_href);
+  len = strlen (key);
+  while (len > 1 && key[len - 1] == '/')
+    key[--len] = '\0';
 
-  return has_name && has_ns;
+  return key;
 }
 
-static inline gboolean
-node_is_element (xmlNodePtr node)
+static char *
+dav_cache_key_for_filename (GVfsBackend *backend,
+                            const char  *filename)
 {
-  return node->type == XML_ELEMENT_NODE && node->name != NULL;
-}
+  SoupURI *uri;
+  char    *key;
+
+  uri = http_backend_uri_for_filename (backend, filename, FALSE);
+  key = dav_cache_key (uri);
+  soup_uri_free (uri);
 
+  return key;
+}
 
-static inline gboolean
-node_is_element_with_name (xmlNodePtr node, const char *name)
+/* takes ownership of key */
+static void
+dav_cache_store (GVfsBackendDav *dav_backend,
+                 char           *key,
+                 GFileInfo      *info)
 {
-  return node->type == XML_ELEMENT_NODE &&
-    node->name != NULL && 
-    ! strcmp ((char *) node->name, name);
+  DavCacheEntry *entry;
+  GTimeVal       now;
+
+  if (dav_backend->cache_ttl == 0 || dav_backend->cache_max_entries == 0)
+    {
+      g_free (key);
+      return;
+    }
+
+  g_get_current_time (&now);
+
+  g_mutex_lock (dav_backend->cache_lock);
+
+  g_hash_table_remove (dav_backend->cache, key);
+
+  /* expired entries are still good for revalidation, so evict the
+   * least recently used ones */
+  while (g_hash_table_size (dav_backend->cache) >= dav_backend->cache_max_entries)
+    {
+      entry = g_queue_peek_tail (&dav_backend->cache_lru);
+      g_hash_table_remove (dav_backend->cache, entry->key);
+    }
+
+  entry = g_slice_new (DavCacheEntry);
+  entry->key = key;
+  entry->info = g_file_info_dup (info);
+  entry->expires = now.tv_sec + dav_backend->cache_ttl;
+  entry->lru = &dav_backend->cache_lru;
+  entry->lru_link.data = entry;
+  entry->lru_link.prev = entry->lru_link.next = NULL;
+  g_queue_push_head_link (&dav_backend->cache_lru, &entry->lru_link);
+  g_hash_table_insert (dav_backend->cache, key, entry);
+
+  g_mutex_unlock (dav_backend->cache_lock);
 }
 
-static const char *
-node_get_content (xmlNodePtr node)
+/* Returns a copy of the cached info or NULL. Expired entries are
+ * returned with is_expired set, so they can be revalidated. */
+static GFileInfo *
+dav_cache_lookup (GVfsBackendDav *dav_backend,
+                  const char     *key,
+                  gboolean       *is_expired)
 {
-    if (node == NULL)
-      return NULL;
+  DavCacheEntry *entry;
+  GFileInfo     *info;
+  GTimeVal       now;
 
-    switch (node->type)
-      {
-        case XML_ELEMENT_NODE:
-          return node_get_content (node->children);
-          break;
-        case XML_TEXT_NODE:
-          return (const char *) node->content;
-          break;
-        default:
-          return NULL;
-      }
+  g_get_current_time (&now);
+  info = NULL;
+
+  g_mutex_lock (dav_backend->cache_lock);
+
+  entry = g_hash_table_lookup (dav_backend->cache, key);
+  if (entry)
+    {
+      info = g_file_info_dup (entry->info);
+      *is_expired = now.tv_sec >= entry->expires;
+
+      g_queue_unlink (&dav_backend->cache_lru, &entry->lru_link);
+      g_queue_push_head_link (&dav_backend->cache_lru, &entry->lru_link);
+    }
+
+  g_mutex_unlock (dav_backend->cache_lock);
+
+  return info;
 }
 
-typedef struct _xmlNodeIter {
+static void
+dav_cache_renew (GVfsBackendDav *dav_backend,
+                 const char     *key)
+{
+  DavCacheEntry *entry;
+  GTimeVal       now;
 
-  xmlNodePtr cur_node;
-  xmlNodePtr next_node;
+  g_get_current_time (&now);
 
-  const char *name;
-  const char *ns_href;
+  g_mutex_lock (dav_backend->cache_lock);
+
+  entry = g_hash_table_lookup (dav_backend->cache, key);
+  if (entry)
+    entry->expires = now.tv_sec + dav_backend->cache_ttl;
 
-  void       *user_data;
+  g_mutex_unlock (dav_backend->cache_lock);
+}
 
-} xmlNodeIter;
+static gboolean
+dav_cache_key_has_prefix (gpointer key,
+                          gpointer value,
+                          gpointer user_data)
+{
+  return g_str_has_prefix (key, user_data);
+}
 
-static xmlNodePtr
-xml_node_iter_next (xmlNodeIter *iter)
+/* Drops the entry for key and the one of its parent directory, whose
+ * modification time changes with it. With recursive, everything below
+ * key goes, too. */
+static void
+dav_cache_invalidate (GVfsBackendDav *dav_backend,
+                      const char     *key,
+                      gboolean        recursive)
 {
-  xmlNodePtr node;
+  char *parent;
+  char *prefix;
 
-  while ((node = iter->next_node))
-    {
-      iter->next_node = node->next;
+  parent = g_path_get_dirname (key);
 
-      if (node->type == XML_ELEMENT_NODE) {
-        if (node_has_name_ns (node, iter->name, iter->ns_href))
-          break;
-      }
+  g_mutex_lock (dav_backend->cache_lock);
+
+  g_hash_table_remove (dav_backend->cache, key);
+  g_hash_table_remove (dav_backend->cache, parent);
+
+  if (recursive)
+    {
+      if (strcmp (key, "/") == 0)
+        g_hash_table_remove_all (dav_backend->cache);
+      else
+        {
+          prefix = g_strconcat (key, "/", NULL);
+          g_hash_table_foreach_remove (dav_backend->cache,
+                                       dav_cache_key_has_prefix,
+                                       prefix);
+          g_free (prefix);
+        }
     }
 
-  iter->cur_node = node;
-  return node;
+  g_mutex_unlock (dav_backend->cache_lock);
+
+  g_free (parent);
 }
 
-static void *
-xml_node_iter_get_user_data (xmlNodeIter *iter)
+static void
+dav_cache_invalidate_filename (GVfsBackend *backend,
+                               const char  *filename,
+                               gboolean     recursive)
 {
-  return iter->user_data;
+  char *key;
+
+  key = dav_cache_key_for_filename (backend, filename);
+  dav_cache_invalidate (G_VFS_BACKEND_DAV (backend), key, recursive);
+  g_free (key);
 }
 
-static xmlNodePtr
-xml_node_iter_get_current (xmlNodeIter *iter)
+/* Builds a request asking the server whether the file changed since
+ * it was cached, which is cheaper than another PROPFIND. A reply of
+ * 304 means the entry is still valid. Collections have no entity to
+ * compare against, so for those there is no request and they are
+ * always fetched again. */
+static SoupMessage *
+dav_cache_revalidate_request_new (GVfsBackend *backend,
+                                  const char  *filename,
+                                  GFileInfo   *info)
 {
-  return iter->cur_node;
+  SoupMessage *msg;
+  SoupURI     *uri;
+  SoupDate    *date;
+  const char  *etag;
+  char        *since;
+  GTimeVal     tv;
+
+  if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
+    return NULL;
+
+  etag = g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_ETAG_VALUE);
+  if (etag == NULL &&
+      ! g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+    return NULL;
+
+  uri = http_backend_uri_for_filename (backend, filename, FALSE);
+  msg = soup_message_new_from_uri (SOUP_METHOD_HEAD, uri);
+  soup_uri_free (uri);
+
+  if (etag)
+    soup_message_headers_append (msg->request_headers, "If-None-Match", etag);
+  else
+    {
+      g_file_info_get_modification_time (info, &tv);
+      date = soup_date_new_from_time_t (tv.tv_sec);
+      since = soup_date_to_string (date, SOUP_DATE_HTTP);
+      soup_message_headers_append (msg->request_headers,
+                                   "If-Modified-Since", since);
+      g_free (since);
+      soup_date_free (date);
+    }
+
+  return msg;
 }
 
+/* ************************************************************************* */
+/* Multistatus parsing code */
+
 static gint
 http_to_gio_error(guint status_code)
 {
@@ -547,203 +743,170 @@ http_to_gio_error(guint status_code)
   return G_IO_ERROR_FAILED;
 }
 
-static xmlDocPtr
-parse_xml (SoupMessage  *msg,
-           xmlNodePtr   *root,
-           const char   *name,
-           GError      **error)
-{
- xmlDocPtr  doc;
-
-  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
-    {
-      g_set_error (error, G_IO_ERROR, http_to_gio_error (msg->status_code),
-                   _("HTTP Error: %s"), msg->reason_phrase);
-      return NULL;
-    }
-
-  doc = xmlReadMemory (msg->response_body->data,
-                       msg->response_body->length,
-                       "response.xml",
-                       NULL,
-                       XML_PARSE_NONET |
-                       XML_PARSE_NOWARNING |
-                       XML_PARSE_NOBLANKS |
-                       XML_PARSE_NSCLEAN |
-                       XML_PARSE_NOCDATA |
-                       XML_PARSE_COMPACT);
-  if (doc == NULL)
-    { 
-      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-	                   _("Could not parse response"));
-      return NULL;
-    }
-
-  *root = xmlDocGetRootElement (doc);
+typedef void (*MultistatusCallback) (GVfsJob     *job,
+                                     SoupMessage *msg,
+                                     GError      *error);
 
-  if (*root == NULL || (*root)->children == NULL)
-    {
-      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-	                   _("Empty response"));
-      xmlFreeDoc (doc);
-      return NULL;
-    }
-
-  if (strcmp ((char *) (*root)->name, name))
-    {
-      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           _("Unexpected reply from server"));
-      xmlFreeDoc (doc);
-      return NULL;
-    }
-
-  return doc;
-}
-
-/* ************************************************************************* */
-/* Multistatus parsing code */
+typedef struct _MultistatusData {
 
-typedef struct _Multistatus Multistatus;
-typedef struct _MsResponse MsResponse;
-typedef struct _MsPropstat MsPropstat;
+  GVfsDavMultistatus *multistatus;
+  GError             *error;
 
-struct _Multistatus {
+  /* set up with the first chunk, NULL if the reply isn't compressed */
+  GVfsHttpDecoder    *decoder;
+  gboolean            got_chunk;
 
-  xmlDocPtr  doc;
-  xmlNodePtr root;
+  /* only for multistatus_queue () */
+  MultistatusCallback callback;
+  GVfsJob            *job;
 
-  SoupURI *target;
+} MultistatusData;
 
-};
+static void
+multistatus_feed (const char *chunk, gsize len, gpointer user_data)
+{
+  MultistatusData *data = user_data;
 
-struct _MsResponse {
+  if (data->error == NULL)
+    g_vfs_dav_multistatus_feed (data->multistatus, chunk, len, &data->error);
+}
 
-  Multistatus *multistatus;
+static void
+multistatus_got_chunk (SoupMessage *msg, SoupBuffer *chunk, gpointer user_data)
+{
+  MultistatusData *data = user_data;
 
-  xmlNodePtr  href;
-  xmlNodePtr  first_propstat;
-};
+  /* error pages and redirects are not for us */
+  if (! SOUP_STATUS_IS_SUCCESSFUL (msg->status_code) || data->error)
+    return;
 
-struct _MsPropstat {
+  if (! data->got_chunk)
+    {
+      data->decoder = g_vfs_http_decoder_new (msg);
+      data->got_chunk = TRUE;
+    }
 
-  Multistatus *multistatus;
+  if (data->decoder)
+    g_vfs_http_decoder_feed (data->decoder, chunk->data, chunk->length,
+                             multistatus_feed, data, &data->error);
+  else
+    multistatus_feed (chunk->data, chunk->length, data);
+}
 
-  xmlNodePtr   prop_node;
-  guint        status_code;
+static gboolean
+multistatus_finish (MultistatusData *data,
+                    SoupMessage     *msg,
+                    GError         **error)
+{
+  if (! SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+    {
+      g_set_error (error, G_IO_ERROR, http_to_gio_error (msg->status_code),
+                   _("HTTP Error: %s"), msg->reason_phrase);
+      return FALSE;
+    }
 
-};
+  if (data->error)
+    {
+      g_propagate_error (error, data->error);
+      data->error = NULL;
+      return FALSE;
+    }
 
+  return g_vfs_dav_multistatus_finish (data->multistatus, error);
+}
 
+/* Sends a PROPFIND and calls func for each response while the reply
+ * arrives, without keeping the whole reply in memory */
 static gboolean
-multistatus_parse (SoupMessage *msg, Multistatus *multistatus, GError **error)
+multistatus_send (GVfsBackend         *backend,
+                  SoupMessage         *msg,
+                  GVfsDavResponseFunc  func,
+                  gpointer             user_data,
+                  GError             **error)
 {
-  xmlDocPtr  doc;
-  xmlNodePtr root;
+  MultistatusData data = { 0, };
+  gboolean        res;
 
-  doc = parse_xml (msg, &root, "multistatus", error);
+  data.multistatus = g_vfs_dav_multistatus_new (func, user_data);
 
-  if (doc == NULL)
-    return FALSE;
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+  g_signal_connect (msg, "got-chunk",
+                    G_CALLBACK (multistatus_got_chunk), &data);
 
-  multistatus->doc = doc;
-  multistatus->root = root;
-  multistatus->target = soup_message_get_uri (msg);
+  g_vfs_backend_dav_send_message (backend, msg);
 
-  return TRUE;
-}
+  g_signal_handlers_disconnect_by_func (msg,
+                                        G_CALLBACK (multistatus_got_chunk),
+                                        &data);
 
-static void
-multistatus_free (Multistatus *multistatus)
-{
-  xmlFreeDoc (multistatus->doc);
-}
+  res = multistatus_finish (&data, msg, error);
 
-static void
-multistatus_get_response_iter (Multistatus *multistatus, xmlNodeIter *iter)
-{
-  iter->cur_node = multistatus->root->children;
-  iter->next_node = multistatus->root->children;
-  iter->name = "response";
-  iter->ns_href = "DAV:";
-  iter->user_data = multistatus;
+  if (data.decoder)
+    g_vfs_http_decoder_free (data.decoder);
+  g_vfs_dav_multistatus_free (data.multistatus);
+  return res;
 }
 
-static gboolean
-multistatus_get_response (xmlNodeIter *resp_iter, MsResponse *response)
+static void
+multistatus_queue_done (SoupSession *session,
+                        SoupMessage *msg,
+                        gpointer     user_data)
 {
-  Multistatus *multistatus;
-  xmlNodePtr   resp_node;
-  xmlNodePtr   iter;
-  xmlNodePtr   href;
-  xmlNodePtr   propstat;
-
-  multistatus = xml_node_iter_get_user_data (resp_iter);
-  resp_node = xml_node_iter_get_current (resp_iter);
+  MultistatusData *data = user_data;
+  GError          *error;
 
-  if (resp_node == NULL)
-    return FALSE;
-
-  propstat = NULL;
-  href = NULL;
-
-  for (iter = resp_node->children; iter; iter = iter->next)
-    {
-      if (! node_is_element (iter))
-        {
-          continue;
-        }
-      else if (node_has_name_ns (iter, "href", "DAV:"))
-        {
-          href = iter;
-        }
-      else if (node_has_name_ns (iter, "propstat", "DAV:"))
-        {
-          if (propstat == NULL)
-            propstat = iter;
-        }
+  error = NULL;
 
-      if (href && propstat)
-        break;
-    }
+  g_signal_handlers_disconnect_by_func (msg,
+                                        G_CALLBACK (multistatus_got_chunk),
+                                        data);
 
-  if (href == NULL)
-    return FALSE;
+  multistatus_finish (data, msg, &error);
+  data->callback (data->job, msg, error);
 
-  response->href = href;
-  response->multistatus = multistatus;
-  response->first_propstat = propstat;
+  if (error)
+    g_error_free (error);
 
-  return resp_node != NULL;
+  if (data->decoder)
+    g_vfs_http_decoder_free (data->decoder);
+  g_vfs_dav_multistatus_free (data->multistatus);
+  g_slice_free (MultistatusData, data);
 }
 
-static char *
-ms_response_get_basename (MsResponse *response)
+/* Like multistatus_send (), but without blocking. func gets the job's
+ * backend data, and callback runs once the whole reply was parsed,
+ * with error set if anything failed. Takes over msg. */
+static void
+multistatus_queue (GVfsBackend         *backend,
+                   SoupMessage         *msg,
+                   GVfsDavResponseFunc  func,
+                   MultistatusCallback  callback,
+                   GVfsJob             *job)
 {
-  const char *text;
-  text = node_get_content (response->href);
+  MultistatusData *data;
 
-  return http_uri_get_basename (text);
+  data = g_slice_new0 (MultistatusData);
+  data->multistatus = g_vfs_dav_multistatus_new (func, job->backend_data);
+  data->callback = callback;
+  data->job = job;
 
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+  g_signal_connect (msg, "got-chunk",
+                    G_CALLBACK (multistatus_got_chunk), data);
+
+  g_vfs_backend_dav_queue_message (backend, msg, multistatus_queue_done, data);
 }
 
 static gboolean
-ms_response_is_target (MsResponse *response)
+dav_response_is_target (SoupMessage           *msg,
+                        const GVfsDavResponse *response)
 {
-  const char *text;
-  const char *path;
   SoupURI    *target;
   SoupURI    *uri;
   gboolean    res;
 
-  uri    = NULL;
-  path   = NULL;
-  target = response->multistatus->target;
-  text   = node_get_content (response->href);
-
-  if (text == NULL)
-    return FALSE;
-
-  uri = soup_uri_new_with_base (target, text);
+  target = soup_message_get_uri (msg);
+  uri = soup_uri_new_with_base (target, response->href);
 
   if (uri == NULL)
     return FALSE;
@@ -755,99 +918,22 @@ ms_response_is_target (MsResponse *response)
   return res;
 }
 
-static void
-ms_response_get_propstat_iter (MsResponse *response, xmlNodeIter *iter)
-{
-  iter->cur_node = response->first_propstat;
-  iter->next_node = response->first_propstat;
-  iter->name = "propstat";
-  iter->ns_href = "DAV:"; 
-  iter->user_data = response;
-}
-
-static guint
-ms_response_get_propstat (xmlNodeIter *cur_node, MsPropstat *propstat)
-{
-  MsResponse *response;
-  xmlNodePtr  pstat_node;
-  xmlNodePtr  iter;
-  xmlNodePtr  prop;
-  xmlNodePtr  status;
-  const char *status_text;
-  gboolean    res;
-  guint       code;
-
-  response = xml_node_iter_get_user_data (cur_node);
-  pstat_node = xml_node_iter_get_current (cur_node);
-
-  if (pstat_node == NULL)
-    return 0;
-
-  status = NULL;
-  prop = NULL;
-  
-  for (iter = pstat_node->children; iter; iter = iter->next)
-    {
-      if (!node_is_element (iter))
-        {
-          continue;
-        }
-      else if (node_has_name_ns (iter, "status", "DAV:"))
-        {
-          status = iter;
-        }
-      else if (node_has_name_ns (iter, "prop", "DAV:"))
-        {
-          prop = iter;
-        }
-
-      if (status && prop)
-        break;
-    }
-
-  status_text = node_get_content (status);
-
-  if (status_text == NULL || prop == NULL)
-    return 0;
-
-  res = soup_headers_parse_status_line ((char *) status_text,
-                                        NULL,
-                                        &code,
-                                        NULL);
-
-  if (res == FALSE)
-    return 0;
-
-  propstat->prop_node = prop;
-  propstat->status_code = code;
-  propstat->multistatus = response->multistatus;
-
-  return code;
-}
-
-static GFileType
-parse_resourcetype (xmlNodePtr rt)
+static char *
+dav_response_cache_key (SoupMessage           *msg,
+                        const GVfsDavResponse *response)
 {
-  xmlNodePtr node;
-  GFileType  type;
+  SoupURI *uri;
+  char    *key;
 
-  for (node = rt->children; node; node = node->next)
-    { 
-      if (node_is_element (node))
-          break;
-    }
+  uri = soup_uri_new_with_base (soup_message_get_uri (msg), response->href);
 
-  if (node == NULL)
-    return G_FILE_TYPE_REGULAR;
+  if (uri == NULL)
+    return NULL;
 
-  if (! strcmp ((char *) node->name, "collection"))
-    type = G_FILE_TYPE_DIRECTORY;
-  else if (! strcmp ((char *) node->name, "redirectref"))
-    type = G_FILE_TYPE_SYMBOLIC_LINK;
-  else
-    type = G_FILE_TYPE_UNKNOWN;
+  key = dav_cache_key (uri);
+  soup_uri_free (uri);
 
-  return type;
+  return key;
 }
 
 static inline void
@@ -861,90 +947,52 @@ file_info_set_content_type (GFileInfo *info, const char *type)
 }
 
 static void
-ms_response_to_file_info (MsResponse *response,
-                          GFileInfo  *info)
+dav_response_to_file_info (const GVfsDavResponse *response,
+                           GFileInfo             *info)
 {
-  xmlNodeIter iter;
-  MsPropstat  propstat;
-  xmlNodePtr  node;
-  guint       status;
   char       *basename;
-  const char *text;
   GTimeVal    tv;
   GFileType   file_type;
   char       *mime_type;
   GIcon      *icon;
-  gboolean    have_display_name;
 
-  basename = ms_response_get_basename (response);
+  basename = http_uri_get_basename (response->href);
   g_file_info_set_name (info, basename);
   g_file_info_set_edit_name (info, basename);
 
-  file_type = G_FILE_TYPE_UNKNOWN;
-  mime_type = NULL;
+  file_type = response->file_type;
+  if (file_type != G_FILE_TYPE_UNKNOWN)
+    g_file_info_set_file_type (info, file_type);
 
-  have_display_name = FALSE;
-  ms_response_get_propstat_iter (response, &iter);
-  while (xml_node_iter_next (&iter))
-    {
-      status = ms_response_get_propstat (&iter, &propstat);
+  if (response->display_name)
+    g_file_info_set_display_name (info, response->display_name);
+  else
+    g_file_info_set_display_name (info, basename);
+
+  if (response->etag)
+    g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_ETAG_VALUE,
+                                      response->etag);
+
+  if (response->creation_date &&
+      g_time_val_from_iso8601 (response->creation_date, &tv))
+    g_file_info_set_attribute_uint64 (info,
+                                      G_FILE_ATTRIBUTE_TIME_CREATED,
+                                      tv.tv_sec);
 
-      if (! SOUP_STATUS_IS_SUCCESSFUL (status))
-        continue;
+  if (response->content_length)
+    g_file_info_set_size (info,
+                          g_ascii_strtoll (response->content_length, NULL, 10));
 
-      for (node = propstat.prop_node->children; node; node = node->next)
+  if (response->last_modified)
+    {
+      SoupDate *sd;
+
+      sd = soup_date_new_from_string (response->last_modified);
+      if (sd)
         {
-          if (! node_is_element (node))
-            continue; /* TODO: check namespace, parse user data nodes*/
-
-          text = node_get_content (node);
-
-          if (node_has_name (node, "resourcetype"))
-            {
-              file_type = parse_resourcetype (node);
-              g_file_info_set_file_type (info, file_type);
-            }
-          else if (node_has_name (node, "displayname"))
-            {
-              g_file_info_set_display_name (info, text);
-              have_display_name = TRUE;
-            }
-          else if (node_has_name (node, "getetag"))
-            {
-              g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_ETAG_VALUE,
-                                                text);
-            }
-          else if (node_has_name (node, "creationdate"))
-            {
-              if (! g_time_val_from_iso8601 (text, &tv))
-                continue;
-
-              g_file_info_set_attribute_uint64 (info,
-                                                G_FILE_ATTRIBUTE_TIME_CREATED,
-                                                tv.tv_sec);
-            }
-          else if (node_has_name (node, "getcontenttype"))
-            {
-              mime_type = g_strdup (text);
-            }
-          else if (node_has_name (node, "getcontentlength"))
-            {
-              gint64 size;
-              size = g_ascii_strtoll (text, NULL, 10);
-              g_file_info_set_size (info, size);
-            }
-          else if (node_has_name (node, "getlastmodified"))
-            {
-              SoupDate *sd;
-              GTimeVal tv;
-	      sd = soup_date_new_from_string(text);
-	      if (sd)
-	        {
-		  soup_date_to_timeval (sd, &tv);
-		  g_file_info_set_modification_time (info, &tv);
-		  soup_date_free (sd);
-		}
-	    }
+          soup_date_to_timeval (sd, &tv);
+          g_file_info_set_modification_time (info, &tv);
+          soup_date_free (sd);
         }
     }
 
@@ -955,7 +1003,9 @@ ms_response_to_file_info (MsResponse *response,
     }
   else
     {
-      if (mime_type == NULL)
+      if (response->content_type)
+        mime_type = g_strdup (response->content_type);
+      else
         mime_type = g_content_type_guess (basename, NULL, 0, NULL);
 
       icon = g_content_type_get_icon (mime_type);
@@ -964,53 +1014,12 @@ ms_response_to_file_info (MsResponse *response,
         g_themed_icon_append_name (G_THEMED_ICON (icon), "text-x-generic");
 
       file_info_set_content_type (info, mime_type);
+      g_free (mime_type);
     }
 
-  if (have_display_name == FALSE)
-    g_file_info_set_display_name (info, basename);
-
   g_file_info_set_icon (info, icon);
   g_object_unref (icon);
-  g_free (mime_type);
   g_free (basename);
-
-}
-
-static GFileType
-ms_response_to_file_type (MsResponse *response)
-{
-  xmlNodeIter prop_iter;
-  MsPropstat  propstat;
-  GFileType   file_type;
-  guint       status;
-
-  file_type = G_FILE_TYPE_UNKNOWN;
-
-  ms_response_get_propstat_iter (response, &prop_iter);
-  while (xml_node_iter_next (&prop_iter))
-    {
-      xmlNodePtr iter;
-
-      status = ms_response_get_propstat (&prop_iter, &propstat);
-
-      if (! SOUP_STATUS_IS_SUCCESSFUL (status))
-        continue;
-
-      for (iter = propstat.prop_node->children; iter; iter = iter->next)
-        {
-          if (node_is_element (iter) &&
-              node_has_name_ns (iter, "resourcetype", "DAV:"))
-            break;
-        }
-
-      if (iter)
-        {
-          file_type = parse_resourcetype (iter);
-          break;
-        }
-    }
-
-  return file_type;
 }
 
 #define PROPSTAT_XML_BEGIN                        \
@@ -1058,6 +1067,7 @@ propfind_request_new (GVfsBackend     *backend,
     header_depth = "infinity";
 
   soup_message_headers_append (msg->request_headers, "Depth", header_depth);
+  g_vfs_http_decoder_accept_encoding (msg);
 
   body = g_string_new (PROPSTAT_XML_BEGIN);
 
@@ -1114,6 +1124,7 @@ stat_location_begin (SoupURI  *uri,
     depth = "0";
 
   soup_message_headers_append (msg->request_headers, "Depth", depth);
+  g_vfs_http_decoder_accept_encoding (msg);
 
   soup_message_set_request (msg, "application/xml",
                             SOUP_MEMORY_STATIC,
@@ -1122,98 +1133,107 @@ stat_location_begin (SoupURI  *uri,
   return msg;
 }
 
-static gboolean
-stat_location_finish (SoupMessage *msg,
-                      GFileType   *target_type,
-                      guint       *num_children)
-{
-  Multistatus  ms;
-  xmlNodeIter  iter;
-  gboolean     res;
-  GError      *error;
-  guint        child_count;
-  GFileType    file_type;
+typedef struct _StatLocationData {
 
-  if (msg->status_code != 207)
-    return FALSE;
+  SoupMessage *msg;
+  gboolean     found;
+  GFileType    file_type;
+  guint        num_children;
 
-  res = multistatus_parse (msg, &ms, &error);
+} StatLocationData;
 
-  if (res == FALSE)
-    return FALSE;
+static void
+stat_location_got_response (const GVfsDavResponse *response,
+                            gpointer               user_data)
+{
+  StatLocationData *data = user_data;
 
-  res = FALSE;
-  child_count = 0;
-  file_type = G_FILE_TYPE_UNKNOWN;
-
-  multistatus_get_response_iter (&ms, &iter);
-  while (xml_node_iter_next (&iter))
+  if (dav_response_is_target (data->msg, response))
     {
-      MsResponse response;
+      data->file_type = response->file_type;
+      data->found = TRUE;
+    }
+  else
+    data->num_children++;
+}
 
-      if (! multistatus_get_response (&iter, &response))
-        continue;
+static gboolean
+stat_location_finish (SoupMessage       *msg,
+                      StatLocationData  *data,
+                      gboolean           res,
+                      GFileType         *target_type,
+                      guint             *num_children,
+                      GError           **error)
+{
+  if (msg->status_code != 207)
+    {
+      g_set_error_literal (error,
+	                   G_IO_ERROR,
+        	           http_error_code_from_status (msg->status_code),
+                	   msg->reason_phrase);
 
-      if (ms_response_is_target (&response))
-        {
-          file_type = ms_response_to_file_type (&response);
-          res = TRUE;
-        }
-      else
-        child_count++;
+      return FALSE;
     }
 
-  if (res)
+  if (res == FALSE || data->found == FALSE)
     {
-      if (target_type)
-        *target_type = file_type;
-
-      if (num_children)
-        *num_children = child_count;
+      g_set_error_literal (error, 
+	                   G_IO_ERROR, G_IO_ERROR_FAILED,
+        	           _("Response invalid"));
+      return FALSE;
     }
 
-  multistatus_free (&ms);
-  return res;
+  if (target_type)
+    *target_type = data->file_type;
+
+  if (num_children)
+    *num_children = data->num_children;
+
+  return TRUE;
 }
 
 static gboolean
-stat_location (GVfsBackend  *backend,
-               SoupURI      *uri,
-               GFileType    *target_type,
-               guint        *num_children,
-               GError      **error)
+stat_location_send (GVfsBackend  *backend,
+                    SoupMessage  *msg,
+                    GFileType    *target_type,
+                    guint        *num_children,
+                    GError      **error)
 {
-  SoupMessage *msg;
-  guint        status;
-  gboolean     count_children;
-  gboolean     res;
+  StatLocationData data;
+  gboolean         res;
 
-  count_children = num_children != NULL;
-  msg = stat_location_begin (uri, count_children);
+  data.msg = msg;
+  data.found = FALSE;
+  data.file_type = G_FILE_TYPE_UNKNOWN;
+  data.num_children = 0;
 
-  if (msg == NULL)
-    return FALSE;
+  res = multistatus_send (backend, msg, stat_location_got_response, &data, NULL);
 
-  status = g_vfs_backend_dav_send_message (backend, msg);
+  return stat_location_finish (msg, &data, res, target_type, num_children, error);
+}
 
-  if (status != 207)
-    {
-      g_set_error_literal (error,
-	                   G_IO_ERROR,
-        	           http_error_code_from_status (status),
-                	   msg->reason_phrase);
+/* Gets the type of uri from the PROPFIND cache, if it is fresh */
+static gboolean
+stat_location_cached (GVfsBackend  *backend,
+                      SoupURI      *uri,
+                      GFileType    *target_type)
+{
+  GFileInfo   *info;
+  gboolean     is_expired;
+  char        *key;
 
-      return FALSE;
-    }
+  key = dav_cache_key (uri);
+  info = dav_cache_lookup (G_VFS_BACKEND_DAV (backend), key, &is_expired);
+  g_free (key);
 
-  res = stat_location_finish (msg, target_type, num_children);
+  if (info == NULL)
+    return FALSE;
 
-  if (res == FALSE)
-    g_set_error_literal (error, 
-	                 G_IO_ERROR, G_IO_ERROR_FAILED,
-        	         _("Response invalid"));
+  if (! is_expired && target_type)
+    *target_type = g_file_info_get_file_type (info);
+  g_object_unref (info);
 
-  return res;
+  return ! is_expired;
 }
 
 
@@ -1666,8 +1686,7 @@ do_mount (GVfsBackend  *backend,
         cur_uri = soup_message_get_uri (msg_opts);
         soup_message_set_uri (msg_stat, cur_uri);
 
-        g_vfs_backend_dav_send_message (backend, msg_stat);
-        res = stat_location_finish (msg_stat, &file_type, NULL);
+        res = stat_location_send (backend, msg_stat, &file_type, NULL, NULL);
 
         if (res && file_type == G_FILE_TYPE_DIRECTORY)
           {
@@ -1752,6 +1771,11 @@ do_mount (GVfsBackend  *backend,
                     data);
 
   g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  /* mounting only used the sync session, the async one that serves
+   * most operations hasn't connected yet */
+  http_backend_warm_up (backend,
+                        soup_message_new_from_uri (SOUP_METHOD_OPTIONS, mount_base));
   g_debug ("- mount\n");
 }
 
@@ -1767,96 +1791,240 @@ static PropName ls_propnames[] = {
 };
 
 /* *** query_info () *** */
+typedef struct _QueryInfoData {
+
+  SoupMessage      *msg;
+  GFileInfo        *info;
+  char             *key;
+
+} QueryInfoData;
+
 static void
-do_query_info (GVfsBackend           *backend,
-               GVfsJobQueryInfo      *job,
-               const char            *filename,
-               GFileQueryInfoFlags    flags,
-               GFileInfo             *info,
-               GFileAttributeMatcher *matcher)
+query_info_data_free (gpointer user_data)
 {
-  SoupMessage *msg;
-  Multistatus  ms;
-  xmlNodeIter  iter;
-  gboolean     res;
-  GError      *error;
+  QueryInfoData *data = user_data;
 
-  error   = NULL;
+  if (data->info)
+    g_object_unref (data->info);
+  g_free (data->key);
+  g_slice_free (QueryInfoData, data);
+}
 
-  g_debug ("Query info %s\n", filename);
+static void
+query_info_got_response (const GVfsDavResponse *response,
+                         gpointer               user_data)
+{
+  QueryInfoData *data = user_data;
+
+  if (! dav_response_is_target (data->msg, response))
+    return;
+
+  if (data->info == NULL)
+    data->info = g_file_info_new ();
+  dav_response_to_file_info (response, data->info);
+}
+
+static void
+query_info_done (GVfsJob     *job,
+                 SoupMessage *msg,
+                 GError      *error)
+{
+  GVfsJobQueryInfo *query_job = G_VFS_JOB_QUERY_INFO (job);
+  QueryInfoData    *data = job->backend_data;
+
+  if (error)
+    g_vfs_job_failed_from_error (job, error);
+  else if (data->info)
+    {
+      g_file_info_copy_into (data->info, query_job->file_info);
+      g_file_info_set_attribute_mask (query_job->file_info,
+                                      query_job->attribute_matcher);
+      dav_cache_store (G_VFS_BACKEND_DAV (query_job->backend),
+                       data->key, data->info);
+      data->key = NULL;
+      g_vfs_job_succeeded (job);
+    }
+  else
+    g_vfs_job_failed (job,
+                      G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Response invalid"));
+}
+
+static void
+query_info_send_propfind (GVfsJobQueryInfo *job)
+{
+  QueryInfoData *data = G_VFS_JOB (job)->backend_data;
+  SoupMessage   *msg;
 
-  msg = propfind_request_new (backend, filename, 0, ls_propnames);
+  msg = propfind_request_new (job->backend, job->filename, 0, ls_propnames);
 
   if (msg == NULL)
     {
       g_vfs_job_failed (G_VFS_JOB (job),
                         G_IO_ERROR, G_IO_ERROR_FAILED,
                         _("Could not create request"));
-      
       return;
     }
 
-  message_add_redirect_header (msg, flags);
+  message_add_redirect_header (msg, job->flags);
 
-  g_vfs_backend_dav_send_message (backend, msg);
+  /* filled without the job's attribute mask, so the cached
+   * copy is good for any query */
+  data->msg = msg;
 
-  res = multistatus_parse (msg, &ms, &error);
+  multistatus_queue (job->backend, msg, query_info_got_response,
+                     query_info_done, G_VFS_JOB (job));
+}
 
-  if (res == FALSE)
+static void
+query_info_revalidated (SoupSession *session,
+                        SoupMessage *msg,
+                        gpointer     user_data)
+{
+  GVfsJobQueryInfo *job = G_VFS_JOB_QUERY_INFO (user_data);
+  QueryInfoData    *data = G_VFS_JOB (job)->backend_data;
+
+  if (msg->status_code != SOUP_STATUS_NOT_MODIFIED)
     {
-      g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
-      g_error_free (error);
-      g_object_unref (msg);
+      g_object_unref (data->info);
+      data->info = NULL;
+      query_info_send_propfind (job);
       return;
     }
 
-  res = FALSE;
-  multistatus_get_response_iter (&ms, &iter);
+  g_debug ("Query info %s: revalidated\n", job->filename);
+  dav_cache_renew (G_VFS_BACKEND_DAV (job->backend), data->key);
+  g_file_info_copy_into (data->info, job->file_info);
+  g_file_info_set_attribute_mask (job->file_info, job->attribute_matcher);
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+}
+
+static gboolean
+try_query_info (GVfsBackend           *backend,
+                GVfsJobQueryInfo      *job,
+                const char            *filename,
+                GFileQueryInfoFlags    flags,
+                GFileInfo             *info,
+                GFileAttributeMatcher *matcher)
+{
+  GVfsBackendDav *dav_backend = G_VFS_BACKEND_DAV (backend);
+  QueryInfoData  *data;
+  SoupMessage    *msg;
+  GFileInfo      *cached;
+  gboolean        is_expired;
+  char           *key;
 
-  while (xml_node_iter_next (&iter))
+  g_debug ("Query info %s\n", filename);
+
+  key = dav_cache_key_for_filename (backend, filename);
+  cached = dav_cache_lookup (dav_backend, key, &is_expired);
+
+  if (cached && ! is_expired)
     {
-      MsResponse response;
+      g_debug ("Query info %s: cached\n", filename);
+      g_file_info_copy_into (cached, info);
+      g_file_info_set_attribute_mask (info, matcher);
+      g_object_unref (cached);
+      g_free (key);
+      g_vfs_job_succeeded (G_VFS_JOB (job));
+      return TRUE;
+    }
 
-      if (! multistatus_get_response (&iter, &response))
-        continue;
+  data = g_slice_new0 (QueryInfoData);
+  data->key = key;
+  g_vfs_job_set_backend_data (G_VFS_JOB (job), data, query_info_data_free);
 
-      if (ms_response_is_target (&response))
+  if (cached)
+    {
+      msg = dav_cache_revalidate_request_new (backend, filename, cached);
+      if (msg)
         {
-          ms_response_to_file_info (&response, job->file_info);
-          res = TRUE;
+          data->info = cached;
+          g_vfs_backend_dav_queue_message (backend, msg,
+                                           query_info_revalidated, job);
+          return TRUE;
         }
+
+      g_object_unref (cached);
     }
 
-  multistatus_free (&ms);
-  g_object_unref (msg);
+  query_info_send_propfind (job);
+  return TRUE;
+}
 
-  if (res)
-    g_vfs_job_succeeded (G_VFS_JOB (job));
-  else
-    g_vfs_job_failed (G_VFS_JOB (job),
-                      G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Response invalid"));
 
+/* *** enumerate *** */
+typedef struct _EnumerateData {
+
+  GVfsJobEnumerate *job;
+  SoupMessage      *msg;
+
+} EnumerateData;
+
+static void
+enumerate_data_free (gpointer user_data)
+{
+  g_slice_free (EnumerateData, user_data);
 }
 
+/* Called while the reply is still arriving, so the first files are
+ * sent to the client before the whole listing was received */
+static void
+enumerate_got_response (const GVfsDavResponse *response,
+                        gpointer               user_data)
+{
+  EnumerateData *data = user_data;
+  GFileInfo     *info;
+  char          *key;
+
+  info = g_file_info_new ();
+  dav_response_to_file_info (response, info);
+
+  /* prefill the cache for the query_info () calls that usually follow,
+   * before add_info () applies the job's attribute mask */
+  key = dav_response_cache_key (data->msg, response);
+  if (key)
+    dav_cache_store (G_VFS_BACKEND_DAV (data->job->backend), key, info);
+
+  if (dav_response_is_target (data->msg, response))
+    {
+      g_object_unref (info);
+      return;
+    }
+
+  /* GotInfo goes out right away, the client only uses the infos
+   * once the job succeeded */
+  g_vfs_job_enumerate_add_info (data->job, info);
+  g_object_unref (info);
+}
 
-/* *** enumerate *** */
 static void
-do_enumerate (GVfsBackend           *backend,
-              GVfsJobEnumerate      *job,
-              const char            *filename,
-              GFileAttributeMatcher *matcher,
-              GFileQueryInfoFlags    flags)
+enumerate_done (GVfsJob     *job,
+                SoupMessage *msg,
+                GError      *error)
 {
-  SoupMessage *msg;
-  Multistatus  ms;
-  xmlNodeIter  iter;
-  gboolean     res;
-  GError      *error;
- 
-  error = NULL;
+  /* a partial listing must not look complete */
+  if (error)
+    {
+      g_vfs_job_failed_from_error (job, error);
+      return;
+    }
+
+  g_vfs_job_succeeded (job);
+  g_vfs_job_enumerate_done (G_VFS_JOB_ENUMERATE (job));
+}
+
+static gboolean
+try_enumerate (GVfsBackend           *backend,
+               GVfsJobEnumerate      *job,
+               const char            *filename,
+               GFileAttributeMatcher *matcher,
+               GFileQueryInfoFlags    flags)
+{
+  SoupMessage   *msg;
+  EnumerateData *data;
 
-  g_debug ("+ do_enumerate: %s\n", filename);
+  g_debug ("+ try_enumerate: %s\n", filename);
 
   msg = propfind_request_new (backend, filename, 1, ls_propnames);
 
@@ -1866,61 +2034,123 @@ do_enumerate (GVfsBackend           *backend,
                         G_IO_ERROR, G_IO_ERROR_FAILED,
                         _("Could not create request"));
       
-      return;
+      return TRUE;
     }
 
   message_add_redirect_header (msg, flags);
 
-  g_vfs_backend_dav_send_message (backend, msg);
+  data = g_slice_new0 (EnumerateData);
+  data->job = job;
+  data->msg = msg;
+  g_vfs_job_set_backend_data (G_VFS_JOB (job), data, enumerate_data_free);
 
-  res = multistatus_parse (msg, &ms, &error);
+  multistatus_queue (backend, msg, enumerate_got_response,
+                     enumerate_done, G_VFS_JOB (job));
+  return TRUE;
+}
 
-  if (res == FALSE)
+/* ************************************************************************* */
+/*  */
+
+/* *** create () and replace () *** */
+
+/* The PUT is sent with the precondition right away, and the stream is
+ * handed out once the server asked for the body with "100 Continue",
+ * so it is checked in the same request that carries the data */
+static void
+open_for_write_send (GVfsBackend         *backend,
+                     GVfsJob             *job,
+                     SoupURI             *uri,
+                     const char          *header,
+                     const char          *value,
+                     GAsyncReadyCallback  callback)
+{
+  GVfsBackendHttp *op_backend = G_VFS_BACKEND_HTTP (backend);
+  SoupMessage     *put_msg;
+  GOutputStream   *stream;
+
+  put_msg = soup_message_new_from_uri (SOUP_METHOD_PUT, uri);
+
+  if (header)
+    soup_message_headers_append (put_msg->request_headers, header, value);
+
+  stream = soup_output_stream_new_chunked (op_backend->session_async, put_msg);
+  g_object_unref (put_msg);
+
+  /* see close_write_ready () */
+  g_object_set_data_full (G_OBJECT (stream), "gvfs-dav-cache-key",
+                          dav_cache_key (uri), g_free);
+
+  soup_output_stream_open_async (stream, G_PRIORITY_DEFAULT,
+                                 job->cancellable, callback, job);
+}
+
+/* Returns TRUE if the job is done, otherwise error is the server's
+ * status for the caller to look at */
+static gboolean
+open_for_write_finish (GOutputStream  *stream,
+                       GAsyncResult   *result,
+                       GVfsJob        *job,
+                       GError        **error_out)
+{
+  GError *error;
+
+  error = NULL;
+
+  if (soup_output_stream_open_finish (stream, result, &error))
     {
-      g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
-      g_error_free (error);
-      g_object_unref (msg);
-      return;
+      g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), stream);
+      g_vfs_job_succeeded (job);
+      return TRUE;
     }
 
-  multistatus_get_response_iter (&ms, &iter);
+  g_object_unref (stream);
 
-  while (xml_node_iter_next (&iter))
+  if (error->domain == SOUP_HTTP_ERROR &&
+      error->code == SOUP_STATUS_PRECONDITION_FAILED)
     {
-      MsResponse  response;
-      GFileInfo  *info;
+      g_propagate_error (error_out, error);
+      return FALSE;
+    }
 
-      if (! multistatus_get_response (&iter, &response))
-        continue;
+  if (error->domain == SOUP_HTTP_ERROR)
+    g_vfs_job_failed_literal (job, G_IO_ERROR,
+                              http_error_code_from_status (error->code),
+                              error->message);
+  else
+    g_vfs_job_failed_from_error (job, error);
 
-      if (ms_response_is_target (&response))
-        continue;
+  g_error_free (error);
+  return TRUE;
+}
 
-      info = g_file_info_new ();
-      ms_response_to_file_info (&response, info);
-      g_vfs_job_enumerate_add_info (job, info);
-    }
+static void
+open_for_write_opened (GObject      *source_object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  GVfsJob *job = G_VFS_JOB (user_data);
+  GError  *error;
 
-  multistatus_free (&ms);
-  g_object_unref (msg);
+  error = NULL;
 
-  g_vfs_job_succeeded (G_VFS_JOB (job)); /* should that be called earlier? */
-  g_vfs_job_enumerate_done (G_VFS_JOB_ENUMERATE (job));
-}
+  if (open_for_write_finish (G_OUTPUT_STREAM (source_object), result,
+                             job, &error))
+    return;
 
-/* ************************************************************************* */
-/*  */
+  g_vfs_job_failed_literal (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                            error->message);
+  g_error_free (error);
+}
 
-/* *** create () *** */
 static void
 try_create_tested_existence (SoupSession *session, SoupMessage *msg,
                              gpointer user_data)
 {
-  GVfsJob *job = G_VFS_JOB (user_data);
-  GVfsBackendHttp *op_backend = job->backend_data;
-  GOutputStream   *stream;
-  SoupMessage     *put_msg;
-  SoupURI         *uri;
+  GVfsJob        *job = G_VFS_JOB (user_data);
+  GVfsBackendDav *dav_backend;
+
+  dav_backend = G_VFS_BACKEND_DAV (G_VFS_JOB_OPEN_FOR_WRITE (job)->backend);
 
   if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
     {
@@ -1930,21 +2160,52 @@ try_create_tested_existence (SoupSession *session, SoupMessage *msg,
                         _("Target file already exists"));
       return;
     }
-  /* TODO: other errors */
+  else if (msg->status_code != SOUP_STATUS_NOT_FOUND)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR,
+                        http_error_code_from_status (msg->status_code),
+                        _("HTTP Error: %s"), msg->reason_phrase);
+      return;
+    }
 
-  uri = soup_message_get_uri (msg);
-  put_msg = soup_message_new_from_uri (SOUP_METHOD_PUT, uri);
+  /* Only reached after a 412 or once the server is known to send
+   * those, don't bother with the precondition from now on */
+  dav_backend->if_none_match_broken = TRUE;
 
-  /* 
-   * Doesn't work with apache > 2.2.9
-   * soup_message_headers_append (put_msg->request_headers, "If-None-Match", "*");
-   */
-  stream = soup_output_stream_new (op_backend->session, put_msg, -1);
-  g_object_unref (put_msg);
+  open_for_write_send (G_VFS_JOB_OPEN_FOR_WRITE (job)->backend, job,
+                       soup_message_get_uri (msg), NULL, NULL,
+                       open_for_write_opened);
+}
 
-  g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), stream);
-  g_vfs_job_succeeded (job);
-}  
+static void
+try_create_opened (GObject      *source_object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  GVfsJob     *job = G_VFS_JOB (user_data);
+  GVfsBackend *backend = G_VFS_JOB_OPEN_FOR_WRITE (job)->backend;
+  SoupMessage *msg;
+  SoupURI     *uri;
+  GError      *error;
+
+  error = NULL;
+
+  if (open_for_write_finish (G_OUTPUT_STREAM (source_object), result,
+                             job, &error))
+    return;
+
+  g_error_free (error);
+
+  /* Some versions of mod_dav refuse "If-None-Match: *" for files that
+   * don't exist, so make sure with a separate request. */
+  uri = http_backend_uri_for_filename (backend,
+                                       G_VFS_JOB_OPEN_FOR_WRITE (job)->filename,
+                                       FALSE);
+  msg = soup_message_new_from_uri (SOUP_METHOD_HEAD, uri);
+  soup_uri_free (uri);
+
+  http_backend_queue_message (backend, msg, try_create_tested_existence, job);
+}
 
 static gboolean
 try_create (GVfsBackend *backend,
@@ -1955,60 +2216,42 @@ try_create (GVfsBackend *backend,
   SoupMessage *msg;
   SoupURI     *uri;
 
-  /* TODO: if SoupOutputStream supported chunked requests, we could
-   * use a PUT with "If-None-Match: *" and "Expect: 100-continue"
-   */
   uri = http_backend_uri_for_filename (backend, filename, FALSE);
-  msg = soup_message_new_from_uri (SOUP_METHOD_HEAD, uri);
-  soup_uri_free (uri);
 
-  g_vfs_job_set_backend_data (G_VFS_JOB (job), backend, NULL);
+  if (G_VFS_BACKEND_DAV (backend)->if_none_match_broken)
+    {
+      msg = soup_message_new_from_uri (SOUP_METHOD_HEAD, uri);
+      http_backend_queue_message (backend, msg, try_create_tested_existence, job);
+    }
+  else
+    open_for_write_send (backend, G_VFS_JOB (job), uri, "If-None-Match", "*",
+                         try_create_opened);
 
-  http_backend_queue_message (backend, msg, try_create_tested_existence, job);
+  soup_uri_free (uri);
   return TRUE;
 }
 
-/* *** replace () *** */
 static void
-open_for_replace_succeeded (GVfsBackendHttp *op_backend, GVfsJob *job,
-                            SoupURI *uri, const char *etag)
+try_replace_opened (GObject      *source_object,
+                    GAsyncResult *result,
+                    gpointer      user_data)
 {
-  SoupMessage     *put_msg;
-  GOutputStream   *stream;
-
-  put_msg = soup_message_new_from_uri (SOUP_METHOD_PUT, uri);
+  GVfsJob *job = G_VFS_JOB (user_data);
+  GError  *error;
 
-  if (etag)
-    soup_message_headers_append (put_msg->request_headers, "If-Match", etag);
+  error = NULL;
 
-  stream = soup_output_stream_new (op_backend->session, put_msg, -1);
-  g_object_unref (put_msg);
+  if (open_for_write_finish (G_OUTPUT_STREAM (source_object), result,
+                             job, &error))
+    return;
 
-  g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), stream);
-  g_vfs_job_succeeded (job);
+  g_error_free (error);
+  g_vfs_job_failed (job,
+                    G_IO_ERROR,
+                    G_IO_ERROR_WRONG_ETAG,
+                    _("The file was externally modified"));
 }
 
-static void
-try_replace_checked_etag (SoupSession *session, SoupMessage *msg,
-                          gpointer user_data)
-{
-  GVfsJob *job = G_VFS_JOB (user_data);
-  GVfsBackendHttp *op_backend = job->backend_data;
-
-  if (msg->status_code == SOUP_STATUS_PRECONDITION_FAILED)
-    {
-      g_vfs_job_failed (G_VFS_JOB (job),
-                        G_IO_ERROR,
-                        G_IO_ERROR_WRONG_ETAG,
-                        _("The file was externally modified"));
-      return;
-    }
-  /* TODO: other errors */
-
-  open_for_replace_succeeded (op_backend, job, soup_message_get_uri (msg),
-                              soup_message_headers_get (msg->request_headers, "If-Match"));
-}  
-
 static gboolean
 try_replace (GVfsBackend *backend,
              GVfsJobOpenForWrite *job,
@@ -2017,14 +2260,7 @@ try_replace (GVfsBackend *backend,
              gboolean make_backup,
              GFileCreateFlags flags)
 {
-  GVfsBackendHttp *op_backend;
-  SoupURI         *uri;
-
-  /* TODO: if SoupOutputStream supported chunked requests, we could
-   * use a PUT with "If-Match: ..." and "Expect: 100-continue"
-   */
-
-  op_backend = G_VFS_BACKEND_HTTP (backend);
+  SoupURI *uri;
 
   if (make_backup)
     {
@@ -2035,25 +2271,15 @@ try_replace (GVfsBackend *backend,
       return TRUE;
     }
 
-
-
   uri = http_backend_uri_for_filename (backend, filename, FALSE);
 
   if (etag)
-    {
-      SoupMessage *msg;
-
-      msg = soup_message_new_from_uri (SOUP_METHOD_HEAD, uri);
-      soup_uri_free (uri);
-      soup_message_headers_append (msg->request_headers, "If-Match", etag);
-
-      g_vfs_job_set_backend_data (G_VFS_JOB (job), op_backend, NULL);
-      soup_session_queue_message (op_backend->session, msg,
-                                  try_replace_checked_etag, job);
-      return TRUE;
-    }
+    open_for_write_send (backend, G_VFS_JOB (job), uri, "If-Match", etag,
+                         try_replace_opened);
+  else
+    open_for_write_send (backend, G_VFS_JOB (job), uri, NULL, NULL,
+                         open_for_write_opened);
 
-  open_for_replace_succeeded (op_backend, G_VFS_JOB (job), uri, NULL);
   soup_uri_free (uri);
   return TRUE;
 }
@@ -2128,6 +2354,11 @@ close_write_ready (GObject      *source_object,
   res = g_output_stream_close_finish (stream,
                                       result,
                                       &error);
+
+  /* even a failed upload may have changed the file */
+  dav_cache_invalidate (G_VFS_BACKEND_DAV (G_VFS_JOB_CLOSE_WRITE (job)->backend),
+                        g_object_get_data (G_OBJECT (stream), "gvfs-dav-cache-key"),
+                        FALSE);
   if (res == FALSE)
     {
       g_vfs_job_failed_literal (G_VFS_JOB (job),
@@ -2161,20 +2392,16 @@ try_close_write (GVfsBackend *backend,
   return TRUE;
 }
 
+/* *** make_directory () *** */
 static void
-do_make_directory (GVfsBackend          *backend,
-                   GVfsJobMakeDirectory *job,
-                   const char           *filename)
+make_directory_done (SoupSession *session,
+                     SoupMessage *msg,
+                     gpointer     user_data)
 {
-  SoupMessage *msg;
-  SoupURI     *uri;
-  guint        status;
+  GVfsJobMakeDirectory *job = G_VFS_JOB_MAKE_DIRECTORY (user_data);
+  guint                 status = msg->status_code;
 
-  uri = http_backend_uri_for_filename (backend, filename, TRUE);
-  msg = soup_message_new_from_uri (SOUP_METHOD_MKCOL, uri);
-  soup_uri_free (uri);
-
-  status = g_vfs_backend_dav_send_message (backend, msg);
+  dav_cache_invalidate_filename (job->backend, job->filename, FALSE);
 
   if (! SOUP_STATUS_IS_SUCCESSFUL (status))
     if (status == SOUP_STATUS_METHOD_NOT_ALLOWED)
@@ -2187,83 +2414,123 @@ do_make_directory (GVfsBackend          *backend,
                                 msg->reason_phrase);
   else
     g_vfs_job_succeeded (G_VFS_JOB (job));
-
-  g_object_unref (msg);
 }
 
-static void
-do_delete (GVfsBackend   *backend,
-           GVfsJobDelete *job,
-           const char    *filename)
+static gboolean
+try_make_directory (GVfsBackend          *backend,
+                    GVfsJobMakeDirectory *job,
+                    const char           *filename)
 {
   SoupMessage *msg;
   SoupURI     *uri;
-  GFileType    file_type;
-  gboolean     res;
-  guint        num_children;
-  guint        status;
-  GError      *error;
 
-  error = NULL;
+  uri = http_backend_uri_for_filename (backend, filename, TRUE);
+  msg = soup_message_new_from_uri (SOUP_METHOD_MKCOL, uri);
+  soup_uri_free (uri);
 
-  uri = http_backend_uri_for_filename (backend, filename, FALSE);
-  res = stat_location (backend, uri, &file_type, &num_children, &error);
+  g_vfs_backend_dav_queue_message (backend, msg, make_directory_done, job);
+  return TRUE;
+}
 
-  if (res == FALSE)
+/* *** delete () *** */
+static void
+stat_location_data_free (gpointer user_data)
+{
+  g_slice_free (StatLocationData, user_data);
+}
+
+static void
+delete_done (SoupSession *session,
+             SoupMessage *msg,
+             gpointer     user_data)
+{
+  GVfsJobDelete *job = G_VFS_JOB_DELETE (user_data);
+
+  dav_cache_invalidate_filename (job->backend, job->filename, TRUE);
+
+  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+    g_vfs_job_failed_literal (G_VFS_JOB (job),
+                              G_IO_ERROR,
+                              http_error_code_from_status (msg->status_code),
+                              msg->reason_phrase);
+  else
+    g_vfs_job_succeeded (G_VFS_JOB (job));
+}
+
+static void
+delete_stat_done (GVfsJob     *job,
+                  SoupMessage *msg,
+                  GError      *error)
+{
+  GVfsJobDelete *delete_job = G_VFS_JOB_DELETE (job);
+  SoupMessage   *delete_msg;
+  SoupURI       *uri;
+  GFileType      file_type;
+  guint          num_children;
+  GError        *stat_error;
+
+  stat_error = NULL;
+
+  if (! stat_location_finish (msg, job->backend_data, error == NULL,
+                              &file_type, &num_children, &stat_error))
     {
-      g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
-      g_error_free (error);
+      g_vfs_job_failed_from_error (job, stat_error);
+      g_error_free (stat_error);
       return;
     }
 
   if (file_type == G_FILE_TYPE_DIRECTORY && num_children)
     {
-      g_vfs_job_failed (G_VFS_JOB (job),
+      g_vfs_job_failed (job,
                         G_IO_ERROR, G_IO_ERROR_NOT_EMPTY,
                         _("Directory not empty"));
       return;
     }
 
-  msg = soup_message_new_from_uri (SOUP_METHOD_DELETE, uri);
+  uri = http_backend_uri_for_filename (delete_job->backend,
+                                       delete_job->filename, FALSE);
+  delete_msg = soup_message_new_from_uri (SOUP_METHOD_DELETE, uri);
+  soup_uri_free (uri);
 
-  status = g_vfs_backend_dav_send_message (backend, msg);
+  g_vfs_backend_dav_queue_message (delete_job->backend, delete_msg,
+                                   delete_done, job);
+}
 
-  if (!SOUP_STATUS_IS_SUCCESSFUL (status))
-    g_vfs_job_failed_literal (G_VFS_JOB (job),
-                              G_IO_ERROR,
-                              http_error_code_from_status (status),
-                              msg->reason_phrase);
-  else
-    g_vfs_job_succeeded (G_VFS_JOB (job));
+static gboolean
+try_delete (GVfsBackend   *backend,
+            GVfsJobDelete *job,
+            const char    *filename)
+{
+  StatLocationData *data;
+  SoupMessage      *msg;
+  SoupURI          *uri;
 
+  uri = http_backend_uri_for_filename (backend, filename, FALSE);
+  msg = stat_location_begin (uri, TRUE);
   soup_uri_free (uri);
-  g_object_unref (msg);
+
+  data = g_slice_new0 (StatLocationData);
+  data->msg = msg;
+  data->file_type = G_FILE_TYPE_UNKNOWN;
+  g_vfs_job_set_backend_data (G_VFS_JOB (job), data, stat_location_data_free);
+
+  multistatus_queue (backend, msg, stat_location_got_response,
+                     delete_stat_done, G_VFS_JOB (job));
+  return TRUE;
 }
 
+/* *** set_display_name () *** */
 static void
-do_set_display_name (GVfsBackend           *backend,
-                     GVfsJobSetDisplayName *job,
-                     const char            *filename,
-                     const char            *display_name)
+set_display_name_done (SoupSession *session,
+                       SoupMessage *msg,
+                       gpointer     user_data)
 {
-  SoupMessage *msg;
-  SoupURI     *source;
-  SoupURI     *target;
-  char        *target_path;
-  char        *dirname;
-  guint        status;
+  GVfsJobSetDisplayName *job = G_VFS_JOB_SET_DISPLAY_NAME (user_data);
+  const char            *target_path = G_VFS_JOB (job)->backend_data;
+  guint                  status = msg->status_code;
 
-  source = http_backend_uri_for_filename (backend, filename, FALSE);
-  msg = soup_message_new_from_uri (SOUP_METHOD_MOVE, source);
-
-  dirname = g_path_get_dirname (filename);
-  target_path = g_build_filename (dirname, display_name, NULL);
-  target = http_backend_uri_for_filename (backend, target_path, FALSE);
-
-  message_add_destination_header (msg, target);
-  message_add_overwrite_header (msg, FALSE);
-
-  status = g_vfs_backend_dav_send_message (backend, msg);
+  dav_cache_invalidate_filename (job->backend, job->filename, TRUE);
+  dav_cache_invalidate_filename (job->backend, target_path, TRUE);
 
   /*
    * The precondition of SOUP_STATUS_PRECONDITION_FAILED (412) in
@@ -2296,12 +2563,311 @@ do_set_display_name (GVfsBackend           *backend,
     g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR,
                       http_error_code_from_status (status),
                       "%s", msg->reason_phrase);
+}
+
+static gboolean
+try_set_display_name (GVfsBackend           *backend,
+                      GVfsJobSetDisplayName *job,
+                      const char            *filename,
+                      const char            *display_name)
+{
+  SoupMessage *msg;
+  SoupURI     *source;
+  SoupURI     *target;
+  char        *target_path;
+  char        *dirname;
+
+  source = http_backend_uri_for_filename (backend, filename, FALSE);
+  msg = soup_message_new_from_uri (SOUP_METHOD_MOVE, source);
+
+  dirname = g_path_get_dirname (filename);
+  target_path = g_build_filename (dirname, display_name, NULL);
+  target = http_backend_uri_for_filename (backend, target_path, FALSE);
+
+  message_add_destination_header (msg, target);
+  message_add_overwrite_header (msg, FALSE);
+
+  g_vfs_job_set_backend_data (G_VFS_JOB (job), target_path, g_free);
+  g_vfs_backend_dav_queue_message (backend, msg, set_display_name_done, job);
 
-  g_object_unref (msg);
   g_free (dirname);
-  g_free (target_path);
   soup_uri_free (target);
   soup_uri_free (source);
+  return TRUE;
+}
+
+/* *** copy () and move () *** */
+typedef struct _CopyData {
+
+  GVfsBackend     *backend;
+  StatLocationData stat;
+  gboolean         is_move;
+  char            *source;
+  char            *destination;
+  GFileCopyFlags   flags;
+  gboolean         is_dir;
+
+} CopyData;
+
+static void
+copy_data_free (gpointer user_data)
+{
+  CopyData *data = user_data;
+
+  g_free (data->source);
+  g_free (data->destination);
+  g_slice_free (CopyData, data);
+}
+
+static void
+copy_got_response (const GVfsDavResponse *response,
+                   gpointer               user_data)
+{
+  CopyData *data = user_data;
+
+  stat_location_got_response (response, &data->stat);
+}
+
+/* Queues a PROPFIND for filename, callback gets the reply in
+ * data->stat */
+static void
+copy_stat_queue (GVfsJob             *job,
+                 const char          *filename,
+                 MultistatusCallback  callback)
+{
+  CopyData    *data = job->backend_data;
+  SoupMessage *msg;
+  SoupURI     *uri;
+
+  uri = http_backend_uri_for_filename (data->backend, filename, FALSE);
+  msg = stat_location_begin (uri, FALSE);
+  soup_uri_free (uri);
+
+  data->stat.msg = msg;
+  data->stat.found = FALSE;
+  data->stat.file_type = G_FILE_TYPE_UNKNOWN;
+  data->stat.num_children = 0;
+
+  multistatus_queue (data->backend, msg, copy_got_response,
+                     callback, job);
+}
+
+static void
+copy_or_move_done (SoupSession *session,
+                   SoupMessage *msg,
+                   gpointer     user_data)
+{
+  GVfsJob  *job = G_VFS_JOB (user_data);
+  CopyData *data = job->backend_data;
+  guint     status = msg->status_code;
+
+  dav_cache_invalidate_filename (data->backend, data->destination, TRUE);
+  if (data->is_move)
+    dav_cache_invalidate_filename (data->backend, data->source, TRUE);
+
+  /* RFC 4918 only answers 207 when some member of a collection
+   * couldn't be moved, whatever the members' states are the move
+   * as a whole didn't happen. See set_display_name_done () for the
+   * 412 and redirection cases. 502 means the server won't copy to
+   * the destination, so let gio do it instead. */
+  if (status == SOUP_STATUS_MULTI_STATUS)
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Some files could not be moved"));
+  else if (SOUP_STATUS_IS_SUCCESSFUL (status))
+    g_vfs_job_succeeded (job);
+  else if (status == SOUP_STATUS_PRECONDITION_FAILED ||
+           SOUP_STATUS_IS_REDIRECTION (status))
+    g_vfs_job_failed (job, G_IO_ERROR,
+                      G_IO_ERROR_EXISTS,
+                      _("Target file already exists"));
+  else if (status == SOUP_STATUS_BAD_GATEWAY)
+    g_vfs_job_failed (job, G_IO_ERROR,
+                      G_IO_ERROR_NOT_SUPPORTED,
+                      _("Operation not supported by backend"));
+  else
+    g_vfs_job_failed (job, G_IO_ERROR,
+                      http_error_code_from_status (status),
+                      "%s", msg->reason_phrase);
+}
+
+static void
+copy_or_move_send (GVfsJob *job)
+{
+  CopyData    *data = job->backend_data;
+  SoupMessage *msg;
+  SoupURI     *source_uri;
+  SoupURI     *target_uri;
+
+  source_uri = http_backend_uri_for_filename (data->backend,
+                                              data->source, data->is_dir);
+  target_uri = http_backend_uri_for_filename (data->backend,
+                                              data->destination, data->is_dir);
+
+  msg = soup_message_new_from_uri (data->is_move ? SOUP_METHOD_MOVE : SOUP_METHOD_COPY,
+                                   source_uri);
+  message_add_destination_header (msg, target_uri);
+  message_add_overwrite_header (msg, data->flags & G_FILE_COPY_OVERWRITE);
+
+  /* RFC 4918 only allows infinity for moving collections */
+  if (data->is_dir)
+    soup_message_headers_append (msg->request_headers, "Depth", "infinity");
+
+  g_vfs_backend_dav_queue_message (data->backend, msg,
+                                   copy_or_move_done, job);
+
+  soup_uri_free (source_uri);
+  soup_uri_free (target_uri);
+}
+
+/* "Overwrite: T" would replace a whole collection, which is not
+ * what gio means by overwriting. A target that can't be found is
+ * fine. */
+static void
+copy_target_known (GVfsJob   *job,
+                   GFileType  target_type)
+{
+  CopyData *data = job->backend_data;
+
+  if (target_type != G_FILE_TYPE_DIRECTORY)
+    copy_or_move_send (job);
+  else if (data->is_dir)
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_WOULD_MERGE,
+                      _("Can't move directory over directory"));
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
+                      _("Can't copy file over directory"));
+}
+
+static void
+copy_target_stat_done (GVfsJob     *job,
+                       SoupMessage *msg,
+                       GError      *error)
+{
+  CopyData  *data = job->backend_data;
+  GFileType  target_type;
+
+  if (! stat_location_finish (msg, &data->stat, error == NULL,
+                              &target_type, NULL, NULL))
+    target_type = G_FILE_TYPE_UNKNOWN;
+
+  copy_target_known (job, target_type);
+}
+
+static void
+copy_source_known (GVfsJob   *job,
+                   GFileType  source_type)
+{
+  CopyData  *data = job->backend_data;
+  GFileType  target_type;
+  SoupURI   *uri;
+
+  data->is_dir = source_type == G_FILE_TYPE_DIRECTORY;
+  if (data->is_dir && ! data->is_move)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_WOULD_RECURSE,
+                        _("Can't recursively copy directory"));
+      return;
+    }
+
+  if (! (data->flags & G_FILE_COPY_OVERWRITE))
+    {
+      copy_or_move_send (job);
+      return;
+    }
+
+  uri = http_backend_uri_for_filename (data->backend,
+                                       data->destination, FALSE);
+  if (stat_location_cached (data->backend, uri, &target_type))
+    copy_target_known (job, target_type);
+  else
+    copy_stat_queue (job, data->destination, copy_target_stat_done);
+  soup_uri_free (uri);
+}
+
+static void
+copy_source_stat_done (GVfsJob     *job,
+                       SoupMessage *msg,
+                       GError      *error)
+{
+  CopyData  *data = job->backend_data;
+  GFileType  source_type;
+  GError    *stat_error;
+
+  stat_error = NULL;
+
+  if (! stat_location_finish (msg, &data->stat, error == NULL,
+                              &source_type, NULL, &stat_error))
+    {
+      g_vfs_job_failed_from_error (job, stat_error);
+      g_error_free (stat_error);
+      return;
+    }
+
+  copy_source_known (job, source_type);
+}
+
+static gboolean
+try_copy_or_move (GVfsBackend    *backend,
+                  GVfsJob        *job,
+                  gboolean        is_move,
+                  const char     *source,
+                  const char     *destination,
+                  GFileCopyFlags  flags)
+{
+  CopyData  *data;
+  GFileType  source_type;
+  SoupURI   *uri;
+
+  /* Let gio fall back to copying the data */
+  if (flags & G_FILE_COPY_BACKUP)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        _("Operation not supported by backend"));
+      return TRUE;
+    }
+
+  data = g_slice_new0 (CopyData);
+  data->backend = backend;
+  data->is_move = is_move;
+  data->source = g_strdup (source);
+  data->destination = g_strdup (destination);
+  data->flags = flags;
+  g_vfs_job_set_backend_data (job, data, copy_data_free);
+
+  uri = http_backend_uri_for_filename (backend, source, FALSE);
+  if (stat_location_cached (backend, uri, &source_type))
+    copy_source_known (job, source_type);
+  else
+    copy_stat_queue (job, source, copy_source_stat_done);
+  soup_uri_free (uri);
+
+  return TRUE;
+}
+
+static gboolean
+try_copy (GVfsBackend           *backend,
+          GVfsJobCopy           *job,
+          const char            *source,
+          const char            *destination,
+          GFileCopyFlags         flags,
+          GFileProgressCallback  progress_callback,
+          gpointer               progress_callback_data)
+{
+  return try_copy_or_move (backend, G_VFS_JOB (job), FALSE,
+                           source, destination, flags);
+}
+
+static gboolean
+try_move (GVfsBackend           *backend,
+          GVfsJobMove           *job,
+          const char            *source,
+          const char            *destination,
+          GFileCopyFlags         flags,
+          GFileProgressCallback  progress_callback,
+          gpointer               progress_callback_data)
+{
+  return try_copy_or_move (backend, G_VFS_JOB (job), TRUE,
+                           source, destination, flags);
 }
 
 static gboolean
@@ -2328,15 +2894,16 @@ g_vfs_backend_dav_class_init (GVfsBackendDavClass *klass)
 
   backend_class->try_mount         = NULL;
   backend_class->mount             = do_mount;
-  backend_class->try_query_info    = NULL;
-  backend_class->query_info        = do_query_info;
-  backend_class->enumerate         = do_enumerate;
+  backend_class->try_query_info    = try_query_info;
+  backend_class->try_enumerate     = try_enumerate;
   backend_class->try_create        = try_create;
   backend_class->try_replace       = try_replace;
   backend_class->try_write         = try_write;
   backend_class->try_close_write   = try_close_write;
-  backend_class->make_directory    = do_make_directory;
-  backend_class->delete            = do_delete;
-  backend_class->set_display_name  = do_set_display_name;
+  backend_class->try_make_directory = try_make_directory;
+  backend_class->try_delete        = try_delete;
+  backend_class->try_set_display_name = try_set_display_name;
+  backend_class->try_copy          = try_copy;
+  backend_class->try_move          = try_move;
   backend_class->try_unmount       = try_unmount;
 }
@@ -46,6 +46,7 @@
 #include "gvfsjobenumerate.h"
 #include "gvfsdaemonprotocol.h"
 #include "gvfsdaemonutils.h"
+#include "gsysutils.h"
 #include "gvfskeyring.h"
 
 #include "ParseFTPList.h"
@@ -102,8 +103,11 @@ gvfs_backend_ftp_determine_features (GVfsFtpTask *task)
     { "EPRT", G_VFS_FTP_FEATURE_EPRT },
     { "EPSV", G_VFS_FTP_FEATURE_EPSV },
     { "UTF8", G_VFS_FTP_FEATURE_UTF8 },
+    { "MLST", G_VFS_FTP_FEATURE_MLST },
+    { "REST", G_VFS_FTP_FEATURE_REST },
   };
   guint i, j;
+  gsize length;
   char **reply;
 
   if (!g_vfs_ftp_task_send_and_check (task, 0, NULL, NULL, &reply, "FEAT"))
@@ -124,9 +128,13 @@ gvfs_backend_ftp_determine_features (GVfsFtpTask *task)
       while (g_ascii_isspace (feature[0]))
         feature++;
 
+      /* Features may take parameters, like "MLST type*;size*;modify*;" */
+      length = strcspn (feature, " ");
+
       for (j = 0; j < G_N_ELEMENTS (features); j++)
         {
-          if (g_ascii_strcasecmp (feature, features[j].name) == 0)
+          if (strlen (features[j].name) == length &&
+              g_ascii_strncasecmp (feature, features[j].name, length) == 0)
             {
               g_debug ("# feature %s supported\n", features[j].name);
               task->backend->features |= 1 << features[j].enable;
@@ -183,12 +191,64 @@ gvfs_backend_ftp_determine_system (GVfsFtpTask *task)
 static void
 gvfs_backend_ftp_setup_directory_cache (GVfsBackendFtp *ftp)
 {
-  if (ftp->system == G_VFS_FTP_SYSTEM_UNIX)
+  /* MLSD gives exact sizes and UTC times in a fixed format, so prefer
+   * it over guessing the format of LIST output */
+  if (g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_MLST))
+    ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_mlsd;
+  else if (ftp->system == G_VFS_FTP_SYSTEM_UNIX)
     ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_unix;
   else
     ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_default;
 
   ftp->dir_cache = g_vfs_ftp_dir_cache_new (ftp->dir_funcs);
+  g_vfs_ftp_dir_cache_set_limits (ftp->dir_cache,
+                                  _g_getenv_uint ("GVFS_FTP_CACHE_TTL",
+                                                  G_VFS_FTP_DIR_CACHE_DEFAULT_TTL),
+                                  _g_getenv_uint ("GVFS_FTP_CACHE_MAX_DIRS",
+                                                  G_VFS_FTP_DIR_CACHE_DEFAULT_MAX_DIRS),
+                                  _g_getenv_uint ("GVFS_FTP_CACHE_MAX_FILES",
+                                                  G_VFS_FTP_DIR_CACHE_DEFAULT_MAX_FILES));
+}
+
+/* Opens idle connections in the background after mounting, so the first
+ * operations that run in parallel don't each wait for a connect and a
+ * login. */
+static gpointer
+gvfs_backend_ftp_prewarm_thread (gpointer data)
+{
+  GVfsBackendFtp *ftp = data;
+  GVfsFtpTask task = { ftp, NULL, NULL, };
+  guint i, n_connections;
+
+  n_connections = _g_getenv_uint ("GVFS_FTP_PREWARM_CONNECTIONS",
+                                  G_VFS_FTP_DEFAULT_PREWARM_CONNECTIONS);
+  for (i = 0; i < n_connections; i++)
+    {
+      if (!g_vfs_ftp_task_prewarm_connection (&task))
+        break;
+    }
+
+  if (g_vfs_ftp_task_is_in_error (&task))
+    g_debug ("# prewarming stopped after %u connections: %s\n", i, task.error->message);
+  else
+    g_debug ("# prewarmed %u connections\n", i);
+
+  g_vfs_ftp_task_done (&task);
+  g_object_unref (ftp);
+
+  return NULL;
+}
+
+static void
+gvfs_backend_ftp_start_prewarm (GVfsBackendFtp *ftp)
+{
+  if (_g_getenv_uint ("GVFS_FTP_PREWARM_CONNECTIONS",
+                      G_VFS_FTP_DEFAULT_PREWARM_CONNECTIONS) == 0)
+    return;
+
+  g_object_ref (ftp);
+  if (g_thread_create (gvfs_backend_ftp_prewarm_thread, ftp, FALSE, NULL) == NULL)
+    g_object_unref (ftp);
 }
 
 /* This parses a file according to RFC 959 Appendix II:
@@ -322,12 +382,17 @@ g_vfs_backend_ftp_finalize (GObject *object)
 
   if (ftp->addr)
     g_object_unref (ftp->addr);
+  if (ftp->connector)
+    g_vfs_connector_free (ftp->connector);
 
   /* has been cleared on unmount */
   g_assert (ftp->queue == NULL);
   g_cond_free (ftp->cond);
   g_mutex_free (ftp->mutex);
 
+  if (ftp->dir_cache)
+    g_vfs_ftp_dir_cache_free (ftp->dir_cache);
+
   g_free (ftp->user);
   g_free (ftp->password);
 
@@ -360,7 +425,7 @@ do_mount (GVfsBackend *backend,
   GNetworkAddress *addr;
   guint port;
 
-  task.conn = g_vfs_ftp_connection_new (ftp->addr, task.cancellable, &task.error);
+  task.conn = g_vfs_ftp_connection_new (ftp->connector, task.cancellable, &task.error);
   /* fail fast here. No need to ask for a password if we know the hostname
    * doesn't exist or the given host/port doesn't have an ftp server running.
    */
@@ -521,6 +586,12 @@ try_login:
           g_vfs_ftp_task_clear_error (&task);
           ftp->addr = g_object_ref (addr);
         }
+      else
+        {
+          /* no need to look up the name again for the pinned address */
+          g_vfs_connector_free (ftp->connector);
+          ftp->connector = g_vfs_connector_new (ftp->addr);
+        }
     }
 
   if (g_vfs_ftp_task_is_in_error (&task))
@@ -579,6 +650,8 @@ try_login:
  
   g_object_unref (addr);
   g_vfs_ftp_task_done (&task);
+
+  gvfs_backend_ftp_start_prewarm (ftp);
 }
 
 static gboolean
@@ -612,6 +685,7 @@ try_mount (GVfsBackend *backend,
     }
 
   ftp->addr = g_network_address_new (host, port);
+  ftp->connector = g_vfs_connector_new (ftp->addr);
   ftp->user = g_strdup (g_mount_spec_get (mount_spec, "user"));
   ftp->has_initial_user = ftp->user != NULL;
   if (port == 21)
@@ -729,39 +803,79 @@ error_550_parent_not_found (GVfsFtpTask *task, gpointer file)
   g_vfs_ftp_file_free (dir);
 }
 
+/* Sends RETR for @file on the task's connection, after REST if
+ * @offset is not 0, and opens the data connection. */
 static void
-do_open_for_read (GVfsBackend *backend,
-                  GVfsJobOpenForRead *job,
-                  const char *filename)
+do_start_read (GVfsFtpTask *      task,
+               const GVfsFtpFile *file,
+               goffset            offset)
 {
-  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
-  GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
-  GVfsFtpFile *file;
   static const GVfsFtpErrorFunc open_read_handlers[] = { error_550_is_directory, 
                                                          error_550_permission_or_not_found, 
                                                          NULL };
 
-  g_vfs_ftp_task_setup_data_connection (&task);
-  file = g_vfs_ftp_file_new_from_gvfs (ftp, filename);
+  g_vfs_ftp_task_setup_data_connection (task);
 
-  g_vfs_ftp_task_send_and_check (&task,
+  /* REST must directly precede RETR, so it goes after PASV/PORT */
+  if (offset > 0)
+    g_vfs_ftp_task_send (task,
+                         G_VFS_FTP_PASS_300,
+                         "REST %" G_GOFFSET_FORMAT, offset);
+
+  g_vfs_ftp_task_send_and_check (task,
                                  G_VFS_FTP_PASS_100 | G_VFS_FTP_FAIL_200,
                                  open_read_handlers,
-                                 file,
+                                 (gpointer) file,
                                  NULL,
                                  "RETR %s", g_vfs_ftp_file_get_ftp_path (file));
-  g_vfs_ftp_file_free (file);
 
-  g_vfs_ftp_task_open_data_connection (&task);
+  g_vfs_ftp_task_open_data_connection (task);
+}
+
+/* forward seeks up to this size read and drop the data instead of
+ * restarting the transfer */
+#define READ_SKIP_MAX (64 * 1024)
+
+typedef struct {
+  GVfsFtpConnection *   conn;           /* connection with the running RETR or NULL after a failed seek */
+  GVfsFtpFile *         file;           /* file being read */
+  goffset               offset;         /* current read position */
+} GVfsFtpReadHandle;
+
+static void
+g_vfs_ftp_read_handle_free (GVfsFtpReadHandle *handle)
+{
+  g_vfs_ftp_file_free (handle->file);
+  g_slice_free (GVfsFtpReadHandle, handle);
+}
+
+static void
+do_open_for_read (GVfsBackend *backend,
+                  GVfsJobOpenForRead *job,
+                  const char *filename)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
+  GVfsFtpReadHandle *handle;
+  GVfsFtpFile *file;
+
+  file = g_vfs_ftp_file_new_from_gvfs (ftp, filename);
+
+  do_start_read (&task, file, 0);
 
   if (!g_vfs_ftp_task_is_in_error (&task))
     {
+      handle = g_slice_new0 (GVfsFtpReadHandle);
       /* don't push the connection back, it's our handle now */
-      GVfsFtpConnection *conn = g_vfs_ftp_task_take_connection (&task);
+      handle->conn = g_vfs_ftp_task_take_connection (&task);
+      handle->file = file;
 
-      g_vfs_job_open_for_read_set_handle (job, conn);
-      g_vfs_job_open_for_read_set_can_seek (job, FALSE);
+      g_vfs_job_open_for_read_set_handle (job, handle);
+      g_vfs_job_open_for_read_set_can_seek (job,
+                                            g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_REST));
     }
+  else
+    g_vfs_ftp_file_free (file);
 
   g_vfs_ftp_task_done (&task);
 }
@@ -773,11 +887,15 @@ do_close_read (GVfsBackend *     backend,
 {
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
-  GVfsFtpConnection *conn = handle;
+  GVfsFtpReadHandle *read_handle = handle;
 
-  g_vfs_ftp_task_give_connection (&task, conn);
-  g_vfs_ftp_task_close_data_connection (&task);
-  g_vfs_ftp_task_receive (&task, 0, NULL);
+  if (read_handle->conn)
+    {
+      g_vfs_ftp_task_give_connection (&task, read_handle->conn);
+      g_vfs_ftp_task_close_data_connection (&task);
+      g_vfs_ftp_task_receive (&task, 0, NULL);
+    }
+  g_vfs_ftp_read_handle_free (read_handle);
 
   g_vfs_ftp_task_done (&task);
 }
@@ -791,11 +909,19 @@ do_read (GVfsBackend *     backend,
 {
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
-  GVfsFtpConnection *conn = handle;
+  GVfsFtpReadHandle *read_handle = handle;
   GInputStream *input;
   gssize n_bytes;
 
-  input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (conn));
+  if (read_handle->conn == NULL)
+    {
+      g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                           _("Stream is already closed"));
+      g_vfs_ftp_task_done (&task);
+      return;
+    }
+
+  input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (read_handle->conn));
   n_bytes = g_input_stream_read (input,
                                  buffer,
                                  bytes_requested,
@@ -803,7 +929,115 @@ do_read (GVfsBackend *     backend,
                                  &task.error);
 
   if (n_bytes >= 0)
-    g_vfs_job_read_set_size (job, n_bytes);
+    {
+      read_handle->offset += n_bytes;
+      g_vfs_job_read_set_size (job, n_bytes);
+    }
+
+  g_vfs_ftp_task_done (&task);
+}
+
+static void
+do_seek_on_read (GVfsBackend *     backend,
+                 GVfsJobSeekRead * job,
+                 GVfsBackendHandle handle,
+                 goffset           offset,
+                 GSeekType         type)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
+  GVfsFtpReadHandle *read_handle = handle;
+  GInputStream *input;
+  GFileInfo *info;
+  gssize skipped;
+
+  switch (type)
+    {
+      case G_SEEK_CUR:
+        offset += read_handle->offset;
+        break;
+      case G_SEEK_END:
+        info = g_vfs_ftp_dir_cache_lookup_file (ftp->dir_cache, &task, read_handle->file, TRUE);
+        if (info == NULL)
+          {
+            if (!g_vfs_ftp_task_is_in_error (&task))
+              g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                                   _("Unsupported seek type"));
+            g_vfs_ftp_task_done (&task);
+            return;
+          }
+        offset += g_file_info_get_size (info);
+        g_object_unref (info);
+        /* the lookup may have used a connection */
+        g_vfs_ftp_task_release_connection (&task);
+        break;
+      case G_SEEK_SET:
+      default:
+        break;
+    }
+
+  if (offset < 0)
+    {
+      g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                           _("Invalid seek offset"));
+      g_vfs_ftp_task_done (&task);
+      return;
+    }
+
+  /* short forward seeks are cheaper than a new data connection */
+  if (read_handle->conn &&
+      offset >= read_handle->offset &&
+      offset - read_handle->offset <= READ_SKIP_MAX)
+    {
+      input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (read_handle->conn));
+      while (read_handle->offset < offset)
+        {
+          skipped = g_input_stream_skip (input,
+                                         offset - read_handle->offset,
+                                         task.cancellable,
+                                         &task.error);
+          if (skipped <= 0)
+            break;
+          read_handle->offset += skipped;
+        }
+      /* at the offset or past the end of the file */
+      if (!g_vfs_ftp_task_is_in_error (&task))
+        {
+          g_vfs_job_seek_read_set_offset (job, offset);
+          read_handle->offset = offset;
+          g_vfs_ftp_task_done (&task);
+          return;
+        }
+      if (g_error_matches (task.error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_vfs_ftp_task_done (&task);
+          return;
+        }
+      /* the transfer broke, restart it at the offset below */
+      g_vfs_ftp_task_clear_error (&task);
+    }
+
+  /* abort the running transfer by closing its data connection */
+  if (read_handle->conn)
+    {
+      g_vfs_ftp_task_give_connection (&task, read_handle->conn);
+      read_handle->conn = NULL;
+      g_vfs_ftp_task_close_data_connection (&task);
+      g_vfs_ftp_task_receive (&task, 0, NULL);
+      /* 426 transfer aborted is expected here */
+      g_vfs_ftp_task_clear_error (&task);
+      if (!g_vfs_ftp_connection_is_usable (task.conn))
+        g_vfs_ftp_task_release_connection (&task);
+    }
+
+  do_start_read (&task, read_handle->file, offset);
+
+  if (!g_vfs_ftp_task_is_in_error (&task))
+    {
+      read_handle->conn = g_vfs_ftp_task_take_connection (&task);
+      read_handle->offset = offset;
+      g_vfs_job_seek_read_set_offset (job, offset);
+    }
 
   g_vfs_ftp_task_done (&task);
 }
@@ -1004,6 +1238,40 @@ do_query_info (GVfsBackend *backend,
   g_vfs_ftp_file_free (file);
 }
 
+static void
+do_query_fs_info (GVfsBackend *backend,
+                  GVfsJobQueryFsInfo *job,
+                  const char *filename,
+                  GFileInfo *info,
+                  GFileAttributeMatcher *matcher)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  GVfsFtpDirCacheStats stats;
+  GVfsConnectorStats connector_stats;
+
+  g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_FILESYSTEM_TYPE, "ftp");
+
+  g_vfs_ftp_dir_cache_get_stats (ftp->dir_cache, &stats);
+  g_file_info_set_attribute_uint32 (info, G_VFS_FILE_ATTRIBUTE_STATS_CACHE_HITS, stats.hits);
+  g_file_info_set_attribute_uint32 (info, G_VFS_FILE_ATTRIBUTE_STATS_CACHE_MISSES, stats.misses);
+  g_file_info_set_attribute_uint32 (info, G_VFS_FILE_ATTRIBUTE_STATS_CACHE_EVICTIONS, stats.evictions);
+  g_file_info_set_attribute_uint32 (info, G_VFS_FILE_ATTRIBUTE_STATS_CACHE_EXPIRATIONS, stats.expirations);
+
+  g_vfs_connector_get_stats (ftp->connector, &connector_stats);
+  g_file_info_set_attribute_uint32 (info, G_VFS_FILE_ATTRIBUTE_STATS_CONNECTS,
+                                    connector_stats.connects);
+  g_file_info_set_attribute_uint32 (info, G_VFS_FILE_ATTRIBUTE_STATS_FAILED_CONNECTS,
+                                    connector_stats.failed_connects);
+  g_file_info_set_attribute_uint32 (info, G_VFS_FILE_ATTRIBUTE_STATS_CONNECT_TIME,
+                                    connector_stats.connect_time * 1000);
+  g_file_info_set_attribute_uint32 (info, G_VFS_FILE_ATTRIBUTE_STATS_LAST_CONNECT_TIME,
+                                    connector_stats.last_connect_time * 1000);
+  g_file_info_set_attribute_uint32 (info, G_VFS_FILE_ATTRIBUTE_STATS_RESOLVE_TIME,
+                                    connector_stats.resolve_time * 1000);
+
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+}
+
 static void
 do_enumerate (GVfsBackend *backend,
               GVfsJobEnumerate *job,
@@ -1247,9 +1515,15 @@ cancel_cancellable (gpointer cancellable)
   return FALSE;
 }
 
-static gssize
+/* Copies @input to @output. @bytes_copied is the position in the
+ * transfer, it is used for progress reporting and updated with the
+ * bytes written, also when an error occurs. @input_failed tells if an
+ * error came from reading @input. */
+static gboolean
 ftp_output_stream_splice (GOutputStream *output,
                           GInputStream *input,
+                          goffset *bytes_copied,
+                          gboolean *input_failed,
                           goffset total_size,
                           GFileProgressCallback progress_callback,
                           gpointer progress_callback_data,
@@ -1257,7 +1531,7 @@ ftp_output_stream_splice (GOutputStream *output,
                           GError **error)
 {
   gssize n_read, n_written;
-  gssize bytes_copied;
+  gboolean success;
   char buffer[8192], *p;
   GCancellable *current, *timer_cancel;
   gulong cancel_cb_id;
@@ -1265,7 +1539,8 @@ ftp_output_stream_splice (GOutputStream *output,
   timer_cancel = NULL;
   cancel_cb_id = 0;
 
-  bytes_copied = 0;
+  success = TRUE;
+  *input_failed = FALSE;
   if (progress_callback)
     {
       timer_cancel = g_cancellable_new ();
@@ -1286,12 +1561,13 @@ ftp_output_stream_splice (GOutputStream *output,
               g_cancellable_reset (timer_cancel);
               current = cancellable;
               g_clear_error (error);
-              progress_callback (bytes_copied, total_size, progress_callback_data);
+              progress_callback (*bytes_copied, total_size, progress_callback_data);
               continue;
             }
           else
             {
-              bytes_copied = -1;
+              success = FALSE;
+              *input_failed = TRUE;
               break;
             }
           g_assert_not_reached();
@@ -1311,12 +1587,12 @@ ftp_output_stream_splice (GOutputStream *output,
                   g_cancellable_reset (timer_cancel);
                   current = cancellable;
                   g_clear_error (error);
-                  progress_callback (bytes_copied, total_size, progress_callback_data);
+                  progress_callback (*bytes_copied, total_size, progress_callback_data);
                   continue;
                 }
               else
                 {
-                  bytes_copied = -1;
+                  success = FALSE;
                   break;
                 }
               g_assert_not_reached();
@@ -1324,7 +1600,7 @@ ftp_output_stream_splice (GOutputStream *output,
 
           p += n_written;
           n_read -= n_written;
-          bytes_copied += n_written;
+          *bytes_copied += n_written;
           if (progress_callback && current != timer_cancel)
             {
               g_object_ref (timer_cancel);
@@ -1336,6 +1612,8 @@ ftp_output_stream_splice (GOutputStream *output,
               current = timer_cancel;
             }
         }
+      if (!success)
+        break;
     }
 
   if (timer_cancel != NULL)
@@ -1345,10 +1623,382 @@ ftp_output_stream_splice (GOutputStream *output,
       g_cancellable_disconnect (cancellable, cancel_cb_id);
       g_object_unref (timer_cancel);
     }
-  if (bytes_copied >= 0 && progress_callback)
-    progress_callback (bytes_copied, total_size, progress_callback_data);
+  if (success && progress_callback)
+    progress_callback (*bytes_copied, total_size, progress_callback_data);
+
+  return success;
+}
+
+/* Asks the server for the current size of @file, without the directory
+ * cache. Returns -1 on error. */
+static goffset
+do_get_remote_size (GVfsFtpTask *      task,
+                    const GVfsFtpFile *file)
+{
+  goffset size;
+  char **reply;
+
+  if (!g_vfs_ftp_task_send_and_check (task, 0, NULL, NULL, &reply,
+                                      "SIZE %s", g_vfs_ftp_file_get_ftp_path (file)))
+    return -1;
+
+  size = g_ascii_strtoull (reply[0] + 4, NULL, 10);
+  g_strfreev (reply);
 
-  return bytes_copied;
+  return size;
+}
+
+/* how often do_pull() and do_push() restart a transfer that broke
+ * off without getting any further */
+#define PULL_MAX_RESUME_ATTEMPTS 3
+
+/* Large files are fetched in up to this many ranges over separate
+ * connections at the same time, each at least this large */
+#define PULL_MAX_SEGMENTS 4
+#define PULL_MIN_SEGMENT_SIZE (8 * 1024 * 1024)
+#define PULL_SEGMENT_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+  goffset               start;          /* first byte of the range */
+  goffset               end;            /* first byte after the range or -1 for the end of the file */
+} PullRange;
+
+typedef struct {
+  GVfsBackendFtp *      ftp;
+  const GVfsFtpFile *   file;           /* file to download */
+  GOutputStream *       output;         /* seekable local file, protected by lock */
+  GCancellable *        cancellable;    /* cancelled by the job or when a segment fails */
+  GMutex *              lock;           /* protects everything below and output */
+  GCond *               cond;           /* signalled when a segment is done */
+  GQueue *              ranges;         /* PullRanges nobody downloads yet */
+  goffset               bytes_done;     /* bytes written by all segments */
+  guint                 n_running;      /* segments still running */
+  guint                 n_connected;    /* running segments that have a connection */
+  GError *              error;          /* first error of any segment */
+} PullTransfer;
+
+typedef struct {
+  PullTransfer *        transfer;
+  GVfsFtpConnection *   conn;           /* connection with a running RETR for range or NULL */
+  PullRange *           range;          /* range to start with or NULL */
+} PullSegment;
+
+/* Downloads @range on the task's connection. @running is TRUE if the
+ * RETR for the start of the range was sent already. Returns whether any
+ * data of the range arrived. */
+static gboolean
+do_pull_range (GVfsFtpTask *  task,
+               PullTransfer * transfer,
+               PullRange *    range,
+               gboolean       running,
+               char *         buffer)
+{
+  GInputStream *input;
+  gboolean write_failed, progress;
+  gssize n_read;
+  goffset pos;
+  guint attempts;
+
+  pos = range->start;
+  attempts = 0;
+  write_failed = FALSE;
+  progress = FALSE;
+
+  if (!running)
+    do_start_read (task, transfer->file, pos);
+
+  while (!g_vfs_ftp_task_is_in_error (task) && (range->end < 0 || pos < range->end))
+    {
+      input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (task->conn));
+      n_read = g_input_stream_read (input,
+                                    buffer,
+                                    range->end < 0 ? PULL_SEGMENT_BUFFER_SIZE
+                                                   : MIN (PULL_SEGMENT_BUFFER_SIZE, range->end - pos),
+                                    task->cancellable,
+                                    &task->error);
+      if (n_read > 0)
+        {
+          g_mutex_lock (transfer->lock);
+          if (!g_seekable_seek (G_SEEKABLE (transfer->output), pos, G_SEEK_SET, task->cancellable, &task->error) ||
+              !g_output_stream_write_all (transfer->output, buffer, n_read, NULL, task->cancellable, &task->error))
+            write_failed = TRUE;
+          else
+            transfer->bytes_done += n_read;
+          g_mutex_unlock (transfer->lock);
+
+          if (write_failed)
+            break;
+          pos += n_read;
+          progress = TRUE;
+          attempts = 0;
+          continue;
+        }
+
+      /* the last range goes on until the file ends, however large
+       * the file is by now */
+      if (n_read == 0 && range->end < 0)
+        break;
+
+      if (n_read == 0)
+        g_set_error_literal (&task->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Unexpected end of stream"));
+
+      /* the data connection broke off, continue where it stopped */
+      if (g_vfs_ftp_task_error_matches (task, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+          ++attempts > PULL_MAX_RESUME_ATTEMPTS)
+        break;
+
+      g_debug ("# segment download interrupted (%s), resuming at %" G_GOFFSET_FORMAT "\n",
+               task->error->message, pos);
+      g_vfs_ftp_task_clear_error (task);
+      g_vfs_ftp_task_close_data_connection (task);
+      g_vfs_ftp_task_release_connection (task);
+      do_start_read (task, transfer->file, pos);
+    }
+
+  if (task->conn && !g_vfs_ftp_task_is_in_error (task))
+    {
+      g_vfs_ftp_task_close_data_connection (task);
+      g_vfs_ftp_task_receive (task, 0, NULL);
+      /* all but the last range stop before the end of the file,
+       * so the server will complain about the aborted transfer */
+      if (range->end >= 0)
+        g_vfs_ftp_task_clear_error (task);
+    }
+
+  return progress;
+}
+
+static gpointer
+do_pull_segment (gpointer data)
+{
+  PullSegment *segment = data;
+  PullTransfer *transfer = segment->transfer;
+  GVfsFtpTask task = { transfer->ftp, NULL, transfer->cancellable, };
+  PullRange *range;
+  gboolean running, progress;
+  char *buffer;
+
+  buffer = g_malloc (PULL_SEGMENT_BUFFER_SIZE);
+  range = segment->range;
+  running = segment->conn != NULL;
+  progress = FALSE;
+
+  if (segment->conn)
+    g_vfs_ftp_task_give_connection (&task, segment->conn);
+  else if (!g_vfs_ftp_task_try_acquire_connection (&task))
+    {
+      /* the server doesn't allow another connection, the running
+       * segments download the ranges this one would have done */
+      g_debug ("# no connection for another range%s%s\n",
+               task.error ? ": " : "", task.error ? task.error->message : "");
+      g_vfs_ftp_task_clear_error (&task);
+    }
+
+  g_mutex_lock (transfer->lock);
+  if (task.conn)
+    transfer->n_connected++;
+  g_mutex_unlock (transfer->lock);
+
+  while (task.conn != NULL)
+    {
+      if (range == NULL)
+        {
+          g_mutex_lock (transfer->lock);
+          range = g_queue_pop_head (transfer->ranges);
+          if (range == NULL)
+            transfer->n_connected--;
+          g_mutex_unlock (transfer->lock);
+          if (range == NULL)
+            break;
+        }
+
+      progress = do_pull_range (&task, transfer, range, running, buffer);
+      running = FALSE;
+      if (g_vfs_ftp_task_is_in_error (&task))
+        break;
+
+      g_slice_free (PullRange, range);
+      range = NULL;
+    }
+
+  g_mutex_lock (transfer->lock);
+  if (g_vfs_ftp_task_is_in_error (&task))
+    {
+      transfer->n_connected--;
+      if (!progress && transfer->n_connected > 0 &&
+          !g_vfs_ftp_task_error_matches (&task, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          /* nothing of the range arrived, maybe the other segments
+           * have more luck with it */
+          g_debug ("# handing range at %" G_GOFFSET_FORMAT " to another segment (%s)\n",
+                   range->start, task.error->message);
+          g_queue_push_head (transfer->ranges, range);
+          range = NULL;
+          g_vfs_ftp_task_clear_error (&task);
+        }
+      else
+        {
+          if (transfer->error == NULL)
+            {
+              transfer->error = task.error;
+              task.error = NULL;
+            }
+          /* no use in downloading the other ranges */
+          g_cancellable_cancel (transfer->cancellable);
+        }
+    }
+  g_mutex_unlock (transfer->lock);
+
+  if (range)
+    g_slice_free (PullRange, range);
+
+  /* releases the connection */
+  g_vfs_ftp_task_done (&task);
+  g_free (buffer);
+
+  g_mutex_lock (transfer->lock);
+  transfer->n_running--;
+  g_cond_signal (transfer->cond);
+  g_mutex_unlock (transfer->lock);
+
+  return NULL;
+}
+
+/* Decides how many ranges a file of @size is downloaded in */
+static guint
+do_pull_count_segments (GVfsBackendFtp *ftp,
+                        goffset         size)
+{
+  guint n;
+
+  if (!g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_REST))
+    return 1;
+
+  n = MIN (PULL_MAX_SEGMENTS, size / PULL_MIN_SEGMENT_SIZE);
+
+  /* don't take connections other jobs are waiting for */
+  g_mutex_lock (ftp->mutex);
+  if (ftp->max_connections > ftp->busy_connections)
+    n = MIN (n, ftp->max_connections - ftp->busy_connections);
+  else
+    n = 1;
+  g_mutex_unlock (ftp->mutex);
+
+  return MAX (n, 1);
+}
+
+/* Downloads @file into @output in @n_segments ranges in parallel. The
+ * task's connection must have the RETR for the start of the file
+ * running. @total_size only decides where the ranges start, the last
+ * range goes on until the end of the file. Segments that don't get a
+ * connection leave their range to the others, in the worst case the
+ * task's connection downloads all of them one after another. */
+static void
+do_pull_segmented (GVfsFtpTask *         task,
+                   const GVfsFtpFile *   file,
+                   GOutputStream *       output,
+                   goffset               total_size,
+                   guint                 n_segments,
+                   GFileProgressCallback progress_callback,
+                   gpointer              progress_callback_data)
+{
+  PullTransfer transfer = { 0, };
+  PullSegment *segments;
+  PullRange *range;
+  GThread **threads;
+  GTimeVal timeout;
+  goffset bytes_done;
+  gulong cancel_id;
+  guint i;
+
+  transfer.ftp = task->backend;
+  transfer.file = file;
+  transfer.output = output;
+  transfer.cancellable = g_cancellable_new ();
+  transfer.lock = g_mutex_new ();
+  transfer.cond = g_cond_new ();
+  transfer.ranges = g_queue_new ();
+  cancel_id = g_cancellable_connect (task->cancellable,
+                                     G_CALLBACK (cancel_timer_cb),
+                                     transfer.cancellable,
+                                     NULL);
+
+  segments = g_new0 (PullSegment, n_segments);
+  threads = g_new0 (GThread *, n_segments);
+  for (i = 0; i < n_segments; i++)
+    {
+      range = g_slice_new (PullRange);
+      range->start = total_size / n_segments * i;
+      range->end = i + 1 == n_segments ? -1 : total_size / n_segments * (i + 1);
+      g_queue_push_tail (transfer.ranges, range);
+      segments[i].transfer = &transfer;
+    }
+  /* the first range continues the transfer that is already running */
+  segments[0].range = g_queue_pop_head (transfer.ranges);
+  segments[0].conn = g_vfs_ftp_task_take_connection (task);
+
+  g_debug ("# downloading in %u ranges\n", n_segments);
+  for (i = 0; i < n_segments; i++)
+    {
+      g_mutex_lock (transfer.lock);
+      transfer.n_running++;
+      g_mutex_unlock (transfer.lock);
+
+      threads[i] = g_thread_create (do_pull_segment, &segments[i], TRUE, NULL);
+      if (threads[i] != NULL)
+        continue;
+
+      if (i == 0)
+        {
+          /* the others still get a chance to run */
+          do_pull_segment (&segments[i]);
+        }
+      else
+        {
+          g_mutex_lock (transfer.lock);
+          transfer.n_running--;
+          g_mutex_unlock (transfer.lock);
+        }
+    }
+
+  g_mutex_lock (transfer.lock);
+  while (transfer.n_running > 0)
+    {
+      g_get_current_time (&timeout);
+      g_time_val_add (&timeout, G_USEC_PER_SEC);
+      g_cond_timed_wait (transfer.cond, transfer.lock, &timeout);
+      if (progress_callback)
+        {
+          bytes_done = transfer.bytes_done;
+          g_mutex_unlock (transfer.lock);
+          progress_callback (bytes_done, MAX (total_size, bytes_done), progress_callback_data);
+          g_mutex_lock (transfer.lock);
+        }
+    }
+  g_mutex_unlock (transfer.lock);
+
+  for (i = 0; i < n_segments; i++)
+    {
+      if (threads[i])
+        g_thread_join (threads[i]);
+    }
+
+  if (transfer.error)
+    g_propagate_error (&task->error, transfer.error);
+  else if (!g_queue_is_empty (transfer.ranges))
+    g_set_error_literal (&task->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Unexpected end of stream"));
+
+  while ((range = g_queue_pop_head (transfer.ranges)))
+    g_slice_free (PullRange, range);
+  g_queue_free (transfer.ranges);
+  g_cancellable_disconnect (task->cancellable, cancel_id);
+  g_object_unref (transfer.cancellable);
+  g_cond_free (transfer.cond);
+  g_mutex_free (transfer.lock);
+  g_free (threads);
+  g_free (segments);
 }
 
 static void
@@ -1420,9 +2070,6 @@ do_pull (GVfsBackend *         backend,
          GFileProgressCallback progress_callback,
          gpointer              progress_callback_data)
 {
-  static const GVfsFtpErrorFunc open_read_handlers[] = { error_550_is_directory,
-                                                         error_550_permission_or_not_found, 
-                                                         NULL };
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
   GVfsFtpFile *src;
@@ -1430,11 +2077,16 @@ do_pull (GVfsBackend *         backend,
   GInputStream *input;
   GOutputStream *output;
   goffset total_size = 0;
+  goffset split_size, bytes_done, resume_offset;
+  gboolean input_failed, resumable;
+  guint attempts, n_segments;
   
   src = g_vfs_ftp_file_new_from_gvfs (ftp, source);
   dest = g_file_new_for_path (local_path);
 
-  if (progress_callback)
+  /* the size is needed to split the download too */
+  if (progress_callback ||
+      g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_REST))
     {
       GFileInfo *info = g_vfs_ftp_dir_cache_lookup_file (ftp->dir_cache, &task, src, TRUE);
       if (info)
@@ -1444,14 +2096,21 @@ do_pull (GVfsBackend *         backend,
         }
     }
 
-  g_vfs_ftp_task_setup_data_connection (&task);
-  g_vfs_ftp_task_send_and_check (&task,
-                                 G_VFS_FTP_PASS_100 | G_VFS_FTP_FAIL_200,
-                                 open_read_handlers,
-                                 src,
-                                 NULL,
-                                 "RETR %s", g_vfs_ftp_file_get_ftp_path (src));
-  g_vfs_ftp_task_open_data_connection (&task);
+  /* the cached size may be a whole cache lifetime old, so the download
+   * is only split with the size the file has now */
+  split_size = 0;
+  if (g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_REST) &&
+      g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_SIZE) &&
+      total_size >= PULL_MIN_SEGMENT_SIZE * 2)
+    {
+      split_size = MAX (do_get_remote_size (&task, src), 0);
+      if (split_size > 0)
+        total_size = split_size;
+      /* RETR reports problems with the file better */
+      g_vfs_ftp_task_clear_error (&task);
+    }
+
+  do_start_read (&task, src, 0);
   if (g_vfs_ftp_task_is_in_error (&task))
     {
       do_pull_improve_error_message (&task, dest, flags & G_FILE_COPY_OVERWRITE);
@@ -1477,18 +2136,63 @@ do_pull (GVfsBackend *         backend,
       goto out;
     }
 
-  input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (task.conn));
-  ftp_output_stream_splice (output,
-                            input,
-                            total_size,
-                            progress_callback,
-                            progress_callback_data,
-                            task.cancellable,
-                            &task.error);
-  g_vfs_ftp_task_close_data_connection (&task);
-  g_vfs_ftp_task_receive (&task, 0, NULL);
+  n_segments = do_pull_count_segments (ftp, split_size);
+  if (n_segments > 1 &&
+      g_seekable_can_seek (G_SEEKABLE (output)))
+    {
+      do_pull_segmented (&task, src, output, total_size, n_segments,
+                         progress_callback, progress_callback_data);
+      g_output_stream_close (output, NULL, task.error ? NULL : &task.error);
+      g_object_unref (output);
+      goto finish;
+    }
+
+  bytes_done = 0;
+  attempts = 0;
+  for (;;)
+    {
+      resume_offset = bytes_done;
+      input = g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (task.conn));
+      if (ftp_output_stream_splice (output,
+                                    input,
+                                    &bytes_done,
+                                    &input_failed,
+                                    total_size,
+                                    progress_callback,
+                                    progress_callback_data,
+                                    task.cancellable,
+                                    &task.error))
+        /* the server failing the transfer after a short read counts too */
+        resumable = total_size > 0 && bytes_done < total_size;
+      else
+        resumable = input_failed;
+      g_vfs_ftp_task_close_data_connection (&task);
+      g_vfs_ftp_task_receive (&task, 0, NULL);
+
+      /* If the download broke off, continue where it stopped instead
+       * of starting over. Give up after a few tries without progress. */
+      if (!g_vfs_ftp_task_is_in_error (&task) ||
+          !resumable ||
+          g_vfs_ftp_task_error_matches (&task, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+          !g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_REST))
+        break;
+      if (bytes_done > resume_offset)
+        attempts = 0;
+      if (++attempts > PULL_MAX_RESUME_ATTEMPTS)
+        break;
+
+      g_debug ("# download interrupted (%s), resuming at %" G_GOFFSET_FORMAT "\n",
+               task.error->message, bytes_done);
+      g_vfs_ftp_task_clear_error (&task);
+      /* the broken connection gets closed here */
+      g_vfs_ftp_task_release_connection (&task);
+      do_start_read (&task, src, bytes_done);
+      if (g_vfs_ftp_task_is_in_error (&task))
+        break;
+    }
   g_object_unref (output);
 
+finish:
   if (remove_source)
     {
       g_vfs_ftp_task_send (&task,
@@ -1502,6 +2206,166 @@ out:
   g_vfs_ftp_task_done (&task);
 }
 
+/* Sends STOR for @file, or APPE to continue at @offset, and opens the
+ * data connection */
+static void
+do_start_push (GVfsFtpTask *      task,
+               const GVfsFtpFile *file,
+               goffset            offset)
+{
+  static const GVfsFtpErrorFunc store_handlers[] = { error_550_is_directory,
+                                                     error_550_parent_not_found,
+                                                     NULL };
+
+  g_vfs_ftp_task_setup_data_connection (task);
+  g_vfs_ftp_task_send_and_check (task,
+                                 G_VFS_FTP_PASS_100 | G_VFS_FTP_FAIL_200,
+                                 store_handlers,
+                                 (gpointer) file,
+                                 NULL,
+                                 "%s %s",
+                                 offset > 0 ? "APPE" : "STOR",
+                                 g_vfs_ftp_file_get_ftp_path (file));
+  g_vfs_ftp_task_open_data_connection (task);
+}
+
+static void
+do_push (GVfsBackend *         backend,
+         GVfsJobPush *         job,
+         const char *          destination,
+         const char *          local_path,
+         GFileCopyFlags        flags,
+         gboolean              remove_source,
+         GFileProgressCallback progress_callback,
+         gpointer              progress_callback_data)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
+  GVfsFtpFile *dest;
+  GFile *source;
+  GFileInfo *info;
+  GFileInputStream *input;
+  GOutputStream *output;
+  goffset total_size, bytes_done, resume_offset;
+  gboolean input_failed;
+  guint attempts;
+
+  /* Let the generic copy code handle directories, backups and
+   * everything else that isn't a plain upload */
+  if (flags & G_FILE_COPY_BACKUP)
+    {
+      g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           _("Operation unsupported"));
+      g_vfs_ftp_task_done (&task);
+      return;
+    }
+
+  source = g_file_new_for_path (local_path);
+  info = g_file_query_info (source,
+                            G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            0,
+                            task.cancellable,
+                            &task.error);
+  if (info == NULL)
+    {
+      g_object_unref (source);
+      g_vfs_ftp_task_done (&task);
+      return;
+    }
+  if (g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR)
+    {
+      g_object_unref (info);
+      g_object_unref (source);
+      g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           _("Operation unsupported"));
+      g_vfs_ftp_task_done (&task);
+      return;
+    }
+  total_size = g_file_info_get_size (info);
+  g_object_unref (info);
+
+  dest = g_vfs_ftp_file_new_from_gvfs (ftp, destination);
+
+  /* The directory cache answers this for all files of a directory
+   * with one listing, so uploading a tree of small files doesn't cost
+   * a round trip per file here */
+  info = g_vfs_ftp_dir_cache_lookup_file (ftp->dir_cache, &task, dest, FALSE);
+  if (info)
+    {
+      if (!(flags & G_FILE_COPY_OVERWRITE))
+        g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                             _("Target file already exists"));
+      else if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
+        g_set_error_literal (&task.error, G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
+                             _("File is directory"));
+      g_object_unref (info);
+    }
+  else
+    g_vfs_ftp_task_clear_error (&task);
+
+  input = NULL;
+  if (!g_vfs_ftp_task_is_in_error (&task))
+    input = g_file_read (source, task.cancellable, &task.error);
+  if (input == NULL)
+    goto out;
+
+  /* the connection used for the lookup is reused for the upload */
+  do_start_push (&task, dest, 0);
+  g_vfs_ftp_dir_cache_purge_file (ftp->dir_cache, dest);
+
+  bytes_done = 0;
+  attempts = 0;
+  while (!g_vfs_ftp_task_is_in_error (&task))
+    {
+      resume_offset = bytes_done;
+      output = g_io_stream_get_output_stream (g_vfs_ftp_connection_get_data_stream (task.conn));
+      ftp_output_stream_splice (output,
+                                G_INPUT_STREAM (input),
+                                &bytes_done,
+                                &input_failed,
+                                total_size,
+                                progress_callback,
+                                progress_callback_data,
+                                task.cancellable,
+                                &task.error);
+      g_vfs_ftp_task_close_data_connection (&task);
+      g_vfs_ftp_task_receive (&task, 0, NULL);
+
+      /* If the upload broke off, ask the server how much it got and
+       * append the rest. Give up after a few tries without progress. */
+      if (!g_vfs_ftp_task_is_in_error (&task) ||
+          input_failed ||
+          g_vfs_ftp_task_error_matches (&task, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+          !g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_SIZE))
+        break;
+      if (bytes_done > resume_offset)
+        attempts = 0;
+      if (++attempts > PULL_MAX_RESUME_ATTEMPTS)
+        break;
+
+      g_debug ("# upload interrupted (%s), resuming\n", task.error->message);
+      g_vfs_ftp_task_clear_error (&task);
+      g_vfs_ftp_task_release_connection (&task);
+      bytes_done = do_get_remote_size (&task, dest);
+      if (bytes_done < 0 ||
+          !g_seekable_seek (G_SEEKABLE (input), bytes_done, G_SEEK_SET,
+                            task.cancellable, &task.error))
+        break;
+      do_start_push (&task, dest, bytes_done);
+    }
+
+  g_object_unref (input);
+
+  if (remove_source && !g_vfs_ftp_task_is_in_error (&task))
+    g_file_delete (source, task.cancellable, &task.error);
+
+out:
+  g_vfs_ftp_file_free (dest);
+  g_object_unref (source);
+  g_vfs_ftp_task_done (&task);
+}
+
 static void
 g_vfs_backend_ftp_class_init (GVfsBackendFtpClass *klass)
 {
@@ -1516,18 +2380,21 @@ g_vfs_backend_ftp_class_init (GVfsBackendFtpClass *klass)
   backend_class->open_for_read = do_open_for_read;
   backend_class->close_read = do_close_read;
   backend_class->read = do_read;
+  backend_class->seek_on_read = do_seek_on_read;
   backend_class->create = do_create;
   backend_class->append_to = do_append;
   backend_class->replace = do_replace;
   backend_class->close_write = do_close_write;
   backend_class->write = do_write;
   backend_class->query_info = do_query_info;
+  backend_class->query_fs_info = do_query_fs_info;
   backend_class->enumerate = do_enumerate;
   backend_class->set_display_name = do_set_display_name;
   backend_class->delete = do_delete;
   backend_class->make_directory = do_make_directory;
   backend_class->move = do_move;
   backend_class->pull = do_pull;
+  backend_class->push = do_push;
 }
 
 /*** PUBLIC API ***/
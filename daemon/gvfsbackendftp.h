@@ -25,10 +25,12 @@
 
 #include <gvfsbackend.h>
 #include <gmountspec.h>
+#include <gvfsconnector.h>
 
 G_BEGIN_DECLS
 
 #define G_VFS_FTP_TIMEOUT_IN_SECONDS 30
+#define G_VFS_FTP_DEFAULT_PREWARM_CONNECTIONS 1
 
 typedef enum {
   G_VFS_FTP_FEATURE_MDTM,
@@ -36,7 +38,9 @@ typedef enum {
   G_VFS_FTP_FEATURE_TVFS,
   G_VFS_FTP_FEATURE_EPRT,
   G_VFS_FTP_FEATURE_EPSV,
-  G_VFS_FTP_FEATURE_UTF8
+  G_VFS_FTP_FEATURE_UTF8,
+  G_VFS_FTP_FEATURE_MLST,
+  G_VFS_FTP_FEATURE_REST
 } GVfsFtpFeature;
 #define G_VFS_FTP_FEATURES_DEFAULT (0)
 
@@ -80,6 +84,7 @@ struct _GVfsBackendFtp
   GVfsBackend           backend;
 
   GSocketConnectable *  addr;
+  GVfsConnector *       connector;              /* opens connections to addr */
   GSocketClient *       connection_factory;
   char *                user;
   gboolean              has_initial_user;
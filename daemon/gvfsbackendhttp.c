@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <glib/gstdio.h>
@@ -48,6 +49,7 @@
 #include "gvfsjobenumerate.h"
 #include "gvfsdaemonprotocol.h"
 #include "gvfsdaemonutils.h"
+#include "gsysutils.h"
 
 #include "soup-input-stream.h"
 
@@ -70,6 +72,8 @@ g_vfs_backend_http_finalize (GObject *object)
   soup_session_abort (backend->session_async);
   g_object_unref (backend->session_async);
 
+  if (backend->cache)
+    g_vfs_http_cache_free (backend->cache);
 
   if (G_OBJECT_CLASS (g_vfs_backend_http_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_http_parent_class)->finalize) (object);
@@ -128,6 +132,9 @@ g_vfs_backend_http_init (GVfsBackendHttp *backend)
       g_object_unref (logger);
     }
 
+  /* Fetch the next range of a file on a second connection while
+   * sequential reads are busy with the current one */
+  backend->parallel_reads = _g_getenv_uint ("GVFS_HTTP_PARALLEL_READS", 1) != 0;
 }
 
 /* ************************************************************************* */
@@ -282,6 +289,67 @@ http_backend_queue_message (GVfsBackend         *backend,
   soup_session_queue_message (op_backend->session_async, msg, 
                               callback, user_data);
 }
+
+static void
+warm_up_copy_header (const char *name,
+                     const char *value,
+                     gpointer    user_data)
+{
+  soup_message_headers_append (user_data, name, value);
+}
+
+static void
+warm_up_done (SoupSession *session,
+              SoupMessage *msg,
+              gpointer     user_data)
+{
+  GTimer *timer = user_data;
+
+  g_debug ("http: warm-up %s to %s took %.1f ms (%u)\n",
+           msg->method, soup_message_get_uri (msg)->host,
+           g_timer_elapsed (timer, NULL) * 1000, msg->status_code);
+  g_timer_destroy (timer);
+}
+
+/**
+ * http_backend_warm_up:
+ * @backend: a mounted backend
+ * @msg: a cheap request to the server
+ *
+ * Sends @msg, and copies of it, on the async session right after
+ * mounting and ignores the responses. That way libsoup looks up the
+ * host and opens its connections while the user is still looking at
+ * the new mount, instead of during the first operation. Set
+ * GVFS_HTTP_WARM_CONNECTIONS to the number of requests to send, 0
+ * turns this off. Takes ownership of @msg.
+ **/
+void
+http_backend_warm_up (GVfsBackend *backend,
+                      SoupMessage *msg)
+{
+  GVfsBackendHttp *op_backend = G_VFS_BACKEND_HTTP (backend);
+  SoupMessage *copy;
+  guint i, n_connections;
+
+  n_connections = _g_getenv_uint ("GVFS_HTTP_WARM_CONNECTIONS",
+                                  G_VFS_HTTP_DEFAULT_WARM_CONNECTIONS);
+
+  for (i = 1; i < n_connections; i++)
+    {
+      copy = soup_message_new_from_uri (msg->method, soup_message_get_uri (msg));
+      soup_message_headers_foreach (msg->request_headers,
+                                    warm_up_copy_header,
+                                    copy->request_headers);
+      soup_session_queue_message (op_backend->session_async, copy,
+                                  warm_up_done, g_timer_new ());
+    }
+
+  if (n_connections > 0)
+    soup_session_queue_message (op_backend->session_async, msg,
+                                warm_up_done, g_timer_new ());
+  else
+    g_object_unref (msg);
+}
 /* ************************************************************************* */
 /* virtual functions overrides */
 
@@ -297,6 +365,7 @@ try_mount (GVfsBackend  *backend,
   char            *path;
   SoupURI         *uri;
   GMountSpec      *real_mount_spec;
+  guint64          max_size;
 
   op_backend = G_VFS_BACKEND_HTTP (backend);
 
@@ -331,17 +400,49 @@ try_mount (GVfsBackend  *backend,
   
   op_backend->mount_base = uri;
 
+  /* If a size is configured, keep downloaded files in the user's cache
+   * directory, so opening them again only needs a conditional GET.
+   * The size is in MiB. */
+  max_size = _g_getenv_uint ("GVFS_HTTP_CACHE_SIZE", G_VFS_HTTP_CACHE_DEFAULT_SIZE);
+  if (max_size > 0)
+    {
+      path = g_build_filename (g_get_user_cache_dir (), "gvfs", "http", NULL);
+      op_backend->cache = g_vfs_http_cache_new (path, max_size * 1024 * 1024);
+      g_free (path);
+    }
+
   g_vfs_job_succeeded (G_VFS_JOB (job));
   return TRUE;
 }
 
 /* *** open_read () *** */
+typedef struct {
+  char               *cache_key;
+  GVfsHttpCacheEntry *cache_entry;
+} OpenForReadData;
+
+static void
+open_for_read_data_free (gpointer user_data)
+{
+  OpenForReadData *data = user_data;
+
+  if (data->cache_entry)
+    g_vfs_http_cache_entry_free (data->cache_entry);
+  g_free (data->cache_key);
+  g_slice_free (OpenForReadData, data);
+}
+
 static void
 open_for_read_ready (GObject      *source_object,
                      GAsyncResult *result,
                      gpointer      user_data)
 {
+  GVfsBackendHttp *op_backend;
+  OpenForReadData *data;
+  GVfsHttpCacheWriter *writer;
   GInputStream *stream;
+  GInputStream *cached;
+  SoupMessage  *msg;
   GVfsJob      *job;
   gboolean      res;
   gboolean      can_seek;
@@ -350,10 +451,33 @@ open_for_read_ready (GObject      *source_object,
   stream = G_INPUT_STREAM (source_object); 
   error  = NULL;
   job    = G_VFS_JOB (user_data);
+  data   = job->backend_data;
+  op_backend = G_VFS_BACKEND_HTTP (G_VFS_JOB_OPEN_FOR_READ (job)->backend);
 
   res = soup_input_stream_send_finish (stream,
                                        result,
                                        &error);
+
+  if (res == FALSE && data && data->cache_entry &&
+      error->domain == SOUP_HTTP_ERROR &&
+      error->code == SOUP_STATUS_NOT_MODIFIED)
+    {
+      /* Serve the body from the cache; the message stays around for
+       * query_info_on_read () */
+      msg = soup_input_stream_get_message (stream);
+      cached = g_vfs_http_cache_entry_open (data->cache_entry, msg);
+      g_object_set_data_full (G_OBJECT (cached), "gvfs-http-message",
+                              msg, g_object_unref);
+
+      g_error_free (error);
+      g_object_unref (stream);
+
+      g_vfs_job_open_for_read_set_can_seek (G_VFS_JOB_OPEN_FOR_READ (job), TRUE);
+      g_vfs_job_open_for_read_set_handle (G_VFS_JOB_OPEN_FOR_READ (job), cached);
+      g_vfs_job_succeeded (job);
+      return;
+    }
+
   if (res == FALSE)
     {
       g_vfs_job_failed_literal (G_VFS_JOB (job),
@@ -366,6 +490,18 @@ open_for_read_ready (GObject      *source_object,
       return;
     }
 
+  if (data && op_backend->cache)
+    {
+      msg = soup_input_stream_get_message (stream);
+      writer = g_vfs_http_cache_writer_new (op_backend->cache,
+                                            data->cache_key, msg);
+      if (writer)
+        g_object_set_data_full (G_OBJECT (stream), "gvfs-http-cache-writer",
+                                writer,
+                                (GDestroyNotify) g_vfs_http_cache_writer_free);
+      g_object_unref (msg);
+    }
+
   can_seek = G_IS_SEEKABLE (stream) && g_seekable_can_seek (G_SEEKABLE (stream));
 
   g_vfs_job_open_for_read_set_can_seek (G_VFS_JOB_OPEN_FOR_READ (job), can_seek);
@@ -379,6 +515,7 @@ try_open_for_read (GVfsBackend        *backend,
                    const char         *filename)
 {
   GVfsBackendHttp *op_backend;
+  OpenForReadData *data;
   GInputStream    *stream;
   SoupMessage     *msg;
   SoupURI         *uri;
@@ -386,6 +523,20 @@ try_open_for_read (GVfsBackend        *backend,
   op_backend = G_VFS_BACKEND_HTTP (backend);
   uri = http_backend_uri_for_filename (backend, filename, FALSE);
   msg = soup_message_new_from_uri (SOUP_METHOD_GET, uri);
+
+  if (op_backend->cache)
+    {
+      data = g_slice_new0 (OpenForReadData);
+      data->cache_key = soup_uri_to_string (uri, FALSE);
+      data->cache_entry = g_vfs_http_cache_lookup (op_backend->cache,
+                                                   data->cache_key);
+      if (data->cache_entry)
+        g_vfs_http_cache_entry_add_conditions (data->cache_entry, msg);
+
+      g_vfs_job_set_backend_data (G_VFS_JOB (job), data,
+                                  open_for_read_data_free);
+    }
+
   soup_uri_free (uri);
 
   soup_message_body_set_accumulate (msg->response_body, FALSE);
@@ -393,6 +544,8 @@ try_open_for_read (GVfsBackend        *backend,
   stream = soup_input_stream_new (op_backend->session_async, msg);
   g_object_unref (msg);
 
+  soup_input_stream_set_prefetch (stream, op_backend->parallel_reads);
+
   soup_input_stream_send_async (stream,
                                 G_PRIORITY_DEFAULT,
                                 G_VFS_JOB (job)->cancellable,
@@ -407,6 +560,7 @@ read_ready (GObject      *source_object,
             GAsyncResult *result,
             gpointer      user_data)
 {
+  GVfsHttpCacheWriter *writer;
   GInputStream *stream;
   GVfsJob      *job;
   GError       *error;
@@ -418,8 +572,13 @@ read_ready (GObject      *source_object,
 
   nread = g_input_stream_read_finish (stream, result, &error);
 
+  writer = g_object_get_data (G_OBJECT (stream), "gvfs-http-cache-writer");
+
   if (nread < 0)
    {
+     if (writer)
+       g_object_set_data (G_OBJECT (stream), "gvfs-http-cache-writer", NULL);
+
      g_vfs_job_failed_literal (G_VFS_JOB (job),
                                error->domain,
                                error->code,
@@ -429,6 +588,20 @@ read_ready (GObject      *source_object,
      return;
    }
 
+  /* Store the body in the cache while it is read */
+  if (writer)
+    {
+      if (nread == 0)
+        {
+          g_vfs_http_cache_writer_commit (writer);
+          g_object_set_data (G_OBJECT (stream), "gvfs-http-cache-writer", NULL);
+        }
+      else if (!g_vfs_http_cache_writer_write (writer,
+                                               G_VFS_JOB_READ (job)->buffer,
+                                               nread))
+        g_object_set_data (G_OBJECT (stream), "gvfs-http-cache-writer", NULL);
+    }
+
   g_vfs_job_read_set_size (G_VFS_JOB_READ (job), nread);
   g_vfs_job_succeeded (job);
 
@@ -464,8 +637,10 @@ try_seek_on_read (GVfsBackend *backend,
 {
   GInputStream    *stream;
   GError          *error = NULL;
+  goffset          pos;
 
   stream = G_INPUT_STREAM (handle);
+  pos = g_seekable_tell (G_SEEKABLE (stream));
 
   if (!g_seekable_seek (G_SEEKABLE (stream), offset, type,
                         G_VFS_JOB (job)->cancellable, &error))
@@ -479,6 +654,10 @@ try_seek_on_read (GVfsBackend *backend,
     }
   else
     {
+      /* Only bodies read from start to end are cached */
+      if (g_seekable_tell (G_SEEKABLE (stream)) != pos)
+        g_object_set_data (G_OBJECT (stream), "gvfs-http-cache-writer", NULL);
+
       g_vfs_job_seek_read_set_offset (job, g_seekable_tell (G_SEEKABLE (stream)));
       g_vfs_job_succeeded (G_VFS_JOB (job));
     }
@@ -666,7 +845,13 @@ try_query_info_on_read (GVfsBackend           *backend,
                         GFileInfo             *info,
                         GFileAttributeMatcher *attribute_matcher)
 {
-    SoupMessage *msg = soup_input_stream_get_message (G_INPUT_STREAM (handle));
+    SoupMessage *msg;
+
+    /* Bodies served from the cache keep the message that revalidated them */
+    if (SOUP_IS_INPUT_STREAM (handle))
+      msg = soup_input_stream_get_message (G_INPUT_STREAM (handle));
+    else
+      msg = g_object_ref (g_object_get_data (G_OBJECT (handle), "gvfs-http-message"));
 
     file_info_from_message (msg, info, attribute_matcher);
     g_object_unref (msg);
@@ -26,9 +26,12 @@
 #include <gvfsbackend.h>
 #include <gmountspec.h>
 #include <libsoup/soup.h>
+#include "gvfshttpcache.h"
 
 G_BEGIN_DECLS
 
+#define G_VFS_HTTP_DEFAULT_WARM_CONNECTIONS 1
+
 #define G_VFS_TYPE_BACKEND_HTTP         (g_vfs_backend_http_get_type ())
 #define G_VFS_BACKEND_HTTP(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), G_VFS_TYPE_BACKEND_HTTP, GVfsBackendHttp))
 #define G_VFS_BACKEND_HTTP_CLASS(k)     (G_TYPE_CHECK_CLASS_CAST((k), G_VFS_TYPE_BACKEND_HTTP, GVfsBackendHttpClass))
@@ -53,6 +56,10 @@ struct _GVfsBackendHttp
   SoupSession *session;
 
   SoupSession *session_async;
+
+  gboolean     parallel_reads;
+
+  GVfsHttpCache *cache;
 };
 
 GType         g_vfs_backend_http_get_type    (void) G_GNUC_CONST;
@@ -74,6 +81,9 @@ void          http_backend_queue_message     (GVfsBackend         *backend,
                                               SoupSessionCallback  callback,
                                               gpointer             user_data);
 
+void          http_backend_warm_up           (GVfsBackend         *backend,
+                                              SoupMessage         *msg);
+
 G_END_DECLS
 
 #endif /* __G_VFS_BACKEND_HTTP_H__ */
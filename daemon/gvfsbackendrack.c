@@ -45,6 +45,7 @@
 #include "gvfskeyring.h"
 #include "soup-input-stream.h"
 #include "soup-output-stream.h"
+#include "gvfshttpdecoder.h"
 
 #define RACK_PROTOCOL_SCHEME "rack"
 #define RACK_PROTOCOL_DISPLAY_NAME "Cloud Files"
@@ -71,6 +72,9 @@ struct _GVfsBackendRack
   gchar *host;
   int port;
 
+  /* set once the store refused a create because of "If-None-Match" */
+  gboolean if_none_match_works;
+
   GPasswordSave password_save;
 };
 
@@ -318,6 +322,9 @@ static gboolean get_credentials(GVfsBackendRack *rack,
   return !aborted;
 }
 
+static SoupMessage*
+new_cloud_message(GVfsBackendRack *rack, const gchar *http_method, const gchar *custom_path, GHashTable *query);
+
 static void
 do_mount (GVfsBackend  *backend,
           GVfsJobMount *job,
@@ -407,6 +414,9 @@ do_mount (GVfsBackend  *backend,
   soup_uri_free(auth_uri);
 
   g_vfs_job_succeeded(G_VFS_JOB(job));
+
+  // the auth server is usually not the storage server, so connect to that
+  http_backend_warm_up(backend, new_cloud_message(rack, SOUP_METHOD_HEAD, "", NULL));
 }
 
 static gboolean
@@ -518,6 +528,7 @@ new_root_list_message(GVfsBackendRack *rack)
   SoupMessage *msg = new_cloud_message(rack, SOUP_METHOD_GET, NULL, query);
   g_hash_table_unref(query);
 
+  g_vfs_http_decoder_accept_encoding(msg);
   return msg;
 }
 
@@ -553,6 +564,8 @@ new_container_list_message(GVfsBackendRack *rack, RackPath *path)
   query_set_json(query);
   SoupMessage *msg = new_cloud_message(rack, SOUP_METHOD_GET, path->container, query);
   g_hash_table_unref(query);
+
+  g_vfs_http_decoder_accept_encoding(msg);
   return msg;
 }
 
@@ -575,6 +588,8 @@ new_folder_list_message(GVfsBackendRack *rack, RackPath *path, gboolean json)
 
   SoupMessage *msg = new_cloud_message(rack, SOUP_METHOD_GET, path->container, query);
   g_hash_table_unref(query);
+
+  g_vfs_http_decoder_accept_encoding(msg);
   return msg;
 }
 
@@ -1566,28 +1581,57 @@ try_replace (GVfsBackend *backend,
 }
 
 static void
-try_created_object (SoupSession *session, SoupMessage *create_msg, 
-                    gpointer user_data)
+try_create_opened (GObject      *source_object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
 {
-  GVfsJob *job = G_VFS_JOB (user_data);
-  GVfsBackendHttp *op_backend = job->backend_data;
-  GOutputStream   *stream;
-  SoupMessage     *write_msg;
+  GOutputStream *stream = G_OUTPUT_STREAM (source_object);
+  GVfsJob       *job = G_VFS_JOB (user_data);
+  GVfsBackendRack *rack = job->backend_data;
+  GError        *error = NULL;
 
-  guint ret = create_msg->status_code;
+  if (soup_output_stream_open_finish (stream, result, &error))
+    {
+      g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), stream);
+      g_vfs_job_succeeded (job);
+      return;
+    }
 
-  if(ret != SOUP_STATUS_CREATED) {
-    g_vfs_job_failed(G_VFS_JOB(job), G_IO_ERROR, G_IO_ERROR_FAILED, _("HTTP Error: %s"), create_msg->reason_phrase);
-    return;
-  } 
+  g_object_unref (stream);
 
-  write_msg = new_object_message_from_uri(G_VFS_BACKEND_RACK(op_backend), soup_message_get_uri(create_msg), SOUP_METHOD_PUT);
+  if (error->domain == SOUP_HTTP_ERROR &&
+      error->code == SOUP_STATUS_PRECONDITION_FAILED)
+    {
+      rack->if_none_match_works = TRUE;
+      g_vfs_job_failed (job,
+                        G_IO_ERROR,
+                        G_IO_ERROR_EXISTS,
+                        _("Target file exists"));
+    }
+  else if (error->domain == SOUP_HTTP_ERROR)
+    g_vfs_job_failed (job, G_IO_ERROR, http_error_code_from_status (error->code),
+                      _("HTTP Error: %s"), error->message);
+  else
+    g_vfs_job_failed_from_error (job, error);
 
-  stream = soup_output_stream_new_chunked (op_backend->session_async, write_msg);
-  g_object_unref (write_msg);
+  g_error_free (error);
+}
 
-  g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), stream);
-  g_vfs_job_succeeded (job);
+static void
+create_object (GVfsBackendRack *rack, GVfsJob *job, SoupMessage *msg)
+{
+  GOutputStream *stream;
+
+  /* The server checks that the object doesn't exist before it asks
+   * for the data with "100 Continue" */
+  soup_message_headers_append(msg->request_headers, "If-None-Match", "*");
+
+  stream = soup_output_stream_new_chunked (G_VFS_BACKEND_HTTP(rack)->session_async, msg);
+  g_object_unref (msg);
+
+  soup_output_stream_open_async (stream, G_PRIORITY_DEFAULT,
+                                 job->cancellable,
+                                 try_create_opened, job);
 }
 
 static void
@@ -1595,8 +1639,11 @@ try_create_tested_existence (SoupSession *session, SoupMessage *msg,
                              gpointer user_data)
 {
   GVfsJob *job = G_VFS_JOB (user_data);
-  GVfsBackendHttp *op_backend = job->backend_data;
-  SoupMessage     *create_msg;
+  GVfsBackendRack *rack = job->backend_data;
+
+  /* only a store that evaluates the precondition answers 304 */
+  if (msg->status_code == SOUP_STATUS_NOT_MODIFIED)
+    rack->if_none_match_works = TRUE;
 
   if (SOUP_STATUS_NOT_FOUND != msg->status_code)
     {
@@ -1607,33 +1654,39 @@ try_create_tested_existence (SoupSession *session, SoupMessage *msg,
       return;
     }
 
-  create_msg = new_object_message_from_uri(G_VFS_BACKEND_RACK(op_backend), soup_message_get_uri(msg), SOUP_METHOD_PUT);
-
-  // Create a zero-length file before signalling success
-  soup_message_headers_append(create_msg->request_headers, "Content-Length", "0");
-  soup_message_headers_append(create_msg->request_headers, "Content-Type", "application/octet-stream");
-  http_backend_queue_message (G_VFS_BACKEND(op_backend), create_msg, try_created_object, job);
+  create_object (rack, job,
+                 new_object_message_from_uri(rack, soup_message_get_uri(msg), SOUP_METHOD_PUT));
 }
 
-
 static gboolean
 try_create (GVfsBackend *backend,
             GVfsJobOpenForWrite *job,
             const char *filename,
             GFileCreateFlags flags)
 {
+  GVfsBackendRack *rack = G_VFS_BACKEND_RACK(backend);
   SoupMessage *msg;
+  RackPath *path;
 
-  /* TODO: if SoupOutputStream supported chunked requests, we could
-   * use a PUT with "If-None-Match: *" and "Expect: 100-continue"
-   */
+  g_vfs_job_set_backend_data (G_VFS_JOB (job), backend, NULL);
 
-  RackPath *path = rack_path_new(filename);
-  msg = new_object_message(G_VFS_BACKEND_RACK(backend), path, SOUP_METHOD_HEAD);
-  rack_path_free(path);
+  path = rack_path_new(filename);
 
-  g_vfs_job_set_backend_data (G_VFS_JOB (job), backend, NULL);
+  if (rack->if_none_match_works)
+    {
+      create_object (rack, G_VFS_JOB (job),
+                     new_object_message(rack, path, SOUP_METHOD_PUT));
+      rack_path_free(path);
+      return TRUE;
+    }
+
+  /* Stores or proxies that ignore "If-None-Match: *" would overwrite
+   * the object, so keep checking for it until the store has shown
+   * that it honours the header */
+  msg = new_object_message(rack, path, SOUP_METHOD_HEAD);
+  rack_path_free(path);
 
+  soup_message_headers_append(msg->request_headers, "If-None-Match", "*");
   http_backend_queue_message (backend, msg, try_create_tested_existence, job);
 
   return TRUE;
@@ -61,7 +61,10 @@
 #include "gvfsjobqueryattributes.h"
 #include "gvfsjobenumerate.h"
 #include "gvfsjobmakedirectory.h"
+#include "gvfsjobpull.h"
+#include "gvfsjobpush.h"
 #include "gvfsdaemonprotocol.h"
+#include "gsysutils.h"
 #include "gvfskeyring.h"
 #include "sftp.h"
 #include "pty_open.h"
@@ -78,6 +81,30 @@
 
 #define SFTP_READ_TIMEOUT 40   /* seconds */
 
+/* Once a handle has been read sequentially this many times, READ
+   requests for the following blocks are sent ahead of time */
+#define READ_AHEAD_MIN_SEQUENTIAL 2
+#define READ_AHEAD_BLOCK_SIZE 32768
+#define READ_AHEAD_BLOCKS 16
+
+/* type, id and the data length of a SSH_FXP_DATA reply */
+#define REPLY_HEADER_SIZE 9
+
+/* Replies up to this size use recycled buffers */
+#define REPLY_BUFFER_POOL_SIZE (READ_AHEAD_BLOCK_SIZE + 64)
+#define REPLY_BUFFER_POOL_MAX 16
+
+/* How long attributes and directory listings are trusted, can be
+   changed with GVFS_SFTP_CACHE_TTL (seconds, 0 disables caching) */
+#define STAT_CACHE_DEFAULT_TTL 5   /* seconds */
+#define STAT_CACHE_MAX_ENTRIES 20000
+
+/* ssh processes per mount, GVFS_SFTP_CONNECTIONS overrides the
+   default. Extra ones log in in the background after mounting, and
+   are only used if they can do that without asking anything. */
+#define SFTP_MAX_CONNECTIONS 8
+#define SFTP_DEFAULT_CONNECTIONS 3
+
 static GQuark id_q;
 
 typedef enum {
@@ -95,6 +122,13 @@ typedef void (*ReplyCallback) (GVfsBackendSftp *backend,
                                GVfsJob *job,
                                gpointer user_data);
 
+/* Called instead of the ReplyCallback when the data of a READ
+   reply was read directly into the destination buffer */
+typedef void (*DirectReplyCallback) (GVfsBackendSftp *backend,
+                                     guint32 count,
+                                     GVfsJob *job,
+                                     gpointer user_data);
+
 typedef void (*MultiReplyCallback) (GVfsBackendSftp *backend,
                                     MultiReply *replies,
                                     int n_replies,
@@ -119,6 +153,44 @@ struct _MultiReply {
 };
 
 
+typedef struct _SftpConnection SftpConnection;
+
+typedef struct {
+  SftpConnection *connection;
+  ReplyCallback callback;
+  GVfsJob *job;
+  gpointer user_data;
+
+  DirectReplyCallback direct_callback;
+  guchar *direct_buffer;
+  gsize direct_size;
+} ExpectedReply;
+
+/* One ssh process talking to its own sftp-server. Handles only
+   exist on the connection that opened them. */
+struct _SftpConnection {
+  GVfsBackendSftp *backend;
+  gboolean dead; /* ssh went away, requests fail right away */
+  guint fail_replies_id;
+
+  GOutputStream *command_stream;
+  GInputStream *reply_stream;
+  GDataInputStream *error_stream;
+
+  GCancellable *reply_stream_cancellable;
+
+  /* Output Queue */
+  
+  gsize command_bytes_written;
+  GList *command_queue;
+  guint n_outstanding; /* Requests sent, reply not seen yet */
+  
+  /* Reply reading: */
+  guint32 reply_size;
+  guint32 reply_size_read;
+  guint8 *reply;
+  ExpectedReply *direct_reply;
+};
 
 typedef struct {
   guchar *data;
@@ -126,20 +198,33 @@ typedef struct {
 } DataBuffer;
 
 typedef struct {
+  SftpConnection *connection;
   DataBuffer *raw_handle;
   goffset offset;
   char *filename;
   char *tempname;
   guint32 permissions;
   gboolean make_backup;
-} SftpHandle;
 
+  /* Read handles only */
+  int sequential_reads;
+  GQueue *read_ahead;
+  gboolean read_ahead_eof; /* a block hit the end, until the next seek */
+} SftpHandle;
 
+/* A READ request sent before anyone asked for the data */
 typedef struct {
-  ReplyCallback callback;
-  GVfsJob *job;
-  gpointer user_data;
-} ExpectedReply;
+  SftpHandle *handle; /* NULL once discarded */
+  goffset offset;
+  guint32 len;
+  gboolean done;
+  guint32 status; /* SSH_FX_OK if data arrived */
+  guchar *data;
+  guint32 size;
+  guint32 consumed;
+  GVfsJob *waiting_job;
+} ReadAheadBlock;
+
 
 struct _GVfsBackendSftp
 {
@@ -158,25 +243,28 @@ struct _GVfsBackendSftp
   guint32 my_gid;
   
   int protocol_version;
-  
-  GOutputStream *command_stream;
-  GInputStream *reply_stream;
-  GDataInputStream *error_stream;
 
-  GCancellable *reply_stream_cancellable;
+  /* The first connection carries path based requests, file data
+     for open handles and transfers goes over the others */
+  SftpConnection *connections[SFTP_MAX_CONNECTIONS];
+  int n_connections;
+  GList *dead_connections; /* data connections whose ssh died */
+  int max_connections;
+  int next_bulk_connection;
 
   guint32 current_id;
   
-  /* Output Queue */
-  
-  gsize command_bytes_written;
-  GList *command_queue;
-  
-  /* Reply reading: */
   GHashTable *expected_replies;
-  guint32 reply_size;
-  guint32 reply_size_read;
-  guint8 *reply;
+
+  /* Attribute cache */
+  GHashTable *stat_cache; /* path -> StatCacheEntry */
+  GHashTable *dir_cache; /* path -> DirCacheEntry */
+  GFileAttributeMatcher *stat_cache_matcher;
+  gint64 stat_cache_ttl; /* msec, 0 disables the cache */
+  guint32 stat_cache_generation;
+  guint stat_cache_hits;
+  guint stat_cache_misses;
+  guint stat_cache_invalidations;
   
   GMountSource *mount_source; /* Only used/set during mount */
   int mount_try;
@@ -246,26 +334,310 @@ get_sftp_client_vendor (void)
   return res;
 }
 
+/* Attributes of a remote path from a READDIR, LSTAT or STAT reply */
+typedef struct {
+  gint64 expires;
+  GFileInfo *lstat_info;
+  GFileInfo *stat_info; /* Symlink followed, NULL if not known */
+  gboolean has_symlink_target;
+  char *symlink_target;
+} StatCacheEntry;
+
+/* The names in a directory, from a READDIR run that reached the end */
+typedef struct {
+  gint64 expires;
+  char **names;
+} DirCacheEntry;
+
+static gint64
+stat_cache_now (void)
+{
+  GTimeVal now;
+
+  g_get_current_time (&now);
+  return (gint64)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+static void
+stat_cache_entry_free (StatCacheEntry *entry)
+{
+  g_object_unref (entry->lstat_info);
+  if (entry->stat_info)
+    g_object_unref (entry->stat_info);
+  g_free (entry->symlink_target);
+  g_slice_free (StatCacheEntry, entry);
+}
+
+static void
+dir_cache_entry_free (DirCacheEntry *entry)
+{
+  g_strfreev (entry->names);
+  g_slice_free (DirCacheEntry, entry);
+}
+
+static gboolean
+stat_cache_entry_expired (gpointer key,
+                          gpointer value,
+                          gpointer user_data)
+{
+  StatCacheEntry *entry = value;
+  gint64 *now = user_data;
+
+  return entry->expires <= *now;
+}
+
+static gboolean
+dir_cache_entry_expired (gpointer key,
+                         gpointer value,
+                         gpointer user_data)
+{
+  DirCacheEntry *entry = value;
+  gint64 *now = user_data;
+
+  return entry->expires <= *now;
+}
+
+static gboolean
+stat_cache_path_is_below (gpointer key,
+                          gpointer value,
+                          gpointer user_data)
+{
+  return g_str_has_prefix (key, user_data);
+}
+
+static void
+stat_cache_prune (GVfsBackendSftp *backend)
+{
+  gint64 now;
+
+  now = stat_cache_now ();
+  g_hash_table_foreach_remove (backend->stat_cache, stat_cache_entry_expired, &now);
+  g_hash_table_foreach_remove (backend->dir_cache, dir_cache_entry_expired, &now);
+
+  /* Everything is fresh, start over rather than picking victims */
+  if (g_hash_table_size (backend->stat_cache) >= STAT_CACHE_MAX_ENTRIES)
+    {
+      g_hash_table_remove_all (backend->stat_cache);
+      g_hash_table_remove_all (backend->dir_cache);
+    }
+}
+
+/* Replies to requests sent before we changed something on the server
+   may describe the old state, so those are not cached */
+static gboolean
+stat_cache_can_fill (GVfsBackendSftp *backend,
+                     guint32 generation)
+{
+  return backend->stat_cache_ttl > 0 &&
+    generation == backend->stat_cache_generation;
+}
+
+static StatCacheEntry *
+stat_cache_insert (GVfsBackendSftp *backend,
+                   const char *path,
+                   GFileInfo *lstat_info)
+{
+  StatCacheEntry *entry;
+
+  if (g_hash_table_size (backend->stat_cache) >= STAT_CACHE_MAX_ENTRIES)
+    stat_cache_prune (backend);
+
+  entry = g_slice_new0 (StatCacheEntry);
+  entry->expires = stat_cache_now () + backend->stat_cache_ttl;
+  entry->lstat_info = g_object_ref (lstat_info);
+  g_hash_table_replace (backend->stat_cache, g_strdup (path), entry);
+
+  return entry;
+}
+
+static void
+dir_cache_insert (GVfsBackendSftp *backend,
+                  const char *path,
+                  GPtrArray *names)
+{
+  DirCacheEntry *entry;
+
+  entry = g_slice_new0 (DirCacheEntry);
+  entry->expires = stat_cache_now () + backend->stat_cache_ttl;
+  entry->names = g_new (char *, names->len + 1);
+  memcpy (entry->names, names->pdata, names->len * sizeof (char *));
+  entry->names[names->len] = NULL;
+  g_ptr_array_set_size (names, 0);
+  g_hash_table_replace (backend->dir_cache, g_strdup (path), entry);
+}
+
+static StatCacheEntry *
+stat_cache_lookup (GVfsBackendSftp *backend,
+                   const char *path)
+{
+  StatCacheEntry *entry;
+
+  if (backend->stat_cache_ttl == 0)
+    return NULL;
+
+  entry = g_hash_table_lookup (backend->stat_cache, path);
+  if (entry != NULL && entry->expires <= stat_cache_now ())
+    {
+      g_hash_table_remove (backend->stat_cache, path);
+      entry = NULL;
+    }
+
+  return entry;
+}
+
+static char **
+dir_cache_lookup (GVfsBackendSftp *backend,
+                  const char *path)
+{
+  DirCacheEntry *entry;
+
+  if (backend->stat_cache_ttl == 0)
+    return NULL;
+
+  entry = g_hash_table_lookup (backend->dir_cache, path);
+  if (entry == NULL)
+    return NULL;
+
+  if (entry->expires <= stat_cache_now ())
+    {
+      g_hash_table_remove (backend->dir_cache, path);
+      return NULL;
+    }
+
+  return entry->names;
+}
+
+/* Returns the cached info to report for path, not masked by matcher,
+   or NULL if anything that was asked for is not known */
+static GFileInfo *
+stat_cache_lookup_info (GVfsBackendSftp *backend,
+                        const char *path,
+                        GFileQueryInfoFlags flags,
+                        GFileAttributeMatcher *matcher,
+                        const char **symlink_target)
+{
+  StatCacheEntry *entry;
+  gboolean is_symlink;
+
+  entry = stat_cache_lookup (backend, path);
+  if (entry == NULL)
+    return NULL;
+
+  is_symlink =
+    g_file_info_get_file_type (entry->lstat_info) == G_FILE_TYPE_SYMBOLIC_LINK;
+
+  if (is_symlink &&
+      !entry->has_symlink_target &&
+      g_file_attribute_matcher_matches (matcher,
+                                        G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET))
+    return NULL;
+
+  *symlink_target = entry->symlink_target;
+
+  if (!is_symlink || (flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS))
+    return entry->lstat_info;
+
+  return entry->stat_info;
+}
+
+/* Drops the single cached entry for path */
+static void
+stat_cache_forget (GVfsBackendSftp *backend,
+                   const char *path)
+{
+  backend->stat_cache_generation++;
+  if (backend->stat_cache_ttl == 0)
+    return;
+
+  backend->stat_cache_invalidations++;
+  g_hash_table_remove (backend->stat_cache, path);
+}
+
+/* Drops what we know about path and its parent directory, whose
+   listing and mtime change when path is created or removed. With
+   subtree set also everything below path, for moved directories */
+static void
+stat_cache_invalidate (GVfsBackendSftp *backend,
+                       const char *path,
+                       gboolean subtree)
+{
+  char *parent, *prefix;
+
+  stat_cache_forget (backend, path);
+  if (backend->stat_cache_ttl == 0)
+    return;
+
+  g_hash_table_remove (backend->dir_cache, path);
+
+  parent = g_path_get_dirname (path);
+  g_hash_table_remove (backend->stat_cache, parent);
+  g_hash_table_remove (backend->dir_cache, parent);
+  g_free (parent);
+
+  if (subtree)
+    {
+      if (strcmp (path, "/") == 0)
+        prefix = g_strdup (path);
+      else
+        prefix = g_strconcat (path, "/", NULL);
+      g_hash_table_foreach_remove (backend->stat_cache, stat_cache_path_is_below, prefix);
+      g_hash_table_foreach_remove (backend->dir_cache, stat_cache_path_is_below, prefix);
+      g_free (prefix);
+    }
+}
+
+static SftpConnection *
+sftp_connection_new (GVfsBackendSftp *backend)
+{
+  SftpConnection *connection;
+
+  connection = g_slice_new0 (SftpConnection);
+  connection->backend = backend;
+
+  return connection;
+}
+
+static void
+sftp_connection_free (SftpConnection *connection)
+{
+  if (connection->command_stream)
+    g_object_unref (connection->command_stream);
+  
+  if (connection->reply_stream_cancellable)
+    g_object_unref (connection->reply_stream_cancellable);
+
+  if (connection->reply_stream)
+    g_object_unref (connection->reply_stream);
+  
+  if (connection->error_stream)
+    g_object_unref (connection->error_stream);
+
+  if (connection->fail_replies_id)
+    g_source_remove (connection->fail_replies_id);
+
+  g_list_foreach (connection->command_queue, (GFunc) data_buffer_free, NULL);
+  g_list_free (connection->command_queue);
+
+  g_slice_free (SftpConnection, connection);
+}
+
 static void
 g_vfs_backend_sftp_finalize (GObject *object)
 {
   GVfsBackendSftp *backend;
+  int i;
 
   backend = G_VFS_BACKEND_SFTP (object);
 
   g_hash_table_destroy (backend->expected_replies);
-  
-  if (backend->command_stream)
-    g_object_unref (backend->command_stream);
-  
-  if (backend->reply_stream_cancellable)
-    g_object_unref (backend->reply_stream_cancellable);
+  g_hash_table_destroy (backend->stat_cache);
+  g_hash_table_destroy (backend->dir_cache);
+  g_file_attribute_matcher_unref (backend->stat_cache_matcher);
 
-  if (backend->reply_stream)
-    g_object_unref (backend->reply_stream);
-  
-  if (backend->error_stream)
-    g_object_unref (backend->error_stream);
+  for (i = 0; i < backend->n_connections; i++)
+    sftp_connection_free (backend->connections[i]);
+  g_list_foreach (backend->dead_connections, (GFunc) sftp_connection_free, NULL);
+  g_list_free (backend->dead_connections);
   
   if (G_OBJECT_CLASS (g_vfs_backend_sftp_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_sftp_parent_class)->finalize) (object);
@@ -282,6 +654,19 @@ static void
 g_vfs_backend_sftp_init (GVfsBackendSftp *backend)
 {
   backend->expected_replies = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)expected_reply_free);
+
+  backend->stat_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)stat_cache_entry_free);
+  backend->dir_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify)dir_cache_entry_free);
+  /* Cached infos have all attributes, each job masks out what it wants */
+  backend->stat_cache_matcher = g_file_attribute_matcher_new ("*");
+
+  backend->stat_cache_ttl = (gint64)_g_getenv_uint ("GVFS_SFTP_CACHE_TTL",
+                                                    STAT_CACHE_DEFAULT_TTL) * 1000;
+  backend->max_connections = CLAMP (_g_getenv_uint ("GVFS_SFTP_CONNECTIONS",
+                                                    SFTP_DEFAULT_CONNECTIONS),
+                                    1, SFTP_MAX_CONNECTIONS);
 }
 
 static void
@@ -292,7 +677,7 @@ look_for_stderr_errors (GVfsBackend *backend, GError **error)
 
   while (1)
     {
-      line = g_data_input_stream_read_line (op_backend->error_stream, NULL, NULL, NULL);
+      line = g_data_input_stream_read_line (op_backend->connections[0]->error_stream, NULL, NULL, NULL);
       
       if (line == NULL)
         {
@@ -422,7 +807,8 @@ setup_ssh_environment (void)
 }
 
 static char **
-setup_ssh_commandline (GVfsBackend *backend)
+setup_ssh_commandline (GVfsBackend *backend,
+                       gboolean batch_mode)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   guint last_arg;
@@ -443,6 +829,9 @@ setup_ssh_commandline (GVfsBackend *backend)
       args[last_arg++] = g_strdup ("-oNoHostAuthenticationForLocalhost yes");
 #ifndef USE_PTY
       args[last_arg++] = g_strdup ("-oBatchMode yes");
+#else
+      if (batch_mode)
+        args[last_arg++] = g_strdup ("-oBatchMode yes");
 #endif
     
     }
@@ -572,7 +961,7 @@ get_data_from_command_stream (GDataOutputStream *command_stream, gsize *len)
 }
 
 static gboolean
-send_command_sync_and_unref_command (GVfsBackendSftp *backend,
+send_command_sync_and_unref_command (SftpConnection *connection,
                                      GDataOutputStream *command_stream,
                                      GCancellable *cancellable,
                                      GError **error)
@@ -584,7 +973,7 @@ send_command_sync_and_unref_command (GVfsBackendSftp *backend,
   
   data = get_data_from_command_stream (command_stream, &len);
 
-  res = g_output_stream_write_all (backend->command_stream,
+  res = g_output_stream_write_all (connection->command_stream,
                                    data, len,
                                    &bytes_written,
                                    cancellable, error);
@@ -636,15 +1025,73 @@ make_reply_stream (guint8 *data, gsize len)
   return data_stream;
 }
 
+/* Only used from the main thread */
+static GTrashStack *reply_buffer_pool = NULL;
+static guint reply_buffer_pool_len = 0;
+
+static guint8 *
+reply_buffer_new (gsize size)
+{
+  guint8 *data;
+
+  if (size > REPLY_BUFFER_POOL_SIZE)
+    return g_malloc (size);
+
+  data = g_trash_stack_pop (&reply_buffer_pool);
+  if (data != NULL)
+    reply_buffer_pool_len--;
+  else
+    data = g_malloc (REPLY_BUFFER_POOL_SIZE);
+
+  return data;
+}
+
+static void
+reply_buffer_release (gpointer data)
+{
+  if (reply_buffer_pool_len >= REPLY_BUFFER_POOL_MAX)
+    g_free (data);
+  else
+    {
+      g_trash_stack_push (&reply_buffer_pool, data);
+      reply_buffer_pool_len++;
+    }
+}
+
+static void
+reply_buffer_free (guint8 *data, gsize size)
+{
+  if (size > REPLY_BUFFER_POOL_SIZE)
+    g_free (data);
+  else
+    reply_buffer_release (data);
+}
+
+/* For buffers from reply_buffer_new() */
+static GDataInputStream *
+make_pooled_reply_stream (guint8 *data, gsize len)
+{
+  GInputStream *mem_stream;
+  GDataInputStream *data_stream;
+
+  mem_stream = g_memory_input_stream_new_from_data (data, len,
+                                                    len > REPLY_BUFFER_POOL_SIZE ?
+                                                    g_free : reply_buffer_release);
+  data_stream = g_data_input_stream_new (mem_stream);
+  g_object_unref (mem_stream);
+
+  return data_stream;
+}
+
 static GDataInputStream *
-read_reply_sync (GVfsBackendSftp *backend, gsize *len_out, GError **error)
+read_reply_sync (SftpConnection *connection, gsize *len_out, GError **error)
 {
   guint32 len;
   gsize bytes_read;
   GByteArray *array;
   guint8 *data;
   
-  if (!g_input_stream_read_all (backend->reply_stream,
+  if (!g_input_stream_read_all (connection->reply_stream,
 				&len, 4,
 				&bytes_read, NULL, error))
     return NULL;
@@ -663,7 +1110,7 @@ read_reply_sync (GVfsBackendSftp *backend, gsize *len_out, GError **error)
   
   array = g_byte_array_sized_new (len);
 
-  if (!g_input_stream_read_all (backend->reply_stream,
+  if (!g_input_stream_read_all (connection->reply_stream,
 				array->data, len,
 				&bytes_read, NULL, error))
     {
@@ -1151,8 +1598,10 @@ fail_jobs_and_die (GVfsBackendSftp *backend, GError *error)
   _exit (1);
 }
 
-static void
-check_input_stream_read_result (GVfsBackendSftp *backend, gssize res, GError *error)
+static void sftp_connection_died (SftpConnection *connection, GError *error);
+
+static gboolean
+check_input_stream_read_result (SftpConnection *connection, gssize res, GError *error)
 {
   if (G_UNLIKELY (res <= 0))
     {
@@ -1164,42 +1613,27 @@ check_input_stream_read_result (GVfsBackendSftp *backend, gssize res, GError *er
                        res == 0 ? "The underlying ssh process died" : "Unkown Error");
         }
 
-      fail_jobs_and_die (backend, error);
+      sftp_connection_died (connection, error);
+      return FALSE;
     }
+
+  return TRUE;
 }
 
-static void read_reply_async (GVfsBackendSftp *backend);
+static void read_reply_async (SftpConnection *connection);
 
 static void
-read_reply_async_got_data  (GObject *source_object,
-                            GAsyncResult *result,
-                            gpointer user_data)
+dispatch_reply (SftpConnection *connection)
 {
-  GVfsBackendSftp *backend = user_data;
-  gssize res;
+  GVfsBackendSftp *backend = connection->backend;
   GDataInputStream *reply;
   ExpectedReply *expected_reply;
   guint32 id;
   int type;
-  GError *error;
-
-  error = NULL;
-  res = g_input_stream_read_finish (G_INPUT_STREAM (source_object), result, &error);
-
-  check_input_stream_read_result (backend, res, error);
-
-  backend->reply_size_read += res;
-
-  if (backend->reply_size_read < backend->reply_size)
-    {
-      g_input_stream_read_async (backend->reply_stream,
-				 backend->reply + backend->reply_size_read, backend->reply_size - backend->reply_size_read,
-				 0, NULL, read_reply_async_got_data, backend);
-      return;
-    }
 
-  reply = make_reply_stream (backend->reply, backend->reply_size);
-  backend->reply = NULL;
+  reply = make_pooled_reply_stream (connection->reply, connection->reply_size);
+  connection->reply = NULL;
+  connection->n_outstanding--;
 
   type = g_data_input_stream_read_byte (reply, NULL, NULL);
   id = g_data_input_stream_read_uint32 (reply, NULL, NULL);
@@ -1208,83 +1642,238 @@ read_reply_async_got_data  (GObject *source_object,
   if (expected_reply)
     {
       if (expected_reply->callback != NULL)
-        (expected_reply->callback) (backend, type, reply, backend->reply_size,
+        (expected_reply->callback) (backend, type, reply, connection->reply_size,
                                     expected_reply->job, expected_reply->user_data);
       g_hash_table_remove (backend->expected_replies, GINT_TO_POINTER (id));
     }
   else
-    g_warning ("Got unhandled reply of size %"G_GUINT32_FORMAT" for id %"G_GUINT32_FORMAT"\n", backend->reply_size, id);
+    g_warning ("Got unhandled reply of size %"G_GUINT32_FORMAT" for id %"G_GUINT32_FORMAT"\n", connection->reply_size, id);
 
   g_object_unref (reply);
-
-  read_reply_async (backend);
-  
 }
 
 static void
-read_reply_async_got_len  (GObject *source_object,
-                           GAsyncResult *result,
-                           gpointer user_data)
+read_reply_async_got_data  (GObject *source_object,
+                            GAsyncResult *result,
+                            gpointer user_data)
 {
-  GVfsBackendSftp *backend = user_data;
+  SftpConnection *connection = user_data;
   gssize res;
   GError *error;
 
   error = NULL;
   res = g_input_stream_read_finish (G_INPUT_STREAM (source_object), result, &error);
 
-  /* Bail out if cancelled */
-  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+  if (!check_input_stream_read_result (connection, res, error))
+    return;
+
+  connection->reply_size_read += res;
+
+  if (connection->reply_size_read < connection->reply_size)
     {
-      g_object_unref (backend);
+      g_input_stream_read_async (connection->reply_stream,
+				 connection->reply + connection->reply_size_read, connection->reply_size - connection->reply_size_read,
+				 0, NULL, read_reply_async_got_data, connection);
       return;
     }
 
-  check_input_stream_read_result (backend, res, error);
+  dispatch_reply (connection);
 
-  backend->reply_size_read += res;
+  read_reply_async (connection);
+}
+
+static void
+read_reply_async_got_direct  (GObject *source_object,
+                              GAsyncResult *result,
+                              gpointer user_data)
+{
+  SftpConnection *connection = user_data;
+  GVfsBackendSftp *backend = connection->backend;
+  ExpectedReply *expected_reply;
+  gssize res;
+  GError *error;
+  guint32 id;
+
+  expected_reply = connection->direct_reply;
+
+  if (source_object != NULL)
+    {
+      error = NULL;
+      res = g_input_stream_read_finish (G_INPUT_STREAM (source_object), result, &error);
+
+      if (!check_input_stream_read_result (connection, res, error))
+        return;
+
+      connection->reply_size_read += res;
+
+      if (connection->reply_size_read < connection->reply_size)
+        {
+          g_input_stream_read_async (connection->reply_stream,
+                                     expected_reply->direct_buffer + connection->reply_size_read - REPLY_HEADER_SIZE,
+                                     connection->reply_size - connection->reply_size_read,
+                                     0, NULL, read_reply_async_got_direct, connection);
+          return;
+        }
+    }
+
+  memcpy (&id, connection->reply + 1, 4);
+  id = GUINT32_FROM_BE (id);
+  reply_buffer_free (connection->reply, connection->reply_size);
+  connection->reply = NULL;
+  connection->direct_reply = NULL;
+  connection->n_outstanding--;
+
+  (expected_reply->direct_callback) (backend,
+                                     connection->reply_size - REPLY_HEADER_SIZE,
+                                     expected_reply->job,
+                                     expected_reply->user_data);
+  g_hash_table_remove (backend->expected_replies, GINT_TO_POINTER (id));
+
+  read_reply_async (connection);
+}
+
+/* Looks at the start of the reply, and if it is the data for a
+   READ that has a destination buffer, reads the rest right into
+   that instead of the reply buffer */
+static void
+read_reply_async_got_header  (GObject *source_object,
+                              GAsyncResult *result,
+                              gpointer user_data)
+{
+  SftpConnection *connection = user_data;
+  ExpectedReply *expected_reply;
+  gssize res;
+  GError *error;
+  guint32 header_size, id, count;
+
+  error = NULL;
+  res = g_input_stream_read_finish (G_INPUT_STREAM (source_object), result, &error);
+
+  if (!check_input_stream_read_result (connection, res, error))
+    return;
+
+  connection->reply_size_read += res;
+
+  header_size = MIN (connection->reply_size, REPLY_HEADER_SIZE);
+  if (connection->reply_size_read < header_size)
+    {
+      g_input_stream_read_async (connection->reply_stream,
+				 connection->reply + connection->reply_size_read, header_size - connection->reply_size_read,
+				 0, NULL, read_reply_async_got_header, connection);
+      return;
+    }
+
+  if (header_size == REPLY_HEADER_SIZE &&
+      connection->reply[0] == SSH_FXP_DATA)
+    {
+      /* Not aligned */
+      memcpy (&id, connection->reply + 1, 4);
+      id = GUINT32_FROM_BE (id);
+      memcpy (&count, connection->reply + 5, 4);
+      count = GUINT32_FROM_BE (count);
+
+      expected_reply = g_hash_table_lookup (connection->backend->expected_replies, GINT_TO_POINTER (id));
+      if (expected_reply != NULL &&
+          expected_reply->direct_callback != NULL &&
+          count <= expected_reply->direct_size &&
+          connection->reply_size == REPLY_HEADER_SIZE + count)
+        {
+          connection->direct_reply = expected_reply;
+          if (count == 0)
+            read_reply_async_got_direct (NULL, NULL, connection);
+          else
+            g_input_stream_read_async (connection->reply_stream,
+                                       expected_reply->direct_buffer, count,
+                                       0, NULL, read_reply_async_got_direct, connection);
+          return;
+        }
+    }
+
+  if (connection->reply_size_read < connection->reply_size)
+    {
+      g_input_stream_read_async (connection->reply_stream,
+				 connection->reply + connection->reply_size_read, connection->reply_size - connection->reply_size_read,
+				 0, NULL, read_reply_async_got_data, connection);
+      return;
+    }
+
+  dispatch_reply (connection);
+
+  read_reply_async (connection);
+}
+
+static void
+read_reply_async_got_len  (GObject *source_object,
+                           GAsyncResult *result,
+                           gpointer user_data)
+{
+  SftpConnection *connection = user_data;
+  gssize res;
+  GError *error;
+
+  error = NULL;
+  res = g_input_stream_read_finish (G_INPUT_STREAM (source_object), result, &error);
+
+  /* Bail out if cancelled */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      g_error_free (error);
+      g_object_unref (connection->backend);
+      return;
+    }
 
-  if (backend->reply_size_read < 4)
+  if (!check_input_stream_read_result (connection, res, error))
+    return;
+
+  connection->reply_size_read += res;
+
+  if (connection->reply_size_read < 4)
     {
-      g_input_stream_read_async (backend->reply_stream,
-				 &backend->reply_size + backend->reply_size_read, 4 - backend->reply_size_read,
-				 0, backend->reply_stream_cancellable, read_reply_async_got_len,
-				 backend);
+      g_input_stream_read_async (connection->reply_stream,
+				 &connection->reply_size + connection->reply_size_read, 4 - connection->reply_size_read,
+				 0, connection->reply_stream_cancellable, read_reply_async_got_len,
+				 connection);
       return;
     }
-  backend->reply_size = GUINT32_FROM_BE (backend->reply_size);
+  connection->reply_size = GUINT32_FROM_BE (connection->reply_size);
 
-  backend->reply_size_read = 0;
-  backend->reply = g_malloc (backend->reply_size);
-  g_input_stream_read_async (backend->reply_stream,
-			     backend->reply, backend->reply_size,
-			     0, NULL, read_reply_async_got_data, backend);
+  connection->reply_size_read = 0;
+  connection->reply = reply_buffer_new (connection->reply_size);
+  g_input_stream_read_async (connection->reply_stream,
+			     connection->reply, MIN (connection->reply_size, REPLY_HEADER_SIZE),
+			     0, NULL, read_reply_async_got_header, connection);
 }
 
+/* The caller passes a reference to the backend, which is
+   dropped when reading is cancelled on unmount */
 static void
-read_reply_async (GVfsBackendSftp *backend)
+read_reply_async (SftpConnection *connection)
 {
-  backend->reply_size_read = 0;
-  g_input_stream_read_async (backend->reply_stream,
-                             &backend->reply_size, 4,
-                             0, backend->reply_stream_cancellable,
+  connection->reply_size_read = 0;
+  g_input_stream_read_async (connection->reply_stream,
+                             &connection->reply_size, 4,
+                             0, connection->reply_stream_cancellable,
                              read_reply_async_got_len,
-                             backend);
+                             connection);
 }
 
-static void send_command (GVfsBackendSftp *backend);
+static void send_command (SftpConnection *connection);
 
 static void
 send_command_data (GObject *source_object,
                    GAsyncResult *result,
                    gpointer user_data)
 {
-  GVfsBackendSftp *backend = user_data;
+  SftpConnection *connection = user_data;
   gssize res;
   DataBuffer *buffer;
 
   res = g_output_stream_write_finish (G_OUTPUT_STREAM (source_object), result, NULL);
 
+  /* The queue is freed with the connection */
+  if (connection->dead)
+    return;
+
   if (res <= 0)
     {
       /* TODO: unmount, etc */
@@ -1292,62 +1881,66 @@ send_command_data (GObject *source_object,
       return;
     }
 
-  buffer = backend->command_queue->data;
+  buffer = connection->command_queue->data;
   
-  backend->command_bytes_written += res;
+  connection->command_bytes_written += res;
 
-  if (backend->command_bytes_written < buffer->size)
+  if (connection->command_bytes_written < buffer->size)
     {
-      g_output_stream_write_async (backend->command_stream,
-                                   buffer->data + backend->command_bytes_written,
-                                   buffer->size - backend->command_bytes_written,
+      g_output_stream_write_async (connection->command_stream,
+                                   buffer->data + connection->command_bytes_written,
+                                   buffer->size - connection->command_bytes_written,
                                    0,
                                    NULL,
                                    send_command_data,
-                                   backend);
+                                   connection);
       return;
     }
 
   data_buffer_free (buffer);
 
-  backend->command_queue = g_list_delete_link (backend->command_queue, backend->command_queue);
+  connection->command_queue = g_list_delete_link (connection->command_queue, connection->command_queue);
 
-  if (backend->command_queue != NULL)
-    send_command (backend);
+  if (connection->command_queue != NULL)
+    send_command (connection);
 }
 
 static void
-send_command (GVfsBackendSftp *backend)
+send_command (SftpConnection *connection)
 {
   DataBuffer *buffer;
 
-  buffer = backend->command_queue->data;
+  buffer = connection->command_queue->data;
   
-  backend->command_bytes_written = 0;
-  g_output_stream_write_async (backend->command_stream,
+  connection->command_bytes_written = 0;
+  g_output_stream_write_async (connection->command_stream,
                                buffer->data,
                                buffer->size,
                                0,
                                NULL,
                                send_command_data,
-                               backend);
+                               connection);
 }
 
-static void
-expect_reply (GVfsBackendSftp *backend,
+static ExpectedReply *
+expect_reply (SftpConnection *connection,
               guint32 id,
               ReplyCallback callback,
               GVfsJob *job,
               gpointer user_data)
 {
+  GVfsBackendSftp *backend = connection->backend;
   ExpectedReply *expected;
 
-  expected = g_slice_new (ExpectedReply);
+  expected = g_slice_new0 (ExpectedReply);
+  expected->connection = connection;
   expected->callback = callback;
   expected->job = g_object_ref (job);
   expected->user_data = user_data;
 
   g_hash_table_replace (backend->expected_replies, GINT_TO_POINTER (id), expected);
+
+  return expected;
 }
 
 static DataBuffer *
@@ -1362,26 +1955,61 @@ data_buffer_new (guchar *data, gsize len)
   return buffer;
 }
 
+static gboolean fail_dead_connection_replies (gpointer user_data);
+
 static void
-queue_command_buffer (GVfsBackendSftp *backend,
+queue_command_buffer (SftpConnection *connection,
                       DataBuffer *buffer)
 {
   gboolean first;
+
+  if (connection->dead)
+    {
+      data_buffer_free (buffer);
+      if (connection->fail_replies_id == 0)
+        connection->fail_replies_id = g_idle_add (fail_dead_connection_replies, connection);
+      return;
+    }
   
-  first = backend->command_queue == NULL;
+  first = connection->command_queue == NULL;
 
-  backend->command_queue = g_list_append (backend->command_queue, buffer);
+  connection->command_queue = g_list_append (connection->command_queue, buffer);
+  connection->n_outstanding++;
   
   if (first)
-    send_command (backend);
+    send_command (connection);
+}
+
+/* Picks the connection a new handle or transfer should use: the
+   data connection with the fewest requests in flight */
+static SftpConnection *
+get_data_connection (GVfsBackendSftp *backend)
+{
+  SftpConnection *connection, *best;
+  int i, n;
+
+  n = backend->n_connections - 1;
+  if (n == 0)
+    return backend->connections[0];
+
+  best = NULL;
+  for (i = 0; i < n; i++)
+    {
+      connection = backend->connections[1 + (backend->next_bulk_connection + i) % n];
+      if (best == NULL || connection->n_outstanding < best->n_outstanding)
+        best = connection;
+    }
+  backend->next_bulk_connection = (backend->next_bulk_connection + 1) % n;
+
+  return best;
 }
 
 static void
-queue_command_stream_and_free (GVfsBackendSftp *backend,
-                               GDataOutputStream *command_stream,
-                               ReplyCallback callback,
-                               GVfsJob *job,
-                               gpointer user_data)
+queue_connection_command_stream_and_free (SftpConnection *connection,
+                                          GDataOutputStream *command_stream,
+                                          ReplyCallback callback,
+                                          GVfsJob *job,
+                                          gpointer user_data)
 {
   gpointer data;
   gsize len;
@@ -1394,8 +2022,240 @@ queue_command_stream_and_free (GVfsBackendSftp *backend,
   buffer = data_buffer_new (data, len);
   g_object_unref (command_stream);
 
-  expect_reply (backend, id, callback, job, user_data);
-  queue_command_buffer (backend, buffer);
+  expect_reply (connection, id, callback, job, user_data);
+  queue_command_buffer (connection, buffer);
+}
+
+static void
+queue_command_stream_and_free (GVfsBackendSftp *backend,
+                               GDataOutputStream *command_stream,
+                               ReplyCallback callback,
+                               GVfsJob *job,
+                               gpointer user_data)
+{
+  queue_connection_command_stream_and_free (backend->connections[0], command_stream,
+                                            callback, job, user_data);
+}
+
+
+/* Commands on the data path are built directly in a byte array
+   of the right size, instead of through a GDataOutputStream */
+static void
+command_put_byte (GByteArray *command, guint8 val)
+{
+  g_byte_array_append (command, &val, 1);
+}
+
+static void
+command_put_uint32 (GByteArray *command, guint32 val)
+{
+  val = GUINT32_TO_BE (val);
+  g_byte_array_append (command, (guint8 *)&val, 4);
+}
+
+static void
+command_put_uint64 (GByteArray *command, guint64 val)
+{
+  val = GUINT64_TO_BE (val);
+  g_byte_array_append (command, (guint8 *)&val, 8);
+}
+
+static void
+command_put_data (GByteArray *command, const guchar *data, gsize len)
+{
+  command_put_uint32 (command, len);
+  g_byte_array_append (command, data, len);
+}
+
+static GByteArray *
+new_command_buffer (GVfsBackendSftp *backend,
+                    int type,
+                    gsize size_hint,
+                    guint32 *id_out)
+{
+  GByteArray *command;
+
+  command = g_byte_array_sized_new (4 + 1 + 4 + size_hint);
+  command_put_uint32 (command, 0); /* LEN */
+  command_put_byte (command, type);
+  *id_out = get_new_id (backend);
+  command_put_uint32 (command, *id_out);
+
+  return command;
+}
+
+static ExpectedReply *
+queue_command_buffer_and_free (SftpConnection *connection,
+                               GByteArray *command,
+                               guint32 id,
+                               ReplyCallback callback,
+                               GVfsJob *job,
+                               gpointer user_data)
+{
+  ExpectedReply *expected;
+  DataBuffer *buffer;
+  guint32 *len_ptr;
+
+  len_ptr = (guint32 *)command->data;
+  *len_ptr = GUINT32_TO_BE (command->len - 4);
+
+  buffer = data_buffer_new (command->data, command->len);
+  g_byte_array_free (command, FALSE);
+
+  expected = expect_reply (connection, id, callback, job, user_data);
+  queue_command_buffer (connection, buffer);
+
+  return expected;
+}
+
+/* Answers every request that is still waiting for a reply from a dead
+   connection with a CONNECTION_LOST status, so the jobs fail the way
+   they handle any other error */
+static gboolean
+fail_dead_connection_replies (gpointer user_data)
+{
+  SftpConnection *connection = user_data;
+  GVfsBackendSftp *backend = connection->backend;
+  const char *message = _("The connection to the server was lost");
+  ExpectedReply *expected_reply;
+  GDataInputStream *reply;
+  GInputStream *mem_stream;
+  GHashTableIter iter;
+  GByteArray *status;
+  gpointer key, value;
+  GList *ids, *l;
+  gsize len;
+
+  connection->fail_replies_id = 0;
+
+  ids = NULL;
+  g_hash_table_iter_init (&iter, backend->expected_replies);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      if (((ExpectedReply *) value)->connection == connection)
+        ids = g_list_prepend (ids, key);
+    }
+
+  for (l = ids; l != NULL; l = l->next)
+    {
+      expected_reply = g_hash_table_lookup (backend->expected_replies, l->data);
+      if (expected_reply == NULL)
+        continue;
+
+      status = g_byte_array_new ();
+      command_put_uint32 (status, SSH_FX_CONNECTION_LOST);
+      command_put_data (status, (const guchar *) message, strlen (message));
+      command_put_data (status, (const guchar *) "", 0); /* language tag */
+      len = status->len;
+      mem_stream = g_memory_input_stream_new_from_data (g_byte_array_free (status, FALSE),
+                                                        len, g_free);
+      reply = g_data_input_stream_new (mem_stream);
+      g_object_unref (mem_stream);
+
+      if (expected_reply->callback != NULL)
+        (expected_reply->callback) (backend, SSH_FXP_STATUS, reply, len,
+                                    expected_reply->job, expected_reply->user_data);
+      g_hash_table_remove (backend->expected_replies, l->data);
+      g_object_unref (reply);
+    }
+  g_list_free (ids);
+
+  return FALSE;
+}
+
+/* The first connection carries everything that isn't bound to a
+   handle, losing it ends the mount. Losing another one only fails the
+   requests and handles that were using it. */
+static void
+sftp_connection_died (SftpConnection *connection, GError *error)
+{
+  GVfsBackendSftp *backend = connection->backend;
+  int i;
+
+  if (connection == backend->connections[0])
+    fail_jobs_and_die (backend, error);
+
+  g_debug ("sftp: dropping a data connection: %s\n", error->message);
+  g_error_free (error);
+
+  connection->dead = TRUE;
+  for (i = 1; i < backend->n_connections; i++)
+    {
+      if (backend->connections[i] == connection)
+        {
+          backend->n_connections--;
+          memmove (&backend->connections[i], &backend->connections[i + 1],
+                   (backend->n_connections - i) * sizeof (SftpConnection *));
+          break;
+        }
+    }
+  backend->dead_connections = g_list_prepend (backend->dead_connections, connection);
+
+  if (connection->reply)
+    {
+      reply_buffer_free (connection->reply, connection->reply_size);
+      connection->reply = NULL;
+    }
+  connection->direct_reply = NULL;
+
+  if (connection->fail_replies_id == 0)
+    connection->fail_replies_id = g_idle_add (fail_dead_connection_replies, connection);
+
+  /* Reading stops here, so drop the reference it held */
+  g_object_unref (backend);
+}
+
+/* Sends a READ. If the reply is data that fits in buffer, it is
+   read right into it and direct_callback is called, otherwise
+   callback gets the reply as usual. */
+static void
+queue_read_command (SftpConnection *connection,
+                    DataBuffer *raw_handle,
+                    goffset offset,
+                    guint32 len,
+                    guchar *buffer,
+                    ReplyCallback callback,
+                    DirectReplyCallback direct_callback,
+                    GVfsJob *job,
+                    gpointer user_data)
+{
+  GByteArray *command;
+  ExpectedReply *expected;
+  guint32 id;
+
+  command = new_command_buffer (connection->backend, SSH_FXP_READ,
+                                4 + raw_handle->size + 8 + 4, &id);
+  command_put_data (command, raw_handle->data, raw_handle->size);
+  command_put_uint64 (command, offset);
+  command_put_uint32 (command, len);
+
+  expected = queue_command_buffer_and_free (connection, command, id, callback, job, user_data);
+  expected->direct_callback = direct_callback;
+  expected->direct_buffer = buffer;
+  expected->direct_size = len;
+}
+
+/* Sends a WRITE, copying data only once */
+static void
+queue_write_command (SftpConnection *connection,
+                     DataBuffer *raw_handle,
+                     goffset offset,
+                     const guchar *data,
+                     gsize len,
+                     ReplyCallback callback,
+                     GVfsJob *job,
+                     gpointer user_data)
+{
+  GByteArray *command;
+  guint32 id;
+
+  command = new_command_buffer (connection->backend, SSH_FXP_WRITE,
+                                4 + raw_handle->size + 8 + 4 + len, &id);
+  command_put_data (command, raw_handle->data, raw_handle->size);
+  command_put_uint64 (command, offset);
+  command_put_data (command, data, len);
+
+  queue_command_buffer_and_free (connection, command, id, callback, job, user_data);
 }
 
 
@@ -1444,12 +2304,12 @@ multi_request_cb (GVfsBackendSftp *backend,
 }
 
 static void
-queue_command_streams_and_free (GVfsBackendSftp *backend,
-                                GDataOutputStream **commands,
-                                int n_commands,
-                                MultiReplyCallback callback,
-                                GVfsJob *job,
-                                gpointer user_data)
+queue_connection_command_streams_and_free (SftpConnection *connection,
+                                           GDataOutputStream **commands,
+                                           int n_commands,
+                                           MultiReplyCallback callback,
+                                           GVfsJob *job,
+                                           gpointer user_data)
 {
   MultiRequest *data;
   MultiReply *reply;
@@ -1468,14 +2328,26 @@ queue_command_streams_and_free (GVfsBackendSftp *backend,
     {
       reply = &data->replies[i];
       reply->request = data;
-      queue_command_stream_and_free (backend,
-                                     commands[i],
-                                     multi_request_cb,
-                                     job,
-                                     reply);
+      queue_connection_command_stream_and_free (connection,
+                                                commands[i],
+                                                multi_request_cb,
+                                                job,
+                                                reply);
     }
 }
 
+static void
+queue_command_streams_and_free (GVfsBackendSftp *backend,
+                                GDataOutputStream **commands,
+                                int n_commands,
+                                MultiReplyCallback callback,
+                                GVfsJob *job,
+                                gpointer user_data)
+{
+  queue_connection_command_streams_and_free (backend->connections[0], commands, n_commands,
+                                             callback, job, user_data);
+}
+
 static gboolean
 get_uid_sync (GVfsBackendSftp *backend)
 {
@@ -1485,9 +2357,9 @@ get_uid_sync (GVfsBackendSftp *backend)
   
   command = new_command_stream (backend, SSH_FXP_STAT);
   put_string (command, ".");
-  send_command_sync_and_unref_command (backend, command, NULL, NULL);
+  send_command_sync_and_unref_command (backend->connections[0], command, NULL, NULL);
 
-  reply = read_reply_sync (backend, NULL, NULL);
+  reply = read_reply_sync (backend->connections[0], NULL, NULL);
   if (reply == NULL)
     return FALSE;
   
@@ -1530,9 +2402,9 @@ get_home_sync (GVfsBackendSftp *backend)
 
   command = new_command_stream (backend, SSH_FXP_REALPATH);
   put_string (command, ".");
-  send_command_sync_and_unref_command (backend, command, NULL, NULL);
+  send_command_sync_and_unref_command (backend->connections[0], command, NULL, NULL);
 
-  reply = read_reply_sync (backend, NULL, NULL);
+  reply = read_reply_sync (backend->connections[0], NULL, NULL);
   if (reply == NULL)
     return FALSE;
 
@@ -1554,48 +2426,166 @@ get_home_sync (GVfsBackendSftp *backend)
   return TRUE;
 }
 
-static void
-do_mount (GVfsBackend *backend,
-          GVfsJobMount *job,
-          GMountSpec *mount_spec,
-          GMountSource *mount_source,
-          gboolean is_automount)
+/* Starts one more ssh process for file data. This happens after
+   the first one logged in, so keys or the agent have to be enough,
+   otherwise we stay with the connections we have. Runs in the
+   thread below, so it must not touch the connection pool. */
+static SftpConnection *
+open_data_connection (GVfsBackendSftp *backend)
 {
-  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  gchar **args; /* Enough for now, extend if you add more args */
-  pid_t pid;
-  int tty_fd, stdout_fd, stdin_fd, stderr_fd;
-  GError *error;
-  GInputStream *is;
+  SftpConnection *connection;
   GDataOutputStream *command;
   GDataInputStream *reply;
+  GInputStream *is;
+  gchar **args;
+  pid_t pid;
+  int tty_fd, stdout_fd, stdin_fd, stderr_fd;
   gboolean res;
-  GMountSpec *sftp_mount_spec;
-  char *extension_name, *extension_data;
-  char *display_name;
-
-  args = setup_ssh_commandline (backend);
-
-  error = NULL;
-  if (!spawn_ssh (backend,
-		  args, &pid,
-		  &tty_fd, &stdin_fd, &stdout_fd, &stderr_fd,
-		  &error))
-    {
-      g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
-      g_error_free (error);
-      g_strfreev (args);
-      return;
-    }
 
+  args = setup_ssh_commandline (G_VFS_BACKEND (backend), TRUE);
+  res = spawn_ssh (G_VFS_BACKEND (backend),
+                   args, &pid,
+                   &tty_fd, &stdin_fd, &stdout_fd, &stderr_fd,
+                   NULL);
   g_strfreev (args);
 
-  op_backend->command_stream = g_unix_output_stream_new (stdin_fd, TRUE);
+  if (!res)
+    return NULL;
+
+  connection = sftp_connection_new (backend);
+  connection->command_stream = g_unix_output_stream_new (stdin_fd, TRUE);
+  connection->reply_stream = g_unix_input_stream_new (stdout_fd, TRUE);
+  connection->reply_stream_cancellable = g_cancellable_new ();
+
+  make_fd_nonblocking (stderr_fd);
+  is = g_unix_input_stream_new (stderr_fd, TRUE);
+  connection->error_stream = g_data_input_stream_new (is);
+  g_object_unref (is);
+
+  command = new_command_stream (backend, SSH_FXP_INIT);
+  g_data_output_stream_put_int32 (command,
+                                  SSH_FILEXFER_VERSION, NULL, NULL);
+  send_command_sync_and_unref_command (connection, command, NULL, NULL);
+
+  reply = NULL;
+  if (wait_for_reply (G_VFS_BACKEND (backend), stdout_fd, NULL))
+    reply = read_reply_sync (connection, NULL, NULL);
+
+  if (reply == NULL ||
+      g_data_input_stream_read_byte (reply, NULL, NULL) != SSH_FXP_VERSION)
+    {
+      if (reply)
+        g_object_unref (reply);
+      /* Closing the pipes makes ssh exit */
+      sftp_connection_free (connection);
+      if (tty_fd != -1)
+        close (tty_fd);
+      return NULL;
+    }
+
+  g_object_unref (reply);
+
+  return connection;
+}
+
+/* Puts a logged in data connection into the pool, on the main thread */
+static gboolean
+add_data_connection (gpointer data)
+{
+  SftpConnection *connection = data;
+  GVfsBackendSftp *backend = connection->backend;
+
+  /* Unmounting cancels the reads of the first connection */
+  if (backend->n_connections == SFTP_MAX_CONNECTIONS ||
+      g_cancellable_is_cancelled (backend->connections[0]->reply_stream_cancellable))
+    {
+      sftp_connection_free (connection);
+      g_object_unref (backend);
+      return FALSE;
+    }
+
+  backend->connections[backend->n_connections++] = connection;
+
+  /* Takes over the reference */
+  read_reply_async (connection);
+
+  return FALSE;
+}
+
+/* Each login takes a few round trips, so the mount doesn't wait for
+   the data connections. Until they are there, everything goes over
+   the first one. */
+static gpointer
+open_data_connections_thread (gpointer data)
+{
+  GVfsBackendSftp *backend = data;
+  SftpConnection *connection;
+  int i;
+
+  for (i = 1; i < backend->max_connections; i++)
+    {
+      connection = open_data_connection (backend);
+      if (connection == NULL)
+        break;
+
+      g_object_ref (backend);
+      g_idle_add (add_data_connection, connection);
+    }
+
+  g_debug ("sftp: %d data connections\n", i - 1);
+
+  g_object_unref (backend);
+  return NULL;
+}
+
+static void
+do_mount (GVfsBackend *backend,
+          GVfsJobMount *job,
+          GMountSpec *mount_spec,
+          GMountSource *mount_source,
+          gboolean is_automount)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  gchar **args; /* Enough for now, extend if you add more args */
+  pid_t pid;
+  int tty_fd, stdout_fd, stdin_fd, stderr_fd;
+  GError *error;
+  GInputStream *is;
+  GDataOutputStream *command;
+  GDataInputStream *reply;
+  gboolean res;
+  GMountSpec *sftp_mount_spec;
+  SftpConnection *connection;
+  char *extension_name, *extension_data;
+  char *display_name;
+  int i;
+
+  args = setup_ssh_commandline (backend, FALSE);
+
+  error = NULL;
+  if (!spawn_ssh (backend,
+		  args, &pid,
+		  &tty_fd, &stdin_fd, &stdout_fd, &stderr_fd,
+		  &error))
+    {
+      g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
+      g_error_free (error);
+      g_strfreev (args);
+      return;
+    }
+
+  g_strfreev (args);
+
+  if (op_backend->n_connections == 0)
+    op_backend->connections[op_backend->n_connections++] = sftp_connection_new (op_backend);
+  connection = op_backend->connections[0];
+
+  connection->command_stream = g_unix_output_stream_new (stdin_fd, TRUE);
 
   command = new_command_stream (op_backend, SSH_FXP_INIT);
   g_data_output_stream_put_int32 (command,
                                   SSH_FILEXFER_VERSION, NULL, NULL);
-  send_command_sync_and_unref_command (op_backend, command, NULL, NULL);
+  send_command_sync_and_unref_command (connection, command, NULL, NULL);
 
   if (tty_fd == -1)
     res = wait_for_reply (backend, stdout_fd, &error);
@@ -1621,15 +2611,15 @@ do_mount (GVfsBackend *backend,
       return;
     }
 
-  op_backend->reply_stream = g_unix_input_stream_new (stdout_fd, TRUE);
-  op_backend->reply_stream_cancellable = g_cancellable_new ();
+  connection->reply_stream = g_unix_input_stream_new (stdout_fd, TRUE);
+  connection->reply_stream_cancellable = g_cancellable_new ();
 
   make_fd_nonblocking (stderr_fd);
   is = g_unix_input_stream_new (stderr_fd, TRUE);
-  op_backend->error_stream = g_data_input_stream_new (is);
+  connection->error_stream = g_data_input_stream_new (is);
   g_object_unref (is);
   
-  reply = read_reply_sync (op_backend, NULL, NULL);
+  reply = read_reply_sync (connection, NULL, NULL);
   if (reply == NULL)
     {
       look_for_stderr_errors (backend, &error);
@@ -1669,7 +2659,20 @@ do_mount (GVfsBackend *backend,
       return;
     }
 
-  read_reply_async (g_object_ref (op_backend));
+  for (i = 0; i < op_backend->n_connections; i++)
+    {
+      g_object_ref (op_backend);
+      read_reply_async (op_backend->connections[i]);
+    }
+
+  /* We are logged in, now try to get the connections for file data */
+  if (op_backend->client_vendor == SFTP_VENDOR_OPENSSH &&
+      op_backend->max_connections > 1)
+    {
+      g_object_ref (op_backend);
+      if (g_thread_create (open_data_connections_thread, op_backend, FALSE, NULL) == NULL)
+        g_object_unref (op_backend);
+    }
 
   sftp_mount_spec = g_mount_spec_new ("sftp");
   if (op_backend->user_specified_in_uri)
@@ -1776,9 +2779,20 @@ try_unmount (GVfsBackend *backend,
              GMountSource *mount_source)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  SftpConnection *connection;
+  int i;
 
-  if (op_backend->reply_stream && op_backend->reply_stream_cancellable)
-    g_cancellable_cancel (op_backend->reply_stream_cancellable);
+  g_debug ("sftp attribute cache: %u hits, %u misses, %u invalidations\n",
+           op_backend->stat_cache_hits,
+           op_backend->stat_cache_misses,
+           op_backend->stat_cache_invalidations);
+
+  for (i = 0; i < op_backend->n_connections; i++)
+    {
+      connection = op_backend->connections[i];
+      if (connection->reply_stream && connection->reply_stream_cancellable)
+        g_cancellable_cancel (connection->reply_stream_cancellable);
+    }
   g_vfs_job_succeeded (G_VFS_JOB (job));
 
   return TRUE;
@@ -2283,20 +3297,51 @@ parse_attributes (GVfsBackendSftp *backend,
 }
 
 static SftpHandle *
-sftp_handle_new (GDataInputStream *reply)
+sftp_handle_new (SftpConnection *connection,
+                 GDataInputStream *reply)
 {
   SftpHandle *handle;
 
   handle = g_slice_new0 (SftpHandle);
+  handle->connection = connection;
   handle->raw_handle = read_data_buffer (reply);
   handle->offset = 0;
 
   return handle;
 }
 
+static void
+read_ahead_block_free (ReadAheadBlock *block)
+{
+  g_free (block->data);
+  g_slice_free (ReadAheadBlock, block);
+}
+
+/* Blocks still waiting for a reply are freed when it arrives */
+static void
+read_ahead_discard (SftpHandle *handle)
+{
+  ReadAheadBlock *block;
+
+  if (handle->read_ahead == NULL)
+    return;
+
+  while ((block = g_queue_pop_head (handle->read_ahead)) != NULL)
+    {
+      g_assert (block->waiting_job == NULL);
+      if (block->done)
+        read_ahead_block_free (block);
+      else
+        block->handle = NULL;
+    }
+}
+
 static void
 sftp_handle_free (SftpHandle *handle)
 {
+  read_ahead_discard (handle);
+  if (handle->read_ahead)
+    g_queue_free (handle->read_ahead);
   data_buffer_free (handle->raw_handle);
   g_free (handle->filename);
   g_free (handle->tempname);
@@ -2369,7 +3414,7 @@ open_for_read_reply (GVfsBackendSftp *backend,
           
           command = new_command_stream (backend, SSH_FXP_CLOSE);
           put_data_buffer (command, bhandle);
-          queue_command_stream_and_free (backend, command, NULL, G_VFS_JOB (job), NULL);
+          queue_connection_command_stream_and_free (user_data, command, NULL, G_VFS_JOB (job), NULL);
 
           data_buffer_free (bhandle);
         }
@@ -2399,7 +3444,7 @@ open_for_read_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (user_data, reply);
   
   g_vfs_job_open_for_read_set_handle (G_VFS_JOB_OPEN_FOR_READ (job), handle);
   g_vfs_job_open_for_read_set_can_seek (G_VFS_JOB_OPEN_FOR_READ (job), TRUE);
@@ -2412,14 +3457,19 @@ try_open_for_read (GVfsBackend *backend,
                    const char *filename)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  SftpConnection *connection;
   GDataOutputStream *command;
 
   G_VFS_JOB(job)->backend_data = GINT_TO_POINTER (0);
+
+  /* The stat reply has to arrive before the open reply, so both
+     go over the connection that will carry the data */
+  connection = get_data_connection (op_backend);
   
   command = new_command_stream (op_backend,
                                 SSH_FXP_STAT);
   put_string (command, filename);
-  queue_command_stream_and_free (op_backend, command, open_stat_reply, G_VFS_JOB (job), NULL);
+  queue_connection_command_stream_and_free (connection, command, open_stat_reply, G_VFS_JOB (job), NULL);
 
   command = new_command_stream (op_backend,
                                 SSH_FXP_OPEN);
@@ -2427,7 +3477,7 @@ try_open_for_read (GVfsBackend *backend,
   g_data_output_stream_put_uint32 (command, SSH_FXF_READ, NULL, NULL); /* open flags */
   g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
   
-  queue_command_stream_and_free (op_backend, command, open_for_read_reply, G_VFS_JOB (job), NULL);
+  queue_connection_command_stream_and_free (connection, command, open_for_read_reply, G_VFS_JOB (job), connection);
 
   return TRUE;
 }
@@ -2495,6 +3545,195 @@ read_reply (GVfsBackendSftp *backend,
   g_vfs_job_succeeded (job);
 }
 
+static void
+read_direct_reply (GVfsBackendSftp *backend,
+                   guint32 count,
+                   GVfsJob *job,
+                   gpointer user_data)
+{
+  SftpHandle *handle = user_data;
+
+  handle->offset += count;
+
+  g_vfs_job_read_set_size (G_VFS_JOB_READ (job), count);
+  g_vfs_job_succeeded (job);
+}
+
+static void read_ahead_fill (GVfsBackendSftp *backend,
+                             SftpHandle *handle,
+                             GVfsJob *job);
+
+/* Answers job from the first read-ahead block, which must
+   have arrived and start at the handle offset */
+static void
+read_ahead_serve (GVfsBackendSftp *backend,
+                  SftpHandle *handle,
+                  GVfsJob *job)
+{
+  ReadAheadBlock *block;
+  GVfsJobRead *op_job;
+  guint32 count;
+
+  op_job = G_VFS_JOB_READ (job);
+  block = g_queue_peek_head (handle->read_ahead);
+
+  if (block->status != SSH_FX_OK || block->size == 0)
+    {
+      if (block->status == SSH_FX_EOF || block->status == SSH_FX_OK)
+        {
+          g_vfs_job_read_set_size (op_job, 0);
+          g_vfs_job_succeeded (job);
+        }
+      else if (block->status == SSH_FX_BAD_MESSAGE)
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                          _("Invalid reply received"));
+      else
+        failure_from_status_code (job, block->status, -1, -1);
+
+      /* Anything after this is not going to be any better, and
+         don't read ahead again unless the reading continues */
+      read_ahead_discard (handle);
+      handle->sequential_reads = 0;
+      return;
+    }
+
+  count = MIN (op_job->bytes_requested, block->size - block->consumed);
+  memcpy (op_job->buffer, block->data + block->consumed, count);
+  block->consumed += count;
+  handle->offset += count;
+
+  if (block->consumed == block->size)
+    {
+      g_queue_pop_head (handle->read_ahead);
+      read_ahead_block_free (block);
+
+      /* A short read means the next block doesn't start at
+         the handle offset anymore */
+      block = g_queue_peek_head (handle->read_ahead);
+      if (block != NULL && block->offset != handle->offset)
+        read_ahead_discard (handle);
+    }
+
+  read_ahead_fill (backend, handle, job);
+
+  g_vfs_job_read_set_size (op_job, count);
+  g_vfs_job_succeeded (job);
+}
+
+static void
+read_ahead_block_arrived (GVfsBackendSftp *backend,
+                          ReadAheadBlock *block)
+{
+  GVfsJob *waiting_job;
+
+  block->done = TRUE;
+  if (block->status != SSH_FX_OK)
+    block->size = 0;
+
+  /* Reading further ahead would only get more EOFs */
+  if (block->status != SSH_FX_OK || block->size < block->len)
+    block->handle->read_ahead_eof = TRUE;
+
+  if (block->waiting_job)
+    {
+      waiting_job = block->waiting_job;
+      block->waiting_job = NULL;
+      read_ahead_serve (backend, block->handle, waiting_job);
+      g_object_unref (waiting_job);
+    }
+}
+
+static void
+read_ahead_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  ReadAheadBlock *block = user_data;
+
+  if (block->handle == NULL)
+    {
+      read_ahead_block_free (block);
+      return;
+    }
+
+  block->status = SSH_FX_BAD_MESSAGE;
+
+  if (reply_type == SSH_FXP_STATUS)
+    block->status = read_status_code (reply);
+  else if (reply_type == SSH_FXP_DATA)
+    {
+      block->size = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      if (block->size <= block->len &&
+          g_input_stream_read_all (G_INPUT_STREAM (reply),
+                                   block->data, block->size,
+                                   NULL, NULL, NULL))
+        block->status = SSH_FX_OK;
+    }
+
+  read_ahead_block_arrived (backend, block);
+}
+
+static void
+read_ahead_direct_reply (GVfsBackendSftp *backend,
+                         guint32 count,
+                         GVfsJob *job,
+                         gpointer user_data)
+{
+  ReadAheadBlock *block = user_data;
+
+  if (block->handle == NULL)
+    {
+      read_ahead_block_free (block);
+      return;
+    }
+
+  block->status = SSH_FX_OK;
+  block->size = count;
+
+  read_ahead_block_arrived (backend, block);
+}
+
+/* job is only used to keep track of the requests */
+static void
+read_ahead_fill (GVfsBackendSftp *backend,
+                 SftpHandle *handle,
+                 GVfsJob *job)
+{
+  ReadAheadBlock *block, *last;
+  goffset offset;
+
+  if (handle->read_ahead == NULL)
+    handle->read_ahead = g_queue_new ();
+
+  /* Hit the end of the file, later reads are sent as they come */
+  if (handle->read_ahead_eof)
+    return;
+
+  last = g_queue_peek_tail (handle->read_ahead);
+
+  offset = last ? last->offset + last->len : handle->offset;
+
+  while (g_queue_get_length (handle->read_ahead) < READ_AHEAD_BLOCKS)
+    {
+      block = g_slice_new0 (ReadAheadBlock);
+      block->handle = handle;
+      block->offset = offset;
+      block->len = READ_AHEAD_BLOCK_SIZE;
+      block->data = g_malloc (block->len);
+      g_queue_push_tail (handle->read_ahead, block);
+
+      queue_read_command (handle->connection, handle->raw_handle,
+                          block->offset, block->len, block->data,
+                          read_ahead_reply, read_ahead_direct_reply,
+                          job, block);
+
+      offset += block->len;
+    }
+}
+
 static gboolean
 try_read (GVfsBackend *backend,
           GVfsJobRead *job,
@@ -2504,15 +3743,38 @@ try_read (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  ReadAheadBlock *block;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_READ);
-  put_data_buffer (command, handle->raw_handle);
-  g_data_output_stream_put_uint64 (command, handle->offset, NULL, NULL);
-  g_data_output_stream_put_uint32 (command, bytes_requested, NULL, NULL);
-  
-  queue_command_stream_and_free (op_backend, command, read_reply, G_VFS_JOB (job), handle);
+  handle->sequential_reads++;
+
+  block = handle->read_ahead ? g_queue_peek_head (handle->read_ahead) : NULL;
+  if (block != NULL &&
+      block->offset + block->consumed != handle->offset)
+    {
+      read_ahead_discard (handle);
+      block = NULL;
+    }
+
+  if (block == NULL &&
+      handle->sequential_reads >= READ_AHEAD_MIN_SEQUENTIAL)
+    {
+      read_ahead_fill (op_backend, handle, G_VFS_JOB (job));
+      block = g_queue_peek_head (handle->read_ahead);
+    }
+
+  if (block != NULL)
+    {
+      if (block->done)
+        read_ahead_serve (op_backend, handle, G_VFS_JOB (job));
+      else
+        block->waiting_job = g_object_ref (job);
+      return TRUE;
+    }
+
+  queue_read_command (handle->connection, handle->raw_handle,
+                      handle->offset, bytes_requested, (guchar *)buffer,
+                      read_reply, read_direct_reply,
+                      G_VFS_JOB (job), handle);
 
   return TRUE;
 }
@@ -2586,15 +3848,37 @@ try_seek_on_read (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  /* Data read ahead is for the old position */
+  read_ahead_discard (handle);
+  handle->sequential_reads = 0;
+  handle->read_ahead_eof = FALSE;
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_FSTAT);
   put_data_buffer (command, handle->raw_handle);
   
-  queue_command_stream_and_free (op_backend, command, seek_read_fstat_reply, G_VFS_JOB (job), handle);
+  queue_connection_command_stream_and_free (handle->connection, command, seek_read_fstat_reply, G_VFS_JOB (job), handle);
 
   return TRUE;
 }
 
+/* Called when closing starts and again when it is done, so that
+   attributes cached while the file was being replaced are dropped */
+static void
+close_write_forget_cache (GVfsBackendSftp *backend,
+                          SftpHandle *handle)
+{
+  char *backup_name;
+
+  stat_cache_invalidate (backend, handle->filename, FALSE);
+  if (handle->make_backup)
+    {
+      backup_name = g_strconcat (handle->filename, "~", NULL);
+      stat_cache_forget (backend, backup_name);
+      g_free (backup_name);
+    }
+}
+
 static void
 delete_temp_file (GVfsBackendSftp *backend,
                   SftpHandle *handle,
@@ -2630,6 +3914,7 @@ close_moved_tempfile (GVfsBackendSftp *backend,
                       _("Invalid reply received"));
 
   /* On failure, don't remove tempfile, since we removed the new original file */
+  close_write_forget_cache (backend, handle);
   sftp_handle_free (handle);
 }
   
@@ -2698,6 +3983,7 @@ close_deleted_file (GVfsBackendSftp *backend,
       
       g_vfs_job_failed_from_error (job, error);
       g_error_free (error);
+      close_write_forget_cache (backend, handle);
       sftp_handle_free (handle);
     }
 }
@@ -2745,6 +4031,7 @@ close_moved_file (GVfsBackendSftp *backend,
       g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_CANT_CREATE_BACKUP,
                         _("Error creating backup file: %s"), error->message);
       g_error_free (error);
+      close_write_forget_cache (backend, handle);
       sftp_handle_free (handle);
     }
 }
@@ -2823,6 +4110,7 @@ close_write_reply (GVfsBackendSftp *backend,
         }
       else
         {
+          close_write_forget_cache (backend, handle);
           g_vfs_job_succeeded (job);
           sftp_handle_free (handle);
         }
@@ -2837,6 +4125,7 @@ close_write_reply (GVfsBackendSftp *backend,
       g_vfs_job_failed_from_error (job, error);
       g_error_free (error);
       
+      close_write_forget_cache (backend, handle);
       sftp_handle_free (handle);
     }
 }
@@ -2868,7 +4157,7 @@ close_write_fstat_reply (GVfsBackendSftp *backend,
   command = new_command_stream (backend, SSH_FXP_CLOSE);
   put_data_buffer (command, handle->raw_handle);
 
-  queue_command_stream_and_free (backend, command, close_write_reply, G_VFS_JOB (job), handle);
+  queue_connection_command_stream_and_free (handle->connection, command, close_write_reply, G_VFS_JOB (job), handle);
 }
 
 static gboolean
@@ -2880,10 +4169,12 @@ try_close_write (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  close_write_forget_cache (op_backend, handle);
+
   command = new_command_stream (op_backend, SSH_FXP_FSTAT);
   put_data_buffer (command, handle->raw_handle);
 
-  queue_command_stream_and_free (op_backend, command, close_write_fstat_reply, G_VFS_JOB (job), handle);
+  queue_connection_command_stream_and_free (handle->connection, command, close_write_fstat_reply, G_VFS_JOB (job), handle);
 
   return TRUE;
 }
@@ -2921,14 +4212,40 @@ try_close_read (GVfsBackend *backend,
   command = new_command_stream (op_backend, SSH_FXP_CLOSE);
   put_data_buffer (command, handle->raw_handle);
 
-  queue_command_stream_and_free (op_backend, command, close_read_reply, G_VFS_JOB (job), handle);
+  queue_connection_command_stream_and_free (handle->connection, command, close_read_reply, G_VFS_JOB (job), handle);
 
   return TRUE;
 }
 
-static void not_dir_or_not_exist_error (GVfsBackendSftp *backend,
-					GVfsJob *job,
-					char *filename);
+/* Gets the error instead of the job, which the callback has to fail */
+typedef void (*NotDirOrNotExistCallback) (GVfsJob *job,
+                                          GError *error);
+
+typedef struct {
+  char *path;
+  NotDirOrNotExistCallback callback;
+} NotDirOrNotExistData;
+
+static void not_dir_or_not_exist_error_full (GVfsBackendSftp *backend,
+					     GVfsJob *job,
+					     char *filename,
+					     NotDirOrNotExistCallback callback);
+
+static void
+not_dir_or_not_exist_report (GVfsJob *job,
+			     NotDirOrNotExistCallback callback,
+			     gint code,
+			     const char *message)
+{
+  GError *error;
+
+  error = g_error_new_literal (G_IO_ERROR, code, message);
+  if (callback)
+    callback (job, error);
+  else
+    g_vfs_job_failed_from_error (job, error);
+  g_error_free (error);
+}
 
 static void
 not_dir_or_not_exist_error_cb (GVfsBackendSftp *backend,
@@ -2938,38 +4255,41 @@ not_dir_or_not_exist_error_cb (GVfsBackendSftp *backend,
 			       GFileInfo *info,
 			       gpointer user_data)
 {
-  char *path;
+  NotDirOrNotExistData *data;
 
-  path = user_data;
+  data = user_data;
   if (info != NULL)
     {
       if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
 	/* Parent is a directory, so must not have found child */
-	g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
-			  _("No such file or directory"));
+	not_dir_or_not_exist_report (job, data->callback, G_IO_ERROR_NOT_FOUND,
+				     _("No such file or directory"));
       else /* Some path element was not a directory */
-	g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
-			  _("Not a directory"));
+	not_dir_or_not_exist_report (job, data->callback, G_IO_ERROR_NOT_DIRECTORY,
+				     _("Not a directory"));
     }
   else if (stat_error == SSH_FX_NO_SUCH_FILE)
     {
-      not_dir_or_not_exist_error (backend, job, path);
+      not_dir_or_not_exist_error_full (backend, job, data->path, data->callback);
     }
   else
     {
       /* Some other weird error, lets say "not found" */
-      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
-			_("No such file or directory"));
+      not_dir_or_not_exist_report (job, data->callback, G_IO_ERROR_NOT_FOUND,
+				   _("No such file or directory"));
     }
   
-  g_free (path);
+  g_free (data->path);
+  g_slice_free (NotDirOrNotExistData, data);
 }
 
 static void
-not_dir_or_not_exist_error (GVfsBackendSftp *backend,
-			    GVfsJob *job,
-			    char *filename)
+not_dir_or_not_exist_error_full (GVfsBackendSftp *backend,
+				 GVfsJob *job,
+				 char *filename,
+				 NotDirOrNotExistCallback callback)
 {
+  NotDirOrNotExistData *data;
   char *parent;
 
   parent = g_path_get_dirname (filename);
@@ -2978,17 +4298,29 @@ not_dir_or_not_exist_error (GVfsBackendSftp *backend,
       g_free (parent);
       /* Root not found? Weird, but at least not
 	 NOT_DIRECTORY, so lets report not found */
-      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
-			_("No such file or directory"));
+      not_dir_or_not_exist_report (job, callback, G_IO_ERROR_NOT_FOUND,
+				   _("No such file or directory"));
       return;
     }
-    
+
+  data = g_slice_new (NotDirOrNotExistData);
+  data->path = parent;
+  data->callback = callback;
+
   error_from_lstat (backend,
 		    job,
 		    SSH_FX_NO_SUCH_FILE,
 		    filename,
 		    not_dir_or_not_exist_error_cb,
-		    parent);
+		    data);
+}
+
+static void
+not_dir_or_not_exist_error (GVfsBackendSftp *backend,
+			    GVfsJob *job,
+			    char *filename)
+{
+  not_dir_or_not_exist_error_full (backend, job, filename, NULL);
 }
 
 static void
@@ -3026,7 +4358,8 @@ create_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (user_data, reply);
+  handle->filename = g_strdup (G_VFS_JOB_OPEN_FOR_WRITE (job)->filename);
   
   g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), handle);
   g_vfs_job_open_for_write_set_can_seek (G_VFS_JOB_OPEN_FOR_WRITE (job), TRUE);
@@ -3040,15 +4373,20 @@ try_create (GVfsBackend *backend,
             GFileCreateFlags flags)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  SftpConnection *connection;
   GDataOutputStream *command;
 
+  stat_cache_invalidate (op_backend, filename, FALSE);
+
+  connection = get_data_connection (op_backend);
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_OPEN);
   put_string (command, filename);
   g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL,  NULL, NULL); /* open flags */
   g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
   
-  queue_command_stream_and_free (op_backend, command, create_reply, G_VFS_JOB (job), NULL);
+  queue_connection_command_stream_and_free (connection, command, create_reply, G_VFS_JOB (job), connection);
 
   return TRUE;
 }
@@ -3107,7 +4445,8 @@ append_to_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (user_data, reply);
+  handle->filename = g_strdup (G_VFS_JOB_OPEN_FOR_WRITE (job)->filename);
   
   g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), handle);
   g_vfs_job_open_for_write_set_can_seek (G_VFS_JOB_OPEN_FOR_WRITE (job), FALSE);
@@ -3121,20 +4460,26 @@ try_append_to (GVfsBackend *backend,
                GFileCreateFlags flags)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  SftpConnection *connection;
   GDataOutputStream *command;
 
-  command = new_command_stream (op_backend,
+  stat_cache_invalidate (op_backend, filename, FALSE);
+
+  connection = get_data_connection (op_backend);
+
+  command = new_command_stream (op_backend,
                                 SSH_FXP_OPEN);
   put_string (command, filename);
   g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_APPEND,  NULL, NULL); /* open flags */
   g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
   
-  queue_command_stream_and_free (op_backend, command, append_to_reply, G_VFS_JOB (job), NULL);
+  queue_connection_command_stream_and_free (connection, command, append_to_reply, G_VFS_JOB (job), connection);
 
   return TRUE;
 }
 
 typedef struct {
+  SftpConnection *connection;
   guint32 permissions;
   guint32 uid;
   guint32 gid;
@@ -3191,7 +4536,7 @@ replace_truncate_original_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (data->connection, reply);
   handle->filename = g_strdup (op_job->filename);
   handle->tempname = NULL;
   handle->permissions = data->permissions;
@@ -3220,7 +4565,7 @@ replace_truncate_original (GVfsBackendSftp *backend,
   g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_TRUNC,  NULL, NULL); /* open flags */
   g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
   
-  queue_command_stream_and_free (backend, command, replace_truncate_original_reply, job, NULL);
+  queue_connection_command_stream_and_free (data->connection, command, replace_truncate_original_reply, job, NULL);
 }
 
 static void
@@ -3291,7 +4636,7 @@ replace_create_temp_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (data->connection, reply);
   handle->filename = g_strdup (op_job->filename);
   handle->tempname = g_strdup (data->tempname);
   handle->permissions = data->permissions;
@@ -3373,7 +4718,7 @@ replace_create_temp (GVfsBackendSftp *backend,
   }
   
   g_data_output_stream_put_uint32 (command, data->permissions, NULL, NULL);
-  queue_command_stream_and_free (op_backend, command, replace_create_temp_reply, G_VFS_JOB (job), NULL);
+  queue_connection_command_stream_and_free (data->connection, command, replace_create_temp_reply, G_VFS_JOB (job), NULL);
 }
 
 static void
@@ -3438,6 +4783,7 @@ replace_stat_reply (GVfsBackendSftp *backend,
     }
 
   data = g_slice_new0 (ReplaceData);
+  data->connection = user_data;
   data->permissions = permissions;
   data->set_ownership = set_ownership;
   
@@ -3491,7 +4837,7 @@ replace_exclusive_reply (GVfsBackendSftp *backend,
           command = new_command_stream (backend,
                                         SSH_FXP_LSTAT);
           put_string (command, op_job->filename);
-          queue_command_stream_and_free (backend, command, replace_stat_reply, G_VFS_JOB (job), NULL);
+          queue_command_stream_and_free (backend, command, replace_stat_reply, G_VFS_JOB (job), user_data);
         }
       else
         {
@@ -3508,7 +4854,8 @@ replace_exclusive_reply (GVfsBackendSftp *backend,
       return;
     }
   
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (user_data, reply);
+  handle->filename = g_strdup (op_job->filename);
   
   g_vfs_job_open_for_write_set_handle (op_job, handle);
   g_vfs_job_open_for_write_set_can_seek (op_job, TRUE);
@@ -3525,15 +4872,20 @@ try_replace (GVfsBackend *backend,
              GFileCreateFlags flags)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  SftpConnection *connection;
   GDataOutputStream *command;
 
+  stat_cache_invalidate (op_backend, filename, FALSE);
+
+  connection = get_data_connection (op_backend);
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_OPEN);
   put_string (command, filename);
   g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL,  NULL, NULL); /* open flags */
   g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
   
-  queue_command_stream_and_free (op_backend, command, replace_exclusive_reply, G_VFS_JOB (job), NULL);
+  queue_connection_command_stream_and_free (connection, command, replace_exclusive_reply, G_VFS_JOB (job), connection);
 
   return TRUE;
 }
@@ -3571,20 +4923,14 @@ try_write (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_WRITE);
-  put_data_buffer (command, handle->raw_handle);
-  g_data_output_stream_put_uint64 (command, handle->offset, NULL, NULL);
-  g_data_output_stream_put_uint32 (command, buffer_size, NULL, NULL);
+  stat_cache_forget (op_backend, handle->filename);
+
   /* Ideally we shouldn't do this copy, but doing the writes as multiple writes
      caused problems on the read side in openssh */
-  g_output_stream_write_all (G_OUTPUT_STREAM (command),
-                             buffer, buffer_size,
-                             NULL, NULL, NULL);
-  
-  queue_command_stream_and_free (op_backend, command, write_reply, G_VFS_JOB (job), handle);
+  queue_write_command (handle->connection, handle->raw_handle,
+                       handle->offset, (guchar *)buffer, buffer_size,
+                       write_reply, G_VFS_JOB (job), handle);
 
   /* We always write the full size (on success) */
   g_vfs_job_write_set_written_size (job, buffer_size);
@@ -3665,7 +5011,7 @@ try_seek_on_write (GVfsBackend *backend,
                                 SSH_FXP_FSTAT);
   put_data_buffer (command, handle->raw_handle);
   
-  queue_command_stream_and_free (op_backend, command, seek_write_fstat_reply, G_VFS_JOB (job), handle);
+  queue_connection_command_stream_and_free (handle->connection, command, seek_write_fstat_reply, G_VFS_JOB (job), handle);
 
   return TRUE;
 }
@@ -3673,6 +5019,8 @@ try_seek_on_write (GVfsBackend *backend,
 typedef struct {
   DataBuffer *handle;
   int outstanding_requests;
+  guint32 cache_generation;
+  GPtrArray *names; /* Collected for the directory cache, or NULL */
 } ReadDirData;
 
 static
@@ -3680,9 +5028,36 @@ void
 read_dir_data_free (ReadDirData *data)
 {
   data_buffer_free (data->handle);
+  if (data->names)
+    {
+      g_ptr_array_foreach (data->names, (GFunc)g_free, NULL);
+      g_ptr_array_free (data->names, TRUE);
+    }
   g_slice_free (ReadDirData, data);
 }
 
+/* The cache entry to complete with replies about a directory child,
+   or NULL if this enumeration doesn't fill the cache */
+static StatCacheEntry *
+read_dir_cache_entry (GVfsBackendSftp *backend,
+                      GVfsJob *job,
+                      const char *name)
+{
+  StatCacheEntry *entry;
+  ReadDirData *data;
+  char *abs_name;
+
+  data = job->backend_data;
+  if (!stat_cache_can_fill (backend, data->cache_generation))
+    return NULL;
+
+  abs_name = g_build_filename (G_VFS_JOB_ENUMERATE (job)->filename, name, NULL);
+  entry = g_hash_table_lookup (backend->stat_cache, abs_name);
+  g_free (abs_name);
+
+  return entry;
+}
+
 static void
 read_dir_readlink_reply (GVfsBackendSftp *backend,
                          int reply_type,
@@ -3693,6 +5068,7 @@ read_dir_readlink_reply (GVfsBackendSftp *backend,
 {
   ReadDirData *data;
   GFileInfo *info = user_data;
+  StatCacheEntry *entry;
   char *target;
 
   data = job->backend_data;
@@ -3709,6 +5085,14 @@ read_dir_readlink_reply (GVfsBackendSftp *backend,
         }
     }
 
+  entry = read_dir_cache_entry (backend, job, g_file_info_get_name (info));
+  if (entry)
+    {
+      g_free (entry->symlink_target);
+      entry->symlink_target = g_strdup (g_file_info_get_symlink_target (info));
+      entry->has_symlink_target = TRUE;
+    }
+
   g_vfs_job_enumerate_add_info (G_VFS_JOB_ENUMERATE (job), info);
   g_object_unref (info);
   
@@ -3758,10 +5142,12 @@ read_dir_symlink_reply (GVfsBackendSftp *backend,
   GFileInfo *info;
   GFileInfo *lstat_info;
   ReadDirData *data;
+  StatCacheEntry *entry;
 
   lstat_info = user_data;
   name = g_file_info_get_name (lstat_info);
   data = job->backend_data;
+  entry = read_dir_cache_entry (backend, job, name);
   
   if (reply_type == SSH_FXP_ATTRS)
     {
@@ -3769,14 +5155,28 @@ read_dir_symlink_reply (GVfsBackendSftp *backend,
       g_file_info_set_name (info, name);
       g_file_info_set_is_symlink (info, TRUE);
       
-      parse_attributes (backend, info, name, reply, G_VFS_JOB_ENUMERATE (job)->attribute_matcher);
+      parse_attributes (backend, info, name, reply,
+                        entry ? backend->stat_cache_matcher : G_VFS_JOB_ENUMERATE (job)->attribute_matcher);
+
+      if (entry)
+        {
+          if (entry->stat_info)
+            g_object_unref (entry->stat_info);
+          entry->stat_info = g_file_info_dup (info);
+        }
 
       read_dir_got_stat_info (backend, job, info);
       
       g_object_unref (info);
     }
   else
-    read_dir_got_stat_info (backend, job, lstat_info);
+    {
+      /* Broken symlink, following it gives the lstat data */
+      if (entry && entry->stat_info == NULL)
+        entry->stat_info = g_object_ref (entry->lstat_info);
+
+      read_dir_got_stat_info (backend, job, lstat_info);
+    }
 
   g_object_unref (lstat_info);
   
@@ -3797,15 +5197,23 @@ read_dir_reply (GVfsBackendSftp *backend,
   int i;
   GDataOutputStream *command;
   ReadDirData *data;
+  gboolean fill;
 
   data = job->backend_data;
   enum_job = G_VFS_JOB_ENUMERATE (job);
+  fill = stat_cache_can_fill (backend, data->cache_generation);
 
   if (reply_type != SSH_FXP_NAME)
     {
       /* Ignore all error, including the expected END OF FILE.
        * Real errors are expected in open_dir anyway */
 
+      /* Only a listing that got to the end is worth caching */
+      if (fill && data->names != NULL &&
+          reply_type == SSH_FXP_STATUS &&
+          read_status_code (reply) == SSH_FX_EOF)
+        dir_cache_insert (backend, enum_job->filename, data->names);
+
       /* Close handle */
 
       command = new_command_stream (backend,
@@ -3823,9 +5231,11 @@ read_dir_reply (GVfsBackendSftp *backend,
   for (i = 0; i < count; i++)
     {
       GFileInfo *info;
+      GFileInfo *cached_info;
       char *name;
       char *longname;
       char *abs_name;
+      gboolean is_dot;
 
       info = g_file_info_new ();
       name = read_string (reply, NULL);
@@ -3834,7 +5244,23 @@ read_dir_reply (GVfsBackendSftp *backend,
       longname = read_string (reply, NULL);
       g_free (longname);
       
-      parse_attributes (backend, info, name, reply, enum_job->attribute_matcher);
+      parse_attributes (backend, info, name, reply,
+                        fill ? backend->stat_cache_matcher : enum_job->attribute_matcher);
+
+      is_dot = strcmp (".", name) == 0 || strcmp ("..", name) == 0;
+
+      if (fill && !is_dot)
+        {
+          abs_name = g_build_filename (enum_job->filename, name, NULL);
+          stat_cache_insert (backend, abs_name, info);
+          g_free (abs_name);
+          g_ptr_array_add (data->names, g_strdup (name));
+
+          /* The job masks and extends its infos, keep ours intact */
+          cached_info = info;
+          info = g_file_info_dup (cached_info);
+          g_object_unref (cached_info);
+        }
       
       if (g_file_info_get_file_type (info) == G_FILE_TYPE_SYMBOLIC_LINK &&
           ! (enum_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS))
@@ -3850,8 +5276,7 @@ read_dir_reply (GVfsBackendSftp *backend,
           queue_command_stream_and_free (backend, command, read_dir_symlink_reply, G_VFS_JOB (job), g_object_ref (info));
           data->outstanding_requests ++;
         }
-      else if (strcmp (".", name) != 0 &&
-               strcmp ("..", name) != 0)
+      else if (!is_dot)
         read_dir_got_stat_info (backend, job, info);
         
       g_object_unref (info);
@@ -3930,6 +5355,55 @@ open_dir_reply (GVfsBackendSftp *backend,
   queue_command_stream_and_free (op_backend, command, read_dir_reply, G_VFS_JOB (job), NULL);
 }
 
+static gboolean
+enumerate_from_cache (GVfsBackendSftp *backend,
+                      GVfsJobEnumerate *job,
+                      const char *filename,
+                      GFileAttributeMatcher *attribute_matcher,
+                      GFileQueryInfoFlags flags)
+{
+  GFileInfo *cached_info, *info;
+  const char *symlink_target;
+  GList *infos;
+  char **names;
+  char *abs_name;
+  int i;
+
+  names = dir_cache_lookup (backend, filename);
+  if (names == NULL)
+    return FALSE;
+
+  infos = NULL;
+  for (i = 0; names[i] != NULL; i++)
+    {
+      abs_name = g_build_filename (filename, names[i], NULL);
+      cached_info = stat_cache_lookup_info (backend, abs_name, flags,
+                                            attribute_matcher, &symlink_target);
+      g_free (abs_name);
+
+      if (cached_info == NULL)
+        break;
+
+      info = g_file_info_dup (cached_info);
+      if (symlink_target)
+        g_file_info_set_symlink_target (info, symlink_target);
+      infos = g_list_prepend (infos, info);
+    }
+
+  if (names[i] == NULL)
+    {
+      infos = g_list_reverse (infos);
+      g_vfs_job_succeeded (G_VFS_JOB (job));
+      g_vfs_job_enumerate_add_infos (job, infos);
+      g_vfs_job_enumerate_done (job);
+    }
+
+  g_list_foreach (infos, (GFunc)g_object_unref, NULL);
+  g_list_free (infos);
+
+  return names[i] == NULL;
+}
+
 static gboolean
 try_enumerate (GVfsBackend *backend,
                GVfsJobEnumerate *job,
@@ -3941,7 +5415,17 @@ try_enumerate (GVfsBackend *backend,
   GDataOutputStream *command;
   ReadDirData *data;
 
+  if (enumerate_from_cache (op_backend, job, filename, attribute_matcher, flags))
+    {
+      op_backend->stat_cache_hits++;
+      return TRUE;
+    }
+  op_backend->stat_cache_misses++;
+
   data = g_slice_new0 (ReadDirData);
+  data->cache_generation = op_backend->stat_cache_generation;
+  if (op_backend->stat_cache_ttl > 0)
+    data->names = g_ptr_array_new ();
 
   g_vfs_job_set_backend_data (G_VFS_JOB (job), data, (GDestroyNotify)read_dir_data_free);
   command = new_command_stream (op_backend,
@@ -3963,8 +5447,12 @@ query_info_reply (GVfsBackendSftp *backend,
   char *basename;
   int i;
   MultiReply *lstat_reply, *reply;
-  GFileInfo *lstat_info;
+  GFileInfo *lstat_info, *stat_info;
+  GFileAttributeMatcher *matcher;
   GVfsJobQueryInfo *op_job;
+  StatCacheEntry *entry;
+  char *symlink_target;
+  gboolean fill, has_symlink_target;
 
   op_job = G_VFS_JOB_QUERY_INFO (job);
   
@@ -3984,62 +5472,77 @@ query_info_reply (GVfsBackendSftp *backend,
       return;
     }
 
+  fill = stat_cache_can_fill (backend, GPOINTER_TO_UINT (user_data));
+  matcher = fill ? backend->stat_cache_matcher : op_job->attribute_matcher;
+
   basename = NULL;
   if (strcmp (op_job->filename, "/") != 0)
     basename = g_path_get_basename (op_job->filename);
 
-  if (op_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS)
-    {
-      parse_attributes (backend, op_job->file_info, basename,
-                        lstat_reply->data, op_job->attribute_matcher);
-    }
-  else
+  lstat_info = g_file_info_new ();
+  parse_attributes (backend, lstat_info, basename,
+                    lstat_reply->data, matcher);
+
+  stat_info = NULL;
+  if (! (op_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS))
     {
       /* Look at stat results */
       reply = &replies[i++];
 
       if (reply->type == SSH_FXP_ATTRS)
         {
-          parse_attributes (backend, op_job->file_info, basename,
-                            reply->data, op_job->attribute_matcher);
-
-          
-          lstat_info = g_file_info_new ();
-          parse_attributes (backend, lstat_info, basename,
-                            lstat_reply->data, op_job->attribute_matcher);
+          stat_info = g_file_info_new ();
+          parse_attributes (backend, stat_info, basename,
+                            reply->data, matcher);
           if (g_file_info_get_is_symlink (lstat_info))
-            g_file_info_set_is_symlink (op_job->file_info, TRUE);
-          g_object_unref (lstat_info);
+            g_file_info_set_is_symlink (stat_info, TRUE);
         }
       else
         {
           /* Broken symlink, use lstat data */
-          parse_attributes (backend, op_job->file_info, basename,
-                            lstat_reply->data, op_job->attribute_matcher);
+          stat_info = g_object_ref (lstat_info);
         }
-      
     }
     
   g_free (basename);
 
+  symlink_target = NULL;
+  has_symlink_target = FALSE;
   if (g_file_attribute_matcher_matches (op_job->attribute_matcher,
                                         G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET))
     {
       /* Look at readlink results */
       reply = &replies[i++];
+      has_symlink_target = TRUE;
 
       if (reply->type == SSH_FXP_NAME)
         {
-          char *symlink_target;
           guint32 count;
           
           count = g_data_input_stream_read_uint32 (reply->data, NULL, NULL);
           symlink_target = read_string (reply->data, NULL);
-          g_file_info_set_symlink_target (op_job->file_info, symlink_target);
-          g_free (symlink_target);
         }
     }
 
+  if (fill)
+    {
+      entry = stat_cache_insert (backend, op_job->filename, lstat_info);
+      if (stat_info)
+        entry->stat_info = g_object_ref (stat_info);
+      entry->has_symlink_target = has_symlink_target;
+      entry->symlink_target = g_strdup (symlink_target);
+    }
+
+  g_file_info_copy_into (stat_info ? stat_info : lstat_info, op_job->file_info);
+  if (symlink_target)
+    g_file_info_set_symlink_target (op_job->file_info, symlink_target);
+  g_file_info_set_attribute_mask (op_job->file_info, op_job->attribute_matcher);
+
+  g_free (symlink_target);
+  g_object_unref (lstat_info);
+  if (stat_info)
+    g_object_unref (stat_info);
+
   g_vfs_job_succeeded (G_VFS_JOB (job));
 }
 
@@ -4054,8 +5557,24 @@ try_query_info (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *commands[3];
   GDataOutputStream *command;
+  GFileInfo *cached_info;
+  const char *symlink_target;
   int n_commands;
 
+  cached_info = stat_cache_lookup_info (op_backend, filename, job->flags,
+                                        job->attribute_matcher, &symlink_target);
+  if (cached_info)
+    {
+      op_backend->stat_cache_hits++;
+      g_file_info_copy_into (cached_info, info);
+      if (symlink_target)
+        g_file_info_set_symlink_target (info, symlink_target);
+      g_file_info_set_attribute_mask (info, job->attribute_matcher);
+      g_vfs_job_succeeded (G_VFS_JOB (job));
+      return TRUE;
+    }
+  op_backend->stat_cache_misses++;
+
   n_commands = 0;
   
   command = commands[n_commands++] =
@@ -4080,7 +5599,8 @@ try_query_info (GVfsBackend *backend,
       put_string (command, filename);
     }
 
-  queue_command_streams_and_free (op_backend, commands, n_commands, query_info_reply, G_VFS_JOB (job), NULL);
+  queue_command_streams_and_free (op_backend, commands, n_commands, query_info_reply, G_VFS_JOB (job),
+                                  GUINT_TO_POINTER (op_backend->stat_cache_generation));
   
   return TRUE;
 }
@@ -4146,7 +5666,7 @@ try_query_info_fstat (GVfsBackend *backend,
   data = g_slice_new (QueryInfoFStatData);
   data->info = info;
   data->attribute_matcher = attribute_matcher;
-  queue_command_stream_and_free (op_backend, command, query_info_fstat_reply, G_VFS_JOB (job), data);
+  queue_connection_command_stream_and_free (handle->connection, command, query_info_fstat_reply, G_VFS_JOB (job), data);
 
   return TRUE;
 }
@@ -4293,6 +5813,9 @@ move_lstat_reply (GVfsBackendSftp *backend,
 
   /* TODO: Check flags & G_FILE_COPY_BACKUP */
 
+  stat_cache_invalidate (backend, op_job->source, TRUE);
+  stat_cache_invalidate (backend, op_job->destination, TRUE);
+
   if (destination_exist && (op_job->flags & G_FILE_COPY_OVERWRITE))
     {
       command = new_command_stream (backend,
@@ -4374,6 +5897,9 @@ try_set_display_name (GVfsBackend *backend,
 
   g_vfs_job_set_display_name_set_new_path (job,
                                            new_name);
+
+  stat_cache_invalidate (op_backend, filename, TRUE);
+  stat_cache_invalidate (op_backend, new_name, TRUE);
   
   command = new_command_stream (op_backend,
                                 SSH_FXP_RENAME);
@@ -4411,6 +5937,8 @@ try_make_symlink (GVfsBackend *backend,
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
+
+  stat_cache_invalidate (op_backend, filename, FALSE);
   
   command = new_command_stream (op_backend,
                                 SSH_FXP_SYMLINK);
@@ -4484,6 +6012,8 @@ try_make_directory (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  stat_cache_invalidate (op_backend, filename, FALSE);
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_MKDIR);
   put_string (command, filename);
@@ -4546,6 +6076,8 @@ delete_lstat_reply (GVfsBackendSftp *backend,
       info = g_file_info_new ();
       parse_attributes (backend, info, NULL, reply, NULL);
 
+      stat_cache_invalidate (backend, G_VFS_JOB_DELETE (job)->filename, TRUE);
+
       if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
         {
           command = new_command_stream (backend,
@@ -4638,6 +6170,8 @@ try_set_attribute (GVfsBackend *backend,
       return TRUE;
     }
 
+  stat_cache_forget (op_backend, filename);
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_SETSTAT);
   put_string (command, filename);
@@ -4648,54 +6182,993 @@ try_set_attribute (GVfsBackend *backend,
   return TRUE;
 }
 
+/* Push and pull keep many READ/WRITE requests in flight at the same
+   time, like the openssh sftp client does, so that copies are not
+   limited to one block per round trip. */
+#define TRANSFER_BLOCK_SIZE 32768
+#define TRANSFER_MAX_REQUESTS 64
+
+typedef struct {
+  GVfsBackendSftp *backend;
+  SftpConnection *connection;
+  GVfsJob *job;
+  gboolean is_push;
+  char *remote_path;
+  char *local_path;
+  GFileCopyFlags flags;
+  gboolean remove_source;
+  GFileProgressCallback progress_callback;
+  gpointer progress_callback_data;
+
+  DataBuffer *raw_handle;
+  GInputStream *input;
+  GOutputStream *output;
+  guchar *buffer;
+
+  goffset size;
+  goffset next_offset;
+  goffset bytes_done;
+  int n_outstanding;
+  gboolean reading;
+  gboolean eof;
+  gboolean finishing;
+  GError *error;
+
+  char *tempname;                       /* push writes here when overwriting */
+  int temp_count;
+  guint32 permissions;
+} TransferData;
+
+typedef struct {
+  goffset offset;
+  guint32 len;
+} TransferRequest;
+
+static void
+transfer_data_free (TransferData *data)
+{
+  if (data->raw_handle)
+    data_buffer_free (data->raw_handle);
+  if (data->input)
+    g_object_unref (data->input);
+  if (data->output)
+    g_object_unref (data->output);
+  if (data->error)
+    g_error_free (data->error);
+  g_free (data->buffer);
+  g_free (data->remote_path);
+  g_free (data->local_path);
+  g_free (data->tempname);
+  g_slice_free (TransferData, data);
+}
+
+static TransferData *
+transfer_data_new (GVfsBackendSftp *backend,
+                   GVfsJob *job,
+                   gboolean is_push,
+                   const char *remote_path,
+                   const char *local_path,
+                   GFileCopyFlags flags,
+                   gboolean remove_source,
+                   GFileProgressCallback progress_callback,
+                   gpointer progress_callback_data)
+{
+  TransferData *data;
+
+  data = g_slice_new0 (TransferData);
+  data->backend = backend;
+  data->connection = get_data_connection (backend);
+  data->job = job;
+  data->is_push = is_push;
+  data->remote_path = g_strdup (remote_path);
+  data->local_path = g_strdup (local_path);
+  data->flags = flags;
+  data->remove_source = remove_source;
+  data->progress_callback = progress_callback;
+  data->progress_callback_data = progress_callback_data;
+  data->buffer = g_malloc (TRANSFER_BLOCK_SIZE);
+
+  g_vfs_job_set_backend_data (job, data, (GDestroyNotify)transfer_data_free);
+
+  return data;
+}
+
 static void
-setup_icon_reply (GVfsBackendSftp *backend,
-                  MultiReply *replies,
-                  int n_replies,
-                  GVfsJob *job,
-                  gpointer user_data)
+transfer_set_error (TransferData *data,
+                    GError *error)
 {
-  GIcon *icon;
-  gboolean have_favicon;
-  MultiReply *stat_reply;
+  if (data->error == NULL)
+    data->error = error;
+  else
+    g_error_free (error);
+}
 
-  have_favicon = FALSE;
+static gboolean
+transfer_check_cancelled (TransferData *data)
+{
+  if (data->error == NULL &&
+      g_vfs_job_is_cancelled (data->job))
+    g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                         _("Operation was cancelled"));
 
-  stat_reply = &replies[0];
-  if (stat_reply->type == SSH_FXP_ATTRS)
-    have_favicon = TRUE;
+  return data->error != NULL;
+}
 
-  if (have_favicon)
+static void
+transfer_progress (TransferData *data)
+{
+  if (data->progress_callback)
+    data->progress_callback (data->bytes_done,
+                             MAX (data->size, data->bytes_done),
+                             data->progress_callback_data);
+}
+
+static void
+transfer_done (TransferData *data)
+{
+  if (data->is_push || data->remove_source)
+    stat_cache_invalidate (data->backend, data->remote_path, FALSE);
+
+  if (data->error)
+    g_vfs_job_failed_from_error (data->job, data->error);
+  else
+    g_vfs_job_succeeded (data->job);
+}
+
+static void
+transfer_remove_reply (GVfsBackendSftp *backend,
+                       int reply_type,
+                       GDataInputStream *reply,
+                       guint32 len,
+                       GVfsJob *job,
+                       gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+
+  if (reply_type == SSH_FXP_STATUS)
+    error_from_status (job, reply, -1, -1, &data->error);
+  else
+    g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+
+  transfer_done (data);
+}
+
+static void push_move_tempfile (TransferData *data);
+
+static void
+transfer_remove_local_source (TransferData *data)
+{
+  int errsv;
+
+  if (g_unlink (data->local_path) != 0)
     {
-      icon = g_vfs_icon_new (g_vfs_backend_get_mount_spec (G_VFS_BACKEND (backend)),
-                             "favicon:/etc/favicon.png");
-      g_vfs_backend_set_icon (G_VFS_BACKEND (backend), icon);
-      g_object_unref (icon);
+      errsv = errno;
+      g_set_error_literal (&data->error, G_IO_ERROR,
+                           g_io_error_from_errno (errsv),
+                           g_strerror (errsv));
     }
-  else
+}
+
+static void
+transfer_close_reply (GVfsBackendSftp *backend,
+                      int reply_type,
+                      GDataInputStream *reply,
+                      guint32 len,
+                      GVfsJob *job,
+                      gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+
+  if (data->error == NULL)
     {
-      g_vfs_backend_set_icon_name (G_VFS_BACKEND (backend), "folder-remote");
+      if (reply_type == SSH_FXP_STATUS)
+        error_from_status (job, reply, -1, -1, &data->error);
+      else
+        g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Invalid reply received"));
     }
 
-  g_vfs_job_succeeded (G_VFS_JOB (job));
+  if (data->tempname)
+    {
+      push_move_tempfile (data);
+      return;
+    }
+
+  if (data->error && data->is_push)
+    {
+      /* The destination was created with EXCL, so the partial
+         file is ours */
+      command = new_command_stream (backend, SSH_FXP_REMOVE);
+      put_string (command, data->remote_path);
+      queue_command_stream_and_free (backend, command, NULL, job, NULL);
+    }
+
+  if (data->error == NULL && data->remove_source)
+    {
+      if (data->is_push)
+        transfer_remove_local_source (data);
+      else
+        {
+          command = new_command_stream (backend, SSH_FXP_REMOVE);
+          put_string (command, data->remote_path);
+          queue_command_stream_and_free (backend, command, transfer_remove_reply, job, NULL);
+          return;
+        }
+    }
+
+  transfer_done (data);
 }
 
-/* called from do_mount(); finds out if there's an /etc/favicon.png file; if so, use it as the icon */
+/* Called once all outstanding requests are answered, either
+   because everything was transferred or because of an error */
 static void
-setup_icon (GVfsBackendSftp *op_backend,
-            GVfsJobMount    *job)
+transfer_finish (TransferData *data)
 {
+  GCancellable *cancellable;
   GDataOutputStream *command;
+  GFile *dest;
 
-  command = new_command_stream (op_backend, SSH_FXP_STAT);
-  put_string (command, "/etc/favicon.png");
+  if (data->finishing)
+    return;
+  data->finishing = TRUE;
 
-  queue_command_streams_and_free (op_backend,
-                                  &command,
-                                  1,
-                                  setup_icon_reply,
-                                  G_VFS_JOB (job),
-                                  NULL);
+  if (data->input)
+    g_input_stream_close (data->input, NULL, NULL);
+
+  if (data->output)
+    {
+      if (data->error == NULL)
+        g_output_stream_close (data->output, NULL, &data->error);
+      else
+        {
+          /* Closing with a cancelled cancellable keeps the original
+             file when replacing */
+          cancellable = g_cancellable_new ();
+          g_cancellable_cancel (cancellable);
+          g_output_stream_close (data->output, cancellable, NULL);
+          g_object_unref (cancellable);
+
+          if (!(data->flags & G_FILE_COPY_OVERWRITE))
+            {
+              dest = g_file_new_for_path (data->local_path);
+              g_file_delete (dest, NULL, NULL);
+              g_object_unref (dest);
+            }
+        }
+    }
+
+  if (data->raw_handle == NULL)
+    {
+      transfer_done (data);
+      return;
+    }
+
+  command = new_command_stream (data->backend, SSH_FXP_CLOSE);
+  put_data_buffer (command, data->raw_handle);
+  queue_connection_command_stream_and_free (data->connection, command, transfer_close_reply, data->job, NULL);
+}
+
+static void pull_read_more (TransferData *data);
+
+static void pull_request_range (TransferData *data,
+                                goffset offset,
+                                guint32 len);
+
+/* The data is in data->buffer */
+static void
+pull_got_data (TransferData *data,
+               TransferRequest *request,
+               guint32 count)
+{
+  GError *error;
+
+  error = NULL;
+  if (!g_seekable_seek (G_SEEKABLE (data->output), request->offset,
+                        G_SEEK_SET, NULL, &error) ||
+      !g_output_stream_write_all (data->output, data->buffer, count,
+                                  NULL, NULL, &error))
+    {
+      transfer_set_error (data, error);
+      return;
+    }
+
+  data->bytes_done += count;
+  if (request->offset + count > data->size)
+    data->size = request->offset + count; /* File grew */
+
+  /* The server may return less than asked for, ask for
+     the rest unless we are at the end of the file */
+  if (count == 0)
+    data->eof = TRUE;
+  else if (count < request->len &&
+           request->offset + count < data->size)
+    pull_request_range (data, request->offset + count, request->len - count);
+
+  transfer_progress (data);
+}
+
+static void
+pull_read_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  TransferRequest *request = user_data;
+  guint32 code, count;
+
+  data->n_outstanding--;
+
+  if (transfer_check_cancelled (data))
+    ;
+  else if (reply_type == SSH_FXP_STATUS)
+    {
+      code = read_status_code (reply);
+      if (code == SSH_FX_EOF)
+        {
+          /* File shrunk since we looked at its size */
+          data->eof = TRUE;
+          data->size = MIN (data->size, request->offset);
+        }
+      else
+        error_from_status_code (job, code, -1, -1, &data->error);
+    }
+  else
+    {
+      count = 0;
+      if (reply_type == SSH_FXP_DATA)
+        count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+
+      if (reply_type == SSH_FXP_DATA &&
+          count <= request->len &&
+          g_input_stream_read_all (G_INPUT_STREAM (reply),
+                                   data->buffer, count,
+                                   NULL, NULL, NULL))
+        pull_got_data (data, request, count);
+      else
+        g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Invalid reply received"));
+    }
+
+  g_slice_free (TransferRequest, request);
+  pull_read_more (data);
+}
+
+static void
+pull_read_direct_reply (GVfsBackendSftp *backend,
+                        guint32 count,
+                        GVfsJob *job,
+                        gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  TransferRequest *request = user_data;
+
+  data->n_outstanding--;
+
+  if (!transfer_check_cancelled (data))
+    pull_got_data (data, request, count);
+
+  g_slice_free (TransferRequest, request);
+  pull_read_more (data);
+}
+
+static void
+pull_request_range (TransferData *data,
+                    goffset offset,
+                    guint32 len)
+{
+  TransferRequest *request;
+
+  request = g_slice_new (TransferRequest);
+  request->offset = offset;
+  request->len = len;
+
+  /* Replies are handled one at a time, so they can all
+     use the same buffer */
+  queue_read_command (data->connection, data->raw_handle,
+                      offset, len, data->buffer,
+                      pull_read_reply, pull_read_direct_reply,
+                      data->job, request);
+
+  data->n_outstanding++;
+}
+
+static void
+pull_read_more (TransferData *data)
+{
+  /* Also asks for the block at the end of the file, so that
+     we notice if the file grew */
+  while (data->error == NULL &&
+         !data->eof &&
+         data->n_outstanding < TRANSFER_MAX_REQUESTS &&
+         data->next_offset <= data->size)
+    {
+      pull_request_range (data, data->next_offset, TRANSFER_BLOCK_SIZE);
+      data->next_offset += TRANSFER_BLOCK_SIZE;
+    }
+
+  if (data->n_outstanding == 0)
+    transfer_finish (data);
+}
+
+/* Source is a directory, check the target to give
+   the same error as a generic copy would */
+static void
+pull_directory_error (TransferData *data)
+{
+  GFileInfo *info;
+  GFileType file_type;
+  GFile *dest;
+  GError *error;
+
+  dest = g_file_new_for_path (data->local_path);
+  error = NULL;
+  info = g_file_query_info (dest, G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                            NULL, &error);
+  g_object_unref (dest);
+
+  if (info != NULL)
+    {
+      file_type = g_file_info_get_file_type (info);
+      g_object_unref (info);
+
+      if (!(data->flags & G_FILE_COPY_OVERWRITE))
+        {
+          g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                               _("Target file exists"));
+          return;
+        }
+      if (file_type == G_FILE_TYPE_DIRECTORY)
+        {
+          g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_WOULD_MERGE,
+                               _("Can't copy directory over directory"));
+          return;
+        }
+    }
+  else if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      data->error = error;
+      return;
+    }
+  else
+    g_error_free (error);
+
+  g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_WOULD_RECURSE,
+                       _("Can't recursively copy directory"));
+}
+
+static void
+pull_open_reply (GVfsBackendSftp *backend,
+                 MultiReply *replies,
+                 int n_replies,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  MultiReply *stat_reply, *open_reply;
+  GFileInfo *info;
+  GFile *dest;
+
+  stat_reply = &replies[0];
+  open_reply = &replies[1];
+
+  if (open_reply->type == SSH_FXP_HANDLE)
+    data->raw_handle = read_data_buffer (open_reply->data);
+
+  if (stat_reply->type == SSH_FXP_ATTRS)
+    {
+      info = g_file_info_new ();
+      parse_attributes (backend, info, NULL, stat_reply->data, NULL);
+      if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
+        pull_directory_error (data);
+      data->size = g_file_info_get_size (info);
+      g_object_unref (info);
+    }
+  else if (stat_reply->type == SSH_FXP_STATUS)
+    error_from_status (job, stat_reply->data, -1, -1, &data->error);
+
+  if (data->error == NULL && data->raw_handle == NULL)
+    {
+      if (open_reply->type == SSH_FXP_STATUS)
+        error_from_status (job, open_reply->data, -1, -1, &data->error);
+      if (data->error == NULL)
+        g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Invalid reply received"));
+    }
+
+  if (data->error == NULL)
+    {
+      dest = g_file_new_for_path (data->local_path);
+      if (data->flags & G_FILE_COPY_OVERWRITE)
+        data->output = G_OUTPUT_STREAM (g_file_replace (dest,
+                                                        NULL,
+                                                        data->flags & G_FILE_COPY_BACKUP ? TRUE : FALSE,
+                                                        G_FILE_CREATE_REPLACE_DESTINATION,
+                                                        NULL,
+                                                        &data->error));
+      else
+        data->output = G_OUTPUT_STREAM (g_file_create (dest,
+                                                       0,
+                                                       NULL,
+                                                       &data->error));
+      g_object_unref (dest);
+    }
+
+  if (data->error != NULL)
+    transfer_finish (data);
+  else
+    {
+      transfer_progress (data);
+      pull_read_more (data);
+    }
+}
+
+static gboolean
+try_pull (GVfsBackend *backend,
+          GVfsJobPull *job,
+          const char *source,
+          const char *local_path,
+          GFileCopyFlags flags,
+          gboolean remove_source,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *commands[2];
+  TransferData *data;
+
+  data = transfer_data_new (op_backend, G_VFS_JOB (job), FALSE,
+                            source, local_path, flags, remove_source,
+                            progress_callback, progress_callback_data);
+
+  commands[0] = new_command_stream (op_backend, SSH_FXP_STAT);
+  put_string (commands[0], source);
+
+  commands[1] = new_command_stream (op_backend, SSH_FXP_OPEN);
+  put_string (commands[1], source);
+  g_data_output_stream_put_uint32 (commands[1], SSH_FXF_READ, NULL, NULL); /* open flags */
+  g_data_output_stream_put_uint32 (commands[1], 0, NULL, NULL); /* Attr flags */
+
+  queue_connection_command_streams_and_free (data->connection, commands, 2, pull_open_reply, G_VFS_JOB (job), NULL);
+
+  return TRUE;
+}
+
+static void push_write_more (TransferData *data);
+
+static void
+push_write_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  TransferRequest *request = user_data;
+
+  data->n_outstanding--;
+
+  if (transfer_check_cancelled (data))
+    ;
+  else if (reply_type == SSH_FXP_STATUS)
+    {
+      if (error_from_status (job, reply, -1, -1, &data->error))
+        {
+          data->bytes_done += request->len;
+          transfer_progress (data);
+        }
+    }
+  else
+    g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+
+  g_slice_free (TransferRequest, request);
+  push_write_more (data);
+}
+
+static void
+push_read_ready (GObject *source_object,
+                 GAsyncResult *result,
+                 gpointer user_data)
+{
+  TransferData *data = user_data;
+  TransferRequest *request;
+  GError *error;
+  gssize n_read;
+
+  data->reading = FALSE;
+
+  error = NULL;
+  n_read = g_input_stream_read_finish (data->input, result, &error);
+  if (n_read < 0)
+    transfer_set_error (data, error);
+  else if (n_read == 0)
+    data->eof = TRUE;
+  else if (!transfer_check_cancelled (data))
+    {
+      request = g_slice_new (TransferRequest);
+      request->offset = data->next_offset;
+      request->len = n_read;
+
+      queue_write_command (data->connection, data->raw_handle,
+                           request->offset, data->buffer, n_read,
+                           push_write_reply, data->job, request);
+
+      data->next_offset += n_read;
+      data->n_outstanding++;
+    }
+
+  push_write_more (data);
+}
+
+/* Local reads go one at a time into data->buffer, the writes
+   they turn into are pipelined */
+static void
+push_write_more (TransferData *data)
+{
+  if (data->reading)
+    return;
+
+  if (data->error == NULL &&
+      !data->eof &&
+      data->n_outstanding < TRANSFER_MAX_REQUESTS)
+    {
+      data->reading = TRUE;
+      g_input_stream_read_async (data->input,
+                                 data->buffer, TRANSFER_BLOCK_SIZE,
+                                 G_PRIORITY_DEFAULT,
+                                 data->job->cancellable,
+                                 push_read_ready, data);
+      return;
+    }
+
+  if (data->n_outstanding == 0)
+    transfer_finish (data);
+}
+
+static void push_create_tempfile (TransferData *data);
+
+static void
+push_open_failed (GVfsJob *job,
+                  GError *error)
+{
+  TransferData *data = job->backend_data;
+
+  transfer_set_error (data, g_error_copy (error));
+  transfer_finish (data);
+}
+
+static void
+push_open_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  guint32 code;
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      code = read_status_code (reply);
+
+      if (code == SSH_FX_NO_SUCH_FILE)
+        {
+          /* openssh sftp returns NO_SUCH_FILE for both ENOTDIR and ENOENT,
+             we need to stat-walk the hierarchy to see what the error was */
+          not_dir_or_not_exist_error_full (backend, job, data->remote_path,
+                                           push_open_failed);
+          return;
+        }
+
+      error_from_status_code (job, code, G_IO_ERROR_EXISTS, -1, &data->error);
+      if (data->tempname &&
+          g_error_matches (data->error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+        {
+          /* It was *probably* the EXCL flag failing on the
+             temporary name, try another one */
+          g_clear_error (&data->error);
+          push_create_tempfile (data);
+          return;
+        }
+
+      transfer_finish (data);
+      return;
+    }
+
+  if (reply_type != SSH_FXP_HANDLE)
+    {
+      g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           _("Invalid reply received"));
+      transfer_finish (data);
+      return;
+    }
+
+  data->raw_handle = read_data_buffer (reply);
+
+  transfer_progress (data);
+  push_write_more (data);
+}
+
+static void
+push_open_remote (TransferData *data,
+                  const char *path)
+{
+  GDataOutputStream *command;
+
+  command = new_command_stream (data->backend, SSH_FXP_OPEN);
+  put_string (command, path);
+  g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL, NULL, NULL); /* open flags */
+  g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS, NULL, NULL); /* Attr flags */
+  g_data_output_stream_put_uint32 (command, data->permissions, NULL, NULL);
+
+  queue_connection_command_stream_and_free (data->connection, command, push_open_reply, data->job, NULL);
+}
+
+/* When overwriting, the data goes to a temporary file next to the
+   destination, which only replaces it once everything was written.
+   A failed or cancelled push leaves the existing file alone. */
+static void
+push_create_tempfile (TransferData *data)
+{
+  char basename[] = ".giosaveXXXXXX";
+  char *dirname;
+
+  data->temp_count++;
+  if (data->temp_count == 100)
+    {
+      g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           _("Unable to create temporary file"));
+      transfer_finish (data);
+      return;
+    }
+
+  g_free (data->tempname);
+  dirname = g_path_get_dirname (data->remote_path);
+  random_text (basename + 8);
+  data->tempname = g_build_filename (dirname, basename, NULL);
+  g_free (dirname);
+
+  push_open_remote (data, data->tempname);
+}
+
+static void
+push_delete_tempfile (TransferData *data)
+{
+  GDataOutputStream *command;
+
+  command = new_command_stream (data->backend, SSH_FXP_REMOVE);
+  put_string (command, data->tempname);
+  queue_command_stream_and_free (data->backend, command, NULL, data->job, NULL);
+}
+
+static void
+push_renamed_tempfile_reply (GVfsBackendSftp *backend,
+                             int reply_type,
+                             GDataInputStream *reply,
+                             guint32 len,
+                             GVfsJob *job,
+                             gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+
+  /* On failure, don't remove the tempfile, since we removed the original */
+  if (reply_type == SSH_FXP_STATUS)
+    error_from_status (job, reply, -1, -1, &data->error);
+  else
+    g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+
+  if (data->error == NULL && data->remove_source)
+    transfer_remove_local_source (data);
+
+  transfer_done (data);
+}
+
+static void
+push_removed_destination_reply (GVfsBackendSftp *backend,
+                                int reply_type,
+                                GDataInputStream *reply,
+                                guint32 len,
+                                GVfsJob *job,
+                                gpointer user_data)
+{
+  TransferData *data = job->backend_data;
+  GDataOutputStream *command;
+  guint32 code;
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      code = read_status_code (reply);
+      if (code != SSH_FX_OK && code != SSH_FX_NO_SUCH_FILE)
+        error_from_status_code (job, code, -1, -1, &data->error);
+    }
+  else
+    g_set_error_literal (&data->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+
+  if (data->error)
+    {
+      push_delete_tempfile (data);
+      transfer_done (data);
+      return;
+    }
+
+  /* sftp can't rename over an existing file, so the original
+     was removed first, like replace does on close */
+  command = new_command_stream (backend, SSH_FXP_RENAME);
+  put_string (command, data->tempname);
+  put_string (command, data->remote_path);
+  queue_command_stream_and_free (backend, command, push_renamed_tempfile_reply, job, NULL);
+}
+
+/* The temporary file is closed, move it over the destination
+   if everything was written */
+static void
+push_move_tempfile (TransferData *data)
+{
+  GDataOutputStream *command;
+
+  if (data->error)
+    {
+      push_delete_tempfile (data);
+      transfer_done (data);
+      return;
+    }
+
+  command = new_command_stream (data->backend, SSH_FXP_REMOVE);
+  put_string (command, data->remote_path);
+  queue_command_stream_and_free (data->backend, command, push_removed_destination_reply, data->job, NULL);
+}
+
+static void
+push_source_opened (GObject *source_object,
+                    GAsyncResult *result,
+                    gpointer user_data)
+{
+  TransferData *data = user_data;
+
+  data->input = G_INPUT_STREAM (g_file_read_finish (G_FILE (source_object),
+                                                    result, &data->error));
+  if (data->input == NULL)
+    {
+      transfer_done (data);
+      return;
+    }
+
+  if (data->flags & G_FILE_COPY_OVERWRITE)
+    push_create_tempfile (data);
+  else
+    push_open_remote (data, data->remote_path);
+}
+
+static gboolean
+try_push (GVfsBackend *backend,
+          GVfsJobPush *job,
+          const char *destination,
+          const char *local_path,
+          GFileCopyFlags flags,
+          gboolean remove_source,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  TransferData *data;
+  struct stat statbuf;
+  GFile *source;
+  int errsv;
+
+  if (g_stat (local_path, &statbuf) != 0)
+    {
+      errsv = errno;
+      g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR,
+                        g_io_error_from_errno (errsv),
+                        "%s", g_strerror (errsv));
+      return TRUE;
+    }
+
+  /* Let the generic copy code handle directories and backups */
+  if (!S_ISREG (statbuf.st_mode) ||
+      (flags & G_FILE_COPY_BACKUP))
+    {
+      g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        _("Operation unsupported"));
+      return TRUE;
+    }
+
+  data = transfer_data_new (op_backend, G_VFS_JOB (job), TRUE,
+                            destination, local_path, flags, remove_source,
+                            progress_callback, progress_callback_data);
+  data->size = statbuf.st_size;
+  data->permissions = statbuf.st_mode & 07777;
+
+  stat_cache_invalidate (op_backend, destination, FALSE);
+
+  source = g_file_new_for_path (local_path);
+  g_file_read_async (source, G_PRIORITY_DEFAULT, G_VFS_JOB (job)->cancellable,
+                     push_source_opened, data);
+  g_object_unref (source);
+
+  return TRUE;
+}
+
+static void
+setup_icon_reply (GVfsBackendSftp *backend,
+                  MultiReply *replies,
+                  int n_replies,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  GIcon *icon;
+  gboolean have_favicon;
+  MultiReply *stat_reply;
+
+  have_favicon = FALSE;
+
+  stat_reply = &replies[0];
+  if (stat_reply->type == SSH_FXP_ATTRS)
+    have_favicon = TRUE;
+
+  if (have_favicon)
+    {
+      icon = g_vfs_icon_new (g_vfs_backend_get_mount_spec (G_VFS_BACKEND (backend)),
+                             "favicon:/etc/favicon.png");
+      g_vfs_backend_set_icon (G_VFS_BACKEND (backend), icon);
+      g_object_unref (icon);
+    }
+  else
+    {
+      g_vfs_backend_set_icon_name (G_VFS_BACKEND (backend), "folder-remote");
+    }
+
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+}
+
+/* called from do_mount(); finds out if there's an /etc/favicon.png file; if so, use it as the icon */
+static void
+setup_icon (GVfsBackendSftp *op_backend,
+            GVfsJobMount    *job)
+{
+  GDataOutputStream *command;
+
+  command = new_command_stream (op_backend, SSH_FXP_STAT);
+  put_string (command, "/etc/favicon.png");
+
+  queue_command_streams_and_free (op_backend,
+                                  &command,
+                                  1,
+                                  setup_icon_reply,
+                                  G_VFS_JOB (job),
+                                  NULL);
+}
+
+static gboolean
+try_query_fs_info (GVfsBackend *backend,
+                   GVfsJobQueryFsInfo *job,
+                   const char *filename,
+                   GFileInfo *info,
+                   GFileAttributeMatcher *matcher)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+
+  g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_FILESYSTEM_TYPE, "sftp");
+
+  g_file_info_set_attribute_uint32 (info, G_VFS_FILE_ATTRIBUTE_STATS_CACHE_HITS,
+                                    op_backend->stat_cache_hits);
+  g_file_info_set_attribute_uint32 (info, G_VFS_FILE_ATTRIBUTE_STATS_CACHE_MISSES,
+                                    op_backend->stat_cache_misses);
+  g_file_info_set_attribute_uint32 (info, G_VFS_FILE_ATTRIBUTE_STATS_CACHE_INVALIDATIONS,
+                                    op_backend->stat_cache_invalidations);
+
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+  return TRUE;
 }
 
 static void
@@ -4720,6 +7193,7 @@ g_vfs_backend_sftp_class_init (GVfsBackendSftpClass *klass)
   backend_class->try_query_info = try_query_info;
   backend_class->try_query_info_on_read = (gpointer) try_query_info_fstat;
   backend_class->try_query_info_on_write = (gpointer) try_query_info_fstat;
+  backend_class->try_query_fs_info = try_query_fs_info;
   backend_class->try_enumerate = try_enumerate;
   backend_class->try_create = try_create;
   backend_class->try_append_to = try_append_to;
@@ -4733,4 +7207,6 @@ g_vfs_backend_sftp_class_init (GVfsBackendSftpClass *klass)
   backend_class->try_set_display_name = try_set_display_name;
   backend_class->try_query_settable_attributes = try_query_settable_attributes;
   backend_class->try_set_attribute = try_set_attribute;
+  backend_class->try_pull = try_pull;
+  backend_class->try_push = try_push;
 }
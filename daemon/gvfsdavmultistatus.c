@@ -0,0 +1,494 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib/gi18n.h>
+#include <libxml/parser.h>
+
+#include "gvfsdavmultistatus.h"
+
+/* A SAX parser for PROPFIND replies. Unlike building a tree with
+ * xmlReadMemory(), it can be fed the reply as it arrives, reports each
+ * <response> as soon as it is complete and only keeps the current one
+ * in memory.
+ */
+
+typedef enum {
+  PROP_DISPLAY_NAME,
+  PROP_ETAG,
+  PROP_CREATION_DATE,
+  PROP_CONTENT_TYPE,
+  PROP_CONTENT_LENGTH,
+  PROP_LAST_MODIFIED,
+  PROP_RESOURCE_TYPE,
+  N_PROPS
+} DavProp;
+
+static const char *prop_names[N_PROPS] = {
+  "displayname",
+  "getetag",
+  "creationdate",
+  "getcontenttype",
+  "getcontentlength",
+  "getlastmodified",
+  "resourcetype"
+};
+
+/* depth of the elements we care about */
+enum {
+  DEPTH_MULTISTATUS,
+  DEPTH_RESPONSE,
+  DEPTH_PROPSTAT,               /* and <href> */
+  DEPTH_PROP,                   /* and <status> */
+  DEPTH_PROPERTY,
+  DEPTH_RESOURCE_TYPE
+};
+
+struct _GVfsDavMultistatus {
+  xmlParserCtxtPtr      ctxt;
+  GVfsDavResponseFunc   func;
+  gpointer              user_data;
+
+  GError *              error;
+  gboolean              have_root;
+  int                   depth;
+  int                   skip_depth;     /* inside an element we don't know, or -1 */
+
+  GString *             collect;        /* where text goes, or NULL */
+
+  /* the response being parsed */
+  GString *             href;
+  GString *             props[N_PROPS];
+  gboolean              have_props[N_PROPS];
+  GFileType             file_type;
+
+  /* the propstat being parsed */
+  GString *             status;
+  GString *             propstat[N_PROPS];
+  gboolean              have_propstat[N_PROPS];
+  GFileType             propstat_type;
+  gboolean              have_type;
+};
+
+static gboolean
+is_dav_element (const xmlChar *localname,
+                const xmlChar *uri,
+                const char *   name)
+{
+  return uri != NULL &&
+         g_ascii_strcasecmp ((const char *) uri, "DAV:") == 0 &&
+         strcmp ((const char *) localname, name) == 0;
+}
+
+static void
+multistatus_fail (GVfsDavMultistatus *ms,
+                  const char *        message)
+{
+  if (ms->error == NULL)
+    g_set_error_literal (&ms->error, G_IO_ERROR, G_IO_ERROR_FAILED, message);
+  xmlStopParser (ms->ctxt);
+}
+
+static void
+response_reset (GVfsDavMultistatus *ms)
+{
+  guint i;
+
+  g_string_truncate (ms->href, 0);
+  for (i = 0; i < N_PROPS; i++)
+    ms->have_props[i] = FALSE;
+  ms->file_type = G_FILE_TYPE_UNKNOWN;
+}
+
+static void
+propstat_reset (GVfsDavMultistatus *ms)
+{
+  guint i;
+
+  g_string_truncate (ms->status, 0);
+  for (i = 0; i < N_PROPS; i++)
+    {
+      g_string_truncate (ms->propstat[i], 0);
+      ms->have_propstat[i] = FALSE;
+    }
+  ms->propstat_type = G_FILE_TYPE_UNKNOWN;
+  ms->have_type = FALSE;
+}
+
+/* Only properties of propstats with a 2xx status are used */
+static void
+propstat_commit (GVfsDavMultistatus *ms)
+{
+  const char *p;
+  guint code, i;
+
+  /* "HTTP/1.1 200 OK" */
+  p = ms->status->str;
+  while (g_ascii_isspace (*p))
+    p++;
+  if (!g_str_has_prefix (p, "HTTP/"))
+    return;
+  p = strchr (p, ' ');
+  if (p == NULL)
+    return;
+  code = strtoul (p, NULL, 10);
+  if (code < 200 || code >= 300)
+    return;
+
+  for (i = 0; i < N_PROPS; i++)
+    {
+      if (!ms->have_propstat[i])
+        continue;
+      g_string_assign (ms->props[i], ms->propstat[i]->str);
+      ms->have_props[i] = TRUE;
+    }
+  if (ms->have_propstat[PROP_RESOURCE_TYPE])
+    ms->file_type = ms->propstat_type;
+}
+
+static const char *
+response_get_prop (GVfsDavMultistatus *ms,
+                   DavProp             prop)
+{
+  /* like an element without text in the tree */
+  if (!ms->have_props[prop] || ms->props[prop]->len == 0)
+    return NULL;
+
+  return ms->props[prop]->str;
+}
+
+static void
+response_emit (GVfsDavMultistatus *ms)
+{
+  GVfsDavResponse response;
+
+  if (ms->href->len == 0)
+    return;
+
+  response.href = ms->href->str;
+  response.file_type = ms->file_type;
+  response.display_name = response_get_prop (ms, PROP_DISPLAY_NAME);
+  response.etag = response_get_prop (ms, PROP_ETAG);
+  response.creation_date = response_get_prop (ms, PROP_CREATION_DATE);
+  response.content_type = response_get_prop (ms, PROP_CONTENT_TYPE);
+  response.content_length = response_get_prop (ms, PROP_CONTENT_LENGTH);
+  response.last_modified = response_get_prop (ms, PROP_LAST_MODIFIED);
+
+  ms->func (&response, ms->user_data);
+}
+
+static void
+multistatus_start_element (void *           ctx,
+                           const xmlChar *  localname,
+                           const xmlChar *  prefix,
+                           const xmlChar *  uri,
+                           int              nb_namespaces,
+                           const xmlChar ** namespaces,
+                           int              nb_attributes,
+                           int              nb_defaulted,
+                           const xmlChar ** attributes)
+{
+  GVfsDavMultistatus *ms = ctx;
+  int depth;
+  guint i;
+
+  depth = ms->depth++;
+  ms->collect = NULL;
+
+  if (ms->skip_depth >= 0)
+    return;
+
+  switch (depth)
+    {
+    case DEPTH_MULTISTATUS:
+      if (!is_dav_element (localname, uri, "multistatus"))
+        {
+          multistatus_fail (ms, _("Unexpected reply from server"));
+          return;
+        }
+      ms->have_root = TRUE;
+      return;
+
+    case DEPTH_RESPONSE:
+      if (is_dav_element (localname, uri, "response"))
+        {
+          response_reset (ms);
+          return;
+        }
+      break;
+
+    case DEPTH_PROPSTAT:
+      if (is_dav_element (localname, uri, "href"))
+        {
+          /* the first <href> names the resource */
+          if (ms->href->len == 0)
+            ms->collect = ms->href;
+          return;
+        }
+      else if (is_dav_element (localname, uri, "propstat"))
+        {
+          propstat_reset (ms);
+          return;
+        }
+      break;
+
+    case DEPTH_PROP:
+      if (is_dav_element (localname, uri, "status"))
+        {
+          ms->collect = ms->status;
+          return;
+        }
+      else if (is_dav_element (localname, uri, "prop"))
+        return;
+      break;
+
+    case DEPTH_PROPERTY:
+      /* like the tree parser, properties are matched by name only */
+      for (i = 0; i < N_PROPS; i++)
+        {
+          if (strcmp ((const char *) localname, prop_names[i]) != 0)
+            continue;
+
+          ms->have_propstat[i] = TRUE;
+          ms->collect = ms->propstat[i];
+          if (i == PROP_RESOURCE_TYPE)
+            ms->propstat_type = G_FILE_TYPE_REGULAR;
+          return;
+        }
+      break;
+
+    case DEPTH_RESOURCE_TYPE:
+      if (ms->have_propstat[PROP_RESOURCE_TYPE] && !ms->have_type)
+        {
+          ms->have_type = TRUE;
+          if (strcmp ((const char *) localname, "collection") == 0)
+            ms->propstat_type = G_FILE_TYPE_DIRECTORY;
+          else if (strcmp ((const char *) localname, "redirectref") == 0)
+            ms->propstat_type = G_FILE_TYPE_SYMBOLIC_LINK;
+          else
+            ms->propstat_type = G_FILE_TYPE_UNKNOWN;
+        }
+      break;
+    }
+
+  ms->skip_depth = depth;
+}
+
+static void
+multistatus_end_element (void *          ctx,
+                         const xmlChar * localname,
+                         const xmlChar * prefix,
+                         const xmlChar * uri)
+{
+  GVfsDavMultistatus *ms = ctx;
+  int depth;
+
+  depth = --ms->depth;
+  ms->collect = NULL;
+
+  if (ms->skip_depth >= 0)
+    {
+      if (ms->skip_depth == depth)
+        ms->skip_depth = -1;
+      return;
+    }
+
+  if (depth == DEPTH_PROPSTAT &&
+      is_dav_element (localname, uri, "propstat"))
+    propstat_commit (ms);
+  else if (depth == DEPTH_RESPONSE)
+    response_emit (ms);
+}
+
+static void
+multistatus_characters (void *          ctx,
+                        const xmlChar * ch,
+                        int             len)
+{
+  GVfsDavMultistatus *ms = ctx;
+
+  if (ms->collect)
+    g_string_append_len (ms->collect, (const char *) ch, len);
+}
+
+static void
+multistatus_error (void *      ctx,
+                   xmlErrorPtr error)
+{
+  /* reported by the return value of xmlParseChunk() */
+}
+
+/**
+ * g_vfs_dav_multistatus_new:
+ * @func: function to call for each response
+ * @user_data: data to pass to @func
+ *
+ * Creates a parser for a "207 Multi-Status" reply, which calls @func
+ * for each <response> while the reply is fed to it.
+ *
+ * Returns: a new parser
+ **/
+GVfsDavMultistatus *
+g_vfs_dav_multistatus_new (GVfsDavResponseFunc func,
+                           gpointer            user_data)
+{
+  GVfsDavMultistatus *ms;
+  xmlSAXHandler sax;
+  guint i;
+
+  g_return_val_if_fail (func != NULL, NULL);
+
+  ms = g_slice_new0 (GVfsDavMultistatus);
+  ms->func = func;
+  ms->user_data = user_data;
+  ms->skip_depth = -1;
+  ms->href = g_string_new (NULL);
+  ms->status = g_string_new (NULL);
+  for (i = 0; i < N_PROPS; i++)
+    {
+      ms->props[i] = g_string_new (NULL);
+      ms->propstat[i] = g_string_new (NULL);
+    }
+
+  memset (&sax, 0, sizeof (sax));
+  sax.initialized = XML_SAX2_MAGIC;
+  sax.startElementNs = multistatus_start_element;
+  sax.endElementNs = multistatus_end_element;
+  sax.characters = multistatus_characters;
+  sax.serror = multistatus_error;
+
+  ms->ctxt = xmlCreatePushParserCtxt (&sax, ms, NULL, 0, "response.xml");
+  xmlCtxtUseOptions (ms->ctxt,
+                     XML_PARSE_NONET |
+                     XML_PARSE_NOWARNING |
+                     XML_PARSE_NOCDATA);
+
+  return ms;
+}
+
+void
+g_vfs_dav_multistatus_free (GVfsDavMultistatus *ms)
+{
+  guint i;
+
+  g_return_if_fail (ms != NULL);
+
+  xmlFreeParserCtxt (ms->ctxt);
+  if (ms->error)
+    g_error_free (ms->error);
+  g_string_free (ms->href, TRUE);
+  g_string_free (ms->status, TRUE);
+  for (i = 0; i < N_PROPS; i++)
+    {
+      g_string_free (ms->props[i], TRUE);
+      g_string_free (ms->propstat[i], TRUE);
+    }
+
+  g_slice_free (GVfsDavMultistatus, ms);
+}
+
+static gboolean
+multistatus_parse (GVfsDavMultistatus *ms,
+                   const char *        data,
+                   gsize               length,
+                   gboolean            terminate,
+                   GError **           error)
+{
+  int res;
+
+  if (ms->error == NULL)
+    {
+      res = xmlParseChunk (ms->ctxt, data, length, terminate);
+      if (res != 0 && ms->error == NULL)
+        g_set_error_literal (&ms->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Could not parse response"));
+    }
+
+  if (ms->error)
+    {
+      if (error)
+        *error = g_error_copy (ms->error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * g_vfs_dav_multistatus_feed:
+ * @multistatus: the parser
+ * @data: the next part of the reply
+ * @length: length of @data
+ * @error: location to take an error
+ *
+ * Parses the next part of the reply, calling the response function for
+ * each response that is complete now.
+ *
+ * Returns: %FALSE if the reply is invalid
+ **/
+gboolean
+g_vfs_dav_multistatus_feed (GVfsDavMultistatus *ms,
+                            const char *        data,
+                            gsize               length,
+                            GError **           error)
+{
+  g_return_val_if_fail (ms != NULL, FALSE);
+
+  /* xmlParseChunk takes an int */
+  while (length > G_MAXINT)
+    {
+      if (!multistatus_parse (ms, data, G_MAXINT, FALSE, error))
+        return FALSE;
+      data += G_MAXINT;
+      length -= G_MAXINT;
+    }
+
+  return multistatus_parse (ms, data, length, FALSE, error);
+}
+
+/**
+ * g_vfs_dav_multistatus_finish:
+ * @multistatus: the parser
+ * @error: location to take an error
+ *
+ * Tells the parser the whole reply has been fed to it.
+ *
+ * Returns: %FALSE if the reply is invalid or incomplete
+ **/
+gboolean
+g_vfs_dav_multistatus_finish (GVfsDavMultistatus *ms,
+                              GError **           error)
+{
+  g_return_val_if_fail (ms != NULL, FALSE);
+
+  if (!multistatus_parse (ms, NULL, 0, TRUE, error))
+    return FALSE;
+
+  if (!ms->have_root)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           _("Empty response"));
+      return FALSE;
+    }
+
+  return TRUE;
+}
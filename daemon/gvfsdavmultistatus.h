@@ -0,0 +1,61 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __G_VFS_DAV_MULTISTATUS_H__
+#define __G_VFS_DAV_MULTISTATUS_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+
+typedef struct _GVfsDavMultistatus GVfsDavMultistatus;
+typedef struct _GVfsDavResponse GVfsDavResponse;
+
+/* One <response> of a PROPFIND reply, with the properties of all its
+ * successful propstats. Properties the server didn't send are NULL.
+ * The strings are only valid during the callback. */
+struct _GVfsDavResponse {
+  const char *          href;
+  GFileType             file_type;      /* G_FILE_TYPE_UNKNOWN if not sent */
+  const char *          display_name;
+  const char *          etag;
+  const char *          creation_date;
+  const char *          content_type;
+  const char *          content_length;
+  const char *          last_modified;
+};
+
+typedef void (* GVfsDavResponseFunc) (const GVfsDavResponse *response,
+                                      gpointer               user_data);
+
+GVfsDavMultistatus *    g_vfs_dav_multistatus_new       (GVfsDavResponseFunc    func,
+                                                         gpointer               user_data);
+void                    g_vfs_dav_multistatus_free      (GVfsDavMultistatus *   multistatus);
+
+gboolean                g_vfs_dav_multistatus_feed      (GVfsDavMultistatus *   multistatus,
+                                                         const char *           data,
+                                                         gsize                  length,
+                                                         GError **              error);
+gboolean                g_vfs_dav_multistatus_finish    (GVfsDavMultistatus *   multistatus,
+                                                         GError **              error);
+
+
+G_END_DECLS
+
+#endif /* __G_VFS_DAV_MULTISTATUS_H__ */
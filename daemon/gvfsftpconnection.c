@@ -63,19 +63,18 @@ enable_keepalive (GSocketConnection *conn)
 }
 
 GVfsFtpConnection *
-g_vfs_ftp_connection_new (GSocketConnectable *addr,
-                          GCancellable *      cancellable,
-                          GError **           error)
+g_vfs_ftp_connection_new (GVfsConnector *connector,
+                          GCancellable * cancellable,
+                          GError **      error)
 {
   GVfsFtpConnection *conn;
 
-  g_return_val_if_fail (G_IS_SOCKET_CONNECTABLE (addr), NULL);
+  g_return_val_if_fail (connector != NULL, NULL);
 
   conn = g_slice_new0 (GVfsFtpConnection);
   conn->client = g_socket_client_new ();
   conn->debug_id = g_atomic_int_exchange_and_add (&debug_id, 1);
-  conn->commands = G_IO_STREAM (g_socket_client_connect (conn->client,
-                                                         addr,
+  conn->commands = G_IO_STREAM (g_vfs_connector_connect (connector,
                                                          cancellable,
                                                          error));
   if (conn->commands == NULL)
@@ -24,13 +24,14 @@
 #define __G_VFS_FTP_CONNECTION_H__
 
 #include <gio/gio.h>
+#include "gvfsconnector.h"
 
 G_BEGIN_DECLS
 
 
 typedef struct _GVfsFtpConnection GVfsFtpConnection;
 
-GVfsFtpConnection *     g_vfs_ftp_connection_new              (GSocketConnectable *     addr,
+GVfsFtpConnection *     g_vfs_ftp_connection_new              (GVfsConnector *          connector,
                                                                GCancellable *           cancellable,
                                                                GError **                error);
 void                    g_vfs_ftp_connection_free             (GVfsFtpConnection *      conn);
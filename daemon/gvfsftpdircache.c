@@ -30,17 +30,23 @@
 
 struct _GVfsFtpDirCacheEntry
 {
+  GVfsFtpFile *         dir;            /* the directory, also the key in the cache */
   GHashTable *          files;          /* GVfsFtpFile => GFileInfo mapping */
   guint                 stamp;          /* cache's stamp when this entry was created */
+  glong                 expires;        /* time in seconds after which the listing is stale */
+  guint                 n_files;        /* number of files counted in the cache's total */
+  GList *               lru_link;       /* link in the cache's LRU queue or NULL if not cached */
   volatile int          refcount;       /* need to refount this struct for thread safety */
 };
 
 static GVfsFtpDirCacheEntry *
-g_vfs_ftp_dir_cache_entry_new (guint stamp)
+g_vfs_ftp_dir_cache_entry_new (const GVfsFtpFile *dir,
+                               guint              stamp)
 {
   GVfsFtpDirCacheEntry *entry;
 
   entry = g_slice_new0 (GVfsFtpDirCacheEntry);
+  entry->dir = g_vfs_ftp_file_copy (dir);
   entry->files = g_hash_table_new_full (g_vfs_ftp_file_hash,
                                         g_vfs_ftp_file_equal,
                                         (GDestroyNotify) g_vfs_ftp_file_free,
@@ -66,6 +72,7 @@ g_vfs_ftp_dir_cache_entry_unref (GVfsFtpDirCacheEntry *entry)
     return;
 
   g_hash_table_destroy (entry->files);
+  g_vfs_ftp_file_free (entry->dir);
   g_slice_free (GVfsFtpDirCacheEntry, entry);
 }
 
@@ -94,9 +101,22 @@ g_vfs_ftp_dir_cache_entry_add (GVfsFtpDirCacheEntry *entry, GVfsFtpFile *file, G
 struct _GVfsFtpDirCache
 {
   GHashTable *          directories;    /* GVfsFtpFile of directory => GVfsFtpDirCacheEntry mapping */
+  GQueue                lru;            /* cached entries, most recently used first */
+  guint                 n_files;        /* files in all cached entries */
   guint                 stamp;          /* used to identify validity of cache when flushing */
-  GMutex *              lock;           /* mutex for thread safety of stamp and hash table */
+  GMutex *              lock;           /* mutex for thread safety of everything in here */
   const GVfsFtpDirFuncs *funcs;         /* functions to call */
+
+  /* limits, see g_vfs_ftp_dir_cache_set_limits() */
+  guint                 ttl;
+  guint                 max_dirs;
+  guint                 max_files;
+
+  /* statistics */
+  guint                 hits;
+  guint                 misses;
+  guint                 evictions;
+  guint                 expirations;
 };
 
 GVfsFtpDirCache *
@@ -107,12 +127,17 @@ g_vfs_ftp_dir_cache_new (const GVfsFtpDirFuncs *funcs)
   g_return_val_if_fail (funcs != NULL, NULL);
 
   cache = g_slice_new0 (GVfsFtpDirCache);
+  /* keys are owned by the entries */
   cache->directories = g_hash_table_new_full (g_vfs_ftp_file_hash,
                                               g_vfs_ftp_file_equal,
-                                              (GDestroyNotify) g_vfs_ftp_file_free,
+                                              NULL,
                                               (GDestroyNotify) g_vfs_ftp_dir_cache_entry_unref);
+  g_queue_init (&cache->lru);
   cache->lock = g_mutex_new();
   cache->funcs = funcs;
+  cache->ttl = G_VFS_FTP_DIR_CACHE_DEFAULT_TTL;
+  cache->max_dirs = G_VFS_FTP_DIR_CACHE_DEFAULT_MAX_DIRS;
+  cache->max_files = G_VFS_FTP_DIR_CACHE_DEFAULT_MAX_FILES;
 
   return cache;
 }
@@ -122,11 +147,106 @@ g_vfs_ftp_dir_cache_free (GVfsFtpDirCache *cache)
 {
   g_return_if_fail (cache != NULL);
 
+  g_debug ("# dir cache: %u hits, %u misses, %u evictions, %u expired\n",
+           cache->hits, cache->misses, cache->evictions, cache->expirations);
+
+  g_queue_clear (&cache->lru);
   g_hash_table_destroy (cache->directories);
   g_mutex_free (cache->lock);
   g_slice_free (GVfsFtpDirCache, cache);
 }
 
+/**
+ * g_vfs_ftp_dir_cache_set_limits:
+ * @cache: the cache
+ * @ttl: seconds a directory listing is used before it is read again
+ * @max_dirs: maximum number of directories to keep
+ * @max_files: maximum number of files to keep in all directories
+ *
+ * Bounds the memory used by the cache. When either limit is exceeded,
+ * the least recently used directories are dropped. The most recently
+ * listed directory is always kept, even if it is larger than @max_files.
+ **/
+void
+g_vfs_ftp_dir_cache_set_limits (GVfsFtpDirCache *cache,
+                                guint            ttl,
+                                guint            max_dirs,
+                                guint            max_files)
+{
+  g_return_if_fail (cache != NULL);
+
+  g_mutex_lock (cache->lock);
+  cache->ttl = ttl;
+  cache->max_dirs = max_dirs;
+  cache->max_files = max_files;
+  g_mutex_unlock (cache->lock);
+}
+
+/**
+ * g_vfs_ftp_dir_cache_get_stats:
+ * @cache: the cache
+ * @stats: location to store the statistics in
+ *
+ * Copies the hit, miss and eviction counters of @cache to @stats.
+ **/
+void
+g_vfs_ftp_dir_cache_get_stats (GVfsFtpDirCache *      cache,
+                               GVfsFtpDirCacheStats * stats)
+{
+  g_return_if_fail (cache != NULL);
+  g_return_if_fail (stats != NULL);
+
+  g_mutex_lock (cache->lock);
+  stats->hits = cache->hits;
+  stats->misses = cache->misses;
+  stats->evictions = cache->evictions;
+  stats->expirations = cache->expirations;
+  g_mutex_unlock (cache->lock);
+}
+
+/* must be called with the lock held */
+static void
+g_vfs_ftp_dir_cache_remove_locked (GVfsFtpDirCache *     cache,
+                                   GVfsFtpDirCacheEntry *entry)
+{
+  g_queue_delete_link (&cache->lru, entry->lru_link);
+  entry->lru_link = NULL;
+  cache->n_files -= entry->n_files;
+  /* unrefs the entry, which owns the key */
+  g_hash_table_remove (cache->directories, entry->dir);
+}
+
+/* must be called with the lock held */
+static void
+g_vfs_ftp_dir_cache_insert_locked (GVfsFtpDirCache *     cache,
+                                   GVfsFtpDirCacheEntry *entry)
+{
+  GVfsFtpDirCacheEntry *old;
+  GTimeVal now;
+
+  old = g_hash_table_lookup (cache->directories, entry->dir);
+  if (old)
+    g_vfs_ftp_dir_cache_remove_locked (cache, old);
+
+  g_get_current_time (&now);
+  entry->expires = now.tv_sec + cache->ttl;
+  entry->n_files = g_hash_table_size (entry->files);
+  g_queue_push_head (&cache->lru, entry);
+  entry->lru_link = cache->lru.head;
+  cache->n_files += entry->n_files;
+  g_hash_table_insert (cache->directories,
+                       entry->dir,
+                       g_vfs_ftp_dir_cache_entry_ref (entry));
+
+  while (cache->lru.length > 1 &&
+         (cache->lru.length > cache->max_dirs ||
+          cache->n_files > cache->max_files))
+    {
+      g_vfs_ftp_dir_cache_remove_locked (cache, g_queue_peek_tail (&cache->lru));
+      cache->evictions++;
+    }
+}
+
 static GVfsFtpDirCacheEntry *
 g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
                                   GVfsFtpTask *      task,
@@ -134,15 +254,37 @@ g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
                                   guint              stamp)
 {
   GVfsFtpDirCacheEntry *entry;
+  GTimeVal now;
 
   g_mutex_lock (cache->lock);
   entry = g_hash_table_lookup (cache->directories, dir);
   if (entry)
-    g_vfs_ftp_dir_cache_entry_ref (entry);
+    {
+      g_get_current_time (&now);
+      if (entry->stamp < stamp)
+        {
+          g_vfs_ftp_dir_cache_remove_locked (cache, entry);
+          entry = NULL;
+        }
+      else if (now.tv_sec >= entry->expires)
+        {
+          g_vfs_ftp_dir_cache_remove_locked (cache, entry);
+          cache->expirations++;
+          entry = NULL;
+        }
+    }
+  if (entry)
+    {
+      /* move to the front of the LRU queue */
+      g_queue_unlink (&cache->lru, entry->lru_link);
+      g_queue_push_head_link (&cache->lru, entry->lru_link);
+      g_vfs_ftp_dir_cache_entry_ref (entry);
+      cache->hits++;
+    }
+  else
+    cache->misses++;
   g_mutex_unlock (cache->lock);
-  if (entry && entry->stamp < stamp)
-    g_vfs_ftp_dir_cache_entry_unref (entry);
-  else if (entry)
+  if (entry)
     return entry;
 
   if (g_vfs_ftp_task_send (task,
@@ -161,7 +303,7 @@ g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
   if (g_vfs_ftp_task_is_in_error (task))
     return NULL;
 
-  entry = g_vfs_ftp_dir_cache_entry_new (stamp);
+  entry = g_vfs_ftp_dir_cache_entry_new (dir, stamp);
   cache->funcs->process (g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (task->conn)),
                          g_vfs_ftp_connection_get_debug_id (task->conn),
                          dir,
@@ -176,9 +318,7 @@ g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
       return NULL;
     }
   g_mutex_lock (cache->lock);
-  g_hash_table_insert (cache->directories,
-                       g_vfs_ftp_file_copy (dir),
-                       g_vfs_ftp_dir_cache_entry_ref (entry));
+  g_vfs_ftp_dir_cache_insert_locked (cache, entry);
   g_mutex_unlock (cache->lock);
   return entry;
 }
@@ -384,11 +524,15 @@ void
 g_vfs_ftp_dir_cache_purge_dir (GVfsFtpDirCache *  cache,
                                const GVfsFtpFile *dir)
 {
+  GVfsFtpDirCacheEntry *entry;
+
   g_return_if_fail (cache != NULL);
   g_return_if_fail (dir != NULL);
 
   g_mutex_lock (cache->lock);
-  g_hash_table_remove (cache->directories, dir);
+  entry = g_hash_table_lookup (cache->directories, dir);
+  if (entry)
+    g_vfs_ftp_dir_cache_remove_locked (cache, entry);
   g_mutex_unlock (cache->lock);
 }
 
@@ -412,6 +556,7 @@ g_vfs_ftp_dir_cache_purge_file (GVfsFtpDirCache *  cache,
 /*** DIR CACHE FUNCS ***/
 
 #include "ParseFTPList.h"
+#include "gvfsftpmlsd.h"
 #include "gvfsdaemonutils.h"
 
 static GFileInfo *
@@ -692,6 +837,143 @@ g_vfs_ftp_dir_cache_funcs_process_default (GInputStream *        stream,
   return g_vfs_ftp_dir_cache_funcs_process (stream, debug_id, dir, entry, FALSE, cancellable, error);
 }
 
+static GFileInfo *
+g_vfs_ftp_dir_cache_funcs_create_mlsd_info (const GVfsFtpFile *     file,
+                                            const GVfsFtpMlsdEntry *mlsd)
+{
+  GFileInfo *info;
+  GTimeVal tv = { 0, 0 };
+  char *s;
+
+  info = g_file_info_new ();
+
+  s = g_path_get_basename (g_vfs_ftp_file_get_gvfs_path (file));
+  g_file_info_set_name (info, s);
+  g_free (s);
+
+  if (mlsd->type == 'l')
+    {
+      g_file_info_set_is_symlink (info, TRUE);
+      if (mlsd->link != NULL)
+        {
+          s = g_strndup (mlsd->link, mlsd->link_len);
+          g_file_info_set_symlink_target (info, s);
+          g_free (s);
+        }
+    }
+
+  if (mlsd->has_size)
+    g_file_info_set_size (info, mlsd->size);
+
+  gvfs_file_info_populate_default (info, g_vfs_ftp_file_get_gvfs_path (file),
+                                   mlsd->type == 'f' ? G_FILE_TYPE_REGULAR :
+                                   mlsd->type == 'l' ? G_FILE_TYPE_SYMBOLIC_LINK :
+                                   G_FILE_TYPE_DIRECTORY);
+
+  g_file_info_set_is_hidden (info, g_file_info_get_name (info)[0] == '.');
+
+  if (mlsd->has_mtime)
+    {
+      tv.tv_sec = mlsd->mtime;
+      g_file_info_set_modification_time (info, &tv);
+    }
+
+  if (mlsd->has_mode)
+    g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE, mlsd->mode);
+
+  return info;
+}
+
+static gboolean
+g_vfs_ftp_dir_cache_funcs_process_mlsd (GInputStream *        stream,
+                                        int                   debug_id,
+                                        const GVfsFtpFile *   dir,
+                                        GVfsFtpDirCacheEntry *entry,
+                                        GCancellable *        cancellable,
+                                        GError **             error)
+{
+  GVfsFtpMlsdEntry mlsd;
+  GDataInputStream *data;
+  GVfsFtpFile *file;
+  char *line, *s;
+  gsize length;
+
+  /* protect against code reorg - in current code, error never is NULL */
+  g_assert (error != NULL);
+  g_assert (*error == NULL);
+
+  data = g_data_input_stream_new (stream);
+  g_data_input_stream_set_newline_type (data, G_DATA_STREAM_NEWLINE_TYPE_LF);
+  while ((line = g_data_input_stream_read_line (data, &length, cancellable, error)))
+    {
+      g_debug ("<<%2d <<  %s\n", debug_id, line);
+
+      /* cdir and pdir entries are the . and .. directories */
+      if (!g_vfs_ftp_mlsd_parse_line (line, length, &mlsd) ||
+          mlsd.type == 0)
+        {
+          g_free (line);
+          continue;
+        }
+
+      s = g_strndup (mlsd.name, mlsd.name_len);
+      file = g_vfs_ftp_file_new_child (dir, s, NULL);
+      g_free (s);
+      if (file == NULL)
+        {
+          g_debug ("# invalid filename, skipping");
+          g_free (line);
+          continue;
+        }
+
+      g_vfs_ftp_dir_cache_entry_add (entry, file,
+                                     g_vfs_ftp_dir_cache_funcs_create_mlsd_info (file, &mlsd));
+      g_free (line);
+    }
+
+  g_object_unref (data);
+  return *error != NULL;
+}
+
+static GFileInfo *
+g_vfs_ftp_dir_cache_funcs_lookup_mlst (GVfsFtpTask *      task,
+                                       const GVfsFtpFile *file)
+{
+  GVfsFtpMlsdEntry mlsd;
+  GFileInfo *info;
+  char **reply;
+  guint i;
+
+  if (g_vfs_ftp_file_is_root (file))
+    return create_root_file_info (task->backend);
+
+  /* MLST answers with the same facts as MLSD in a multiline reply, so
+   * this is one round trip instead of a CWD and a SIZE.
+   */
+  if (!g_vfs_ftp_task_send_and_check (task, 0, NULL, NULL, &reply, "MLST %s", g_vfs_ftp_file_get_ftp_path (file)))
+    {
+      g_vfs_ftp_task_clear_error (task);
+      return g_vfs_ftp_dir_cache_funcs_lookup_uncached (task, file);
+    }
+
+  info = NULL;
+  for (i = 1; reply[i] != NULL && reply[i + 1] != NULL; i++)
+    {
+      if (reply[i][0] == ' ' &&
+          g_vfs_ftp_mlsd_parse_line (reply[i] + 1, strlen (reply[i] + 1), &mlsd))
+        {
+          info = g_vfs_ftp_dir_cache_funcs_create_mlsd_info (file, &mlsd);
+          break;
+        }
+    }
+  g_strfreev (reply);
+
+  if (info == NULL)
+    return g_vfs_ftp_dir_cache_funcs_lookup_uncached (task, file);
+
+  return info;
+}
+
 const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_unix = {
   "LIST -a",
   g_vfs_ftp_dir_cache_funcs_process_unix,
@@ -705,3 +987,10 @@ const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_default = {
   g_vfs_ftp_dir_cache_funcs_lookup_uncached,
   g_vfs_ftp_dir_cache_funcs_resolve_default
 };
+
+const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_mlsd = {
+  "MLSD",
+  g_vfs_ftp_dir_cache_funcs_process_mlsd,
+  g_vfs_ftp_dir_cache_funcs_lookup_mlst,
+  g_vfs_ftp_dir_cache_funcs_resolve_default
+};
@@ -29,10 +29,23 @@
 G_BEGIN_DECLS
 
 
+/* how long listings are used and how many are kept by default */
+#define G_VFS_FTP_DIR_CACHE_DEFAULT_TTL 60              /* seconds */
+#define G_VFS_FTP_DIR_CACHE_DEFAULT_MAX_DIRS 1000
+#define G_VFS_FTP_DIR_CACHE_DEFAULT_MAX_FILES 200000
+
 //typedef struct _GVfsFtpDirCache GVfsFtpDirCache;
 typedef struct _GVfsFtpDirCacheEntry GVfsFtpDirCacheEntry;
+typedef struct _GVfsFtpDirCacheStats GVfsFtpDirCacheStats;
 //typedef struct _GVfsFtpDirFuncs GVfsFtpDirFuncs;
 
+struct _GVfsFtpDirCacheStats {
+  guint                 hits;                   /* listings found in the cache */
+  guint                 misses;                 /* listings that had to be read */
+  guint                 evictions;              /* listings dropped to stay in the limits */
+  guint                 expirations;            /* listings dropped because they were too old */
+};
+
 struct _GVfsFtpDirFuncs {
   const char *          command;
   gboolean              (* process)                             (GInputStream *         stream,
@@ -50,9 +63,16 @@ struct _GVfsFtpDirFuncs {
 
 extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_unix;
 extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_default;
+extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_mlsd;
 
 GVfsFtpDirCache *       g_vfs_ftp_dir_cache_new                 (const GVfsFtpDirFuncs *funcs);
 void                    g_vfs_ftp_dir_cache_free                (GVfsFtpDirCache *      cache);
+void                    g_vfs_ftp_dir_cache_set_limits          (GVfsFtpDirCache *      cache,
+                                                                 guint                  ttl,
+                                                                 guint                  max_dirs,
+                                                                 guint                  max_files);
+void                    g_vfs_ftp_dir_cache_get_stats           (GVfsFtpDirCache *      cache,
+                                                                 GVfsFtpDirCacheStats * stats);
 
 GFileInfo *             g_vfs_ftp_dir_cache_lookup_file         (GVfsFtpDirCache *      cache,
                                                                  GVfsFtpTask *          task,
@@ -0,0 +1,227 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "gvfsftpmlsd.h"
+
+/* MLSD lines are machine-readable, so unlike ParseFTPList this does a
+ * single pass over the line without guessing the server's format,
+ * without copying and without going through mktime() and the local
+ * timezone.
+ */
+
+static gboolean
+fact_name_is (const char *name,
+              gsize       len,
+              const char *expected)
+{
+  return strlen (expected) == len &&
+         g_ascii_strncasecmp (name, expected, len) == 0;
+}
+
+static gboolean
+parse_digits (const char *s,
+              gsize       len,
+              int *       result)
+{
+  gsize i;
+
+  *result = 0;
+  for (i = 0; i < len; i++)
+    {
+      if (!g_ascii_isdigit (s[i]))
+        return FALSE;
+      *result = *result * 10 + (s[i] - '0');
+    }
+
+  return TRUE;
+}
+
+/* days since 1970-01-01 of a date in the proleptic Gregorian calendar */
+static gint64
+days_from_civil (int year,
+                 int month,
+                 int day)
+{
+  gint64 era, yoe, doy, doe;
+
+  if (month <= 2)
+    year--;
+  era = (year >= 0 ? year : year - 399) / 400;
+  yoe = year - era * 400;
+  doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+  return era * 146097 + doe - 719468;
+}
+
+/* YYYYMMDDHHMMSS[.sss], always in UTC */
+static gboolean
+parse_time_val (const char *value,
+                gsize       len,
+                gint64 *    result)
+{
+  int year, month, day, hour, minute, second;
+
+  if (len < 14 ||
+      !parse_digits (value, 4, &year) ||
+      !parse_digits (value + 4, 2, &month) ||
+      !parse_digits (value + 6, 2, &day) ||
+      !parse_digits (value + 8, 2, &hour) ||
+      !parse_digits (value + 10, 2, &minute) ||
+      !parse_digits (value + 12, 2, &second))
+    return FALSE;
+
+  if (month < 1 || month > 12 || day < 1 || day > 31 ||
+      hour > 23 || minute > 59 || second > 60)
+    return FALSE;
+
+  *result = days_from_civil (year, month, day) * 86400 +
+            hour * 3600 + minute * 60 + second;
+  return TRUE;
+}
+
+static void
+parse_type (const char *       value,
+            gsize              len,
+            GVfsFtpMlsdEntry * entry)
+{
+  const char *colon;
+
+  if (fact_name_is (value, len, "file"))
+    entry->type = 'f';
+  else if (fact_name_is (value, len, "dir"))
+    entry->type = 'd';
+  else if (fact_name_is (value, len, "cdir") ||
+           fact_name_is (value, len, "pdir"))
+    entry->type = 0;
+  else if (len >= 13 && g_ascii_strncasecmp (value, "OS.unix=slink", 13) == 0)
+    {
+      /* proftpd: type=OS.unix=slink:/target */
+      entry->type = 'l';
+      colon = memchr (value + 13, ':', len - 13);
+      if (colon != NULL && colon + 1 < value + len)
+        {
+          entry->link = colon + 1;
+          entry->link_len = value + len - entry->link;
+        }
+    }
+  else if (fact_name_is (value, len, "OS.unix=symlink"))
+    entry->type = 'l';
+  else
+    /* devices and other OS specific types */
+    entry->type = 'f';
+}
+
+/**
+ * g_vfs_ftp_mlsd_parse_line:
+ * @line: a line of MLSD output, without the line terminator
+ * @length: length of @line
+ * @entry: entry to fill
+ *
+ * Parses the facts and the name of a file listed by MLSD or MLST. Facts
+ * the server didn't send are marked as missing in @entry.
+ *
+ * Returns: %TRUE if the line could be parsed.
+ **/
+gboolean
+g_vfs_ftp_mlsd_parse_line (const char *      line,
+                           gsize             length,
+                           GVfsFtpMlsdEntry *entry)
+{
+  const char *end, *fact, *fact_end, *equals;
+  gsize name_len, value_len;
+  gint64 mtime;
+  guint64 size;
+  guint32 mode;
+  gsize i;
+
+  g_return_val_if_fail (line != NULL, FALSE);
+  g_return_val_if_fail (entry != NULL, FALSE);
+
+  memset (entry, 0, sizeof (GVfsFtpMlsdEntry));
+  entry->type = 'f';
+
+  end = line + length;
+  if (end > line && end[-1] == '\r')
+    end--;
+
+  fact = line;
+  while (fact < end && *fact != ' ')
+    {
+      fact_end = memchr (fact, ';', end - fact);
+      if (fact_end == NULL)
+        return FALSE;
+
+      equals = memchr (fact, '=', fact_end - fact);
+      if (equals == NULL)
+        return FALSE;
+
+      name_len = equals - fact;
+      equals++;
+      value_len = fact_end - equals;
+
+      if (fact_name_is (fact, name_len, "type"))
+        parse_type (equals, value_len, entry);
+      else if (fact_name_is (fact, name_len, "size") ||
+               fact_name_is (fact, name_len, "sizd"))
+        {
+          size = 0;
+          for (i = 0; i < value_len && g_ascii_isdigit (equals[i]); i++)
+            size = size * 10 + (equals[i] - '0');
+          if (i > 0)
+            {
+              entry->has_size = TRUE;
+              entry->size = size;
+            }
+        }
+      else if (fact_name_is (fact, name_len, "modify"))
+        {
+          if (parse_time_val (equals, value_len, &mtime))
+            {
+              entry->has_mtime = TRUE;
+              entry->mtime = mtime;
+            }
+        }
+      else if (fact_name_is (fact, name_len, "UNIX.mode"))
+        {
+          mode = 0;
+          for (i = 0; i < value_len && equals[i] >= '0' && equals[i] <= '7'; i++)
+            mode = mode * 8 + (equals[i] - '0');
+          if (i > 0)
+            {
+              entry->has_mode = TRUE;
+              entry->mode = mode & 07777;
+            }
+        }
+
+      fact = fact_end + 1;
+    }
+
+  /* exactly one space separates the facts from the name */
+  if (fact >= end || *fact != ' ' || fact + 1 >= end)
+    return FALSE;
+
+  entry->name = fact + 1;
+  entry->name_len = end - entry->name;
+
+  return TRUE;
+}
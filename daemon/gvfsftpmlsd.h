@@ -0,0 +1,52 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __G_VFS_FTP_MLSD_H__
+#define __G_VFS_FTP_MLSD_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+
+typedef struct _GVfsFtpMlsdEntry GVfsFtpMlsdEntry;
+
+/* One line of MLSD output or of the MLST reply, see RFC 3659.
+ * Strings point into the parsed line and are not 0-terminated. */
+struct _GVfsFtpMlsdEntry {
+  char                  type;           /* 'f', 'd', 'l' or 0 for cdir/pdir */
+  const char *          name;
+  gsize                 name_len;
+  const char *          link;           /* symlink target or NULL if unknown */
+  gsize                 link_len;
+  gboolean              has_size;
+  guint64               size;
+  gboolean              has_mtime;
+  gint64                mtime;          /* seconds since the epoch, UTC */
+  gboolean              has_mode;
+  guint32               mode;
+};
+
+gboolean          g_vfs_ftp_mlsd_parse_line             (const char *           line,
+                                                         gsize                  length,
+                                                         GVfsFtpMlsdEntry *     entry);
+
+
+G_END_DECLS
+
+#endif /* __G_VFS_FTP_MLSD_H__ */
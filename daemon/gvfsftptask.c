@@ -161,6 +161,28 @@ do_broadcast (GCancellable *cancellable, GCond *cond)
   g_cond_broadcast (cond);
 }
 
+/* Opens a new connection for @task and logs in. The caller must have
+ * counted it in the backend's connections already. */
+static gboolean
+g_vfs_ftp_task_open_connection (GVfsFtpTask *task)
+{
+  GVfsBackendFtp *ftp = task->backend;
+
+  task->conn = g_vfs_ftp_connection_new (ftp->connector, task->cancellable, &task->error);
+  if (G_UNLIKELY (task->conn == NULL))
+    return FALSE;
+
+  g_vfs_ftp_task_receive (task, 0, NULL);
+  g_vfs_ftp_task_login (task, ftp->user, ftp->password);
+  g_vfs_ftp_task_setup_connection (task);
+  if (G_LIKELY (!g_vfs_ftp_task_is_in_error (task)))
+    return TRUE;
+
+  g_vfs_ftp_connection_free (task->conn);
+  task->conn = NULL;
+  return FALSE;
+}
+
 /**
  * g_vfs_ftp_task_acquire_connection:
  * @task: a task without an associated connection
@@ -219,7 +241,7 @@ g_vfs_ftp_task_acquire_connection (GVfsFtpTask *task)
           ftp->connections++;
           last_thread = g_thread_self ();
           g_mutex_unlock (ftp->mutex);
-          task->conn = g_vfs_ftp_connection_new (ftp->addr, task->cancellable, &task->error);
+          task->conn = g_vfs_ftp_connection_new (ftp->connector, task->cancellable, &task->error);
           if (G_LIKELY (task->conn != NULL))
             {
               g_vfs_ftp_task_receive (task, 0, NULL);
@@ -269,6 +291,107 @@ g_vfs_ftp_task_acquire_connection (GVfsFtpTask *task)
   return task->conn != NULL;
 }
 
+/**
+ * g_vfs_ftp_task_prewarm_connection:
+ * @task: a task without an associated connection
+ *
+ * Opens a new connection, logs in and puts the connection into the
+ * connection pool of @task's backend without using it, so that a later
+ * task can acquire it right away. Nothing is opened if the pool already
+ * has as many connections as the server allows. Unlike
+ * g_vfs_ftp_task_acquire_connection(), a failure does not lower the
+ * backend's connection limit, the next task that needs a connection
+ * finds out about it.
+ *
+ * Returns: %TRUE if a connection was added to the pool
+ **/
+gboolean
+g_vfs_ftp_task_prewarm_connection (GVfsFtpTask *task)
+{
+  GVfsBackendFtp *ftp;
+
+  g_return_val_if_fail (task != NULL, FALSE);
+  g_return_val_if_fail (task->conn == NULL, FALSE);
+
+  if (g_vfs_ftp_task_is_in_error (task))
+    return FALSE;
+
+  ftp = task->backend;
+  g_mutex_lock (ftp->mutex);
+  if (ftp->queue == NULL || ftp->connections >= ftp->max_connections)
+    {
+      g_mutex_unlock (ftp->mutex);
+      return FALSE;
+    }
+  ftp->connections++;
+  g_mutex_unlock (ftp->mutex);
+
+  if (!g_vfs_ftp_task_open_connection (task))
+    {
+      g_mutex_lock (ftp->mutex);
+      ftp->connections--;
+      g_mutex_unlock (ftp->mutex);
+      return FALSE;
+    }
+
+  g_vfs_ftp_task_release_connection (task);
+  return TRUE;
+}
+
+/**
+ * g_vfs_ftp_task_try_acquire_connection:
+ * @task: a task without an associated connection
+ *
+ * Like g_vfs_ftp_task_acquire_connection(), but never waits for a busy
+ * connection. It takes an idle connection from the pool or opens a new
+ * one if the server allows more. If opening a connection fails, the
+ * backend assumes that it reached the server's connection limit.
+ *
+ * Returns: %TRUE if @task has a connection now
+ **/
+gboolean
+g_vfs_ftp_task_try_acquire_connection (GVfsFtpTask *task)
+{
+  GVfsBackendFtp *ftp;
+  guint maybe_max_connections;
+
+  g_return_val_if_fail (task != NULL, FALSE);
+  g_return_val_if_fail (task->conn == NULL, FALSE);
+
+  if (g_vfs_ftp_task_is_in_error (task))
+    return FALSE;
+
+  ftp = task->backend;
+  g_mutex_lock (ftp->mutex);
+  if (ftp->queue == NULL)
+    {
+      g_mutex_unlock (ftp->mutex);
+      return FALSE;
+    }
+  task->conn = g_queue_pop_head (ftp->queue);
+  if (task->conn != NULL || ftp->connections >= ftp->max_connections)
+    {
+      g_mutex_unlock (ftp->mutex);
+      return task->conn != NULL;
+    }
+  maybe_max_connections = ftp->connections;
+  ftp->connections++;
+  g_mutex_unlock (ftp->mutex);
+
+  if (g_vfs_ftp_task_open_connection (task))
+    return TRUE;
+
+  g_mutex_lock (ftp->mutex);
+  ftp->connections--;
+  /* unlike g_vfs_ftp_task_acquire_connection(), never give up on the
+   * connections we have */
+  if (!g_vfs_ftp_task_error_matches (task, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    ftp->max_connections = MIN (ftp->max_connections, MAX (maybe_max_connections, 1));
+  g_mutex_unlock (ftp->mutex);
+
+  return FALSE;
+}
+
 /**
  * g_vfs_ftp_task_release_connection:
  * @task: a task
@@ -278,7 +401,7 @@ g_vfs_ftp_task_acquire_connection (GVfsFtpTask *task)
  * a @task's connection, never use g_vfs_ftp_connection_free() directly. If
  * the task does not have a current connection, this function just returns.
  **/
-static void
+void
 g_vfs_ftp_task_release_connection (GVfsFtpTask *task)
 {
   g_return_if_fail (task != NULL);
@@ -61,6 +61,9 @@ void                    g_vfs_ftp_task_done                     (GVfsFtpTask *
 void                    g_vfs_ftp_task_set_error_from_response  (GVfsFtpTask *          task,
                                                                  guint                  response);
 
+gboolean                g_vfs_ftp_task_prewarm_connection       (GVfsFtpTask *          task);
+gboolean                g_vfs_ftp_task_try_acquire_connection   (GVfsFtpTask *          task);
+void                    g_vfs_ftp_task_release_connection       (GVfsFtpTask *          task);
 void                    g_vfs_ftp_task_give_connection          (GVfsFtpTask *          task,
                                                                  GVfsFtpConnection *    conn);
 GVfsFtpConnection *     g_vfs_ftp_task_take_connection          (GVfsFtpTask *          task);
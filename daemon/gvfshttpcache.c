@@ -0,0 +1,651 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "gvfshttpcache.h"
+
+/* Bodies of http resources are kept on disk so that opening them again
+ * only costs a conditional GET. Every entry is a key file named after
+ * the checksum of the URI, pointing to the file with the body. New
+ * bodies are written to a new file and the key file is replaced
+ * atomically, so other processes using the same directory never see
+ * a body that doesn't match its validators.
+ */
+
+#define ENTRY_GROUP "Entry"
+#define STALE_FILE_AGE 3600             /* seconds before unreferenced files are removed */
+
+struct _GVfsHttpCache {
+  char *                dir;
+  guint64               max_size;
+  guint64               size;           /* sum of the bodies, if size_known */
+  gboolean              size_known;
+
+  guint                 hits;           /* bodies served after a 304 */
+  guint                 misses;         /* bodies downloaded */
+  guint64               bytes_saved;
+};
+
+struct _GVfsHttpCacheEntry {
+  GVfsHttpCache *       cache;
+  char *                key;
+  char *                meta_path;
+  GInputStream *        body;
+  char *                etag;
+  char *                last_modified;
+  char *                content_type;
+  guint64               size;
+};
+
+struct _GVfsHttpCacheWriter {
+  GVfsHttpCache *       cache;
+  char *                key;
+  char *                meta_path;
+  char *                body_path;
+  int                   fd;
+  gboolean              committed;
+  guint64               expected;
+  guint64               written;
+  char *                etag;
+  char *                last_modified;
+  char *                content_type;
+};
+
+typedef struct {
+  char *                meta_path;
+  char *                body_path;
+  time_t                mtime;
+  guint64               size;
+} TrimEntry;
+
+static void
+g_vfs_http_cache_debug (GVfsHttpCache *cache,
+                        const char    *what,
+                        const char    *key)
+{
+  g_debug ("http cache %s: %s (%u hits, %u misses, %" G_GUINT64_FORMAT " bytes saved)\n",
+           what, key, cache->hits, cache->misses, cache->bytes_saved);
+}
+
+static char *
+g_vfs_http_cache_get_meta_path (GVfsHttpCache *cache,
+                                const char    *key,
+                                char         **checksum_out)
+{
+  char *checksum, *name, *path;
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+  name = g_strconcat (checksum, ".meta", NULL);
+  path = g_build_filename (cache->dir, name, NULL);
+  g_free (name);
+
+  if (checksum_out)
+    *checksum_out = checksum;
+  else
+    g_free (checksum);
+
+  return path;
+}
+
+static int
+trim_entry_compare (gconstpointer a,
+                    gconstpointer b)
+{
+  const TrimEntry *ea = a;
+  const TrimEntry *eb = b;
+
+  if (ea->mtime < eb->mtime)
+    return -1;
+  return ea->mtime > eb->mtime;
+}
+
+/* Removes the least recently used entries until the cache is below
+ * three quarters of its size, and files no entry refers to anymore */
+static void
+g_vfs_http_cache_trim (GVfsHttpCache *cache)
+{
+  GDir *dir;
+  GArray *entries;
+  GHashTable *referenced;
+  GKeyFile *key_file;
+  TrimEntry entry;
+  struct stat st;
+  const char *name;
+  char *path, *body;
+  guint64 total;
+  time_t now;
+  guint i;
+
+  if (cache->size_known && cache->size <= cache->max_size)
+    return;
+
+  dir = g_dir_open (cache->dir, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  entries = g_array_new (FALSE, FALSE, sizeof (TrimEntry));
+  referenced = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  key_file = g_key_file_new ();
+  total = 0;
+
+  while ((name = g_dir_read_name (dir)))
+    {
+      if (!g_str_has_suffix (name, ".meta"))
+        continue;
+
+      path = g_build_filename (cache->dir, name, NULL);
+      body = NULL;
+      if (g_stat (path, &st) == 0 &&
+          g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, NULL))
+        body = g_key_file_get_string (key_file, ENTRY_GROUP, "Body", NULL);
+
+      if (body == NULL)
+        {
+          g_unlink (path);
+          g_free (path);
+          continue;
+        }
+
+      entry.meta_path = path;
+      entry.body_path = g_build_filename (cache->dir, body, NULL);
+      entry.mtime = st.st_mtime;
+      entry.size = g_stat (entry.body_path, &st) == 0 ? st.st_size : 0;
+      g_array_append_val (entries, entry);
+      g_hash_table_insert (referenced, body, NULL);
+      total += entry.size;
+    }
+
+  /* bodies of replaced entries and leftovers of crashed downloads */
+  now = time (NULL);
+  g_dir_rewind (dir);
+  while ((name = g_dir_read_name (dir)))
+    {
+      if (g_str_has_suffix (name, ".meta") ||
+          g_hash_table_lookup_extended (referenced, name, NULL, NULL))
+        continue;
+
+      path = g_build_filename (cache->dir, name, NULL);
+      if (g_stat (path, &st) == 0 && st.st_mtime + STALE_FILE_AGE < now)
+        g_unlink (path);
+      g_free (path);
+    }
+  g_dir_close (dir);
+
+  if (total > cache->max_size)
+    {
+      g_array_sort (entries, trim_entry_compare);
+      for (i = 0; i < entries->len && total > cache->max_size / 4 * 3; i++)
+        {
+          TrimEntry *e = &g_array_index (entries, TrimEntry, i);
+
+          g_unlink (e->meta_path);
+          g_unlink (e->body_path);
+          total -= e->size;
+        }
+    }
+
+  for (i = 0; i < entries->len; i++)
+    {
+      g_free (g_array_index (entries, TrimEntry, i).meta_path);
+      g_free (g_array_index (entries, TrimEntry, i).body_path);
+    }
+  g_array_free (entries, TRUE);
+  g_hash_table_destroy (referenced);
+  g_key_file_free (key_file);
+
+  cache->size = total;
+  cache->size_known = TRUE;
+}
+
+/**
+ * g_vfs_http_cache_new:
+ * @dir: directory for the cache, created if needed
+ * @max_size: maximum size of the cached bodies in bytes
+ *
+ * Creates a cache for http bodies in @dir. Several caches may use the
+ * same directory at the same time.
+ *
+ * Returns: a new cache or %NULL if @dir can't be created
+ **/
+GVfsHttpCache *
+g_vfs_http_cache_new (const char *dir,
+                      guint64     max_size)
+{
+  GVfsHttpCache *cache;
+
+  g_return_val_if_fail (dir != NULL, NULL);
+  g_return_val_if_fail (max_size > 0, NULL);
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+      g_debug ("http cache: can't create %s: %s\n", dir, g_strerror (errno));
+      return NULL;
+    }
+
+  cache = g_slice_new0 (GVfsHttpCache);
+  cache->dir = g_strdup (dir);
+  cache->max_size = max_size;
+
+  g_vfs_http_cache_trim (cache);
+
+  return cache;
+}
+
+void
+g_vfs_http_cache_free (GVfsHttpCache *cache)
+{
+  g_return_if_fail (cache != NULL);
+
+  g_vfs_http_cache_debug (cache, "closed", cache->dir);
+
+  g_free (cache->dir);
+  g_slice_free (GVfsHttpCache, cache);
+}
+
+/**
+ * g_vfs_http_cache_lookup:
+ * @cache: the cache
+ * @key: the URI of the resource
+ *
+ * Looks for a cached body of @key. The body is opened right away, so
+ * it stays available while the server is asked whether it is still
+ * valid.
+ *
+ * Returns: the entry for @key or %NULL if there is none
+ **/
+GVfsHttpCacheEntry *
+g_vfs_http_cache_lookup (GVfsHttpCache *cache,
+                         const char    *key)
+{
+  GVfsHttpCacheEntry *entry;
+  GKeyFile *key_file;
+  GFile *file;
+  struct stat st;
+  char *meta_path, *uri, *body, *body_path, *size;
+  GInputStream *stream;
+
+  g_return_val_if_fail (cache != NULL, NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+
+  meta_path = g_vfs_http_cache_get_meta_path (cache, key, NULL);
+  key_file = g_key_file_new ();
+  entry = NULL;
+
+  if (!g_key_file_load_from_file (key_file, meta_path, G_KEY_FILE_NONE, NULL))
+    goto out;
+
+  uri = g_key_file_get_string (key_file, ENTRY_GROUP, "Uri", NULL);
+  body = g_key_file_get_string (key_file, ENTRY_GROUP, "Body", NULL);
+  size = g_key_file_get_string (key_file, ENTRY_GROUP, "Size", NULL);
+
+  stream = NULL;
+  if (uri && body && size && strcmp (uri, key) == 0)
+    {
+      body_path = g_build_filename (cache->dir, body, NULL);
+      if (g_stat (body_path, &st) == 0 &&
+          (guint64) st.st_size == g_ascii_strtoull (size, NULL, 10))
+        {
+          file = g_file_new_for_path (body_path);
+          stream = G_INPUT_STREAM (g_file_read (file, NULL, NULL));
+          g_object_unref (file);
+        }
+      g_free (body_path);
+    }
+
+  if (stream)
+    {
+      entry = g_slice_new0 (GVfsHttpCacheEntry);
+      entry->cache = cache;
+      entry->key = g_strdup (key);
+      entry->meta_path = meta_path;
+      entry->body = stream;
+      entry->etag = g_key_file_get_string (key_file, ENTRY_GROUP, "ETag", NULL);
+      entry->last_modified = g_key_file_get_string (key_file, ENTRY_GROUP, "LastModified", NULL);
+      entry->content_type = g_key_file_get_string (key_file, ENTRY_GROUP, "ContentType", NULL);
+      entry->size = g_ascii_strtoull (size, NULL, 10);
+      meta_path = NULL;
+    }
+
+  g_free (uri);
+  g_free (body);
+  g_free (size);
+
+ out:
+  g_key_file_free (key_file);
+  g_free (meta_path);
+
+  return entry;
+}
+
+/**
+ * g_vfs_http_cache_entry_add_conditions:
+ * @entry: a cache entry
+ * @msg: a GET request for the entry
+ *
+ * Makes @msg ask for the body only if it changed since it was cached.
+ **/
+void
+g_vfs_http_cache_entry_add_conditions (GVfsHttpCacheEntry *entry,
+                                       SoupMessage        *msg)
+{
+  g_return_if_fail (entry != NULL);
+  g_return_if_fail (SOUP_IS_MESSAGE (msg));
+
+  if (entry->etag)
+    soup_message_headers_replace (msg->request_headers,
+                                  "If-None-Match", entry->etag);
+  if (entry->last_modified)
+    soup_message_headers_replace (msg->request_headers,
+                                  "If-Modified-Since", entry->last_modified);
+}
+
+/**
+ * g_vfs_http_cache_entry_open:
+ * @entry: a cache entry
+ * @msg: the request that got a 304 reply
+ *
+ * Returns the cached body after the server confirmed it is still
+ * valid. The response headers of @msg get the cached Content-Type and
+ * Content-Length, so they describe the body like a 200 reply would.
+ *
+ * Returns: a stream reading the body
+ **/
+GInputStream *
+g_vfs_http_cache_entry_open (GVfsHttpCacheEntry *entry,
+                             SoupMessage        *msg)
+{
+  GVfsHttpCache *cache;
+
+  g_return_val_if_fail (entry != NULL, NULL);
+  g_return_val_if_fail (SOUP_IS_MESSAGE (msg), NULL);
+
+  cache = entry->cache;
+
+  if (entry->content_type)
+    soup_message_headers_replace (msg->response_headers,
+                                  "Content-Type", entry->content_type);
+  if (entry->last_modified &&
+      soup_message_headers_get (msg->response_headers, "Last-Modified") == NULL)
+    soup_message_headers_replace (msg->response_headers,
+                                  "Last-Modified", entry->last_modified);
+  if (entry->etag &&
+      soup_message_headers_get (msg->response_headers, "ETag") == NULL)
+    soup_message_headers_replace (msg->response_headers,
+                                  "ETag", entry->etag);
+  soup_message_headers_set_content_length (msg->response_headers, entry->size);
+
+  /* the modification time orders entries for trimming */
+  g_utime (entry->meta_path, NULL);
+
+  cache->hits++;
+  cache->bytes_saved += entry->size;
+  g_vfs_http_cache_debug (cache, "hit", entry->key);
+
+  return g_object_ref (entry->body);
+}
+
+void
+g_vfs_http_cache_entry_free (GVfsHttpCacheEntry *entry)
+{
+  g_return_if_fail (entry != NULL);
+
+  g_object_unref (entry->body);
+  g_free (entry->key);
+  g_free (entry->meta_path);
+  g_free (entry->etag);
+  g_free (entry->last_modified);
+  g_free (entry->content_type);
+  g_slice_free (GVfsHttpCacheEntry, entry);
+}
+
+/**
+ * g_vfs_http_cache_writer_new:
+ * @cache: the cache
+ * @key: the URI of the resource
+ * @msg: the request, after the response headers arrived
+ *
+ * Prepares to store the body of @msg while it is read. Only bodies of
+ * a known length that can be revalidated and are at most a quarter of
+ * the cache's size are stored. Nothing that is private to the user,
+ * or was fetched with credentials, goes to disk.
+ *
+ * Returns: a writer or %NULL if the body isn't stored
+ **/
+GVfsHttpCacheWriter *
+g_vfs_http_cache_writer_new (GVfsHttpCache *cache,
+                             const char    *key,
+                             SoupMessage   *msg)
+{
+  GVfsHttpCacheWriter *writer;
+  const char *etag, *last_modified, *cache_control;
+  char *checksum, *template;
+  goffset length;
+  int fd;
+
+  g_return_val_if_fail (cache != NULL, NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+  g_return_val_if_fail (SOUP_IS_MESSAGE (msg), NULL);
+
+  cache->misses++;
+  g_vfs_http_cache_debug (cache, "miss", key);
+
+  if (msg->status_code != SOUP_STATUS_OK ||
+      soup_message_headers_get_encoding (msg->response_headers) != SOUP_ENCODING_CONTENT_LENGTH ||
+      soup_message_headers_get (msg->response_headers, "Content-Encoding") != NULL)
+    return NULL;
+
+  length = soup_message_headers_get_content_length (msg->response_headers);
+  if ((guint64) length > cache->max_size / 4)
+    return NULL;
+
+  etag = soup_message_headers_get (msg->response_headers, "ETag");
+  last_modified = soup_message_headers_get (msg->response_headers, "Last-Modified");
+  if (etag == NULL && last_modified == NULL)
+    return NULL;
+
+  cache_control = soup_message_headers_get (msg->response_headers, "Cache-Control");
+  if (cache_control &&
+      (strstr (cache_control, "no-store") || strstr (cache_control, "private")))
+    return NULL;
+
+  if (soup_message_headers_get (msg->request_headers, "Authorization") != NULL)
+    return NULL;
+
+  g_free (g_vfs_http_cache_get_meta_path (cache, key, &checksum));
+  template = g_strdup_printf ("%s/%s-XXXXXX", cache->dir, checksum);
+  g_free (checksum);
+
+  fd = g_mkstemp (template);
+  if (fd == -1)
+    {
+      g_free (template);
+      return NULL;
+    }
+
+  writer = g_slice_new0 (GVfsHttpCacheWriter);
+  writer->cache = cache;
+  writer->key = g_strdup (key);
+  writer->meta_path = g_vfs_http_cache_get_meta_path (cache, key, NULL);
+  writer->body_path = template;
+  writer->fd = fd;
+  writer->expected = length;
+  writer->etag = g_strdup (etag);
+  writer->last_modified = g_strdup (last_modified);
+  writer->content_type = g_strdup (soup_message_headers_get (msg->response_headers,
+                                                             "Content-Type"));
+  return writer;
+}
+
+static void
+g_vfs_http_cache_writer_abort (GVfsHttpCacheWriter *writer)
+{
+  if (writer->fd != -1)
+    {
+      close (writer->fd);
+      writer->fd = -1;
+    }
+  g_unlink (writer->body_path);
+}
+
+/**
+ * g_vfs_http_cache_writer_write:
+ * @writer: a writer
+ * @data: the next part of the body
+ * @len: length of @data
+ *
+ * Appends @data to the stored body.
+ *
+ * Returns: %FALSE if the body can't be stored anymore
+ **/
+gboolean
+g_vfs_http_cache_writer_write (GVfsHttpCacheWriter *writer,
+                               const char          *data,
+                               gsize                len)
+{
+  gssize n;
+
+  g_return_val_if_fail (writer != NULL, FALSE);
+
+  if (writer->fd == -1)
+    return FALSE;
+
+  if (writer->written + len > writer->expected)
+    {
+      g_vfs_http_cache_writer_abort (writer);
+      return FALSE;
+    }
+
+  while (len > 0)
+    {
+      n = write (writer->fd, data, len);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          g_vfs_http_cache_writer_abort (writer);
+          return FALSE;
+        }
+
+      data += n;
+      len -= n;
+      writer->written += n;
+    }
+
+  return TRUE;
+}
+
+/**
+ * g_vfs_http_cache_writer_commit:
+ * @writer: a writer
+ *
+ * Makes the stored body available, if all of it was written. Call
+ * this when the end of the body was read.
+ **/
+void
+g_vfs_http_cache_writer_commit (GVfsHttpCacheWriter *writer)
+{
+  GVfsHttpCache *cache;
+  GKeyFile *key_file;
+  char *old_body, *old_body_path, *basename, *size, *data;
+  gsize length;
+
+  g_return_if_fail (writer != NULL);
+
+  cache = writer->cache;
+
+  if (writer->fd == -1 || writer->written != writer->expected)
+    return;
+
+  if (close (writer->fd) != 0)
+    {
+      writer->fd = -1;
+      return;
+    }
+  writer->fd = -1;
+
+  key_file = g_key_file_new ();
+
+  /* the body this entry replaces */
+  old_body = NULL;
+  if (g_key_file_load_from_file (key_file, writer->meta_path, G_KEY_FILE_NONE, NULL))
+    old_body = g_key_file_get_string (key_file, ENTRY_GROUP, "Body", NULL);
+  g_key_file_free (key_file);
+
+  key_file = g_key_file_new ();
+  basename = g_path_get_basename (writer->body_path);
+  size = g_strdup_printf ("%" G_GUINT64_FORMAT, writer->written);
+  g_key_file_set_string (key_file, ENTRY_GROUP, "Uri", writer->key);
+  g_key_file_set_string (key_file, ENTRY_GROUP, "Body", basename);
+  g_key_file_set_string (key_file, ENTRY_GROUP, "Size", size);
+  if (writer->etag)
+    g_key_file_set_string (key_file, ENTRY_GROUP, "ETag", writer->etag);
+  if (writer->last_modified)
+    g_key_file_set_string (key_file, ENTRY_GROUP, "LastModified", writer->last_modified);
+  if (writer->content_type)
+    g_key_file_set_string (key_file, ENTRY_GROUP, "ContentType", writer->content_type);
+  data = g_key_file_to_data (key_file, &length, NULL);
+  g_key_file_free (key_file);
+  g_free (basename);
+  g_free (size);
+
+  if (g_file_set_contents (writer->meta_path, data, length, NULL))
+    {
+      writer->committed = TRUE;
+      cache->size += writer->written;
+      g_vfs_http_cache_debug (cache, "stored", writer->key);
+
+      if (old_body)
+        {
+          old_body_path = g_build_filename (cache->dir, old_body, NULL);
+          if (strcmp (old_body_path, writer->body_path) != 0)
+            g_unlink (old_body_path);
+          g_free (old_body_path);
+        }
+
+      g_vfs_http_cache_trim (cache);
+    }
+
+  g_free (data);
+  g_free (old_body);
+}
+
+void
+g_vfs_http_cache_writer_free (GVfsHttpCacheWriter *writer)
+{
+  g_return_if_fail (writer != NULL);
+
+  if (!writer->committed)
+    g_vfs_http_cache_writer_abort (writer);
+
+  g_free (writer->key);
+  g_free (writer->meta_path);
+  g_free (writer->body_path);
+  g_free (writer->etag);
+  g_free (writer->last_modified);
+  g_free (writer->content_type);
+  g_slice_free (GVfsHttpCacheWriter, writer);
+}
@@ -0,0 +1,269 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include "gvfshttpdecoder.h"
+
+/* Directory listings compress very well, so requests for them offer
+ * gzip and deflate. Only requests that ask for it get an encoded body;
+ * file contents are always fetched as they are, so that ranges,
+ * lengths and cached bodies keep referring to the file itself.
+ */
+
+#define DECODE_BUFFER_SIZE 16384
+
+struct _GVfsHttpDecoder {
+  GConverter *          converter;      /* NULL until we know the deflate flavor */
+  gboolean              finished;
+  char                  header[2];      /* start of a deflate body */
+  gsize                 header_len;
+  char                  buffer[DECODE_BUFFER_SIZE];
+};
+
+static void
+append_to_string (const char *data,
+                  gsize       len,
+                  gpointer    user_data)
+{
+  g_string_append_len (user_data, data, len);
+}
+
+/* Replaces an encoded body that was read as a whole with the decoded
+ * one, before anybody looks at it */
+static void
+decode_accumulated_body (SoupMessage *msg,
+                         gpointer     user_data)
+{
+  GVfsHttpDecoder *decoder;
+  SoupBuffer *buffer;
+  GString *decoded;
+  gboolean res;
+
+  if (!soup_message_body_get_accumulate (msg->response_body))
+    return;
+
+  decoder = g_vfs_http_decoder_new (msg);
+  if (decoder == NULL)
+    return;
+
+  buffer = soup_message_body_flatten (msg->response_body);
+  decoded = g_string_new (NULL);
+  res = g_vfs_http_decoder_feed (decoder, buffer->data, buffer->length,
+                                 append_to_string, decoded, NULL);
+  soup_buffer_free (buffer);
+  g_vfs_http_decoder_free (decoder);
+
+  if (!res)
+    {
+      g_debug ("http: can't decode the body of %s\n",
+               soup_message_get_uri (msg)->path);
+      g_string_free (decoded, TRUE);
+      return;
+    }
+
+  soup_message_headers_remove (msg->response_headers, "Content-Encoding");
+  soup_message_headers_set_content_length (msg->response_headers, decoded->len);
+
+  soup_message_body_truncate (msg->response_body);
+  soup_message_body_append (msg->response_body, SOUP_MEMORY_TAKE,
+                            decoded->str, decoded->len);
+  g_string_free (decoded, FALSE);
+
+  /* updates response_body->data */
+  soup_buffer_free (soup_message_body_flatten (msg->response_body));
+}
+
+/**
+ * g_vfs_http_decoder_accept_encoding:
+ * @msg: a request
+ *
+ * Lets the server compress the response to @msg. A body that is
+ * accumulated is decoded before the message finishes, so callers of
+ * soup_session_send_message () don't notice. Callers that read the
+ * body in chunks pass them through a #GVfsHttpDecoder themselves.
+ **/
+void
+g_vfs_http_decoder_accept_encoding (SoupMessage *msg)
+{
+  g_return_if_fail (SOUP_IS_MESSAGE (msg));
+
+  soup_message_headers_replace (msg->request_headers,
+                                "Accept-Encoding", "gzip, deflate");
+  g_signal_connect (msg, "got-body",
+                    G_CALLBACK (decode_accumulated_body), NULL);
+}
+
+/**
+ * g_vfs_http_decoder_new:
+ * @msg: a message whose response headers arrived
+ *
+ * Creates a decoder for the body of @msg.
+ *
+ * Returns: a new decoder or %NULL if the body isn't encoded in a
+ * way we can decode
+ **/
+GVfsHttpDecoder *
+g_vfs_http_decoder_new (SoupMessage *msg)
+{
+  GVfsHttpDecoder *decoder;
+  const char *encoding;
+
+  g_return_val_if_fail (SOUP_IS_MESSAGE (msg), NULL);
+
+  encoding = soup_message_headers_get (msg->response_headers, "Content-Encoding");
+  if (encoding == NULL)
+    return NULL;
+
+  if (g_ascii_strcasecmp (encoding, "gzip") == 0 ||
+      g_ascii_strcasecmp (encoding, "x-gzip") == 0)
+    {
+      decoder = g_slice_new0 (GVfsHttpDecoder);
+      decoder->converter = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+    }
+  else if (g_ascii_strcasecmp (encoding, "deflate") == 0)
+    decoder = g_slice_new0 (GVfsHttpDecoder);
+  else
+    return NULL;
+
+  return decoder;
+}
+
+static gboolean
+decoder_convert (GVfsHttpDecoder     *decoder,
+                 const char          *data,
+                 gsize                len,
+                 GVfsHttpDecodedFunc  func,
+                 gpointer             user_data,
+                 GError             **error)
+{
+  GConverterResult res;
+  GError *my_error;
+  gsize bytes_read, bytes_written;
+
+  do
+    {
+      if (decoder->finished)
+        return TRUE;
+
+      my_error = NULL;
+      res = g_converter_convert (decoder->converter,
+                                 data, len,
+                                 decoder->buffer, DECODE_BUFFER_SIZE,
+                                 G_CONVERTER_NO_FLAGS,
+                                 &bytes_read, &bytes_written,
+                                 &my_error);
+      if (res == G_CONVERTER_ERROR)
+        {
+          /* everything we got so far is decoded */
+          if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT))
+            {
+              g_error_free (my_error);
+              return TRUE;
+            }
+
+          g_propagate_error (error, my_error);
+          return FALSE;
+        }
+
+      if (bytes_written > 0)
+        func (decoder->buffer, bytes_written, user_data);
+
+      data += bytes_read;
+      len -= bytes_read;
+
+      if (res == G_CONVERTER_FINISHED)
+        decoder->finished = TRUE;
+    }
+  while (len > 0 || bytes_written == DECODE_BUFFER_SIZE);
+
+  return TRUE;
+}
+
+/* "deflate" means zlib data, but IIS and others send raw deflate
+ * data. A zlib stream starts with a header whose compression method
+ * is 8 and that is a multiple of 31, which raw data rarely does. */
+static gboolean
+is_zlib_header (const char *header)
+{
+  guchar cmf = header[0];
+  guchar flg = header[1];
+
+  return (cmf & 0x0f) == 8 && (cmf >> 4) <= 7 &&
+    ((cmf << 8) | flg) % 31 == 0;
+}
+
+/**
+ * g_vfs_http_decoder_feed:
+ * @decoder: a decoder
+ * @data: the next part of the encoded body
+ * @len: length of @data
+ * @func: function called with the decoded data
+ * @user_data: data for @func
+ * @error: return location for errors
+ *
+ * Decodes @data and passes the result to @func, in as many pieces as
+ * needed. Data after the end of the encoded stream is ignored. For
+ * deflate, both zlib and raw deflate data are accepted.
+ *
+ * Returns: %FALSE if @data couldn't be decoded
+ **/
+gboolean
+g_vfs_http_decoder_feed (GVfsHttpDecoder     *decoder,
+                         const char          *data,
+                         gsize                len,
+                         GVfsHttpDecodedFunc  func,
+                         gpointer             user_data,
+                         GError             **error)
+{
+  GZlibCompressorFormat format;
+
+  g_return_val_if_fail (decoder != NULL, FALSE);
+
+  if (decoder->converter == NULL)
+    {
+      while (decoder->header_len < 2 && len > 0)
+        {
+          decoder->header[decoder->header_len++] = *data++;
+          len--;
+        }
+      if (decoder->header_len < 2)
+        return TRUE;
+
+      if (is_zlib_header (decoder->header))
+        format = G_ZLIB_COMPRESSOR_FORMAT_ZLIB;
+      else
+        format = G_ZLIB_COMPRESSOR_FORMAT_RAW;
+      decoder->converter = G_CONVERTER (g_zlib_decompressor_new (format));
+
+      if (!decoder_convert (decoder, decoder->header, 2, func, user_data, error))
+        return FALSE;
+    }
+
+  return decoder_convert (decoder, data, len, func, user_data, error);
+}
+
+void
+g_vfs_http_decoder_free (GVfsHttpDecoder *decoder)
+{
+  g_return_if_fail (decoder != NULL);
+
+  if (decoder->converter)
+    g_object_unref (decoder->converter);
+  g_slice_free (GVfsHttpDecoder, decoder);
+}
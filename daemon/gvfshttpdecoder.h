@@ -0,0 +1,48 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __G_VFS_HTTP_DECODER_H__
+#define __G_VFS_HTTP_DECODER_H__
+
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+G_BEGIN_DECLS
+
+
+typedef struct _GVfsHttpDecoder GVfsHttpDecoder;
+
+typedef void (*GVfsHttpDecodedFunc) (const char *data,
+                                     gsize       len,
+                                     gpointer    user_data);
+
+void                    g_vfs_http_decoder_accept_encoding      (SoupMessage *          msg);
+
+GVfsHttpDecoder *       g_vfs_http_decoder_new                  (SoupMessage *          msg);
+gboolean                g_vfs_http_decoder_feed                 (GVfsHttpDecoder *      decoder,
+                                                                 const char *           data,
+                                                                 gsize                  len,
+                                                                 GVfsHttpDecodedFunc    func,
+                                                                 gpointer               user_data,
+                                                                 GError **              error);
+void                    g_vfs_http_decoder_free                 (GVfsHttpDecoder *      decoder);
+
+
+G_END_DECLS
+
+#endif /* __G_VFS_HTTP_DECODER_H__ */
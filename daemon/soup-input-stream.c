@@ -35,14 +35,53 @@ G_DEFINE_TYPE_WITH_CODE (SoupInputStream, soup_input_stream, G_TYPE_INPUT_STREAM
 			 G_IMPLEMENT_INTERFACE (G_TYPE_SEEKABLE,
 						soup_input_stream_seekable_iface_init))
 
+/* The body is received into a cache of blocks, and reads are served
+ * from there. After a seek, the data is fetched with bounded "Range"
+ * requests that grow while the reads stay sequential, so a request
+ * usually runs to its end and its connection can be reused instead of
+ * being closed by cancelling an open-ended GET.
+ */
+#define BLOCK_SIZE   (64 * 1024)
+#define CACHE_BLOCKS 64                         /* 4 MiB per stream */
+#define RANGE_MIN    (256 * 1024)
+#define RANGE_MAX    (2 * 1024 * 1024)
+#define MAX_AHEAD    (1024 * 1024)              /* pause the current request this far ahead of the reader */
+#define SKIP_MAX     (256 * 1024)               /* wait for a request rather than seeking */
+#define DRAIN_MAX    (256 * 1024)               /* let a request finish rather than cancelling it */
+
 typedef void (*SoupInputStreamCallback) (GInputStream *);
 
+typedef struct {
+  guint64 index;
+  gsize lo, hi;                 /* valid data in the block */
+  GList *link;                  /* in priv->lru */
+  guchar data[BLOCK_SIZE];
+} Block;
+
+typedef struct {
+  GInputStream *stream;
+  SoupMessage *msg;
+  goffset start, pos;           /* pos is the offset of the next byte received */
+  goffset end;                  /* one past the last byte requested or -1 */
+  gboolean got_headers, finished, paused;
+} RangeRequest;
+
 typedef struct {
   SoupSession *session;
   GMainContext *async_context;
   SoupMessage *msg;
-  gboolean got_headers, finished;
   goffset offset;
+  goffset length;               /* size of the file or -1 if unknown */
+  gboolean accept_ranges;
+  gboolean prefetch;
+
+  RangeRequest *current;        /* the request the reader waits for */
+  RangeRequest *other;          /* prefetching or draining */
+  goffset range_size;
+  goffset next_sequential;
+
+  GHashTable *blocks;
+  GQueue *lru;
 
   GCancellable *cancellable;
   GSource *cancel_watch;
@@ -51,11 +90,8 @@ typedef struct {
   SoupInputStreamCallback finished_cb;
   SoupInputStreamCallback cancelled_cb;
 
-  guchar *leftover_buffer;
-  gsize leftover_bufsize, leftover_offset;
-
   guchar *caller_buffer;
-  gsize caller_bufsize, caller_nread;
+  gsize caller_bufsize;
   GAsyncReadyCallback outstanding_callback;
   GSimpleAsyncResult *result;
 
@@ -105,9 +141,31 @@ static gboolean soup_input_stream_truncate     (GSeekable            *seekable,
 						GCancellable         *cancellable,
 						GError              **error);
 
-static void soup_input_stream_got_headers (SoupMessage *msg, gpointer stream);
-static void soup_input_stream_got_chunk (SoupMessage *msg, SoupBuffer *chunk, gpointer stream);
-static void soup_input_stream_finished (SoupMessage *msg, gpointer stream);
+static void range_request_got_headers (SoupMessage *msg, gpointer user_data);
+static void range_request_got_chunk (SoupMessage *msg, SoupBuffer *chunk, gpointer user_data);
+static void range_request_finished (SoupMessage *msg, gpointer user_data);
+
+static void
+block_free (gpointer data)
+{
+  g_free (data);
+}
+
+static void
+range_request_free (RangeRequest *req)
+{
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (req->stream);
+
+  g_signal_handlers_disconnect_by_func (req->msg, G_CALLBACK (range_request_got_headers), req);
+  g_signal_handlers_disconnect_by_func (req->msg, G_CALLBACK (range_request_got_chunk), req);
+  g_signal_handlers_disconnect_by_func (req->msg, G_CALLBACK (range_request_finished), req);
+
+  if (!req->finished)
+    soup_session_cancel_message (priv->session, req->msg, SOUP_STATUS_CANCELLED);
+
+  g_object_unref (req->msg);
+  g_slice_free (RangeRequest, req);
+}
 
 static void
 soup_input_stream_finalize (GObject *object)
@@ -115,13 +173,16 @@ soup_input_stream_finalize (GObject *object)
   SoupInputStream *stream = SOUP_INPUT_STREAM (object);
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
 
-  g_object_unref (priv->session);
+  if (priv->current)
+    range_request_free (priv->current);
+  if (priv->other)
+    range_request_free (priv->other);
 
-  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_input_stream_got_headers), stream);
-  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_input_stream_got_chunk), stream);
-  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_input_stream_finished), stream);
+  g_object_unref (priv->session);
   g_object_unref (priv->msg);
-  g_free (priv->leftover_buffer);
+
+  g_hash_table_destroy (priv->blocks);
+  g_queue_free (priv->lru);
 
   if (G_OBJECT_CLASS (soup_input_stream_parent_class)->finalize)
     (*G_OBJECT_CLASS (soup_input_stream_parent_class)->finalize) (object);
@@ -158,19 +219,341 @@ soup_input_stream_seekable_iface_init (GSeekableIface *seekable_iface)
 static void
 soup_input_stream_init (SoupInputStream *stream)
 {
-  ;
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+
+  priv->length = -1;
+  priv->accept_ranges = TRUE;
+  priv->range_size = RANGE_MIN;
+  priv->next_sequential = -1;
+  priv->blocks = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+					NULL, block_free);
+  priv->lru = g_queue_new ();
 }
 
+/* Block cache */
+
 static void
-soup_input_stream_queue_message (SoupInputStream *stream)
+cache_touch (SoupInputStreamPrivate *priv, Block *block)
+{
+  g_queue_unlink (priv->lru, block->link);
+  g_queue_push_head_link (priv->lru, block->link);
+}
+
+static Block *
+cache_get_block (SoupInputStreamPrivate *priv, guint64 index)
+{
+  Block *block;
+
+  block = g_hash_table_lookup (priv->blocks, &index);
+  if (block)
+    return block;
+
+  if (g_hash_table_size (priv->blocks) >= CACHE_BLOCKS)
+    {
+      block = g_queue_pop_tail (priv->lru);
+      g_hash_table_remove (priv->blocks, &block->index);
+    }
+
+  block = g_new (Block, 1);
+  block->index = index;
+  block->lo = block->hi = 0;
+  g_queue_push_head (priv->lru, block);
+  block->link = priv->lru->head;
+  g_hash_table_insert (priv->blocks, &block->index, block);
+
+  return block;
+}
+
+static void
+cache_write (SoupInputStreamPrivate *priv, goffset pos,
+	     const guchar *data, gsize length)
+{
+  Block *block;
+  gsize start, n;
+
+  while (length > 0)
+    {
+      block = cache_get_block (priv, pos / BLOCK_SIZE);
+      start = pos % BLOCK_SIZE;
+      n = MIN (length, BLOCK_SIZE - start);
+
+      /* A block only holds one contiguous piece of data */
+      if (start < block->lo || start > block->hi)
+	block->lo = block->hi = start;
+
+      memcpy (block->data + start, data, n);
+      block->hi = MAX (block->hi, start + n);
+      cache_touch (priv, block);
+
+      pos += n;
+      data += n;
+      length -= n;
+    }
+}
+
+static gsize
+cache_read (SoupInputStreamPrivate *priv, goffset pos,
+	    guchar *buffer, gsize count)
+{
+  Block *block;
+  guint64 index;
+  gsize start, n, nread;
+
+  nread = 0;
+  while (nread < count)
+    {
+      index = pos / BLOCK_SIZE;
+      block = g_hash_table_lookup (priv->blocks, &index);
+      start = pos % BLOCK_SIZE;
+      if (block == NULL || start < block->lo || start >= block->hi)
+	break;
+
+      n = MIN (count - nread, block->hi - start);
+      memcpy (buffer + nread, block->data + start, n);
+      cache_touch (priv, block);
+
+      nread += n;
+      pos += n;
+    }
+
+  return nread;
+}
+
+/* Requests */
+
+/* Conditions only apply to the first request; the ranges fetched after
+ * it are always parts of the body it got */
+static void
+copy_request_header (const char *name, const char *value, gpointer headers)
+{
+  if (g_ascii_strcasecmp (name, "Range") != 0 &&
+      g_ascii_strcasecmp (name, "If-None-Match") != 0 &&
+      g_ascii_strcasecmp (name, "If-Modified-Since") != 0)
+    soup_message_headers_append (headers, name, value);
+}
+
+static RangeRequest *
+range_request_new (GInputStream *stream, SoupMessage *msg,
+		   goffset start, goffset end)
 {
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+  RangeRequest *req;
 
-  priv->got_headers = priv->finished = FALSE;
+  req = g_slice_new0 (RangeRequest);
+  req->stream = stream;
+  req->msg = g_object_ref (msg);
+  req->start = req->pos = start;
+  req->end = end;
+
+  g_signal_connect (msg, "got_headers",
+		    G_CALLBACK (range_request_got_headers), req);
+  g_signal_connect (msg, "got_chunk",
+		    G_CALLBACK (range_request_got_chunk), req);
+  g_signal_connect (msg, "finished",
+		    G_CALLBACK (range_request_finished), req);
 
   /* Add an extra ref since soup_session_queue_message steals one */
-  g_object_ref (priv->msg);
-  soup_session_queue_message (priv->session, priv->msg, NULL, NULL);
+  g_object_ref (msg);
+  soup_session_queue_message (priv->session, msg, NULL, NULL);
+
+  return req;
+}
+
+/* Requests the bytes from start to end (or to the end of the file if
+ * end is -1) with the method, URI and headers of the original message */
+static RangeRequest *
+range_request_new_for_range (GInputStream *stream, goffset start, goffset end)
+{
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+  RangeRequest *req;
+  SoupMessage *msg;
+
+  msg = soup_message_new_from_uri (priv->msg->method,
+				   soup_message_get_uri (priv->msg));
+  soup_message_headers_foreach (priv->msg->request_headers,
+				copy_request_header, msg->request_headers);
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+
+  if (priv->accept_ranges)
+    soup_message_headers_set_range (msg->request_headers,
+				    start, end < 0 ? -1 : end - 1);
+  else
+    {
+      start = 0;
+      end = -1;
+    }
+
+  req = range_request_new (stream, msg, start, end);
+  g_object_unref (msg);
+
+  return req;
+}
+
+static gboolean
+range_request_failed (RangeRequest *req)
+{
+  return !SOUP_STATUS_IS_SUCCESSFUL (req->msg->status_code) &&
+    req->msg->status_code != SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE;
+}
+
+/* Keeps the current request from buffering more than MAX_AHEAD bytes
+ * the reader hasn't asked for yet. Other requests are bounded and
+ * always run to their end. */
+static void
+range_request_update_pause (RangeRequest *req)
+{
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (req->stream);
+  gboolean pause;
+
+  if (req->finished || !req->got_headers)
+    return;
+
+  pause = req == priv->current && req->pos - priv->offset > MAX_AHEAD;
+
+  if (!req->paused && pause)
+    {
+      soup_session_pause_message (priv->session, req->msg);
+      req->paused = TRUE;
+    }
+  else if (req->paused && !pause)
+    {
+      soup_session_unpause_message (priv->session, req->msg);
+      req->paused = FALSE;
+    }
+}
+
+static void
+soup_input_stream_update_pause (GInputStream *stream)
+{
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+
+  if (priv->current)
+    range_request_update_pause (priv->current);
+  if (priv->other)
+    range_request_update_pause (priv->other);
+}
+
+/* Asks for the range following the current one while the current one
+ * is still arriving, so sequential reads don't wait for a new request
+ * every time a range ends. */
+static void
+soup_input_stream_maybe_prefetch (GInputStream *stream)
+{
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+  RangeRequest *current = priv->current;
+  goffset start, end;
+
+  if (!priv->prefetch || !priv->accept_ranges ||
+      current == NULL || current->end < 0 || !current->got_headers ||
+      current->msg->status_code != SOUP_STATUS_PARTIAL_CONTENT)
+    return;
+
+  /* only for readers that have been sequential for a while */
+  if (priv->range_size <= RANGE_MIN ||
+      current->end != priv->next_sequential ||
+      current->pos - current->start < (current->end - current->start) / 2)
+    return;
+
+  if (priv->length >= 0 && current->end >= priv->length)
+    return;
+
+  if (priv->other)
+    {
+      if (!priv->other->finished)
+	return;
+      range_request_free (priv->other);
+    }
+
+  priv->range_size = MIN (priv->range_size * 2, RANGE_MAX);
+  start = current->end;
+  end = start + priv->range_size;
+  if (priv->length >= 0)
+    end = MIN (end, priv->length);
+
+  priv->other = range_request_new_for_range (stream, start, end);
+  priv->next_sequential = end;
+}
+
+static gboolean
+range_request_will_deliver (SoupInputStreamPrivate *priv,
+			    RangeRequest *req, goffset offset)
+{
+  if (req == NULL || req->finished || req->pos > offset ||
+      (req->end >= 0 && offset >= req->end))
+    return FALSE;
+
+  /* a server without ranges sends everything anyway */
+  return offset - req->pos < SKIP_MAX || !priv->accept_ranges;
+}
+
+/* A request that is about to finish is left running, its data goes
+ * into the cache and its connection can be reused afterwards */
+static gboolean
+range_request_can_drain (RangeRequest *req)
+{
+  return !req->finished && req->end >= 0 && req->end - req->pos <= DRAIN_MAX;
+}
+
+static void
+soup_input_stream_retire (GInputStream *stream, RangeRequest *req)
+{
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+
+  if (req == NULL)
+    return;
+
+  if (priv->other == NULL && range_request_can_drain (req))
+    {
+      priv->other = req;
+      range_request_update_pause (req);
+    }
+  else
+    range_request_free (req);
+}
+
+/* Makes sure that the data at the current offset is on its way */
+static void
+soup_input_stream_fetch (GInputStream *stream)
+{
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+  RangeRequest *old;
+  goffset start, end;
+
+  if (range_request_will_deliver (priv, priv->current, priv->offset))
+    return;
+
+  if (range_request_will_deliver (priv, priv->other, priv->offset))
+    {
+      old = priv->current;
+      priv->current = priv->other;
+      priv->other = NULL;
+      soup_input_stream_retire (stream, old);
+      range_request_update_pause (priv->current);
+      return;
+    }
+
+  if (priv->other && !range_request_can_drain (priv->other))
+    {
+      range_request_free (priv->other);
+      priv->other = NULL;
+    }
+  old = priv->current;
+  priv->current = NULL;
+  soup_input_stream_retire (stream, old);
+
+  /* Grow the ranges while the reader is sequential */
+  start = priv->offset;
+  if (start == priv->next_sequential)
+    priv->range_size = MIN (priv->range_size * 2, RANGE_MAX);
+  else
+    priv->range_size = RANGE_MIN;
+
+  end = start + priv->range_size;
+  if (priv->length >= 0)
+    end = MIN (end, priv->length);
+
+  priv->current = range_request_new_for_range (stream, start, end);
+  priv->next_sequential = end;
 }
 
 /**
@@ -189,6 +572,9 @@ soup_input_stream_queue_message (SoupInputStream *stream)
  * If @msg gets a non-2xx result, the first read (or send) will return
  * an error with type %SOUP_INPUT_STREAM_HTTP_ERROR.
  *
+ * Seeking sends new requests for parts of the body with the method,
+ * URI and headers of @msg, @msg itself is only sent once.
+ *
  * Internally, #SoupInputStream is implemented using asynchronous I/O,
  * so if you are using the synchronous API (eg,
  * g_input_stream_read()), you should create a new #GMainContext and
@@ -214,21 +600,38 @@ soup_input_stream_new (SoupSession *session, SoupMessage *msg)
   priv->async_context = soup_session_get_async_context (session);
   priv->msg = g_object_ref (msg);
 
-  g_signal_connect (msg, "got_headers",
-		    G_CALLBACK (soup_input_stream_got_headers), stream);
-  g_signal_connect (msg, "got_chunk",
-		    G_CALLBACK (soup_input_stream_got_chunk), stream);
-  g_signal_connect (msg, "finished",
-		    G_CALLBACK (soup_input_stream_finished), stream);
-
-  soup_input_stream_queue_message (stream);
+  priv->current = range_request_new (G_INPUT_STREAM (stream), msg, 0, -1);
   return G_INPUT_STREAM (stream);
 }
 
+/**
+ * soup_input_stream_set_prefetch:
+ * @stream: a #SoupInputStream
+ * @prefetch: whether to request ranges ahead of the reader
+ *
+ * Lets @stream request the next part of the body on a second
+ * connection while a sequential reader is still busy with the current
+ * one. This is off by default.
+ **/
+void
+soup_input_stream_set_prefetch (GInputStream *stream,
+				gboolean      prefetch)
+{
+  SoupInputStreamPrivate *priv;
+
+  g_return_if_fail (SOUP_IS_INPUT_STREAM (stream));
+
+  priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+  priv->prefetch = prefetch;
+}
+
 static void
-soup_input_stream_got_headers (SoupMessage *msg, gpointer stream)
+range_request_got_headers (SoupMessage *msg, gpointer user_data)
 {
-  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+  RangeRequest *req = user_data;
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (req->stream);
+  const char *accept_ranges;
+  goffset start, end, total;
 
   /* If the status is unsuccessful, we just ignore the signal and let
    * libsoup keep going (eventually either it will requeue the request
@@ -238,24 +641,57 @@ soup_input_stream_got_headers (SoupMessage *msg, gpointer stream)
   if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
     return;
 
-  priv->got_headers = TRUE;
-  if (!priv->caller_buffer)
+  req->got_headers = TRUE;
+
+  if (msg->status_code == SOUP_STATUS_PARTIAL_CONTENT)
     {
-      /* Not ready to read the body yet */
-      soup_session_pause_message (priv->session, msg);
+      if (soup_message_headers_get_content_range (msg->response_headers,
+						  &start, &end, &total))
+	{
+	  req->pos = start;
+	  if (total >= 0)
+	    priv->length = total;
+	}
+    }
+  else
+    {
+      /* The whole body, even if we asked for a range */
+      if (req->start > 0)
+	{
+	  priv->accept_ranges = FALSE;
+
+	  /* not worth it for prefetching */
+	  if (req == priv->other)
+	    {
+	      priv->other = NULL;
+	      range_request_free (req);
+	      return;
+	    }
+	}
+      req->start = req->pos = 0;
+      req->end = -1;
+
+      if (soup_message_headers_get_encoding (msg->response_headers) == SOUP_ENCODING_CONTENT_LENGTH)
+	priv->length = soup_message_headers_get_content_length (msg->response_headers);
     }
 
-  if (priv->got_headers_cb)
-    priv->got_headers_cb (stream);
+  accept_ranges = soup_message_headers_get (msg->response_headers, "Accept-Ranges");
+  if (accept_ranges && g_ascii_strcasecmp (accept_ranges, "none") == 0)
+    priv->accept_ranges = FALSE;
+
+  range_request_update_pause (req);
+
+  if (req == priv->current && priv->got_headers_cb)
+    priv->got_headers_cb (req->stream);
 }
 
 static void
-soup_input_stream_got_chunk (SoupMessage *msg, SoupBuffer *chunk_buffer,
-			     gpointer stream)
+range_request_got_chunk (SoupMessage *msg, SoupBuffer *chunk_buffer,
+			 gpointer user_data)
 {
+  RangeRequest *req = user_data;
+  GInputStream *stream = req->stream;
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
-  const gchar *chunk = chunk_buffer->data;
-  gsize chunk_size = chunk_buffer->length;
 
   /* We only pay attention to the chunk if it's part of a successful
    * response.
@@ -263,57 +699,40 @@ soup_input_stream_got_chunk (SoupMessage *msg, SoupBuffer *chunk_buffer,
   if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
     return;
 
-  /* Sanity check */
-  if (priv->caller_bufsize == 0 || priv->leftover_bufsize != 0)
-    g_warning ("soup_input_stream_got_chunk called again before previous chunk was processed");
-
-  /* Copy what we can into priv->caller_buffer */
-  if (priv->caller_bufsize - priv->caller_nread > 0)
-    {
-      gsize nread = MIN (chunk_size, priv->caller_bufsize - priv->caller_nread);
-
-      memcpy (priv->caller_buffer + priv->caller_nread, chunk, nread);
-      priv->caller_nread += nread;
-      priv->offset += nread;
-      chunk += nread;
-      chunk_size -= nread;
-    }
+  cache_write (priv, req->pos,
+	       (const guchar *) chunk_buffer->data, chunk_buffer->length);
+  req->pos += chunk_buffer->length;
 
-  if (chunk_size > 0)
-    {
-      /* Copy the rest into priv->leftover_buffer. If there's already
-       * some data there, realloc and append. Otherwise just copy.
-       */
-      if (priv->leftover_bufsize)
-	{
-	  priv->leftover_buffer = g_realloc (priv->leftover_buffer,
-					     priv->leftover_bufsize + chunk_size);
-	  memcpy (priv->leftover_buffer + priv->leftover_bufsize,
-		  chunk, chunk_size);
-	  priv->leftover_bufsize += chunk_size;
-	}
-      else
-	{
-	  priv->leftover_bufsize = chunk_size;
-	  priv->leftover_buffer = g_memdup (chunk, chunk_size);
-	  priv->leftover_offset = 0;
-	}
-    }
+  range_request_update_pause (req);
+  soup_input_stream_maybe_prefetch (stream);
 
-  soup_session_pause_message (priv->session, msg);
   if (priv->got_chunk_cb)
     priv->got_chunk_cb (stream);
 }
 
 static void
-soup_input_stream_finished (SoupMessage *msg, gpointer stream)
+range_request_finished (SoupMessage *msg, gpointer user_data)
 {
+  RangeRequest *req = user_data;
+  GInputStream *stream = req->stream;
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
 
-  priv->finished = TRUE;
+  req->finished = TRUE;
+
+  /* A request that ends early ends at the end of the file */
+  if (msg->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE)
+    {
+      if (priv->length < 0 || priv->length > req->start)
+	priv->length = req->start;
+    }
+  else if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code) &&
+	   (req->end < 0 || req->pos < req->end))
+    priv->length = req->pos;
 
-  if (priv->finished_cb)
+  if (req == priv->current && priv->finished_cb)
     priv->finished_cb (stream);
+  else if (priv->got_chunk_cb)
+    priv->got_chunk_cb (stream);
 }
 
 static gboolean
@@ -324,7 +743,6 @@ soup_input_stream_cancelled (GIOChannel *chan, GIOCondition condition,
 
   priv->cancel_watch = NULL;
 
-  soup_session_pause_message (priv->session, priv->msg);
   if (priv->cancelled_cb)
     priv->cancelled_cb (stream);
 
@@ -333,9 +751,7 @@ soup_input_stream_cancelled (GIOChannel *chan, GIOCondition condition,
 
 static void
 soup_input_stream_prepare_for_io (GInputStream *stream,
-				  GCancellable *cancellable,
-				  guchar       *buffer,
-				  gsize         count)
+				  GCancellable *cancellable)
 {
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
   int cancel_fd;
@@ -351,13 +767,6 @@ soup_input_stream_prepare_for_io (GInputStream *stream,
 					      stream);
       g_io_channel_unref (chan);
     }
-
-  priv->caller_buffer = buffer;
-  priv->caller_bufsize = count;
-  priv->caller_nread = 0;
-
-  if (priv->got_headers)
-    soup_session_unpause_message (priv->session, priv->msg);
 }
 
 static void
@@ -389,30 +798,49 @@ set_error_if_http_failed (SoupMessage *msg, GError **error)
   return FALSE;
 }
 
-static gsize
-read_from_leftover (SoupInputStreamPrivate *priv,
-		    gpointer buffer, gsize bufsize)
+/* Returns FALSE if the read has to wait for data from the network,
+ * otherwise sets nread to the number of bytes read or to -1 on error */
+static gboolean
+soup_input_stream_try_read (GInputStream *stream,
+			    guchar       *buffer,
+			    gsize         count,
+			    gssize       *nread,
+			    GError      **error)
 {
-  gsize nread;
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+  RangeRequest *req;
+  gsize n;
 
-  if (priv->leftover_bufsize - priv->leftover_offset <= bufsize)
+  if (count == 0 || (priv->length >= 0 && priv->offset >= priv->length))
     {
-      nread = priv->leftover_bufsize - priv->leftover_offset;
-      memcpy (buffer, priv->leftover_buffer + priv->leftover_offset, nread);
+      *nread = 0;
+      return TRUE;
+    }
 
-      g_free (priv->leftover_buffer);
-      priv->leftover_buffer = NULL;
-      priv->leftover_bufsize = priv->leftover_offset = 0;
+  n = cache_read (priv, priv->offset, buffer, count);
+  if (n > 0)
+    {
+      priv->offset += n;
+      soup_input_stream_update_pause (stream);
+      soup_input_stream_maybe_prefetch (stream);
+      *nread = n;
+      return TRUE;
     }
-  else
+
+  req = priv->current;
+  if (req && req->finished && req->pos <= priv->offset &&
+      (req->end < 0 || priv->offset < req->end) &&
+      range_request_failed (req))
     {
-      nread = bufsize;
-      memcpy (buffer, priv->leftover_buffer + priv->leftover_offset, nread);
-      priv->leftover_offset += nread;
+      set_error_if_http_failed (req->msg, error);
+      priv->current = NULL;
+      range_request_free (req);
+      *nread = -1;
+      return TRUE;
     }
 
-  priv->offset += nread;
-  return nread;
+  soup_input_stream_fetch (stream);
+  return FALSE;
 }
 
 /* This does the work of soup_input_stream_send(), assuming that the
@@ -426,8 +854,8 @@ soup_input_stream_send_internal (GInputStream  *stream,
 {
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
 
-  soup_input_stream_prepare_for_io (stream, cancellable, NULL, 0);
-  while (!priv->finished && !priv->got_headers &&
+  soup_input_stream_prepare_for_io (stream, cancellable);
+  while (!priv->current->finished && !priv->current->got_headers &&
 	 !g_cancellable_is_cancelled (cancellable))
     g_main_context_iteration (priv->async_context, TRUE);
   soup_input_stream_done_io (stream);
@@ -478,30 +906,25 @@ soup_input_stream_read (GInputStream *stream,
 			GError      **error)
 {
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+  gssize nread;
 
-  if (priv->finished)
-    return 0;
+  if (soup_input_stream_try_read (stream, buffer, count, &nread, error))
+    return nread;
 
-  /* If there is data leftover from a previous read, return it. */
-  if (priv->leftover_bufsize)
-    return read_from_leftover (priv, buffer, count);
-
-  /* No leftover data, accept one chunk from the network */
-  soup_input_stream_prepare_for_io (stream, cancellable, buffer, count);
-  while (!priv->finished && priv->caller_nread == 0 &&
-	 !g_cancellable_is_cancelled (cancellable))
-    g_main_context_iteration (priv->async_context, TRUE);
+  soup_input_stream_prepare_for_io (stream, cancellable);
+  while (!g_cancellable_is_cancelled (cancellable))
+    {
+      g_main_context_iteration (priv->async_context, TRUE);
+      if (soup_input_stream_try_read (stream, buffer, count, &nread, error))
+	{
+	  soup_input_stream_done_io (stream);
+	  return nread;
+	}
+    }
   soup_input_stream_done_io (stream);
 
-  if (priv->caller_nread > 0)
-    return priv->caller_nread;
-
-  if (g_cancellable_set_error_if_cancelled (cancellable, error))
-    return -1;
-  else if (set_error_if_http_failed (priv->msg, error))
-    return -1;
-  else
-    return 0;
+  g_cancellable_set_error_if_cancelled (cancellable, error);
+  return -1;
 }
 
 static gboolean
@@ -511,8 +934,16 @@ soup_input_stream_close (GInputStream *stream,
 {
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
 
-  if (!priv->finished)
-    soup_session_cancel_message (priv->session, priv->msg, SOUP_STATUS_CANCELLED);
+  if (priv->current)
+    {
+      range_request_free (priv->current);
+      priv->current = NULL;
+    }
+  if (priv->other)
+    {
+      range_request_free (priv->other);
+      priv->other = NULL;
+    }
 
   return TRUE;
 }
@@ -617,7 +1048,7 @@ soup_input_stream_send_async_internal (GInputStream        *stream,
   priv->got_headers_cb = send_async_finished;
   priv->finished_cb = send_async_finished;
 
-  soup_input_stream_prepare_for_io (stream, cancellable, NULL, 0);
+  soup_input_stream_prepare_for_io (stream, cancellable);
   priv->result = g_simple_async_result_new (G_OBJECT (stream),
 					    wrapper_callback, user_data,
 					    soup_input_stream_send_async);
@@ -696,18 +1127,23 @@ read_async_done (GInputStream *stream)
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
   GSimpleAsyncResult *result;
   GError *error = NULL;
+  gssize nread = 0;
+
+  if (!g_cancellable_set_error_if_cancelled (priv->cancellable, &error) &&
+      !soup_input_stream_try_read (stream, priv->caller_buffer,
+				   priv->caller_bufsize, &nread, &error))
+    return;
 
   result = priv->result;
   priv->result = NULL;
 
-  if (g_cancellable_set_error_if_cancelled (priv->cancellable, &error) ||
-      set_error_if_http_failed (priv->msg, &error))
+  if (error)
     {
       g_simple_async_result_set_from_error (result, error);
       g_error_free (error);
     }
   else
-    g_simple_async_result_set_op_res_gssize (result, priv->caller_nread);
+    g_simple_async_result_set_op_res_gssize (result, nread);
 
   priv->got_chunk_cb = NULL;
   priv->finished_cb = NULL;
@@ -729,6 +1165,8 @@ soup_input_stream_read_async (GInputStream        *stream,
 {
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
   GSimpleAsyncResult *result;
+  GError *error = NULL;
+  gssize nread;
 
   /* If the session uses the default GMainContext, then we can do
    * async I/O directly. But if it has its own main context, we fall
@@ -746,29 +1184,28 @@ soup_input_stream_read_async (GInputStream        *stream,
 				      callback, user_data,
 				      soup_input_stream_read_async);
 
-  if (priv->finished)
+  if (soup_input_stream_try_read (stream, buffer, count, &nread, &error))
     {
-      g_simple_async_result_set_op_res_gssize (result, 0);
-      g_simple_async_result_complete_in_idle (result);
-      g_object_unref (result);
-      return;
-    }
-
-  if (priv->leftover_bufsize)
-    {
-      gsize nread = read_from_leftover (priv, buffer, count);
-      g_simple_async_result_set_op_res_gssize (result, nread);
+      if (error)
+	{
+	  g_simple_async_result_set_from_error (result, error);
+	  g_error_free (error);
+	}
+      else
+	g_simple_async_result_set_op_res_gssize (result, nread);
       g_simple_async_result_complete_in_idle (result);
       g_object_unref (result);
       return;
     }
 
   priv->result = result;
+  priv->caller_buffer = buffer;
+  priv->caller_bufsize = count;
 
   priv->got_chunk_cb = read_async_done;
   priv->finished_cb = read_async_done;
   priv->cancelled_cb = read_async_done;
-  soup_input_stream_prepare_for_io (stream, cancellable, buffer, count);
+  soup_input_stream_prepare_for_io (stream, cancellable);
 }
 
 static gssize
@@ -834,8 +1271,6 @@ soup_input_stream_can_seek (GSeekable *seekable)
   return TRUE;
 }
 
-extern void soup_message_io_cleanup (SoupMessage *msg);
-
 static gboolean
 soup_input_stream_seek (GSeekable     *seekable,
 			goffset        offset,
@@ -845,51 +1280,46 @@ soup_input_stream_seek (GSeekable     *seekable,
 {
   GInputStream *stream = G_INPUT_STREAM (seekable);
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (seekable);
-  char *range;
-
-  if (type == G_SEEK_END)
-    {
-      /* FIXME: we could send "bytes=-offset", but unless we know the
-       * Content-Length, we wouldn't be able to answer a tell() properly.
-       * We could find the Content-Length by doing a HEAD...
-       */
-
-      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-	                   "G_SEEK_END not currently supported");
-      return FALSE;
-    }
-
-  if (!g_input_stream_set_pending (stream, error))
-      return FALSE;
-
-  soup_session_cancel_message (priv->session, priv->msg, SOUP_STATUS_CANCELLED);
-  soup_message_io_cleanup (priv->msg);
 
   switch (type)
     {
     case G_SEEK_CUR:
       offset += priv->offset;
-      /* fall through */
+      break;
 
     case G_SEEK_SET:
-      range = g_strdup_printf ("bytes=%"G_GUINT64_FORMAT"-", (guint64)offset);
-      priv->offset = offset;
       break;
 
     case G_SEEK_END:
-      range = NULL; /* keep compilers happy */
-      g_return_val_if_reached (FALSE);
+      /* Known from Content-Length or Content-Range once the headers
+       * of the first response arrived */
+      if (priv->length < 0)
+	{
+	  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			       "G_SEEK_END not supported without a known length");
+	  return FALSE;
+	}
+      offset += priv->length;
       break;
 
     default:
       g_return_val_if_reached (FALSE);
     }
 
-  soup_message_headers_remove (priv->msg->request_headers, "Range");
-  soup_message_headers_append (priv->msg->request_headers, "Range", range);
-  g_free (range);
+  if (offset < 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+			   "Invalid seek request");
+      return FALSE;
+    }
+
+  if (!g_input_stream_set_pending (stream, error))
+      return FALSE;
 
-  soup_input_stream_queue_message (SOUP_INPUT_STREAM (stream));
+  /* The data is requested by the next read, unless it is cached or
+   * already on its way */
+  priv->offset = offset;
+  soup_input_stream_update_pause (stream);
 
   g_input_stream_clear_pending (stream);
   return TRUE;
@@ -57,6 +57,9 @@ GType soup_input_stream_get_type (void) G_GNUC_CONST;
 GInputStream *soup_input_stream_new         (SoupSession         *session,
 					     SoupMessage         *msg);
 
+void          soup_input_stream_set_prefetch (GInputStream       *stream,
+					      gboolean            prefetch);
+
 gboolean      soup_input_stream_send        (GInputStream        *stream,
 					     GCancellable        *cancellable,
 					     GError             **error);
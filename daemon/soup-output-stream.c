@@ -20,9 +20,12 @@
 
 #include <config.h>
 
+#include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
 #include <libsoup/soup.h>
@@ -32,7 +35,12 @@
 
 G_DEFINE_TYPE (SoupOutputStream, soup_output_stream, G_TYPE_OUTPUT_STREAM)
 
-typedef void (*SoupOutputStreamCallback) (GOutputStream *);
+/* Size of the pieces a spooled request body is sent in */
+#define SPOOL_CHUNK_SIZE (64 * 1024)
+
+/* How long to wait for "100 Continue" before sending the body anyway,
+ * in milliseconds. Same as curl. */
+#define CONTINUE_TIMEOUT 1000
 
 typedef struct {
   SoupSession *session;
@@ -41,19 +49,25 @@ typedef struct {
   gboolean finished;
 
   goffset size, offset;
-  GByteArray *ba;
 
   GCancellable *cancellable;
   GSource *cancel_watch;
-  SoupOutputStreamCallback finished_cb;
-  SoupOutputStreamCallback cancelled_cb;
 
-  GSimpleAsyncResult *result;
+  GSimpleAsyncResult *result; /* Pending write or close */
+  const void *write_buffer; /* Data of the pending write, NULL when closing */
+  gsize write_count;
 
   gboolean chunked; /* Whether chunked encoding should be used */
-  gboolean msg_queued; /* Whether a chunked request has been queued yet */
-  gsize chunk_size; /* Size of chunk currently being written */
-  gboolean chunk_finished; /* FALSE if chunk I/O is currently in progress */
+  gboolean msg_queued; /* Whether the request has been queued yet */
+  gboolean opening; /* Whether the pending result is from open_async */
+  GSource *continue_timeout;
+
+  gboolean spooling; /* Whether writes go to the spool file */
+  gboolean spool_sending; /* Whether the request body is read from the spool file */
+  int spool_fd;
+  goffset spool_size;
+  char *spool_buffer;
+  GError *spool_error;
 } SoupOutputStreamPrivate;
 #define SOUP_OUTPUT_STREAM_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), SOUP_TYPE_OUTPUT_STREAM, SoupOutputStreamPrivate))
 
@@ -85,23 +99,31 @@ static gboolean soup_output_stream_close_finish (GOutputStream        *stream,
 						 GError              **error);
 
 static void soup_output_stream_finished (SoupMessage *msg, gpointer stream);
+static void soup_output_stream_wrote_chunk (SoupMessage *msg, gpointer stream);
+static void soup_output_stream_got_informational (SoupMessage *msg, gpointer stream);
 static void soup_output_stream_done_io (GOutputStream *stream);
 
 static void
-soup_output_stream_wrote_chunk(SoupMessage *msg, gpointer ud)
+soup_output_stream_connect_msg (GOutputStream *stream)
 {
-  SoupOutputStreamPrivate *priv;
-  SoupOutputStream *stream;
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
 
-  stream = SOUP_OUTPUT_STREAM(ud);
-  priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
-  priv->chunk_finished = TRUE;
+  g_signal_connect (priv->msg, "wrote-chunk",
+                    G_CALLBACK (soup_output_stream_wrote_chunk), stream);
+  g_signal_connect (priv->msg, "finished",
+                    G_CALLBACK (soup_output_stream_finished), stream);
+  g_signal_connect (priv->msg, "got-informational",
+                    G_CALLBACK (soup_output_stream_got_informational), stream);
+}
 
-  GSimpleAsyncResult *result = priv->result;
-  soup_output_stream_done_io (G_OUTPUT_STREAM(ud));
-  g_simple_async_result_set_op_res_gssize (result, priv->chunk_size);
-  g_simple_async_result_complete (result);
-  g_object_unref(result);
+static void
+soup_output_stream_disconnect_msg (GOutputStream *stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+
+  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_output_stream_finished), stream);
+  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_output_stream_wrote_chunk), stream);
+  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_output_stream_got_informational), stream);
 }
 
 static void
@@ -109,14 +131,18 @@ soup_output_stream_finalize (GObject *object)
 {
   SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (object);
 
-  g_object_unref (priv->session);
-
-  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_output_stream_finished), object);
-  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_output_stream_wrote_chunk), object);
+  soup_output_stream_disconnect_msg (G_OUTPUT_STREAM (object));
+  if (priv->msg_queued && !priv->finished)
+    soup_session_cancel_message (priv->session, priv->msg, SOUP_STATUS_CANCELLED);
   g_object_unref (priv->msg);
 
-  if (priv->ba)
-    g_byte_array_free (priv->ba, TRUE);
+  g_object_unref (priv->session);
+
+  if (priv->spool_fd != -1)
+    close (priv->spool_fd);
+  g_free (priv->spool_buffer);
+  if (priv->spool_error)
+    g_error_free (priv->spool_error);
 
   if (G_OBJECT_CLASS (soup_output_stream_parent_class)->finalize)
     (*G_OBJECT_CLASS (soup_output_stream_parent_class)->finalize) (object);
@@ -145,31 +171,31 @@ soup_output_stream_init (SoupOutputStream *stream)
 {
   SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
 
-  priv->ba = g_byte_array_new ();
+  priv->spool_fd = -1;
 }
 
 
 /**
  * soup_output_stream_new:
- * @session: the #SoupSessionSync to use
+ * @session: the #SoupSessionAsync to use
  * @msg: the #SoupMessage whose request will be streamed
  * @size: the total size of the request body, or -1 if not known
  * 
  * Prepares to send @msg over @session, and returns a #GOutputStream
- * that can be used to write the response. The server's response will
- * be available in @msg after calling soup_output_stream_close()
- * (which will return a %SOUP_OUTPUT_STREAM_HTTP_ERROR #GError if the
- * status is not 2xx).
+ * that can be used to write the request body. The server's response
+ * will be available in @msg after calling soup_output_stream_close()
+ * (which will return a %SOUP_HTTP_ERROR #GError if the status is not
+ * 2xx).
  *
  * If you know the total number of bytes that will be written, pass
- * that in @size. Otherwise, pass -1. (If you pass a size, you MUST
- * write that many bytes to the stream; Trying to write more than
- * that, or closing the stream without having written enough, will
- * result in an error.
+ * that in @size. The request is then sent with that Content-Length
+ * while you write to the stream, and you MUST write exactly that many
+ * bytes; Trying to write more than that, or closing the stream
+ * without having written enough, will result in an error.
  *
- * In some situations, the request will not actually be sent until you
- * call g_output_stream_close(). (In fact, currently this is *always*
- * true.)
+ * Otherwise, pass -1. The data is then spooled to a temporary file
+ * and the request is sent when you call g_output_stream_close().
+ * Either way the body is never kept in memory as a whole.
  *
  * Internally, #SoupOutputStream is implemented using asynchronous
  * I/O, so if you are using the synchronous API (eg,
@@ -198,6 +224,16 @@ soup_output_stream_new (SoupSession *session, SoupMessage *msg, goffset size)
   priv->size = size;
   priv->chunked = FALSE;
 
+  if (size >= 0)
+    soup_message_headers_set_content_length (priv->msg->request_headers, size);
+  else
+    priv->spooling = TRUE;
+
+  /* Written data is only referenced by the message until it is sent */
+  soup_message_body_set_accumulate (priv->msg->request_body, FALSE);
+
+  soup_output_stream_connect_msg (G_OUTPUT_STREAM (stream));
+
   return G_OUTPUT_STREAM (stream);
 }
 
@@ -206,6 +242,12 @@ soup_output_stream_new (SoupSession *session, SoupMessage *msg, goffset size)
  * @session: the #SoupSessionAsync to use
  * @msg: the #SoupMessage whose request will be streamed
  *
+ * Like soup_output_stream_new(), but sends the data with chunked
+ * encoding while it is being written. The request asks for a
+ * "100 Continue" before sending the body, so if the server refuses
+ * chunked requests the data is spooled to a temporary file instead
+ * and sent with a Content-Length on close.
+ *
  * Returns: a new #GOutputStream.
  **/
 GOutputStream *
@@ -214,18 +256,38 @@ soup_output_stream_new_chunked(SoupSession *session, SoupMessage *msg)
   SoupOutputStreamPrivate *priv;
   GOutputStream *stream;
 
+  soup_message_headers_set_encoding (msg->request_headers, SOUP_ENCODING_CHUNKED);
   stream = soup_output_stream_new (session, msg, -1);
   priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (SOUP_OUTPUT_STREAM(stream));
   priv->chunked = TRUE;
-  priv->msg_queued = FALSE;
-  priv->finished = FALSE;
-  soup_message_headers_set_encoding (priv->msg->request_headers, SOUP_ENCODING_CHUNKED);
+  priv->spooling = FALSE;
+  soup_message_headers_set_expectations (priv->msg->request_headers,
+                                         SOUP_EXPECTATION_CONTINUE);
 
-  g_signal_connect (priv->msg, "wrote-chunk",
-                    G_CALLBACK (soup_output_stream_wrote_chunk), stream);
   return stream;
 }
 
+static void
+soup_output_stream_finish_op (GOutputStream *stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  GSimpleAsyncResult *result;
+
+  result = priv->result;
+  priv->result = NULL;
+  priv->write_buffer = NULL;
+  priv->opening = FALSE;
+  if (priv->continue_timeout)
+    {
+      g_source_destroy (priv->continue_timeout);
+      priv->continue_timeout = NULL;
+    }
+  soup_output_stream_done_io (stream);
+
+  g_simple_async_result_complete (result);
+  g_object_unref (result);
+}
+
 static gboolean
 soup_output_stream_cancelled (GIOChannel *chan, GIOCondition condition,
 			      gpointer stream)
@@ -233,10 +295,18 @@ soup_output_stream_cancelled (GIOChannel *chan, GIOCondition condition,
   SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
 
   priv->cancel_watch = NULL;
+  g_cancellable_release_fd (priv->cancellable);
 
-  soup_session_pause_message (priv->session, priv->msg);
-  if (priv->cancelled_cb)
-    priv->cancelled_cb (stream);
+  /* A request body can't be resumed, so the upload is over */
+  if (priv->result)
+    {
+      g_simple_async_result_set_error (priv->result, G_IO_ERROR,
+				       G_IO_ERROR_CANCELLED,
+				       "Operation was cancelled");
+      soup_output_stream_finish_op (stream);
+    }
+  if (priv->msg_queued && !priv->finished)
+    soup_session_cancel_message (priv->session, priv->msg, SOUP_STATUS_CANCELLED);
 
   return FALSE;
 }  
@@ -260,22 +330,6 @@ soup_output_stream_setup_cancellation(GOutputStream *stream,
     }
 }
 
-static void
-soup_output_stream_prepare_for_io (GOutputStream *stream, GCancellable *cancellable)
-{
-  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
-
-  /* Move the buffer to the SoupMessage */
-  soup_message_body_append (priv->msg->request_body, SOUP_MEMORY_TAKE,
-			    priv->ba->data, priv->ba->len);
-  g_byte_array_free (priv->ba, FALSE);
-  priv->ba = NULL;
-
-  soup_output_stream_setup_cancellation (stream, priv, cancellable);
-
-  soup_session_queue_message (priv->session, priv->msg, NULL, NULL);
-}
-
 static void
 soup_output_stream_done_io (GOutputStream *stream)
 {
@@ -301,209 +355,600 @@ set_error_if_http_failed (SoupMessage *msg, GError **error)
     }
   return FALSE;
 }
+
+/* The server answered before it got the whole request body */
+static void
+set_error_finished_early (SoupMessage *msg, GError **error)
+{
+  if (!set_error_if_http_failed (msg, error))
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			 "Server ended the upload early");
+}
+
+static gboolean
+is_chunked_rejected (guint status)
+{
+  return status == SOUP_STATUS_LENGTH_REQUIRED ||
+         status == SOUP_STATUS_EXPECTATION_FAILED ||
+         status == SOUP_STATUS_NOT_IMPLEMENTED;
+}
+
+static gboolean
+soup_output_stream_check_size (SoupOutputStreamPrivate *priv,
+			       gsize count,
+			       GError **error)
+{
+  if (priv->size >= 0 && priv->offset + count > priv->size)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+			   "Write would exceed caller-defined file size");
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+soup_output_stream_spool (SoupOutputStreamPrivate *priv,
+			  const void *buffer,
+			  gsize count,
+			  GError **error)
+{
+  const char *p = buffer;
+  char *filename;
+  gssize res;
+  int errsv;
+
+  if (priv->spool_fd == -1)
+    {
+      priv->spool_fd = g_file_open_tmp ("gvfs-upload-XXXXXX", &filename, error);
+      if (priv->spool_fd == -1)
+	return FALSE;
+      /* Nobody else needs to see it and it goes away with the fd */
+      g_unlink (filename);
+      g_free (filename);
+    }
+
+  while (count > 0)
+    {
+      res = write (priv->spool_fd, p, count);
+      if (res < 0)
+	{
+	  errsv = errno;
+	  if (errsv == EINTR)
+	    continue;
+	  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+		       "Error writing temporary file: %s", g_strerror (errsv));
+	  return FALSE;
+	}
+      p += res;
+      count -= res;
+      priv->spool_size += res;
+    }
+
+  return TRUE;
+}
+
 static void
-soup_output_stream_do_chunked_io (GOutputStream *stream, const void *buf, gsize len, GCancellable *cancellable)
+soup_output_stream_queue (GOutputStream *stream)
 {
   SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
-  SoupBuffer *soup_buf;
 
-  priv->chunk_finished = FALSE;
+  if (priv->msg_queued)
+    {
+      soup_session_unpause_message (priv->session, priv->msg);
+    }
+  else
+    {
+      priv->msg_queued = TRUE;
+      /* Add an extra ref since soup_session_queue_message steals one */
+      g_object_ref (priv->msg);
+      soup_session_queue_message (priv->session, priv->msg, NULL, stream);
+    }
+}
 
-  soup_buf = soup_buffer_new (SOUP_MEMORY_STATIC, buf, len);
+/* Hands the pending write to the message. The buffer stays owned by
+ * the caller, who waits for it to be sent. */
+static void
+soup_output_stream_send_chunk (GOutputStream *stream,
+			       const void *buffer,
+			       gsize count,
+			       GCancellable *cancellable)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+
+  priv->write_buffer = buffer;
+  priv->write_count = count;
 
-  soup_message_body_append_buffer (priv->msg->request_body, soup_buf);
+  soup_message_body_append (priv->msg->request_body, SOUP_MEMORY_STATIC,
+			    buffer, count);
   soup_output_stream_setup_cancellation (stream, priv, cancellable);
+  soup_output_stream_queue (stream);
+}
+
+static gboolean
+soup_output_stream_send_next_spool_chunk (GOutputStream *stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  gssize res;
+  int errsv;
 
-  if(priv->msg_queued)
-  {
-    soup_session_unpause_message (priv->session, priv->msg);
-  }
+  res = 0;
+  if (priv->spool_fd != -1)
+    {
+      do
+	res = read (priv->spool_fd, priv->spool_buffer, SPOOL_CHUNK_SIZE);
+      while (res < 0 && errno == EINTR);
+    }
+
+  if (res < 0)
+    {
+      errsv = errno;
+      g_set_error (&priv->spool_error, G_IO_ERROR, g_io_error_from_errno (errsv),
+		   "Error reading temporary file: %s", g_strerror (errsv));
+      if (priv->msg_queued)
+	soup_session_cancel_message (priv->session, priv->msg, SOUP_STATUS_IO_ERROR);
+      return FALSE;
+    }
+
+  /* The previous chunk has been written, so the buffer can be reused */
+  if (res == 0)
+    {
+      soup_message_body_complete (priv->msg->request_body);
+      priv->spool_sending = FALSE;
+    }
   else
-  {
-    priv->msg_queued = TRUE;
-    /* Add an extra ref since soup_session_queue_message steals one */
-    g_object_ref (priv->msg);
-    soup_session_queue_message (priv->session, priv->msg, NULL, stream);
-  }
+    soup_message_body_append (priv->msg->request_body, SOUP_MEMORY_STATIC,
+			      priv->spool_buffer, res);
+
+  soup_output_stream_queue (stream);
+  return TRUE;
 }
 
-static gssize
-soup_output_stream_write (GOutputStream  *stream,
-			  const void     *buffer,
-			  gsize           count,
-			  GCancellable   *cancellable,
-			  GError        **error)
+static void
+copy_request_header (const char *name, const char *value, gpointer hdrs)
+{
+  if (g_ascii_strcasecmp (name, "Transfer-Encoding") != 0 &&
+      g_ascii_strcasecmp (name, "Content-Length") != 0 &&
+      g_ascii_strcasecmp (name, "Expect") != 0)
+    soup_message_headers_append (hdrs, name, value);
+}
+
+/* Replaces the queued message with an unsent copy of its request,
+ * without the body framing and the expectation */
+static void
+soup_output_stream_renew_msg (GOutputStream *stream)
 {
   SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  SoupMessage *msg;
 
-  if(priv->chunked) 
-  {
-    GSimpleAsyncResult *result = g_simple_async_result_new (G_OBJECT (stream),
-				      NULL, NULL,
-				      soup_output_stream_write);
-    priv->chunk_size = count;
-    priv->result = result;
-    soup_output_stream_do_chunked_io (stream, buffer, count, cancellable);
-    while (!priv->chunk_finished && !g_cancellable_is_cancelled (cancellable))
-      g_main_context_iteration (priv->async_context, TRUE);
-  }
+  msg = soup_message_new_from_uri (priv->msg->method,
+				   soup_message_get_uri (priv->msg));
+  soup_message_headers_foreach (priv->msg->request_headers,
+				copy_request_header,
+				msg->request_headers);
+
+  soup_output_stream_disconnect_msg (stream);
+  if (!priv->finished)
+    soup_session_cancel_message (priv->session, priv->msg, SOUP_STATUS_CANCELLED);
+  g_object_unref (priv->msg);
+  priv->msg = msg;
+  priv->msg_queued = FALSE;
+  priv->finished = FALSE;
+  soup_message_body_set_accumulate (priv->msg->request_body, FALSE);
+  soup_output_stream_connect_msg (stream);
+}
+
+/* Sends the spooled data with a Content-Length, in a fresh message if
+ * the server already turned down a chunked one. */
+static gboolean
+soup_output_stream_send_spool (GOutputStream *stream,
+			       GCancellable *cancellable,
+			       GError **error)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  int errsv;
+
+  if (priv->msg_queued)
+    soup_output_stream_renew_msg (stream);
   else
-  {
-    if (priv->size > 0 && priv->offset + count > priv->size) 
     {
-       g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
-  			   "Write would exceed caller-defined file size");
-       return -1;
+      soup_message_headers_remove (priv->msg->request_headers, "Transfer-Encoding");
+      soup_message_headers_remove (priv->msg->request_headers, "Expect");
     }
 
-    g_byte_array_append (priv->ba, buffer, count);
-    priv->offset += count;
-  }
+  soup_message_headers_set_content_length (priv->msg->request_headers,
+					   priv->spool_size);
+
+  if (priv->spool_fd != -1 && lseek (priv->spool_fd, 0, SEEK_SET) < 0)
+    {
+      errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+		   "Error reading temporary file: %s", g_strerror (errsv));
+      return FALSE;
+    }
 
-  return count;
+  priv->spool_sending = TRUE;
+  priv->spool_buffer = g_malloc (SPOOL_CHUNK_SIZE);
+  if (!soup_output_stream_send_next_spool_chunk (stream))
+    {
+      g_propagate_error (error, priv->spool_error);
+      priv->spool_error = NULL;
+      return FALSE;
+    }
+  soup_output_stream_setup_cancellation (stream, priv, cancellable);
+  return TRUE;
 }
 
-static int
-soup_output_stream_close (GOutputStream  *stream,
-			  GCancellable   *cancellable,
-			  GError        **error)
+static void
+soup_output_stream_wrote_chunk (SoupMessage *msg, gpointer stream)
 {
   SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
 
-  if(priv->chunked)
-  {
-    GSimpleAsyncResult *result = g_simple_async_result_new (G_OBJECT (stream),
-				NULL, NULL, soup_output_stream_close);
-    if(priv->msg_queued)
+  if (priv->spool_sending)
     {
-      soup_output_stream_setup_cancellation (stream, priv, cancellable);
-      soup_message_body_complete (priv->msg->request_body);
-      soup_session_unpause_message (priv->session, priv->msg);
-      while (!priv->chunk_finished && !g_cancellable_is_cancelled (cancellable))
-        g_main_context_iteration (priv->async_context, TRUE);
+      soup_output_stream_send_next_spool_chunk (stream);
+      return;
+    }
+
+  if (priv->result == NULL || priv->write_buffer == NULL)
+    return;
+
+  priv->offset += priv->write_count;
+  g_simple_async_result_set_op_res_gssize (priv->result, priv->write_count);
+  soup_output_stream_finish_op (stream);
+}
+
+static void
+soup_output_stream_finished (SoupMessage *msg, gpointer stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  GError *error = NULL;
+
+  priv->finished = TRUE;
+
+  if (priv->result == NULL)
+    return;
+
+  if (priv->opening)
+    {
+      /* Without a "100 Continue" a server that can't take chunked
+       * requests gets the spooled body with a fresh message on close */
+      if (priv->chunked && is_chunked_rejected (msg->status_code))
+	{
+	  priv->spooling = TRUE;
+	  g_simple_async_result_set_op_res_gboolean (priv->result, TRUE);
+	}
+      else if (set_error_if_http_failed (msg, &error))
+	{
+	  g_simple_async_result_set_from_error (priv->result, error);
+	  g_error_free (error);
+	}
+      else
+	g_simple_async_result_set_op_res_gboolean (priv->result, TRUE);
     }
-    else
+  else if (priv->write_buffer)
     {
-      g_simple_async_result_set_op_res_gboolean (result, TRUE);
-      g_simple_async_result_complete_in_idle (result);
-      g_object_unref (result);
+      /* Only fall back to spooling if none of the data went out yet */
+      if (priv->chunked && priv->offset == 0 &&
+	  is_chunked_rejected (msg->status_code) &&
+	  soup_output_stream_spool (priv, priv->write_buffer,
+				    priv->write_count, &error))
+	{
+	  priv->spooling = TRUE;
+	  priv->offset += priv->write_count;
+	  g_simple_async_result_set_op_res_gssize (priv->result, priv->write_count);
+	}
+      else
+	{
+	  if (error == NULL)
+	    set_error_finished_early (msg, &error);
+	  g_simple_async_result_set_from_error (priv->result, error);
+	  g_error_free (error);
+	}
     }
-  } 
   else
-  {
-    if (priv->size > 0 && priv->offset != priv->size) 
     {
-	g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
-			    "File is incomplete");
-	return -1;
+      if (priv->spool_error)
+	g_simple_async_result_set_from_error (priv->result, priv->spool_error);
+      else if (set_error_if_http_failed (msg, &error))
+	{
+	  g_simple_async_result_set_from_error (priv->result, error);
+	  g_error_free (error);
+	}
+      else
+	g_simple_async_result_set_op_res_gboolean (priv->result, TRUE);
     }
-    soup_output_stream_prepare_for_io (stream, cancellable);
-    while (!priv->finished && !g_cancellable_is_cancelled (cancellable))
-      g_main_context_iteration (priv->async_context, TRUE);
-    soup_output_stream_done_io (stream);
-  }
 
-  return !set_error_if_http_failed (priv->msg, error);
+  soup_output_stream_finish_op (stream);
 }
 
 static void
-soup_output_stream_write_async (GOutputStream       *stream,
-				const void          *buffer,
-				gsize                count,
-				int                  io_priority,
-				GCancellable        *cancellable,
-				GAsyncReadyCallback  callback,
-				gpointer             user_data)
+soup_output_stream_got_informational (SoupMessage *msg, gpointer stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+
+  if (!priv->opening || msg->status_code != SOUP_STATUS_CONTINUE)
+    return;
+
+  /* The server accepted the headers and waits for the body, which
+   * the message holds back until the first write */
+  g_simple_async_result_set_op_res_gboolean (priv->result, TRUE);
+  soup_output_stream_finish_op (stream);
+}
+
+/* Neither "100 Continue" nor a final status came back, so the server
+ * or a proxy ignores the expectation and waits for the body, which
+ * this message can't send before it got an answer. Start over
+ * without the expectation. */
+static gboolean
+soup_output_stream_continue_timeout (gpointer stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+
+  priv->continue_timeout = NULL;
+
+  soup_output_stream_renew_msg (stream);
+  soup_message_headers_set_encoding (priv->msg->request_headers,
+				     SOUP_ENCODING_CHUNKED);
+  soup_output_stream_queue (stream);
+
+  g_simple_async_result_set_op_res_gboolean (priv->result, TRUE);
+  soup_output_stream_finish_op (stream);
+
+  return FALSE;
+}
+
+/**
+ * soup_output_stream_open_async:
+ * @stream: a #SoupOutputStream created with soup_output_stream_new_chunked()
+ * @io_priority: the io priority of the request.
+ * @cancellable: optional #GCancellable object, %NULL to ignore.
+ * @callback: callback to call when the request is satisfied
+ * @user_data: the data to pass to callback function
+ *
+ * Sends the request headers right away instead of with the first
+ * write, and waits until the server answers them with "100 Continue"
+ * or a final status. That way preconditions like "If-None-Match: *"
+ * or "If-Match" are checked before any data is written, in the same
+ * request that carries the data.
+ *
+ * If the server doesn't answer within a second, the open completes
+ * anyway and the request is sent again without the expectation, so
+ * the precondition is then only checked when the stream is closed.
+ **/
+void
+soup_output_stream_open_async (GOutputStream       *stream,
+			       int                  io_priority,
+			       GCancellable        *cancellable,
+			       GAsyncReadyCallback  callback,
+			       gpointer             user_data)
 {
   SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
   GSimpleAsyncResult *result;
 
+  g_return_if_fail (SOUP_IS_OUTPUT_STREAM (stream));
+  g_return_if_fail (priv->chunked && !priv->msg_queued && priv->result == NULL);
+
   result = g_simple_async_result_new (G_OBJECT (stream),
 				      callback, user_data,
-				      soup_output_stream_write_async);
+				      soup_output_stream_open_async);
+
+  priv->result = result;
+  priv->opening = TRUE;
+  soup_output_stream_setup_cancellation (stream, priv, cancellable);
+  soup_output_stream_queue (stream);
+
+  priv->continue_timeout = soup_add_timeout (priv->async_context,
+					     CONTINUE_TIMEOUT,
+					     soup_output_stream_continue_timeout,
+					     stream);
+}
+
+/**
+ * soup_output_stream_open_finish:
+ * @stream: a #SoupOutputStream
+ * @result: a #GAsyncResult.
+ * @error: a #GError location to store the error occuring, or %NULL to 
+ * ignore.
+ *
+ * Finishes a soup_output_stream_open_async() operation.
+ *
+ * Return value: %TRUE if the stream can be written, %FALSE with a
+ * %SOUP_HTTP_ERROR if the server refused the request.
+ **/
+gboolean
+soup_output_stream_open_finish (GOutputStream  *stream,
+				GAsyncResult   *result,
+				GError        **error)
+{
+  GSimpleAsyncResult *simple;
+
+  g_return_val_if_fail (G_IS_SIMPLE_ASYNC_RESULT (result), FALSE);
+  simple = G_SIMPLE_ASYNC_RESULT (result);
 
-  if (priv->chunked)
+  g_return_val_if_fail (g_simple_async_result_get_source_tag (simple) == soup_output_stream_open_async, FALSE);
+
+  return !g_simple_async_result_propagate_error (simple, error);
+}
+
+/* Starts the pending write. Returns FALSE if it completed right away,
+ * with the result set in @result. */
+static gboolean
+soup_output_stream_start_write (GOutputStream *stream,
+				const void *buffer,
+				gsize count,
+				GCancellable *cancellable,
+				GSimpleAsyncResult *result)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  GError *error = NULL;
+
+  if (!soup_output_stream_check_size (priv, count, &error))
+    ;
+  else if (priv->spooling)
     {
-      priv->chunk_size = count;
-      priv->result = result;
-      soup_output_stream_do_chunked_io(stream, buffer, count, cancellable);
+      if (soup_output_stream_spool (priv, buffer, count, &error))
+	{
+	  priv->offset += count;
+	  g_simple_async_result_set_op_res_gssize (result, count);
+	  return FALSE;
+	}
     }
-  else 
+  else if (priv->finished)
+    set_error_finished_early (priv->msg, &error);
+  else
     {
-      if (priv->size > 0 && priv->offset + count > priv->size)
-      {
-	GError *error;
-
-	error = g_error_new (G_IO_ERROR, G_IO_ERROR_NO_SPACE,
-	    		   "Write would exceed caller-defined file size");
-	g_simple_async_result_set_from_error (result, error);
-	g_error_free (error);
-      }
-      else
-      {
-	g_byte_array_append (priv->ba, buffer, count);
-	priv->offset += count;
-	g_simple_async_result_set_op_res_gssize (result, count);
-      }
-      g_simple_async_result_complete_in_idle (result);
-      g_object_unref (result);
+      priv->result = g_object_ref (result);
+      soup_output_stream_send_chunk (stream, buffer, count, cancellable);
+      return TRUE;
     }
 
+  g_simple_async_result_set_from_error (result, error);
+  g_error_free (error);
+  return FALSE;
 }
 
 static gssize
-soup_output_stream_write_finish (GOutputStream  *stream,
-				 GAsyncResult   *result,
-				 GError        **error)
+soup_output_stream_write (GOutputStream  *stream,
+			  const void     *buffer,
+			  gsize           count,
+			  GCancellable   *cancellable,
+			  GError        **error)
 {
-  GSimpleAsyncResult *simple;
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  GSimpleAsyncResult *result;
   gssize nwritten;
 
-  simple = G_SIMPLE_ASYNC_RESULT (result);
-  g_warn_if_fail (g_simple_async_result_get_source_tag (simple) == soup_output_stream_write_async);
-  
-  nwritten = g_simple_async_result_get_op_res_gssize (simple);
+  result = g_simple_async_result_new (G_OBJECT (stream),
+				      NULL, NULL,
+				      soup_output_stream_write);
+
+  if (soup_output_stream_start_write (stream, buffer, count, cancellable, result))
+    {
+      while (priv->result == result)
+	g_main_context_iteration (priv->async_context, TRUE);
+    }
+
+  if (g_simple_async_result_propagate_error (result, error))
+    nwritten = -1;
+  else
+    nwritten = g_simple_async_result_get_op_res_gssize (result);
+  g_object_unref (result);
+
   return nwritten;
 }
 
-static void
-close_async_done (GOutputStream *stream)
+/* Starts closing the stream. Returns FALSE if it completed right away,
+ * with the result set in @result. */
+static gboolean
+soup_output_stream_start_close (GOutputStream *stream,
+				GCancellable *cancellable,
+				GSimpleAsyncResult *result)
 {
   SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
-  GSimpleAsyncResult *result;
   GError *error = NULL;
 
-  result = priv->result;
-  priv->result = NULL;
-
-  if (g_cancellable_set_error_if_cancelled (priv->cancellable, &error) ||
-      set_error_if_http_failed (priv->msg, &error))
+  if (priv->size >= 0 && priv->offset != priv->size)
     {
+      g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+			   "File is incomplete");
       g_simple_async_result_set_from_error (result, error);
       g_error_free (error);
+      return FALSE;
+    }
+
+  if (priv->finished && !priv->spooling)
+    {
+      if (set_error_if_http_failed (priv->msg, &error))
+	{
+	  g_simple_async_result_set_from_error (result, error);
+	  g_error_free (error);
+	}
+      else
+	g_simple_async_result_set_op_res_gboolean (result, TRUE);
+      return FALSE;
+    }
+
+  /* Nothing was sent yet if the stream is empty */
+  if (priv->spooling || !priv->msg_queued)
+    {
+      if (!soup_output_stream_send_spool (stream, cancellable, &error))
+	{
+	  g_simple_async_result_set_from_error (result, error);
+	  g_error_free (error);
+	  return FALSE;
+	}
+      priv->result = g_object_ref (result);
     }
   else
-    g_simple_async_result_set_op_res_gboolean (result, TRUE);
+    {
+      priv->result = g_object_ref (result);
+      soup_output_stream_setup_cancellation (stream, priv, cancellable);
+      soup_message_body_complete (priv->msg->request_body);
+      soup_session_unpause_message (priv->session, priv->msg);
+    }
 
-  priv->finished_cb = NULL;
-  priv->cancelled_cb = NULL;
-  soup_output_stream_done_io (stream);
+  return TRUE;
+}
 
-  g_simple_async_result_complete (result);
+static gboolean
+soup_output_stream_close (GOutputStream  *stream,
+			  GCancellable   *cancellable,
+			  GError        **error)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  GSimpleAsyncResult *result;
+  gboolean res;
+
+  result = g_simple_async_result_new (G_OBJECT (stream),
+				      NULL, NULL,
+				      soup_output_stream_close);
+
+  if (soup_output_stream_start_close (stream, cancellable, result))
+    {
+      while (priv->result == result)
+	g_main_context_iteration (priv->async_context, TRUE);
+    }
+
+  res = !g_simple_async_result_propagate_error (result, error);
   g_object_unref (result);
+
+  return res;
 }
 
 static void
-soup_output_stream_finished (SoupMessage *msg, gpointer stream)
+soup_output_stream_write_async (GOutputStream       *stream,
+				const void          *buffer,
+				gsize                count,
+				int                  io_priority,
+				GCancellable        *cancellable,
+				GAsyncReadyCallback  callback,
+				gpointer             user_data)
 {
-  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  GSimpleAsyncResult *result;
 
-  priv->finished = TRUE;
+  result = g_simple_async_result_new (G_OBJECT (stream),
+				      callback, user_data,
+				      soup_output_stream_write_async);
 
-  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_output_stream_finished), stream);
-  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_output_stream_wrote_chunk), stream);
+  if (!soup_output_stream_start_write (stream, buffer, count, cancellable, result))
+    g_simple_async_result_complete_in_idle (result);
+  g_object_unref (result);
+}
 
-  close_async_done (stream);
+static gssize
+soup_output_stream_write_finish (GOutputStream  *stream,
+				 GAsyncResult   *result,
+				 GError        **error)
+{
+  GSimpleAsyncResult *simple;
+  gssize nwritten;
+
+  simple = G_SIMPLE_ASYNC_RESULT (result);
+  g_warn_if_fail (g_simple_async_result_get_source_tag (simple) == soup_output_stream_write_async);
+  
+  nwritten = g_simple_async_result_get_op_res_gssize (simple);
+  return nwritten;
 }
 
 static void
@@ -513,49 +958,15 @@ soup_output_stream_close_async (GOutputStream        *stream,
 				GAsyncReadyCallback  callback,
 				gpointer             user_data)
 {
-  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
   GSimpleAsyncResult *result;
 
   result = g_simple_async_result_new (G_OBJECT (stream),
 				      callback, user_data,
 				      soup_output_stream_close_async);
-  priv->result = result;
-  priv->cancelled_cb = close_async_done;
-  g_signal_connect (priv->msg, "finished",
-                  G_CALLBACK (soup_output_stream_finished), stream);
 
-  if (priv->chunked)
-  {
-    if (priv->msg_queued) 
-    {
-      soup_output_stream_setup_cancellation (stream, priv, cancellable);
-      soup_message_body_complete (priv->msg->request_body);
-      soup_session_unpause_message (priv->session, priv->msg);
-    }
-    else
-    {
-      g_simple_async_result_set_op_res_gboolean (result, TRUE);
-      g_simple_async_result_complete_in_idle (result);
-      g_object_unref (result);
-    }
-  }
-  else
-  {
-    if (priv->size > 0 && priv->offset != priv->size)
-      {
-        GError *error;
-
-        error = g_error_new (G_IO_ERROR, G_IO_ERROR_NO_SPACE,
-                             "File is incomplete");
-        g_simple_async_result_set_from_error (result, error);
-        g_error_free (error);
-        g_simple_async_result_complete_in_idle (result);
-        g_object_unref(result);
-        return;
-      }
-
-    soup_output_stream_prepare_for_io (stream, cancellable);
-  }
+  if (!soup_output_stream_start_close (stream, cancellable, result))
+    g_simple_async_result_complete_in_idle (result);
+  g_object_unref (result);
 }
 
 static gboolean
@@ -61,6 +61,15 @@ GOutputStream *soup_output_stream_new         (SoupSession         *session,
 GOutputStream *soup_output_stream_new_chunked (SoupSession         *session,
 					       SoupMessage         *msg);
 
+void           soup_output_stream_open_async  (GOutputStream       *stream,
+					       int                  io_priority,
+					       GCancellable        *cancellable,
+					       GAsyncReadyCallback  callback,
+					       gpointer             user_data);
+gboolean       soup_output_stream_open_finish (GOutputStream       *stream,
+					       GAsyncResult        *result,
+					       GError             **error);
+
 G_END_DECLS
 
 #endif /* __SOUP_OUTPUT_STREAM_H__ */
@@ -0,0 +1,224 @@
+#include "config.h"
+#include "metatree.h"
+#include "metabuilder.h"
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+/* Measures path lookups per second in a wide tree (one directory
+   with many children) and a deep tree (a long chain of directories
+   with a few siblings on each level), for the original directory
+   layout and for the current one with lookup indexes. */
+
+static int width = 50000;
+static int depth = 32;
+static int fanout = 16;
+static int count = 1000000;
+static GOptionEntry entries[] =
+{
+  { "width", 'w', 0, G_OPTION_ARG_INT, &width, "Children in the wide tree", NULL},
+  { "depth", 'd', 0, G_OPTION_ARG_INT, &depth, "Levels in the deep tree", NULL},
+  { "fanout", 'f', 0, G_OPTION_ARG_INT, &fanout, "Children per level in the deep tree", NULL},
+  { "count", 'c', 0, G_OPTION_ARG_INT, &count, "Number of lookups", NULL},
+  { NULL }
+};
+
+static MetaBuilder *
+build_wide (char ***paths_out)
+{
+  MetaBuilder *builder;
+  MetaFile *file;
+  char **paths;
+  char *name;
+  int i;
+
+  builder = meta_builder_new ();
+  paths = g_new0 (char *, width + 1);
+
+  /* Reverse order so each insert is at the head of the sorted list */
+  for (i = width - 1; i >= 0; i--)
+    {
+      name = g_strdup_printf ("IMG_%06d.jpg", i);
+      file = metafile_new (name, builder->root);
+      metafile_set_mtime (file, 1000000000 + i);
+      paths[i] = g_strconcat ("/", name, NULL);
+      g_free (name);
+    }
+
+  *paths_out = paths;
+  return builder;
+}
+
+static MetaBuilder *
+build_deep (char ***paths_out)
+{
+  MetaBuilder *builder;
+  MetaFile *dir, *file, *next;
+  GString *path;
+  char **paths;
+  char *name;
+  int i, j, n;
+
+  builder = meta_builder_new ();
+  paths = g_new0 (char *, depth * fanout + 1);
+  path = g_string_new (NULL);
+
+  n = 0;
+  dir = builder->root;
+  for (i = 0; i < depth; i++)
+    {
+      next = NULL;
+      for (j = 0; j < fanout; j++)
+	{
+	  name = g_strdup_printf ("folder-%02d", j);
+	  file = metafile_new (name, dir);
+	  metafile_set_mtime (file, 1000000000 + n);
+	  paths[n++] = g_strconcat (path->str, "/", name, NULL);
+	  if (j == 0)
+	    next = file;
+	  g_free (name);
+	}
+      g_string_append (path, "/folder-00");
+      dir = next;
+    }
+
+  g_string_free (path, TRUE);
+
+  *paths_out = paths;
+  return builder;
+}
+
+static MetaTree *
+open_encoded (MetaBuilder *builder,
+	      gboolean compact,
+	      char **filename_out)
+{
+  GString *out;
+  GError *error = NULL;
+  MetaTree *tree;
+  guint32 random_tag;
+  char *filename;
+  int fd;
+
+  fd = g_file_open_tmp ("meta-bench-lookup-XXXXXX", &filename, &error);
+  if (fd == -1)
+    {
+      g_printerr ("Can't create temp file: %s\n", error->message);
+      g_error_free (error);
+      return NULL;
+    }
+  close (fd);
+
+  out = meta_builder_encode (builder, compact, &random_tag);
+  if (!g_file_set_contents (filename, out->str, out->len, &error))
+    {
+      g_printerr ("Can't write temp file: %s\n", error->message);
+      g_error_free (error);
+      g_string_free (out, TRUE);
+      g_free (filename);
+      return NULL;
+    }
+  g_string_free (out, TRUE);
+
+  tree = meta_tree_open (filename, FALSE);
+  *filename_out = filename;
+  return tree;
+}
+
+static double
+run_lookups (MetaTree *tree,
+	     char **paths,
+	     int n_paths)
+{
+  GTimer *timer;
+  GRand *rand;
+  double elapsed;
+  int i, misses;
+
+  /* Same sequence of paths for each layout */
+  rand = g_rand_new_with_seed (42);
+  timer = g_timer_new ();
+
+  misses = 0;
+  for (i = 0; i < count; i++)
+    {
+      if (meta_tree_get_last_changed (tree,
+				      paths[g_rand_int_range (rand, 0, n_paths)]) == 0)
+	misses++;
+    }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+  g_rand_free (rand);
+
+  if (misses > 0)
+    g_printerr ("%d lookups failed\n", misses);
+
+  return count / elapsed;
+}
+
+static void
+bench (const char *name,
+       MetaBuilder *builder,
+       char **paths)
+{
+  MetaTree *tree;
+  char *filename;
+  double original, indexed;
+
+  tree = open_encoded (builder, FALSE, &filename);
+  if (tree == NULL)
+    return;
+  original = run_lookups (tree, paths, g_strv_length (paths));
+  meta_tree_unref (tree);
+  g_unlink (filename);
+  g_free (filename);
+
+  tree = open_encoded (builder, TRUE, &filename);
+  if (tree == NULL)
+    return;
+  indexed = run_lookups (tree, paths, g_strv_length (paths));
+  meta_tree_unref (tree);
+  g_unlink (filename);
+  g_free (filename);
+
+  g_print ("%s tree:\n", name);
+  g_print ("  original layout: %12.0f lookups/s\n", original);
+  g_print ("  lookup index:    %12.0f lookups/s (%.2fx)\n",
+	   indexed, indexed / original);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  MetaBuilder *builder;
+  GError *error = NULL;
+  GOptionContext *context;
+  char **paths;
+
+  context = g_option_context_new ("- benchmark metadata tree path lookups");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if (width <= 0 || depth <= 0 || fanout <= 0 || count <= 0)
+    {
+      g_printerr ("all options must be positive\n");
+      return 1;
+    }
+
+  builder = build_wide (&paths);
+  bench ("Wide", builder, paths);
+  g_strfreev (paths);
+  meta_builder_free (builder);
+
+  builder = build_deep (&paths);
+  bench ("Deep", builder, paths);
+  g_strfreev (paths);
+  meta_builder_free (builder);
+
+  return 0;
+}
@@ -0,0 +1,215 @@
+#include "config.h"
+#include "metatree.h"
+#include <glib/gstdio.h>
+#include <dbus/dbus.h>
+#include "gvfsdaemonprotocol.h"
+#include "gvfsdbusutils.h"
+
+/* Measures how fast the metadata daemon accepts key changes when
+   they are sent one path per Set call versus many paths per SetBatch
+   call. Each run writes the key "bench-position" for count paths
+   below /meta-bench in the given tree. */
+
+static char *treename = "meta-bench";
+static int count = 5000;
+static int batch_size = 1000;
+static GOptionEntry entries[] =
+{
+  { "tree", 't', 0, G_OPTION_ARG_STRING, &treename, "Tree", NULL},
+  { "count", 'c', 0, G_OPTION_ARG_INT, &count, "Number of paths", NULL},
+  { "batch-size", 'b', 0, G_OPTION_ARG_INT, &batch_size, "Paths per SetBatch call", NULL},
+  { NULL }
+};
+
+static DBusMessage *
+new_message (const char *op,
+	     const char *metatreefile)
+{
+  DBusMessage *message;
+
+  message =
+    dbus_message_new_method_call (G_VFS_DBUS_METADATA_NAME,
+				  G_VFS_DBUS_METADATA_PATH,
+				  G_VFS_DBUS_METADATA_INTERFACE,
+				  op);
+  _g_dbus_message_append_args (message,
+			       G_DBUS_TYPE_CSTRING, &metatreefile,
+			       0);
+  return message;
+}
+
+static gboolean
+send_message (DBusConnection *connection,
+	      DBusMessage *message)
+{
+  DBusMessage *reply;
+  DBusError derror;
+
+  dbus_error_init (&derror);
+  reply = dbus_connection_send_with_reply_and_block (connection, message, 1000*30,
+						     &derror);
+  dbus_message_unref (message);
+  if (reply == NULL)
+    {
+      g_printerr ("Error: %s\n", derror.message);
+      dbus_error_free (&derror);
+      return FALSE;
+    }
+
+  dbus_message_unref (reply);
+  return TRUE;
+}
+
+static gboolean
+run_single (DBusConnection *connection,
+	    const char *metatreefile,
+	    int pass)
+{
+  DBusMessage *message;
+  const char *key = "bench-position";
+  char *path, *value;
+  int i;
+
+  for (i = 0; i < count; i++)
+    {
+      path = g_strdup_printf ("/meta-bench/file-%d", i);
+      value = g_strdup_printf ("%d,%d", i + pass, i * 2);
+
+      message = new_message (G_VFS_DBUS_METADATA_OP_SET, metatreefile);
+      _g_dbus_message_append_args (message,
+				   G_DBUS_TYPE_CSTRING, &path,
+				   DBUS_TYPE_STRING, &key,
+				   DBUS_TYPE_STRING, &value,
+				   0);
+      g_free (path);
+      g_free (value);
+
+      if (!send_message (connection, message))
+	return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+run_batch (DBusConnection *connection,
+	   const char *metatreefile,
+	   int pass)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array_iter, struct_iter, variant_iter;
+  const char *key = "bench-position";
+  char *path, *value;
+  int i;
+
+  message = NULL;
+  for (i = 0; i < count; i++)
+    {
+      if (message == NULL)
+	message = new_message (G_VFS_DBUS_METADATA_OP_SET_BATCH, metatreefile);
+
+      path = g_strdup_printf ("/meta-bench/file-%d", i);
+      value = g_strdup_printf ("%d,%d", i + pass, i * 2);
+
+      dbus_message_iter_init_append (message, &iter);
+      _g_dbus_message_iter_append_cstring (&iter, path);
+      dbus_message_iter_open_container (&iter,
+					DBUS_TYPE_ARRAY,
+					DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_STRING_AS_STRING
+					DBUS_TYPE_VARIANT_AS_STRING
+					DBUS_STRUCT_END_CHAR_AS_STRING,
+					&array_iter);
+      dbus_message_iter_open_container (&array_iter, DBUS_TYPE_STRUCT,
+					NULL, &struct_iter);
+      dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING, &key);
+      dbus_message_iter_open_container (&struct_iter, DBUS_TYPE_VARIANT,
+					DBUS_TYPE_STRING_AS_STRING, &variant_iter);
+      dbus_message_iter_append_basic (&variant_iter, DBUS_TYPE_STRING, &value);
+      dbus_message_iter_close_container (&struct_iter, &variant_iter);
+      dbus_message_iter_close_container (&array_iter, &struct_iter);
+      dbus_message_iter_close_container (&iter, &array_iter);
+
+      g_free (path);
+      g_free (value);
+
+      if ((i + 1) % batch_size == 0)
+	{
+	  if (!send_message (connection, message))
+	    return FALSE;
+	  message = NULL;
+	}
+    }
+
+  if (message != NULL &&
+      !send_message (connection, message))
+    return FALSE;
+
+  return TRUE;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  MetaTree *tree;
+  GError *error = NULL;
+  GOptionContext *context;
+  DBusConnection *connection;
+  DBusError derror;
+  const char *metatreefile;
+  GTimer *timer;
+  double single, batch;
+
+  context = g_option_context_new ("- benchmark metadata Set versus SetBatch");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if (count <= 0 || batch_size <= 0)
+    {
+      g_printerr ("count and batch size must be positive\n");
+      return 1;
+    }
+
+  tree = meta_tree_lookup_by_name (treename, FALSE);
+  if (tree == NULL)
+    {
+      g_printerr ("can't open metadata tree %s\n", treename);
+      return 1;
+    }
+  metatreefile = meta_tree_get_filename (tree);
+
+  dbus_error_init (&derror);
+  connection = dbus_bus_get (DBUS_BUS_SESSION, &derror);
+  if (connection == NULL)
+    {
+      g_printerr ("Unable to connect to dbus: %s\n", derror.message);
+      dbus_error_free (&derror);
+      return 1;
+    }
+
+  timer = g_timer_new ();
+
+  if (!run_single (connection, metatreefile, 0))
+    return 1;
+  single = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+  if (!run_batch (connection, metatreefile, 1))
+    return 1;
+  batch = g_timer_elapsed (timer, NULL);
+
+  g_print ("%d paths\n", count);
+  g_print ("Set:      %8.3f s, %10.0f paths/s\n", single, count / single);
+  g_print ("SetBatch: %8.3f s, %10.0f paths/s (%d paths per call)\n",
+	   batch, count / batch, batch_size);
+
+  g_timer_destroy (timer);
+  meta_tree_unref (tree);
+
+  return 0;
+}
@@ -32,16 +32,67 @@
 #include "metatree.h"
 #include "gvfsdaemonprotocol.h"
 
+/* Changes are written out WRITEOUT_TIMEOUT_SECS after the first
+   write. If the journal gets WRITEOUT_FILL_PERCENT full, or the
+   current write rate would get it there before that, we write out
+   right away so that writers don't have to rotate the journal
+   synchronously. */
 #define WRITEOUT_TIMEOUT_SECS 60
+#define WRITEOUT_FILL_PERCENT 75
+
+#define USEC_PER_SEC G_GINT64_CONSTANT (1000000)
 
 typedef struct {
   char *filename;
   MetaTree *tree;
   guint writeout_timeout;
+
+  gboolean dirty;
+  gint64 first_dirty; /* Time of first write since last writeout */
+  guint first_dirty_fill;
 } TreeInfo;
 
+static const guint32 latency_limits_usec[] = {
+  100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, G_MAXUINT32
+};
+#define N_LATENCY_BUCKETS G_N_ELEMENTS (latency_limits_usec)
+
+typedef struct {
+  const char *name;
+  guint32 counts[N_LATENCY_BUCKETS];
+} LatencyHistogram;
+
+static LatencyHistogram flush_histogram = { "flush" };
+
 static GHashTable *tree_infos = NULL;
 
+/* GTimer uses the monotonic clock, so deadlines don't move when
+   the wall clock is changed */
+static gint64
+get_time_usec (void)
+{
+  static GTimer *timer = NULL;
+
+  if (timer == NULL)
+    timer = g_timer_new ();
+
+  return (gint64)(g_timer_elapsed (timer, NULL) * USEC_PER_SEC);
+}
+
+static void
+latency_histogram_add (LatencyHistogram *histogram,
+		       gint64 usec)
+{
+  int i;
+
+  for (i = 0; i < N_LATENCY_BUCKETS - 1; i++)
+    {
+      if (usec <= latency_limits_usec[i])
+	break;
+    }
+  histogram->counts[i]++;
+}
+
 static void
 tree_info_free (TreeInfo *info)
 {
@@ -53,24 +104,104 @@ tree_info_free (TreeInfo *info)
   g_free (info);
 }
 
+static void
+tree_info_flush (TreeInfo *info)
+{
+  gint64 start;
+
+  start = get_time_usec ();
+  meta_tree_flush (info->tree);
+  latency_histogram_add (&flush_histogram, get_time_usec () - start);
+
+  info->dirty = FALSE;
+}
+
+static gint64
+tree_info_get_writeout_deadline (TreeInfo *info,
+				 gint64 now)
+{
+  guint fill;
+  gint64 deadline, elapsed;
+
+  deadline = info->first_dirty + WRITEOUT_TIMEOUT_SECS * USEC_PER_SEC;
+
+  fill = meta_tree_get_journal_fill (info->tree);
+  if (fill >= WRITEOUT_FILL_PERCENT)
+    return now;
+
+  /* Extrapolate the fill rate since we got dirty */
+  elapsed = now - info->first_dirty;
+  if (fill > info->first_dirty_fill && elapsed > 0)
+    {
+      gint64 time_to_full;
+
+      time_to_full = elapsed * (WRITEOUT_FILL_PERCENT - fill) / (fill - info->first_dirty_fill);
+      if (now + time_to_full < deadline)
+	return now;
+    }
+
+  return deadline;
+}
+
+static gboolean writeout_timeout (gpointer data);
+
+static void
+tree_info_add_writeout_timeout (TreeInfo *info,
+				gint64 delay_usec)
+{
+  if (delay_usec <= 0)
+    info->writeout_timeout = g_idle_add (writeout_timeout, info);
+  else if (delay_usec >= USEC_PER_SEC)
+    info->writeout_timeout =
+      g_timeout_add_seconds (delay_usec / USEC_PER_SEC,
+			     writeout_timeout, info);
+  else
+    info->writeout_timeout =
+      g_timeout_add (delay_usec / 1000, writeout_timeout, info);
+}
+
 static gboolean
 writeout_timeout (gpointer data)
 {
   TreeInfo *info = data;
+  gint64 now, deadline;
 
-  meta_tree_flush (info->tree);
   info->writeout_timeout = 0;
 
+  /* We don't move the timeout on every write, instead we check
+     whether the deadline moved when it fires */
+  now = get_time_usec ();
+  deadline = tree_info_get_writeout_deadline (info, now);
+  if (deadline > now)
+    tree_info_add_writeout_timeout (info, deadline - now);
+  else
+    tree_info_flush (info);
+
   return FALSE;
 }
 
 static void
 tree_info_schedule_writeout (TreeInfo *info)
 {
+  gint64 now, deadline;
+
+  now = get_time_usec ();
+  if (!info->dirty)
+    {
+      info->dirty = TRUE;
+      info->first_dirty = now;
+      info->first_dirty_fill = meta_tree_get_journal_fill (info->tree);
+    }
+
+  deadline = tree_info_get_writeout_deadline (info, now);
   if (info->writeout_timeout == 0)
-    info->writeout_timeout =
-      g_timeout_add_seconds (WRITEOUT_TIMEOUT_SECS,
-			     writeout_timeout, info);
+    tree_info_add_writeout_timeout (info, deadline - now);
+  else if (deadline <= now)
+    {
+      /* Pending timeout is too late, write out asap */
+      g_source_remove (info->writeout_timeout);
+      tree_info_add_writeout_timeout (info, 0);
+    }
 }
 
 static TreeInfo *
@@ -205,6 +336,147 @@ metadata_set (const char *treefile,
   return res;
 }
 
+static gboolean
+add_batch_item (MetaTreeBatch *batch,
+		const char *path,
+		DBusMessageIter *struct_iter,
+		DBusError *derror)
+{
+  DBusMessageIter variant_iter, array_iter;
+  GPtrArray *strv;
+  const char *key, *str;
+
+  if (dbus_message_iter_get_arg_type (struct_iter) != DBUS_TYPE_STRING)
+    goto invalid;
+  dbus_message_iter_get_basic (struct_iter, &key);
+  dbus_message_iter_next (struct_iter);
+
+  if (dbus_message_iter_get_arg_type (struct_iter) != DBUS_TYPE_VARIANT)
+    goto invalid;
+  dbus_message_iter_recurse (struct_iter, &variant_iter);
+
+  switch (dbus_message_iter_get_arg_type (&variant_iter))
+    {
+    case DBUS_TYPE_STRING:
+      dbus_message_iter_get_basic (&variant_iter, &str);
+      meta_tree_batch_set_string (batch, path, key, str);
+      break;
+    case DBUS_TYPE_ARRAY:
+      if (dbus_message_iter_get_element_type (&variant_iter) != DBUS_TYPE_STRING)
+	goto invalid;
+      strv = g_ptr_array_new ();
+      dbus_message_iter_recurse (&variant_iter, &array_iter);
+      while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRING)
+	{
+	  dbus_message_iter_get_basic (&array_iter, &str);
+	  g_ptr_array_add (strv, (char *)str);
+	  dbus_message_iter_next (&array_iter);
+	}
+      g_ptr_array_add (strv, NULL);
+      meta_tree_batch_set_stringv (batch, path, key, (char **)strv->pdata);
+      g_ptr_array_free (strv, TRUE);
+      break;
+    case DBUS_TYPE_BYTE:
+      /* Unset */
+      meta_tree_batch_unset (batch, path, key);
+      break;
+    default:
+      goto invalid;
+    }
+
+  return TRUE;
+
+ invalid:
+  dbus_set_error (derror,
+		  DBUS_ERROR_INVALID_ARGS,
+		  _("Invalid arguments"));
+  return FALSE;
+}
+
+/* The arguments are a sequence of (path, array of (key, value))
+   pairs, where value is a string, a stringv or a byte for unset.
+   Everything is applied to the tree in one go. */
+static gboolean
+metadata_set_batch (const char *treefile,
+		    DBusMessageIter *iter,
+		    DBusError *derror)
+{
+  TreeInfo *info;
+  MetaTreeBatch *batch;
+  DBusMessageIter array_iter, struct_iter;
+  char *path;
+  gboolean res;
+
+  info = tree_info_lookup (treefile);
+  if (info == NULL)
+    {
+      dbus_set_error (derror,
+		      DBUS_ERROR_FILE_NOT_FOUND,
+		      _("Can't find metadata file %s"),
+		      treefile);
+      return FALSE;
+    }
+
+  batch = meta_tree_batch_new ();
+
+  res = TRUE;
+  while (res && dbus_message_iter_get_arg_type (iter) != 0)
+    {
+      path = NULL;
+      if (!_g_dbus_message_iter_get_args (iter, derror,
+					  G_DBUS_TYPE_CSTRING, &path,
+					  0))
+	{
+	  res = FALSE;
+	  break;
+	}
+
+      if (dbus_message_iter_get_arg_type (iter) != DBUS_TYPE_ARRAY ||
+	  dbus_message_iter_get_element_type (iter) != DBUS_TYPE_STRUCT)
+	{
+	  dbus_set_error (derror,
+			  DBUS_ERROR_INVALID_ARGS,
+			  _("Invalid arguments"));
+	  g_free (path);
+	  res = FALSE;
+	  break;
+	}
+
+      dbus_message_iter_recurse (iter, &array_iter);
+      while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
+	{
+	  dbus_message_iter_recurse (&array_iter, &struct_iter);
+	  if (!add_batch_item (batch, path, &struct_iter, derror))
+	    {
+	      res = FALSE;
+	      break;
+	    }
+	  dbus_message_iter_next (&array_iter);
+	}
+      dbus_message_iter_next (iter);
+
+      g_free (path);
+    }
+
+  if (res &&
+      meta_tree_batch_get_size (batch) > 0)
+    {
+      if (!meta_tree_apply_batch (info->tree, batch))
+	{
+	  dbus_set_error (derror,
+			  DBUS_ERROR_FAILED,
+			  _("Unable to set metadata key"));
+	  res = FALSE;
+	}
+
+      tree_info_schedule_writeout (info);
+    }
+
+  meta_tree_batch_free (batch);
+
+  return res;
+}
+
 static void
 append_string (DBusMessageIter *iter,
 	       const char *key,
@@ -374,6 +646,86 @@ metadata_get (const char *treefile,
   return reply;
 }
 
+/* The arguments are a sequence of (path, array of keys) pairs, an
+   empty key array meaning all keys. The reply contains one array of
+   (key, value) structs per path, in the same order. */
+static DBusMessage *
+metadata_get_batch (const char *treefile,
+		    DBusMessage *message,
+		    DBusMessageIter *iter,
+		    DBusError *derror)
+{
+  TreeInfo *info;
+  DBusMessage *reply;
+  DBusMessageIter reply_iter, array_iter;
+  GPtrArray *keys;
+  char *path, **strv;
+  int i, n_elements;
+
+  info = tree_info_lookup (treefile);
+  if (info == NULL)
+    {
+      dbus_set_error (derror,
+		      DBUS_ERROR_FILE_NOT_FOUND,
+		      _("Can't find metadata file %s"),
+		      treefile);
+      return NULL;
+    }
+
+  reply = dbus_message_new_method_return (message);
+  dbus_message_iter_init_append (reply, &reply_iter);
+
+  keys = g_ptr_array_new ();
+  while (dbus_message_iter_get_arg_type (iter) != 0)
+    {
+      path = NULL;
+      if (!_g_dbus_message_iter_get_args (iter, derror,
+					  G_DBUS_TYPE_CSTRING, &path,
+					  DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &strv, &n_elements,
+					  0))
+	{
+	  g_free (path);
+	  dbus_message_unref (reply);
+	  reply = NULL;
+	  break;
+	}
+
+      if (n_elements == 0)
+	meta_tree_enumerate_keys (info->tree, path, enum_keys, keys);
+      else
+	{
+	  for (i = 0; i < n_elements; i++)
+	    g_ptr_array_add (keys, g_strdup (strv[i]));
+	}
+      g_strfreev (strv);
+
+      if (!dbus_message_iter_open_container (&reply_iter,
+					     DBUS_TYPE_ARRAY,
+					     DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+					     DBUS_TYPE_STRING_AS_STRING
+					     DBUS_TYPE_VARIANT_AS_STRING
+					     DBUS_STRUCT_END_CHAR_AS_STRING,
+					     &array_iter))
+	_g_dbus_oom ();
+
+      for (i = 0; i < keys->len; i++)
+	{
+	  append_key (&array_iter, info->tree, path,
+		      g_ptr_array_index (keys, i));
+	  g_free (g_ptr_array_index (keys, i));
+	}
+      g_ptr_array_set_size (keys, 0);
+
+      if (!dbus_message_iter_close_container (&reply_iter, &array_iter))
+	_g_dbus_oom ();
+
+      g_free (path);
+    }
+  g_ptr_array_free (keys, TRUE);
+
+  return reply;
+}
+
 static gboolean
 metadata_unset (const char *treefile,
 		const char *path,
@@ -467,6 +819,37 @@ metadata_move (const char *treefile,
   return TRUE;
 }
 
+static void
+append_histogram (DBusMessageIter *iter,
+		  LatencyHistogram *histogram)
+{
+  const guint32 *limits, *counts;
+
+  limits = latency_limits_usec;
+  counts = histogram->counts;
+  _g_dbus_message_iter_append_args (iter,
+				    DBUS_TYPE_STRING, &histogram->name,
+				    DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &limits, N_LATENCY_BUCKETS,
+				    DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &counts, N_LATENCY_BUCKETS,
+				    0);
+}
+
+/* Reply is a sequence of (name, bucket upper limits in usec, counts)
+   triples, one per latency histogram */
+static DBusMessage *
+metadata_get_statistics (DBusMessage *message)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter;
+
+  reply = dbus_message_new_method_return (message);
+  dbus_message_iter_init_append (reply, &iter);
+
+  append_histogram (&iter, &flush_histogram);
+
+  return reply;
+}
+
 static gboolean
 register_name (DBusConnection *conn,
 	       gboolean replace)
@@ -615,6 +998,51 @@ metadata_message (DBusConnection  *connection,
       g_free (path);
     }
 
+  else if (dbus_message_is_method_call (message,
+					G_VFS_DBUS_METADATA_INTERFACE,
+					G_VFS_DBUS_METADATA_OP_SET_BATCH))
+    {
+      treefile = NULL;
+      if (!_g_dbus_message_iter_get_args (&iter, &derror,
+					  G_DBUS_TYPE_CSTRING, &treefile,
+					  0) ||
+	  !metadata_set_batch (treefile, &iter, &derror))
+	{
+	  reply = dbus_message_new_error (message,
+					  derror.name,
+					  derror.message);
+	  dbus_error_free (&derror);
+	}
+      else
+	reply = dbus_message_new_method_return (message);
+
+      g_free (treefile);
+    }
+
+  else if (dbus_message_is_method_call (message,
+					G_VFS_DBUS_METADATA_INTERFACE,
+					G_VFS_DBUS_METADATA_OP_GET_BATCH))
+    {
+      treefile = NULL;
+      if (!_g_dbus_message_iter_get_args (&iter, &derror,
+					  G_DBUS_TYPE_CSTRING, &treefile,
+					  0) ||
+	  (reply = metadata_get_batch (treefile, message, &iter, &derror)) == NULL)
+	{
+	  reply = dbus_message_new_error (message,
+					  derror.name,
+					  derror.message);
+	  dbus_error_free (&derror);
+	}
+
+      g_free (treefile);
+    }
+
+  else if (dbus_message_is_method_call (message,
+					G_VFS_DBUS_METADATA_INTERFACE,
+					G_VFS_DBUS_METADATA_OP_GET_STATISTICS))
+    reply = metadata_get_statistics (message);
+
   else if (dbus_message_is_method_call (message,
 					G_VFS_DBUS_METADATA_INTERFACE,
 					G_VFS_DBUS_METADATA_OP_REMOVE))
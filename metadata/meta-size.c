@@ -0,0 +1,157 @@
+#include "config.h"
+#include "metatree.h"
+#include "metabuilder.h"
+#include <glib/gstdio.h>
+
+/* Reports how large a metadata tree is in the original format and
+   in the compact format with inline values and shared value pools */
+
+static char *treename = NULL;
+static GOptionEntry entries[] =
+{
+  { "tree", 't', 0, G_OPTION_ARG_STRING, &treename, "Tree", NULL},
+  { NULL }
+};
+
+typedef struct {
+  char *name;
+  guint64 last_changed;
+  gboolean has_children;
+  gboolean has_data;
+} ChildInfo;
+
+static gboolean
+collect_child (const char *entry,
+	       guint64 last_changed,
+	       gboolean has_children,
+	       gboolean has_data,
+	       gpointer user_data)
+{
+  GList **children = user_data;
+  ChildInfo *info;
+
+  info = g_new (ChildInfo, 1);
+  info->name = g_strdup (entry);
+  info->last_changed = last_changed;
+  info->has_children = has_children;
+  info->has_data = has_data;
+  *children = g_list_prepend (*children, info);
+
+  return TRUE;
+}
+
+static gboolean
+copy_key (const char *key,
+	  MetaKeyType type,
+	  gpointer value,
+	  gpointer user_data)
+{
+  MetaFile *file = user_data;
+  char **strv;
+  int i;
+
+  if (type == META_KEY_TYPE_STRING)
+    metafile_key_set_value (file, key, value);
+  else
+    {
+      strv = value;
+      metafile_key_list_set (file, key);
+      for (i = 0; strv[i] != NULL; i++)
+	metafile_key_list_add (file, key, strv[i]);
+    }
+
+  return TRUE;
+}
+
+static void
+copy_dir (MetaTree *tree,
+	  const char *path,
+	  MetaFile *dir)
+{
+  GList *children, *l;
+  ChildInfo *info;
+  MetaFile *file;
+  char *child_path;
+
+  children = NULL;
+  meta_tree_enumerate_dir (tree, path, collect_child, &children);
+
+  for (l = children; l != NULL; l = l->next)
+    {
+      info = l->data;
+
+      child_path = g_build_filename (path, info->name, NULL);
+      file = metafile_new (info->name, dir);
+      metafile_set_mtime (file, info->last_changed);
+
+      if (info->has_data)
+	meta_tree_enumerate_keys (tree, child_path, copy_key, file);
+      if (info->has_children)
+	copy_dir (tree, child_path, file);
+
+      g_free (child_path);
+      g_free (info->name);
+      g_free (info);
+    }
+  g_list_free (children);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  MetaTree *tree;
+  MetaBuilder *builder;
+  GError *error = NULL;
+  GOptionContext *context;
+  GString *old_format, *compact_format;
+  guint32 random_tag;
+  struct stat statbuf;
+
+  context = g_option_context_new ("[tree file] - report metadata tree size savings");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if (treename)
+    tree = meta_tree_lookup_by_name (treename, FALSE);
+  else if (argc > 1)
+    tree = meta_tree_open (argv[1], FALSE);
+  else
+    {
+      g_printerr ("no tree specified\n");
+      return 1;
+    }
+
+  if (tree == NULL || !meta_tree_exists (tree))
+    {
+      g_printerr ("can't open metadata tree\n");
+      return 1;
+    }
+
+  builder = meta_builder_new ();
+  metafile_set_mtime (builder->root, meta_tree_get_last_changed (tree, "/"));
+  meta_tree_enumerate_keys (tree, "/", copy_key, builder->root);
+  copy_dir (tree, "/", builder->root);
+
+  old_format = meta_builder_encode (builder, FALSE, &random_tag);
+  compact_format = meta_builder_encode (builder, TRUE, &random_tag);
+
+  if (g_stat (meta_tree_get_filename (tree), &statbuf) == 0)
+    g_print ("on disk:         %10ld bytes\n", (long)statbuf.st_size);
+  g_print ("original format: %10ld bytes\n", (long)old_format->len);
+  g_print ("compact format:  %10ld bytes (%.1f%% saved)\n",
+	   (long)compact_format->len,
+	   old_format->len == 0 ? 0.0 :
+	   100.0 * ((double)old_format->len - compact_format->len) / old_format->len);
+
+  g_string_free (old_format, TRUE);
+  g_string_free (compact_format, TRUE);
+  meta_builder_free (builder);
+  meta_tree_unref (tree);
+
+  return 0;
+}
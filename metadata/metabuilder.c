@@ -1,6 +1,7 @@
 #include "metabuilder.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -8,8 +9,10 @@
 #include <sys/mman.h>
 #include <glib/gstdio.h>
 
-#define MAJOR_VERSION 1
-#define MINOR_VERSION 0
+#define MAJOR_VERSION 2
+#define MINOR_VERSION 1
+#define OLD_MAJOR_VERSION 1
+#define OLD_MINOR_VERSION 0
 #define MAJOR_JOURNAL_VERSION 1
 #define MINOR_JOURNAL_VERSION 0
 #define NEW_JOURNAL_SIZE (32*1024)
@@ -18,6 +21,15 @@
 #define ROTATED_OFFSET 8
 
 #define KEY_IS_LIST_MASK (1<<31)
+#define KEY_IS_INLINE_MASK (1<<30)
+#define KEY_INLINE_TYPE_SHIFT 28
+
+/* Types of values stored inline, instead of as an offset */
+enum {
+  INLINE_TYPE_STRING, /* Up to 4 bytes, zero padded */
+  INLINE_TYPE_UINT,   /* Unsigned decimal number */
+  INLINE_TYPE_POINT   /* Two 16bit unsigned decimal numbers, "x,y" */
+};
 
 MetaBuilder *
 meta_builder_new (void)
@@ -630,25 +642,76 @@ append_stringv (GString *out,
   *stringv_block = g_list_prepend (*stringv_block, info);
 }
 
+static guint
+stringv_hash (gconstpointer key)
+{
+  const GList *l;
+  guint hash;
+
+  hash = 0;
+  for (l = key; l != NULL; l = l->next)
+    hash = hash * 31 + g_str_hash (l->data);
+
+  return hash;
+}
+
+static gboolean
+stringv_equal (gconstpointer a,
+	       gconstpointer b)
+{
+  const GList *aa, *bb;
+
+  for (aa = a, bb = b;
+       aa != NULL && bb != NULL;
+       aa = aa->next, bb = bb->next)
+    {
+      if (strcmp (aa->data, bb->data) != 0)
+	return FALSE;
+    }
+
+  return aa == NULL && bb == NULL;
+}
+
+/* Maps lists of strings to the offset of an already written
+   string array, so that identical lists share one array */
+static GHashTable *
+stringv_pool_new (void)
+{
+  return g_hash_table_new (stringv_hash, stringv_equal);
+}
+
 static void
 stringv_block_end (GString *out,
 		   GHashTable *string_block,
-		   GList *stringv_block)
+		   GList *stringv_block,
+		   GHashTable *stringv_pool)
 {
   guint32 table_offset;
   StringvInfo *info;
   GList *l, *s;
+  gpointer pooled;
 
 
   for (l = stringv_block; l != NULL; l = l->next)
     {
       info = l->data;
 
-      table_offset = out->len;
+      if (stringv_pool != NULL &&
+	  g_hash_table_lookup_extended (stringv_pool, info->strings,
+					NULL, &pooled))
+	table_offset = GPOINTER_TO_UINT (pooled);
+      else
+	{
+	  table_offset = out->len;
+
+	  append_uint32 (out, g_list_length (info->strings), NULL);
+	  for (s = info->strings; s != NULL; s = s->next)
+	    append_string (out, s->data, string_block);
 
-      append_uint32 (out, g_list_length (info->strings), NULL);
-      for (s = info->strings; s != NULL; s = s->next)
-	append_string (out, s->data, string_block);
+	  if (stringv_pool != NULL)
+	    g_hash_table_insert (stringv_pool, info->strings,
+				 GUINT_TO_POINTER (table_offset));
+	}
 
       set_uint32 (out, info->offset, table_offset);
 
@@ -662,14 +725,104 @@ stringv_block_end (GString *out,
     g_string_append_c (out, 0);
 }
 
+/* Same as get_name_hash() in metatree.c */
+static guint32
+get_name_hash (const char *name)
+{
+  guint32 hash;
+
+  hash = 2166136261U;
+  while (*name != 0)
+    {
+      hash ^= (guchar)*name++;
+      hash *= 16777619U;
+    }
+
+  return hash;
+}
+
+typedef struct {
+  guint32 hash;
+  guint32 child;
+  const char *name;
+} LookupInfo;
+
+static int
+compare_lookup_info (gconstpointer a,
+		     gconstpointer b)
+{
+  const LookupInfo *aa, *bb;
+
+  aa = a;
+  bb = b;
+
+  if (aa->hash != bb->hash)
+    return aa->hash < bb->hash ? -1 : 1;
+  return strcmp (aa->name, bb->name);
+}
+
+/* Stores the sorted entries in Eytzinger order, i.e. as an
+   implicit binary search tree where node k has children 2k
+   and 2k+1 */
+static void
+fill_lookup_index (LookupInfo *sorted,
+		   guint32 *sorted_pos,
+		   LookupInfo **order,
+		   guint32 num,
+		   guint32 k)
+{
+  if (k > num)
+    return;
+
+  fill_lookup_index (sorted, sorted_pos, order, num, 2 * k);
+  order[k - 1] = &sorted[(*sorted_pos)++];
+  fill_lookup_index (sorted, sorted_pos, order, num, 2 * k + 1);
+}
+
+static void
+append_lookup_index (GString *out,
+		     GList *children)
+{
+  LookupInfo *sorted, **order;
+  MetaFile *child;
+  guint32 num, sorted_pos, i;
+  GList *l;
+
+  num = g_list_length (children);
+  sorted = g_new (LookupInfo, num);
+  order = g_new (LookupInfo *, num);
+
+  for (l = children, i = 0; l != NULL; l = l->next, i++)
+    {
+      child = l->data;
+      sorted[i].hash = get_name_hash (child->name);
+      sorted[i].child = i;
+      sorted[i].name = child->name;
+    }
+  qsort (sorted, num, sizeof (LookupInfo), compare_lookup_info);
+
+  sorted_pos = 0;
+  fill_lookup_index (sorted, &sorted_pos, order, num, 1);
+
+  for (i = 0; i < num; i++)
+    {
+      append_uint32 (out, order[i]->hash, NULL);
+      append_uint32 (out, order[i]->child, NULL);
+    }
+
+  g_free (order);
+  g_free (sorted);
+}
+
 static void
 write_children (GString *out,
-		MetaBuilder *builder)
+		MetaBuilder *builder,
+		gboolean lookup_index)
 {
   GHashTable *strings;
   MetaFile *child, *file;
   GList *l;
-  GList *files;
+  GList *files, *written;
 
   files = g_list_prepend (NULL, builder->root);
 
@@ -686,42 +839,127 @@ write_children (GString *out,
       if (file->children_pointer != 0)
 	set_uint32 (out, file->children_pointer, out->len);
 
-      append_uint32 (out, g_list_length (file->children), NULL);
-
+      /* No mtime, children or metadata, no need for this
+	 to be in the file */
+      written = NULL;
       for (l = file->children; l != NULL; l = l->next)
 	{
 	  child = l->data;
+	  if (child->last_changed != 0 ||
+	      child->children != NULL ||
+	      child->data != NULL)
+	    written = g_list_prepend (written, child);
+	}
+      written = g_list_reverse (written);
 
-	  /* No mtime, children or metadata, no need for this
-	     to be in the file */
-	  if (child->last_changed == 0 &&
-	      child->children == NULL &&
-	      child->data == NULL)
-	    continue;
+      append_uint32 (out, g_list_length (written), NULL);
+
+      for (l = written; l != NULL; l = l->next)
+	{
+	  child = l->data;
 
 	  append_string (out, child->name, strings);
 	  append_uint32 (out, 0, &child->children_pointer);
 	  append_uint32 (out, 0, &child->metadata_pointer);
 	  append_time_t (out, child->last_changed, builder);
 
-	  if (file->children)
-	    files = g_list_append (files, child);
+	  files = g_list_append (files, child);
 	}
 
+      if (lookup_index)
+	append_lookup_index (out, written);
+
+      g_list_free (written);
+
       string_block_end (out, strings);
     }
 }
 
+/* Parses a decimal number without leading zeros (so that it
+   formats back to the same string) that is at most max */
+static gboolean
+parse_canonical_uint (const char *str,
+		      const char **end,
+		      guint32 max,
+		      guint32 *out)
+{
+  guint64 val;
+
+  if (!g_ascii_isdigit (*str) ||
+      (str[0] == '0' && g_ascii_isdigit (str[1])))
+    return FALSE;
+
+  val = 0;
+  while (g_ascii_isdigit (*str))
+    {
+      val = val * 10 + (*str++ - '0');
+      if (val > max)
+	return FALSE;
+    }
+
+  *end = str;
+  *out = val;
+  return TRUE;
+}
+
+/* Returns TRUE if value can be stored in the value field itself,
+   setting the extra key bits and the inline value */
+static gboolean
+encode_inline_value (const char *value,
+		     guint32 *key_bits,
+		     guint32 *inline_value)
+{
+  const char *end;
+  guint32 x, y;
+  gsize len;
+  int i;
+
+  if (parse_canonical_uint (value, &end, G_MAXUINT32, &x) &&
+      *end == 0)
+    {
+      *key_bits = KEY_IS_INLINE_MASK | (INLINE_TYPE_UINT << KEY_INLINE_TYPE_SHIFT);
+      *inline_value = x;
+      return TRUE;
+    }
+
+  if (parse_canonical_uint (value, &end, G_MAXUINT16, &x) &&
+      *end++ == ',' &&
+      parse_canonical_uint (end, &end, G_MAXUINT16, &y) &&
+      *end == 0)
+    {
+      *key_bits = KEY_IS_INLINE_MASK | (INLINE_TYPE_POINT << KEY_INLINE_TYPE_SHIFT);
+      *inline_value = (x << 16) | y;
+      return TRUE;
+    }
+
+  len = strlen (value);
+  if (len <= 4)
+    {
+      *key_bits = KEY_IS_INLINE_MASK | (INLINE_TYPE_STRING << KEY_INLINE_TYPE_SHIFT);
+      *inline_value = 0;
+      for (i = 0; i < 4; i++)
+	{
+	  *inline_value <<= 8;
+	  if (i < len)
+	    *inline_value |= (guchar)value[i];
+	}
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
 static void
 write_metadata_for_file (GString *out,
 			 MetaFile *file,
 			 GList **stringvs,
 			 GHashTable *strings,
-			 GHashTable *key_hash)
+			 GHashTable *key_hash,
+			 gboolean compact)
 {
   GList *l;
   MetaData *data;
-  guint32 key;
+  guint32 key, key_bits, inline_value;
 
   g_assert (file->metadata_pointer != 0);
   set_uint32 (out, file->metadata_pointer, out->len);
@@ -734,35 +972,57 @@ write_metadata_for_file (GString *out,
 
       key = GPOINTER_TO_UINT (g_hash_table_lookup (key_hash, data->key));
       if (data->is_list)
-	key |= KEY_IS_LIST_MASK;
-      append_uint32 (out, key, NULL);
-      if (data->is_list)
-	append_stringv (out, data->values, stringvs);
+	{
+	  append_uint32 (out, key | KEY_IS_LIST_MASK, NULL);
+	  append_stringv (out, data->values, stringvs);
+	}
+      else if (compact &&
+	       encode_inline_value (data->value, &key_bits, &inline_value))
+	{
+	  append_uint32 (out, key | key_bits, NULL);
+	  append_uint32 (out, inline_value, NULL);
+	}
       else
-	append_string (out, data->value, strings);
+	{
+	  append_uint32 (out, key, NULL);
+	  append_string (out, data->value, strings);
+	}
     }
 }
 
 static void
 write_metadata (GString *out,
 		MetaBuilder *builder,
-		GHashTable *key_hash)
+		GHashTable *key_hash,
+		gboolean compact)
 {
-  GHashTable *strings;
+  GHashTable *strings, *stringv_pool;
   GList *stringvs;
   MetaFile *child, *file;
   GList *l;
   GList *files;
 
+  /* In the compact format all values share one string block and
+     identical string lists are only stored once */
+  strings = NULL;
+  stringv_pool = NULL;
+  if (compact)
+    {
+      strings = string_block_begin ();
+      stringv_pool = stringv_pool_new ();
+    }
+
   /* Root metadata */
   if (builder->root->data != NULL)
     {
-      strings = string_block_begin ();
+      if (!compact)
+	strings = string_block_begin ();
       stringvs = stringv_block_begin ();
       write_metadata_for_file (out, builder->root,
-			       &stringvs, strings, key_hash);
-      stringv_block_end (out, strings, stringvs);
-      string_block_end (out, strings);
+			       &stringvs, strings, key_hash, compact);
+      stringv_block_end (out, strings, stringvs, stringv_pool);
+      if (!compact)
+	string_block_end (out, strings);
     }
 
   /* the rest, breadth first with all files in one
@@ -776,7 +1036,8 @@ write_metadata (GString *out,
       if (file->children == NULL)
 	continue; /* No children, skip file */
 
-      strings = string_block_begin ();
+      if (!compact)
+	strings = string_block_begin ();
       stringvs = stringv_block_begin ();
 
       for (l = file->children; l != NULL; l = l->next)
@@ -785,13 +1046,20 @@ write_metadata (GString *out,
 
 	  if (child->data != NULL)
 	    write_metadata_for_file (out, child,
-				     &stringvs, strings, key_hash);
+				     &stringvs, strings, key_hash, compact);
 
 	  if (child->children != NULL)
 	    files = g_list_append (files, child);
 	}
 
-      stringv_block_end (out, strings, stringvs);
+      stringv_block_end (out, strings, stringvs, stringv_pool);
+      if (!compact)
+	string_block_end (out, strings);
+    }
+
+  if (compact)
+    {
+      g_hash_table_destroy (stringv_pool);
       string_block_end (out, strings);
     }
 }
@@ -897,9 +1165,13 @@ create_new_journal (const char *filename, guint32 random_tag)
   return res;
 }
 
-static GString *
-metadata_create_static (MetaBuilder *builder,
-			guint32 *random_tag_out)
+/* The compact format (the current major version) inlines small
+   values and shares values between directories, the non-compact
+   one is the original format */
+GString *
+meta_builder_encode (MetaBuilder *builder,
+		     gboolean compact,
+		     guint32 *random_tag_out)
 {
   GString *out;
   GHashTable *hash, *key_hash;
@@ -924,8 +1196,8 @@ metadata_create_static (MetaBuilder *builder,
   g_string_append_c (out, 'a');
 
   /* VERSION */
-  g_string_append_c (out, MAJOR_VERSION);
-  g_string_append_c (out, MINOR_VERSION);
+  g_string_append_c (out, compact ? MAJOR_VERSION : OLD_MAJOR_VERSION);
+  g_string_append_c (out, compact ? MINOR_VERSION : OLD_MINOR_VERSION);
 
   append_uint32 (out, 0, NULL); /* Rotated */
   random_tag = g_random_int ();
@@ -996,8 +1268,8 @@ metadata_create_static (MetaBuilder *builder,
   while (out->len % 4 != 0)
     g_string_append_c (out, 0);
 
-  write_children (out, builder);
-  write_metadata (out, builder, key_hash);
+  write_children (out, builder, compact);
+  write_metadata (out, builder, key_hash, compact);
 
   g_hash_table_destroy (key_hash);
   g_list_free (keys);
@@ -1014,7 +1286,7 @@ meta_builder_write (MetaBuilder *builder,
   int fd, fd2, fd_dir;
   char *tmp_name, *dirname;
 
-  out = metadata_create_static (builder, &random_tag);
+  out = meta_builder_encode (builder, TRUE, &random_tag);
 
   tmp_name = g_strdup_printf ("%s.XXXXXX", filename);
   fd = g_mkstemp (tmp_name);
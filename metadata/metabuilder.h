@@ -68,6 +68,9 @@ void         meta_builder_copy      (MetaBuilder *builder,
 				     guint64      mtime);
 gboolean     meta_builder_write     (MetaBuilder *builder,
 				     const char  *filename);
+GString *    meta_builder_encode    (MetaBuilder *builder,
+				     gboolean     compact,
+				     guint32     *random_tag_out);
 MetaFile *   metafile_new           (const char  *name,
 				     MetaFile    *parent);
 void         metafile_free          (MetaFile    *file);
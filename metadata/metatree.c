@@ -60,14 +60,31 @@
 
 #define MAGIC "\xda\x1ameta"
 #define MAGIC_LEN 6
-#define MAJOR_VERSION 1
-#define MINOR_VERSION 0
+#define MAJOR_VERSION 2
+#define MINOR_VERSION 1
+#define OLD_MAJOR_VERSION 1
+/* First minor version of MAJOR_VERSION with children lookup indexes */
+#define LOOKUP_INDEX_MINOR_VERSION 1
 #define JOURNAL_MAGIC "\xda\x1ajour"
 #define JOURNAL_MAGIC_LEN 6
 #define JOURNAL_MAJOR_VERSION 1
 #define JOURNAL_MINOR_VERSION 0
 
 #define KEY_IS_LIST_MASK (1<<31)
+#define KEY_IS_INLINE_MASK (1<<30)
+#define KEY_INLINE_TYPE_SHIFT 28
+#define KEY_INLINE_TYPE_MASK (3<<28)
+#define KEY_ID_MASK ((1<<28)-1)
+
+/* Types of values stored inline, instead of as an offset */
+enum {
+  INLINE_TYPE_STRING, /* Up to 4 bytes, zero padded */
+  INLINE_TYPE_UINT,   /* Unsigned decimal number */
+  INLINE_TYPE_POINT   /* Two 16bit unsigned decimal numbers, "x,y" */
+};
+
+/* Big enough for any formatted inline value */
+#define INLINE_VALUE_BUFFER_SIZE 16
 
 static GStaticRWLock metatree_lock = G_STATIC_RW_LOCK_INIT;
 
@@ -102,6 +119,15 @@ typedef struct {
   MetaFileDirEnt children[1];
 } MetaFileDir;
 
+/* Follows the children array in files with lookup indexes, one
+   entry per child ordered by (name hash, name) and stored in
+   Eytzinger (breadth first search tree) order. Lookups then touch
+   few cache lines and only follow the name offset on hash hits */
+typedef struct {
+  guint32 name_hash;
+  guint32 child;
+} MetaFileLookupEnt;
+
 typedef struct {
   guint32 num_strings;
   guint32 strings[1];
@@ -163,6 +189,7 @@ struct _MetaTree {
   gint64 time_t_base;
   MetaFileHeader *header;
   MetaFileDirEnt *root;
+  gboolean has_lookup_index;
 
   int num_attributes;
   char **attributes;
@@ -245,6 +272,40 @@ verify_string (MetaTree *tree, guint32 pos)
   return str;
 }
 
+/* Returns the string value of a non-list key, formatting inline
+   values into buffer, which must be INLINE_VALUE_BUFFER_SIZE long */
+static char *
+get_string_value (MetaTree *tree,
+		  MetaFileDataEnt *ent,
+		  char *buffer)
+{
+  guint32 key, value;
+  int i;
+
+  key = GUINT32_FROM_BE (ent->key);
+  if ((key & KEY_IS_INLINE_MASK) == 0)
+    return verify_string (tree, ent->value);
+
+  value = GUINT32_FROM_BE (ent->value);
+  switch ((key & KEY_INLINE_TYPE_MASK) >> KEY_INLINE_TYPE_SHIFT)
+    {
+    case INLINE_TYPE_STRING:
+      for (i = 0; i < 4; i++)
+	buffer[i] = (value >> (24 - i * 8)) & 0xff;
+      buffer[4] = 0;
+      return buffer;
+    case INLINE_TYPE_UINT:
+      g_snprintf (buffer, INLINE_VALUE_BUFFER_SIZE, "%u", value);
+      return buffer;
+    case INLINE_TYPE_POINT:
+      g_snprintf (buffer, INLINE_VALUE_BUFFER_SIZE, "%u,%u",
+		  value >> 16, value & 0xffff);
+      return buffer;
+    default:
+      return NULL;
+    }
+}
+
 static void
 meta_tree_clear (MetaTree *tree)
 {
@@ -476,7 +537,8 @@ meta_tree_init (MetaTree *tree)
   if (memcmp (tree->header->magic, MAGIC, MAGIC_LEN) != 0)
     goto err;
 
-  if (tree->header->major != MAJOR_VERSION)
+  if (tree->header->major != MAJOR_VERSION &&
+      tree->header->major != OLD_MAJOR_VERSION)
     goto err;
 
   tree->root = verify_block_pointer (tree, tree->header->root, sizeof (MetaFileDirEnt));
@@ -497,6 +559,10 @@ meta_tree_init (MetaTree *tree)
 	goto err;
     }
 
+  tree->has_lookup_index =
+    tree->header->major == MAJOR_VERSION &&
+    tree->header->minor >= LOOKUP_INDEX_MINOR_VERSION;
+
   tree->tag = GUINT32_FROM_BE (tree->header->random_tag);
   tree->time_t_base = GINT64_FROM_BE (tree->header->time_t_base);
 
@@ -525,6 +591,7 @@ meta_tree_open (const char *filename,
   g_assert (sizeof (MetaFileHeader) == 32);
   g_assert (sizeof (MetaFileDirEnt) == 16);
   g_assert (sizeof (MetaFileDataEnt) == 8);
+  g_assert (sizeof (MetaFileLookupEnt) == 8);
 
   tree = g_new0 (MetaTree, 1);
   tree->ref_count = 1;
@@ -707,6 +774,75 @@ find_dir_element (const void *_key, const void *_dirent)
   return strcmp (key->name, dirent_name);
 }
 
+/* FNV-1a, part of the file format so it must never change */
+static guint32
+get_name_hash (const char *name)
+{
+  guint32 hash;
+
+  hash = 2166136261U;
+  while (*name != 0)
+    {
+      hash ^= (guchar)*name++;
+      hash *= 16777619U;
+    }
+
+  return hash;
+}
+
+static MetaFileDirEnt *
+find_dir_element_indexed (MetaTree *tree,
+			  guint32 children_pos,
+			  MetaFileDir *dir,
+			  const char *name)
+{
+  MetaFileLookupEnt *index, *ent;
+  MetaFileDirEnt *dirent;
+  guint32 num_children, pos, hash, ent_hash, child;
+  char *dirent_name;
+  int cmp;
+
+  num_children = GUINT32_FROM_BE (dir->num_children);
+  pos = GUINT32_FROM_BE (children_pos) +
+    sizeof (guint32) + num_children * sizeof (MetaFileDirEnt);
+  index = verify_block_pointer (tree, GUINT32_TO_BE (pos),
+				num_children * sizeof (MetaFileLookupEnt));
+  if (index == NULL)
+    return NULL;
+
+  hash = get_name_hash (name);
+
+  /* Node k has children 2k and 2k+1, with k starting at 1 */
+  pos = 1;
+  while (pos <= num_children)
+    {
+      ent = &index[pos - 1];
+      ent_hash = GUINT32_FROM_BE (ent->name_hash);
+
+      if (hash != ent_hash)
+	cmp = hash < ent_hash ? -1 : 1;
+      else
+	{
+	  child = GUINT32_FROM_BE (ent->child);
+	  if (child >= num_children)
+	    return NULL;
+	  dirent = &dir->children[child];
+
+	  dirent_name = verify_string (tree, dirent->name);
+	  if (dirent_name == NULL)
+	    return NULL;
+
+	  cmp = strcmp (name, dirent_name);
+	  if (cmp == 0)
+	    return dirent;
+	}
+
+      pos = 2 * pos + (cmp > 0 ? 1 : 0);
+    }
+
+  return NULL;
+}
+
 /* modifies path!!! */
 static MetaFileDirEnt *
 dir_lookup_path (MetaTree *tree,
@@ -738,11 +874,16 @@ dir_lookup_path (MetaTree *tree,
   if (*end_path != 0)
     *end_path++ = 0;
 
-  key.name = path;
-  key.tree = tree;
-  dirent = bsearch (&key, &dir->children[0],
-		    GUINT32_FROM_BE (dir->num_children), sizeof (MetaFileDirEnt),
-		    find_dir_element);
+  if (tree->has_lookup_index)
+    dirent = find_dir_element_indexed (tree, dirent->children, dir, path);
+  else
+    {
+      key.name = path;
+      key.tree = tree;
+      dirent = bsearch (&key, &dir->children[0],
+			GUINT32_FROM_BE (dir->num_children), sizeof (MetaFileDirEnt),
+			find_dir_element);
+    }
 
   if (dirent == NULL)
     return NULL;
@@ -821,7 +962,7 @@ find_data_element (const void *_key, const void *_dataent)
   const MetaFileDataEnt *dataent = _dataent;
   guint32 key_id;
 
-  key_id = GUINT32_FROM_BE (dataent->key) & ~KEY_IS_LIST_MASK;
+  key_id = GUINT32_FROM_BE (dataent->key) & KEY_ID_MASK;
 
   return key->id - key_id;
 }
@@ -1109,10 +1250,13 @@ meta_journal_entry_new_unset (guint64 mtime,
 }
 
 
-/* Call with writer lock held */
+/* Appends num_entries consecutive, finished entries in one go.
+   Call with writer lock held */
 static gboolean
-meta_journal_add_entry (MetaJournal *journal,
-			GString *entry)
+meta_journal_add_entries (MetaJournal *journal,
+			  const char *entries,
+			  gsize len,
+			  guint32 num_entries)
 {
   char *ptr;
   guint32 offset;
@@ -1122,19 +1266,27 @@ meta_journal_add_entry (MetaJournal *journal,
   ptr = (char *)journal->last_entry;
   offset =  ptr - journal->data;
 
-  /* Does the entry fit? */
-  if (entry->len > journal->len - offset)
+  /* Do the entries fit? */
+  if (len > journal->len - offset)
     return FALSE;
 
-  memcpy (ptr, entry->str, entry->len);
+  memcpy (ptr, entries, len);
 
-  journal->header->num_entries = GUINT_TO_BE (journal->last_entry_num + 1);
+  journal->header->num_entries = GUINT_TO_BE (journal->last_entry_num + num_entries);
   meta_journal_validate_more (journal);
   g_assert (journal->journal_valid);
 
   return TRUE;
 }
 
+/* Call with writer lock held */
+static gboolean
+meta_journal_add_entry (MetaJournal *journal,
+			GString *entry)
+{
+  return meta_journal_add_entries (journal, entry->str, entry->len, 1);
+}
+
 static MetaJournal *
 meta_journal_open (MetaTree *tree, const char *filename, gboolean for_write, guint32 tag)
 {
@@ -1545,6 +1697,7 @@ meta_tree_lookup_string (MetaTree   *tree,
   gpointer value;
   char *new_path;
   char *res;
+  char inline_buffer[INLINE_VALUE_BUFFER_SIZE];
 
   g_static_rw_lock_reader_lock (&metatree_lock);
 
@@ -1572,7 +1725,7 @@ meta_tree_lookup_string (MetaTree   *tree,
   else if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
     res = NULL;
   else
-    res = g_strdup (verify_string (tree, ent->value));
+    res = g_strdup (get_string_value (tree, ent, inline_buffer));
 
  out:
   g_static_rw_lock_reader_unlock (&metatree_lock);
@@ -2048,13 +2201,14 @@ enumerate_data (MetaTree *tree,
   gpointer free_me;
   char **strv;
   char *strv_static[10];
+  char inline_buffer[INLINE_VALUE_BUFFER_SIZE];
 
   num_keys = GUINT32_FROM_BE (data->num_keys);
   for (i = 0; i < num_keys; i++)
     {
       ent = &data->keys[i];
 
-      key_id = GUINT32_FROM_BE (ent->key) & ~KEY_IS_LIST_MASK;
+      key_id = GUINT32_FROM_BE (ent->key) & KEY_ID_MASK;
       if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
 	type = META_KEY_TYPE_STRINGV;
       else
@@ -2067,13 +2221,13 @@ enumerate_data (MetaTree *tree,
       if (key_name == NULL)
 	continue;
 
-      info = g_hash_table_lookup (keys, key_name);
+      info = keys ? g_hash_table_lookup (keys, key_name) : NULL;
       if (info)
 	continue; /* overridden, handle later */
 
       free_me = NULL;
       if (type == META_KEY_TYPE_STRING)
-	value = verify_string (tree, ent->value);
+	value = get_string_value (tree, ent, inline_buffer);
       else
 	{
 	  stringv = verify_array_block (tree, ent->value,
@@ -2177,6 +2331,148 @@ meta_tree_enumerate_keys (MetaTree                         *tree,
 }
 
 
+struct _MetaDirCursor {
+  MetaTree *tree;
+  char *path;
+
+  /* What the cursor was built for, rebuilt if any changes */
+  char *tree_data;
+  guint32 tree_tag;
+  guint32 journal_entries;
+
+  GHashTable *children; /* name -> MetaFileDirEnt in the tree */
+  GHashTable *journal_children; /* name -> EnumDirChildInfo, touched by journal */
+};
+
+static guint32
+get_journal_entries (MetaTree *tree)
+{
+  if (tree->journal == NULL)
+    return 0;
+  return tree->journal->last_entry_num;
+}
+
+/* Must be called with a read lock held */
+static void
+meta_dir_cursor_build_locked (MetaDirCursor *cursor)
+{
+  MetaTree *tree;
+  EnumDirData data;
+  MetaFileDirEnt *dirent, *child;
+  MetaFileDir *dir;
+  guint32 i, num_children;
+  char *res_path, *name;
+
+  tree = cursor->tree;
+
+  if (cursor->journal_children)
+    g_hash_table_destroy (cursor->journal_children);
+  g_hash_table_remove_all (cursor->children);
+
+  cursor->tree_data = tree->data;
+  cursor->tree_tag = tree->tag;
+  cursor->journal_entries = get_journal_entries (tree);
+
+  /* Any child that the journal touches is looked up the slow way */
+  data.children = cursor->journal_children =
+    g_hash_table_new_full (g_str_hash,
+			   g_str_equal,
+			   NULL,
+			   (GDestroyNotify)child_info_free);
+  res_path = meta_journal_iterate (tree->journal,
+				   cursor->path,
+				   enum_dir_iter_key,
+				   enum_dir_iter_path,
+				   &data);
+  if (res_path == NULL)
+    return; /* Removed in the journal, nothing in the tree applies */
+
+  dirent = meta_tree_lookup (tree, res_path);
+  g_free (res_path);
+
+  if (dirent == NULL ||
+      dirent->children == 0 ||
+      (dir = verify_children_block (tree, dirent->children)) == NULL)
+    return;
+
+  num_children = GUINT32_FROM_BE (dir->num_children);
+  for (i = 0; i < num_children; i++)
+    {
+      child = &dir->children[i];
+      name = verify_string (tree, child->name);
+      if (name != NULL)
+	g_hash_table_insert (cursor->children, name, child);
+    }
+}
+
+MetaDirCursor *
+meta_dir_cursor_new (MetaTree   *tree,
+		     const char *path)
+{
+  MetaDirCursor *cursor;
+
+  cursor = g_new0 (MetaDirCursor, 1);
+  cursor->tree = meta_tree_ref (tree);
+  cursor->path = g_strdup (path);
+  cursor->children = g_hash_table_new (g_str_hash, g_str_equal);
+
+  g_static_rw_lock_reader_lock (&metatree_lock);
+  meta_dir_cursor_build_locked (cursor);
+  g_static_rw_lock_reader_unlock (&metatree_lock);
+
+  return cursor;
+}
+
+void
+meta_dir_cursor_free (MetaDirCursor *cursor)
+{
+  g_hash_table_destroy (cursor->children);
+  if (cursor->journal_children)
+    g_hash_table_destroy (cursor->journal_children);
+  meta_tree_unref (cursor->tree);
+  g_free (cursor->path);
+  g_free (cursor);
+}
+
+void
+meta_dir_cursor_enumerate_keys (MetaDirCursor                    *cursor,
+				const char                       *name,
+				meta_tree_keys_enumerate_callback callback,
+				gpointer                          user_data)
+{
+  MetaTree *tree;
+  MetaFileDirEnt *dirent;
+  MetaFileData *data;
+  char *path;
+
+  tree = cursor->tree;
+
+  g_static_rw_lock_reader_lock (&metatree_lock);
+
+  if (cursor->tree_data != tree->data ||
+      cursor->tree_tag != tree->tag ||
+      cursor->journal_entries != get_journal_entries (tree))
+    meta_dir_cursor_build_locked (cursor);
+
+  if (g_hash_table_lookup (cursor->journal_children, name) != NULL)
+    {
+      g_static_rw_lock_reader_unlock (&metatree_lock);
+
+      path = g_build_filename (cursor->path, name, NULL);
+      meta_tree_enumerate_keys (tree, path, callback, user_data);
+      g_free (path);
+      return;
+    }
+
+  dirent = g_hash_table_lookup (cursor->children, name);
+  if (dirent != NULL &&
+      dirent->metadata != 0 &&
+      (data = verify_metadata_block (tree, dirent->metadata)) != NULL)
+    enumerate_data (tree, data, NULL, callback, user_data);
+
+  g_static_rw_lock_reader_unlock (&metatree_lock);
+}
+
 static void
 copy_tree_to_builder (MetaTree *tree,
 		      MetaFileDirEnt *dirent,
@@ -2189,6 +2485,7 @@ copy_tree_to_builder (MetaTree *tree,
   MetaFileDirEnt *child_dirent;
   MetaKeyType type;
   char *child_name, *key_name, *value;
+  char inline_buffer[INLINE_VALUE_BUFFER_SIZE];
   guint32 i, num_keys, num_children, j;
   guint32 key_id;
 
@@ -2201,7 +2498,7 @@ copy_tree_to_builder (MetaTree *tree,
 	{
 	  ent = &data->keys[i];
 
-	  key_id = GUINT32_FROM_BE (ent->key) & ~KEY_IS_LIST_MASK;
+	  key_id = GUINT32_FROM_BE (ent->key) & KEY_ID_MASK;
 	  if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
 	    type = META_KEY_TYPE_STRINGV;
 	  else
@@ -2216,7 +2513,7 @@ copy_tree_to_builder (MetaTree *tree,
 
 	  if (type == META_KEY_TYPE_STRING)
 	    {
-	      value = verify_string (tree, ent->value);
+	      value = get_string_value (tree, ent, inline_buffer);
 	      if (value)
 		metafile_key_set_value (builder_file,
 					key_name, value);
@@ -2269,11 +2566,10 @@ copy_tree_to_builder (MetaTree *tree,
 }
 
 static void
-apply_journal_to_builder (MetaTree *tree,
-			  MetaBuilder *builder)
+apply_journal_entries_to_builder (MetaBuilder *builder,
+				  MetaJournalEntry *entry,
+				  MetaJournalEntry *last_entry)
 {
-  MetaJournal *journal;
-  MetaJournalEntry *entry;
   guint32 *sizep;
   guint64 mtime;
   char *journal_path, *journal_key, *source_path;
@@ -2282,10 +2578,7 @@ apply_journal_to_builder (MetaTree *tree,
   MetaFile *file;
   int i;
 
-  journal = tree->journal;
-
-  entry = journal->first_entry;
-  while (entry < journal->last_entry)
+  while (entry < last_entry)
     {
       mtime = GUINT64_FROM_BE (entry->mtime);
       journal_path = &entry->path[0];
@@ -2344,10 +2637,23 @@ apply_journal_to_builder (MetaTree *tree,
     }
 }
 
+static void
+apply_journal_to_builder (MetaTree *tree,
+			  MetaBuilder *builder)
+{
+  apply_journal_entries_to_builder (builder,
+				    tree->journal->first_entry,
+				    tree->journal->last_entry);
+}
+
 
 /* Needs write lock */
+/* Writes out a new tree with the journal and the given extra journal
+   entries applied, the entries are only in the tree if this succeeds */
 static gboolean
-meta_tree_flush_locked (MetaTree *tree)
+meta_tree_write_locked (MetaTree *tree,
+			const char *entries,
+			gsize len)
 {
   MetaBuilder *builder;
   gboolean res;
@@ -2359,6 +2665,11 @@ meta_tree_flush_locked (MetaTree *tree)
   if (tree->journal)
     apply_journal_to_builder (tree, builder);
 
+  if (entries)
+    apply_journal_entries_to_builder (builder,
+				      (MetaJournalEntry *)entries,
+				      (MetaJournalEntry *)(entries + len));
+
   res = meta_builder_write (builder,
 			    meta_tree_get_filename (tree));
   if (res)
@@ -2369,6 +2680,12 @@ meta_tree_flush_locked (MetaTree *tree)
   return res;
 }
 
+static gboolean
+meta_tree_flush_locked (MetaTree *tree)
+{
+  return meta_tree_write_locked (tree, NULL, 0);
+}
+
 gboolean
 meta_tree_flush (MetaTree *tree)
 {
@@ -2380,6 +2697,31 @@ meta_tree_flush (MetaTree *tree)
   return res;
 }
 
+/* Returns how much of the journal is in use, in percent */
+guint
+meta_tree_get_journal_fill (MetaTree *tree)
+{
+  MetaJournal *journal;
+  gsize used, size;
+  guint res;
+
+  g_static_rw_lock_reader_lock (&metatree_lock);
+
+  journal = tree->journal;
+  res = 0;
+  if (journal != NULL)
+    {
+      used = (char *)journal->last_entry - (char *)journal->first_entry;
+      size = journal->len - ((char *)journal->first_entry - journal->data);
+      if (size > 0)
+	res = (used * 100) / size;
+    }
+
+  g_static_rw_lock_reader_unlock (&metatree_lock);
+
+  return res;
+}
+
 gboolean
 meta_tree_unset (MetaTree                         *tree,
 		 const char                       *path,
@@ -2576,6 +2918,102 @@ meta_tree_copy (MetaTree                         *tree,
   return res;
 }
 
+struct _MetaTreeBatch {
+  GString *entries;
+  guint32 num_entries;
+};
+
+MetaTreeBatch *
+meta_tree_batch_new (void)
+{
+  MetaTreeBatch *batch;
+
+  batch = g_new0 (MetaTreeBatch, 1);
+  batch->entries = g_string_new (NULL);
+
+  return batch;
+}
+
+void
+meta_tree_batch_free (MetaTreeBatch *batch)
+{
+  g_string_free (batch->entries, TRUE);
+  g_free (batch);
+}
+
+guint
+meta_tree_batch_get_size (MetaTreeBatch *batch)
+{
+  return batch->num_entries;
+}
+
+static void
+meta_tree_batch_add_entry (MetaTreeBatch *batch,
+			   GString *entry)
+{
+  g_string_append_len (batch->entries, entry->str, entry->len);
+  batch->num_entries++;
+  g_string_free (entry, TRUE);
+}
+
+void
+meta_tree_batch_set_string (MetaTreeBatch *batch,
+			    const char    *path,
+			    const char    *key,
+			    const char    *value)
+{
+  meta_tree_batch_add_entry (batch,
+			     meta_journal_entry_new_set (time (NULL), path, key, value));
+}
+
+void
+meta_tree_batch_set_stringv (MetaTreeBatch *batch,
+			     const char    *path,
+			     const char    *key,
+			     char         **value)
+{
+  meta_tree_batch_add_entry (batch,
+			     meta_journal_entry_new_setv (time (NULL), path, key, value));
+}
+
+void
+meta_tree_batch_unset (MetaTreeBatch *batch,
+		       const char    *path,
+		       const char    *key)
+{
+  meta_tree_batch_add_entry (batch,
+			     meta_journal_entry_new_unset (time (NULL), path, key));
+}
+
+gboolean
+meta_tree_apply_batch (MetaTree      *tree,
+		       MetaTreeBatch *batch)
+{
+  gboolean res;
+
+  g_static_rw_lock_writer_lock (&metatree_lock);
+
+  /* The batch goes in with one journal append. If it doesn't fit we
+     write it out together with the tree instead of rotating the
+     journal in the middle of it, so a failure never leaves half the
+     batch applied. */
+  if (tree->journal == NULL ||
+      !tree->journal->journal_valid)
+    res = FALSE;
+  else if (meta_journal_add_entries (tree->journal,
+				     batch->entries->str,
+				     batch->entries->len,
+				     batch->num_entries))
+    res = TRUE;
+  else
+    res = meta_tree_write_locked (tree,
+				  batch->entries->str,
+				  batch->entries->len);
+
+  g_static_rw_lock_writer_unlock (&metatree_lock);
+  return res;
+}
+
 static char *
 canonicalize_filename (const char *filename)
 {
@@ -27,6 +27,8 @@
 
 typedef struct _MetaTree MetaTree;
 typedef struct _MetaLookupCache MetaLookupCache;
+typedef struct _MetaTreeBatch MetaTreeBatch;
+typedef struct _MetaDirCursor MetaDirCursor;
 
 typedef enum {
   META_KEY_TYPE_NONE,
@@ -56,6 +58,36 @@ MetaTree        *meta_lookup_cache_lookup_path (MetaLookupCache *cache,
 						gboolean for_write,
 						char **tree_path);
 
+/* A MetaDirCursor resolves a directory once and then looks up the
+   keys of many of its children without walking the tree from the
+   root for each one. MetaDirCursor is not threadsafe */
+MetaDirCursor *meta_dir_cursor_new           (MetaTree                          *tree,
+					      const char                        *path);
+void           meta_dir_cursor_free          (MetaDirCursor                     *cursor);
+void           meta_dir_cursor_enumerate_keys (MetaDirCursor                    *cursor,
+					       const char                       *name,
+					       meta_tree_keys_enumerate_callback callback,
+					       gpointer                          user_data);
+
+/* A MetaTreeBatch collects a set of key changes that are then
+   applied to a tree at once, under a single lock and either in a
+   single journal append or not at all. MetaTreeBatch is not
+   threadsafe */
+MetaTreeBatch *meta_tree_batch_new         (void);
+void           meta_tree_batch_free        (MetaTreeBatch *batch);
+guint          meta_tree_batch_get_size    (MetaTreeBatch *batch);
+void           meta_tree_batch_set_string  (MetaTreeBatch *batch,
+					    const char    *path,
+					    const char    *key,
+					    const char    *value);
+void           meta_tree_batch_set_stringv (MetaTreeBatch *batch,
+					    const char    *path,
+					    const char    *key,
+					    char         **value);
+void           meta_tree_batch_unset       (MetaTreeBatch *batch,
+					    const char    *path,
+					    const char    *key);
+
 /* All public MetaTree calls are threadsafe */
 MetaTree *  meta_tree_open           (const char *filename,
 				      gboolean    for_write);
@@ -87,6 +119,7 @@ void        meta_tree_enumerate_keys   (MetaTree                         *tree,
 					meta_tree_keys_enumerate_callback callback,
 					gpointer                          user_data);
 gboolean    meta_tree_flush            (MetaTree                         *tree);
+guint       meta_tree_get_journal_fill (MetaTree                         *tree);
 gboolean    meta_tree_unset            (MetaTree                         *tree,
 					const char                       *path,
 					const char                       *key);
@@ -103,4 +136,6 @@ gboolean    meta_tree_remove           (MetaTree                         *tree,
 gboolean    meta_tree_copy             (MetaTree                         *tree,
 					const char                       *src,
 					const char                       *dest);
+gboolean    meta_tree_apply_batch      (MetaTree                         *tree,
+					MetaTreeBatch                    *batch);
 #endif /* __META_TREE_H__ */
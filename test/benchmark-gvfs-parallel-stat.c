@@ -0,0 +1,183 @@
+#include <config.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+/* Measures how many files of a directory on a mounted location can be
+   stat'ed per second, once with one query_info () in flight at a time
+   and once with many at the same time. Backends that block their
+   worker thread for every request show no gain from the parallel
+   run. For the dav backend, run the daemon with GVFS_DAV_CACHE_TTL=0,
+   or the listing fills its cache and no request reaches the server. */
+
+static int n_parallel = 16;
+static int rounds = 3;
+static GOptionEntry entries[] =
+{
+  { "parallel", 'p', 0, G_OPTION_ARG_INT, &n_parallel, "Number of queries in flight", NULL},
+  { "rounds", 'r', 0, G_OPTION_ARG_INT, &rounds, "Number of times to stat every file", NULL},
+  { NULL }
+};
+
+typedef struct {
+  GPtrArray *files;
+  guint      next;
+  guint      total;
+  guint      done;
+  guint      failed;
+  GMainLoop *loop;
+} StatRun;
+
+static void stat_next (StatRun *run);
+
+static void
+stat_ready (GObject      *source_object,
+            GAsyncResult *result,
+            gpointer      user_data)
+{
+  StatRun *run = user_data;
+  GFileInfo *info;
+
+  info = g_file_query_info_finish (G_FILE (source_object), result, NULL);
+  if (info)
+    g_object_unref (info);
+  else
+    run->failed++;
+
+  run->done++;
+  if (run->done == run->total)
+    g_main_loop_quit (run->loop);
+  else
+    stat_next (run);
+}
+
+static void
+stat_next (StatRun *run)
+{
+  GFile *file;
+
+  if (run->next == run->total)
+    return;
+
+  file = g_ptr_array_index (run->files, run->next % run->files->len);
+  run->next++;
+
+  g_file_query_info_async (file,
+                           G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                           G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                           G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                           0, G_PRIORITY_DEFAULT, NULL,
+                           stat_ready, run);
+}
+
+static double
+bench_stat (GPtrArray *files,
+            int        parallel)
+{
+  StatRun run = { 0, };
+  GTimer *timer;
+  double elapsed;
+  int i;
+
+  run.files = files;
+  run.total = files->len * rounds;
+  run.loop = g_main_loop_new (NULL, FALSE);
+
+  timer = g_timer_new ();
+  for (i = 0; i < parallel; i++)
+    stat_next (&run);
+  g_main_loop_run (run.loop);
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  g_main_loop_unref (run.loop);
+
+  if (run.failed)
+    g_printerr ("%u queries failed\n", run.failed);
+
+  return run.total / elapsed;
+}
+
+static GPtrArray *
+list_files (GFile   *dir,
+            GError **error)
+{
+  GFileEnumerator *enumerator;
+  GFileInfo *info;
+  GPtrArray *files;
+
+  enumerator = g_file_enumerate_children (dir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                          0, NULL, error);
+  if (enumerator == NULL)
+    return NULL;
+
+  files = g_ptr_array_new_with_free_func (g_object_unref);
+  while ((info = g_file_enumerator_next_file (enumerator, NULL, NULL)))
+    {
+      g_ptr_array_add (files, g_file_get_child (dir, g_file_info_get_name (info)));
+      g_object_unref (info);
+    }
+  g_object_unref (enumerator);
+
+  return files;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  GPtrArray *files;
+  GFile *dir;
+  double serial, parallel;
+
+  g_type_init ();
+
+  context = g_option_context_new ("LOCATION - benchmark parallel query_info");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if (argc != 2)
+    {
+      g_printerr ("usage: %s [OPTION...] LOCATION\n", argv[0]);
+      return 1;
+    }
+
+  if (n_parallel <= 0 || rounds <= 0)
+    {
+      g_printerr ("all options must be positive\n");
+      return 1;
+    }
+
+  dir = g_file_new_for_commandline_arg (argv[1]);
+  files = list_files (dir, &error);
+  if (files == NULL)
+    {
+      g_printerr ("can't list %s: %s\n", argv[1], error->message);
+      return 1;
+    }
+
+  if (files->len == 0)
+    {
+      g_printerr ("%s is empty\n", argv[1]);
+      return 1;
+    }
+
+  serial = bench_stat (files, 1);
+  parallel = bench_stat (files, n_parallel);
+
+  g_print ("%u files, %d rounds:\n", files->len, rounds);
+  g_print ("  1 in flight:  %10.1f files/s\n", serial);
+  g_print ("  %d in flight: %10.1f files/s (%.2fx)\n",
+           n_parallel, parallel, parallel / serial);
+
+  g_ptr_array_free (files, TRUE);
+  g_object_unref (dir);
+
+  return 0;
+}